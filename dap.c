@@ -35,8 +35,12 @@
 #include "edbg.h"
 #include "dap.h"
 #include "dbg.h"
+#include "stats.h"
 
 /*- Definitions -------------------------------------------------------------*/
+#define DAP_QUEUE_SIZE         255 // Transfer count field is one byte
+#define DAP_MAX_PACKETS        8
+#define DAP_SINGLE_COUNT       128
 
 /*- Types -------------------------------------------------------------------*/
 enum
@@ -179,18 +183,57 @@ enum
 #define AP_CSW_ADDRINC_OFF     (0 << 4)
 #define AP_CSW_ADDRINC_SINGLE  (1 << 4)
 #define AP_CSW_ADDRINC_PACKED  (2 << 4)
+#define AP_CSW_ADDRINC_MASK    (3 << 4)
 #define AP_CSW_DEVICEEN        (1 << 6)
 #define AP_CSW_TRINPROG        (1 << 7)
 #define AP_CSW_SPIDEN          (1 << 23)
 #define AP_CSW_PROT(x)         ((x) << 24)
 #define AP_CSW_DBGSWENABLE     (1 << 31)
 
+typedef struct
+{
+  uint8_t   req;
+  uint32_t  data;
+  uint32_t  *result;
+} dap_request_t;
+
+typedef struct
+{
+  uint8_t   cmd;
+  uint32_t  addr;
+  uint8_t   *data;
+  int       size;
+} dap_pending_t;
+
 /*- Variables ---------------------------------------------------------------*/
-static bool dap_is_prepared = false;
-static int dap_transfer_size = AP_CSW_SIZE_WORD;
+static _Thread_local bool dap_is_prepared = false;
+static _Thread_local uint32_t dap_transfer_mode = AP_CSW_SIZE_WORD | AP_CSW_ADDRINC_SINGLE;
+static _Thread_local int dap_packed = -1; // Unknown until the first packed transfer
+
+static _Thread_local dap_request_t dap_queue[DAP_QUEUE_SIZE];
+static _Thread_local int dap_queue_count = 0;
+static _Thread_local int dap_queue_wsize = 0;
+static _Thread_local int dap_queue_rsize = 0;
+
+static _Thread_local int dap_packet_count = 1;
+static _Thread_local dap_pending_t dap_pending[DAP_MAX_PACKETS];
+static _Thread_local int dap_pending_head = 0;
+static _Thread_local int dap_pending_count = 0;
+static _Thread_local int dap_pending_sent = 0;
+
+/*- Prototypes --------------------------------------------------------------*/
+static void dap_pipeline_flush(void);
 
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static void dap_cmd(uint8_t *data, int size, int rsize)
+{
+  // Responses come in order, the blocks still in flight are received first
+  dap_pipeline_flush();
+  dbg_dap_cmd(data, size, rsize);
+}
+
 //-----------------------------------------------------------------------------
 void dap_led(int index, int state)
 {
@@ -199,7 +242,7 @@ void dap_led(int index, int state)
   buf[0] = ID_DAP_LED;
   buf[1] = index;
   buf[2] = state;
-  dbg_dap_cmd(buf, sizeof(buf), 3);
+  dap_cmd(buf, sizeof(buf), 3);
 
   check(DAP_OK == buf[0], "DAP_LED failed");
 }
@@ -211,7 +254,7 @@ void dap_connect(void)
 
   buf[0] = ID_DAP_CONNECT;
   buf[1] = DAP_PORT_SWD;
-  dbg_dap_cmd(buf, sizeof(buf), 2);
+  dap_cmd(buf, sizeof(buf), 2);
 
   check(DAP_PORT_SWD == buf[0], "DAP_CONNECT failed");
 }
@@ -222,7 +265,7 @@ void dap_disconnect(void)
   uint8_t buf[1];
 
   buf[0] = ID_DAP_DISCONNECT;
-  dbg_dap_cmd(buf, sizeof(buf), 1);
+  dap_cmd(buf, sizeof(buf), 1);
 }
 
 //-----------------------------------------------------------------------------
@@ -235,7 +278,7 @@ void dap_swj_clock(uint32_t clock)
   buf[2] = (clock >> 8) & 0xff;
   buf[3] = (clock >> 16) & 0xff;
   buf[4] = (clock >> 24) & 0xff;
-  dbg_dap_cmd(buf, sizeof(buf), 5);
+  dap_cmd(buf, sizeof(buf), 5);
 
   check(DAP_OK == buf[0], "SWJ_CLOCK failed");
 }
@@ -251,7 +294,7 @@ void dap_transfer_configure(uint8_t idle, uint16_t count, uint16_t retry)
   buf[3] = (count >> 8) & 0xff;
   buf[4] = retry & 0xff;
   buf[5] = (retry >> 8) & 0xff;
-  dbg_dap_cmd(buf, sizeof(buf), 6);
+  dap_cmd(buf, sizeof(buf), 6);
 
   check(DAP_OK == buf[0], "TRANSFER_CONFIGURE failed");
 }
@@ -263,7 +306,7 @@ void dap_swd_configure(uint8_t cfg)
 
   buf[0] = ID_DAP_SWD_CONFIGURE;
   buf[1] = cfg;
-  dbg_dap_cmd(buf, sizeof(buf), 2);
+  dap_cmd(buf, sizeof(buf), 2);
 
   check(DAP_OK == buf[0], "SWD_CONFIGURE failed");
 }
@@ -276,31 +319,31 @@ void dap_get_debugger_info(void)
 
   buf[0] = ID_DAP_INFO;
   buf[1] = DAP_INFO_VENDOR;
-  dbg_dap_cmd(buf, sizeof(buf), 2);
+  dap_cmd(buf, sizeof(buf), 2);
   strncat(str, (char *)&buf[1], buf[0]);
   strcat(str, " ");
 
   buf[0] = ID_DAP_INFO;
   buf[1] = DAP_INFO_PRODUCT;
-  dbg_dap_cmd(buf, sizeof(buf), 2);
+  dap_cmd(buf, sizeof(buf), 2);
   strncat(str, (char *)&buf[1], buf[0]);
   strcat(str, " ");
 
   buf[0] = ID_DAP_INFO;
   buf[1] = DAP_INFO_SER_NUM;
-  dbg_dap_cmd(buf, sizeof(buf), 2);
+  dap_cmd(buf, sizeof(buf), 2);
   strncat(str, (char *)&buf[1], buf[0]);
   strcat(str, " ");
 
   buf[0] = ID_DAP_INFO;
   buf[1] = DAP_INFO_FW_VER;
-  dbg_dap_cmd(buf, sizeof(buf), 2);
+  dap_cmd(buf, sizeof(buf), 2);
   strncat(str, (char *)&buf[1], buf[0]);
   strcat(str, " ");
 
   buf[0] = ID_DAP_INFO;
   buf[1] = DAP_INFO_CAPABILITIES;
-  dbg_dap_cmd(buf, sizeof(buf), 2);
+  dap_cmd(buf, sizeof(buf), 2);
 
   strcat(str, "(");
 
@@ -315,6 +358,17 @@ void dap_get_debugger_info(void)
   verbose("Debugger: %s\n", str);
 
   check(buf[1] & DAP_PORT_SWD, "SWD support required");
+
+  buf[0] = ID_DAP_INFO;
+  buf[1] = DAP_INFO_PACKET_COUNT;
+  dap_cmd(buf, sizeof(buf), 2);
+
+  dap_packet_count = (1 == buf[0]) ? buf[1] : 1;
+
+  if (dap_packet_count < 1)
+    dap_packet_count = 1;
+  else if (dap_packet_count > DAP_MAX_PACKETS)
+    dap_packet_count = DAP_MAX_PACKETS;
 }
 
 //-----------------------------------------------------------------------------
@@ -323,7 +377,7 @@ void dap_reset_target(void)
   uint8_t buf[1];
 
   buf[0] = ID_DAP_RESET_TARGET;
-  dbg_dap_cmd(buf, sizeof(buf), 1);
+  dap_cmd(buf, sizeof(buf), 1);
 
   check(DAP_OK == buf[0], "RESET_TARGET failed");
 }
@@ -334,6 +388,8 @@ void dap_reset_target_hw(int state)
   uint8_t buf[7];
   int value = state ? (DAP_SWJ_SWCLK_TCK | DAP_SWJ_SWDIO_TMS) : 0;
 
+  dap_queue_flush();
+
   //-------------
   buf[0] = ID_DAP_SWJ_PINS;
   buf[1] = value; // Value
@@ -342,7 +398,7 @@ void dap_reset_target_hw(int state)
   buf[4] = 0;
   buf[5] = 0;
   buf[6] = 0;
-  dbg_dap_cmd(buf, sizeof(buf), 7);
+  dap_cmd(buf, sizeof(buf), 7);
 
   //-------------
   buf[0] = ID_DAP_SWJ_PINS;
@@ -352,84 +408,185 @@ void dap_reset_target_hw(int state)
   buf[4] = 0;
   buf[5] = 0;
   buf[6] = 0;
-  dbg_dap_cmd(buf, sizeof(buf), 7);
+  dap_cmd(buf, sizeof(buf), 7);
 }
 
 //-----------------------------------------------------------------------------
-uint32_t dap_read_reg(uint8_t reg)
+static bool dap_request_has_wdata(uint8_t req)
 {
-  uint8_t buf[8];
+  return !(req & DAP_TRANSFER_RnW) || (req & DAP_TRANSFER_MATCH_VALUE);
+}
+
+//-----------------------------------------------------------------------------
+static bool dap_request_has_rdata(uint8_t req)
+{
+  return (req & DAP_TRANSFER_RnW) && !(req & DAP_TRANSFER_MATCH_VALUE);
+}
+
+//-----------------------------------------------------------------------------
+static void dap_queue_request(uint8_t req, uint32_t data, uint32_t *result)
+{
+  int report_size = dbg_get_report_size();
+  int wsize = 1 + (dap_request_has_wdata(req) ? 4 : 0);
+  int rsize = dap_request_has_rdata(req) ? 4 : 0;
+
+  // Request header is 3 bytes, response header is 2 bytes
+  if (DAP_QUEUE_SIZE == dap_queue_count ||
+      (3 + dap_queue_wsize + wsize) > report_size ||
+      (2 + dap_queue_rsize + rsize) > report_size)
+    dap_queue_flush();
+
+  dap_queue[dap_queue_count].req = req;
+  dap_queue[dap_queue_count].data = data;
+  dap_queue[dap_queue_count].result = result;
+
+  dap_queue_count++;
+  dap_queue_wsize += wsize;
+  dap_queue_rsize += rsize;
+}
+
+//-----------------------------------------------------------------------------
+static bool dap_queue_execute(bool match)
+{
+  uint8_t buf[1024];
+  int count = dap_queue_count;
+  int offs = 3;
+
+  if (0 == count)
+    return true;
+
+  dap_queue_count = 0;
+  dap_queue_wsize = 0;
+  dap_queue_rsize = 0;
 
   buf[0] = ID_DAP_TRANSFER;
   buf[1] = 0x00; // DAP index
-  buf[2] = 0x01; // Request size
-  buf[3] = reg | DAP_TRANSFER_RnW;
-  dbg_dap_cmd(buf, sizeof(buf), 4);
+  buf[2] = count;
 
-  if (1 != buf[0] || DAP_TRANSFER_OK != buf[1])
+  for (int i = 0; i < count; i++)
   {
-    error_exit("invalid response while reading the register 0x%02x (count = %d, value = %d)",
-        reg, buf[0], buf[1]);
+    buf[offs++] = dap_queue[i].req;
+
+    if (dap_request_has_wdata(dap_queue[i].req))
+    {
+      buf[offs++] = dap_queue[i].data & 0xff;
+      buf[offs++] = (dap_queue[i].data >> 8) & 0xff;
+      buf[offs++] = (dap_queue[i].data >> 16) & 0xff;
+      buf[offs++] = (dap_queue[i].data >> 24) & 0xff;
+    }
+  }
+
+  dap_cmd(buf, sizeof(buf), offs);
+
+  // Value mismatch on the last request is an expected outcome while polling
+  if (match && (count - 1) == buf[0] && (DAP_TRANSFER_OK | DAP_TRANSFER_MISMATCH) == buf[1] &&
+      (dap_queue[count - 1].req & DAP_TRANSFER_MATCH_VALUE))
+    return false;
+
+  if (count != buf[0] || DAP_TRANSFER_OK != buf[1])
+  {
+    int index = (buf[0] < count) ? buf[0] : (count - 1);
+    uint8_t req = dap_queue[index].req;
+
+    error_exit("invalid response while %s the register 0x%02x (count = %d, value = %d)",
+        (req & DAP_TRANSFER_RnW) ? "reading" : "writing",
+        req & ~DAP_TRANSFER_RnW, buf[0], buf[1]);
+  }
+
+  offs = 2;
+
+  for (int i = 0; i < count; i++)
+  {
+    if (!dap_request_has_rdata(dap_queue[i].req))
+      continue;
+
+    if (dap_queue[i].result)
+    {
+      *dap_queue[i].result = ((uint32_t)buf[offs + 3] << 24) | ((uint32_t)buf[offs + 2] << 16) |
+          ((uint32_t)buf[offs + 1] << 8) | (uint32_t)buf[offs];
+    }
+
+    offs += 4;
   }
 
-  return ((uint32_t)buf[5] << 24) | ((uint32_t)buf[4] << 16) |
-         ((uint32_t)buf[3] << 8) | (uint32_t)buf[2];
+  return true;
 }
 
 //-----------------------------------------------------------------------------
-void dap_write_reg(uint8_t reg, uint32_t data)
+void dap_queue_flush(void)
 {
-  uint8_t buf[8];
+  dap_queue_execute(false);
+}
 
-  buf[0] = ID_DAP_TRANSFER;
-  buf[1] = 0x00; // DAP index
-  buf[2] = 0x01; // Request size
-  buf[3] = reg;
-  buf[4] = data & 0xff;
-  buf[5] = (data >> 8) & 0xff;
-  buf[6] = (data >> 16) & 0xff;
-  buf[7] = (data >> 24) & 0xff;
-  dbg_dap_cmd(buf, sizeof(buf), 8);
-
-  if (1 != buf[0] || DAP_TRANSFER_OK != buf[1])
-  {
-    error_exit("invalid response while writing the register 0x%02x (count = %d, value = %d)",
-        reg, buf[0], buf[1]);
-  }
+//-----------------------------------------------------------------------------
+void dap_queue_read_reg(uint8_t reg, uint32_t *data)
+{
+  dap_queue_request(reg | DAP_TRANSFER_RnW, 0, data);
 }
 
 //-----------------------------------------------------------------------------
-static void dap_set_transfer_size(int size)
+void dap_queue_write_reg(uint8_t reg, uint32_t data)
+{
+  dap_queue_request(reg, data, NULL);
+}
+
+//-----------------------------------------------------------------------------
+uint32_t dap_read_reg(uint8_t reg)
 {
-  uint32_t csw = AP_CSW_ADDRINC_SINGLE | AP_CSW_DEVICEEN | AP_CSW_PROT(0x23);
+  uint32_t data;
+
+  dap_queue_read_reg(reg, &data);
+  dap_queue_flush();
+
+  return data;
+}
+
+//-----------------------------------------------------------------------------
+void dap_write_reg(uint8_t reg, uint32_t data)
+{
+  dap_queue_write_reg(reg, data);
+  dap_queue_flush();
+}
+
+//-----------------------------------------------------------------------------
+static void dap_set_transfer_mode(int size, int inc)
+{
+  uint32_t csw = AP_CSW_DEVICEEN | AP_CSW_PROT(0x23);
 
   if (!dap_is_prepared)
   {
-    dap_write_reg(SWD_DP_W_ABORT, DP_ABORT_STKCMPCLR | DP_ABORT_STKERRCLR | DP_ABORT_ORUNERRCLR);
-    dap_write_reg(SWD_DP_W_SELECT, DP_SELECT_APBANKSEL(0) | DP_SELECT_APSEL(0));
-    dap_write_reg(SWD_DP_W_CTRL_STAT, DP_CST_CDBGPWRUPREQ | DP_CST_CSYSPWRUPREQ | DP_CST_MASKLANE(0xf));
+    dap_queue_write_reg(SWD_DP_W_ABORT, DP_ABORT_STKCMPCLR | DP_ABORT_STKERRCLR | DP_ABORT_ORUNERRCLR);
+    dap_queue_write_reg(SWD_DP_W_SELECT, DP_SELECT_APBANKSEL(0) | DP_SELECT_APSEL(0));
+    dap_queue_write_reg(SWD_DP_W_CTRL_STAT, DP_CST_CDBGPWRUPREQ | DP_CST_CSYSPWRUPREQ | DP_CST_MASKLANE(0xf));
 
-    dap_write_reg(SWD_AP_CSW, csw | AP_CSW_SIZE_WORD);
+    dap_queue_write_reg(SWD_AP_CSW, csw | AP_CSW_SIZE_WORD | AP_CSW_ADDRINC_SINGLE);
 
-    dap_transfer_size = AP_CSW_SIZE_WORD;
+    dap_transfer_mode = AP_CSW_SIZE_WORD | AP_CSW_ADDRINC_SINGLE;
     dap_is_prepared = true;
   }
 
-  if (dap_transfer_size != size)
+  if (dap_transfer_mode != (uint32_t)(size | inc))
   {
-    dap_write_reg(SWD_AP_CSW, csw | size);
-    dap_transfer_size = size;
+    dap_queue_write_reg(SWD_AP_CSW, csw | size | inc);
+    dap_transfer_mode = size | inc;
   }
 }
 
+//-----------------------------------------------------------------------------
+static void dap_set_transfer_size(int size)
+{
+  dap_set_transfer_mode(size, AP_CSW_ADDRINC_SINGLE);
+}
+
 //-----------------------------------------------------------------------------
 uint8_t dap_read_byte(uint32_t addr)
 {
   uint32_t data;
 
   dap_set_transfer_size(AP_CSW_SIZE_BYTE);
-  dap_write_reg(SWD_AP_TAR, addr);
-  data = dap_read_reg(SWD_AP_DRW);
+  dap_queue_write_reg(SWD_AP_TAR, addr);
+  dap_queue_read_reg(SWD_AP_DRW, &data);
+  dap_queue_flush();
 
   return (data >> ((addr & 3) * 8)) & 0xff;
 }
@@ -440,8 +597,9 @@ uint16_t dap_read_half(uint32_t addr)
   uint32_t data;
 
   dap_set_transfer_size(AP_CSW_SIZE_HALF);
-  dap_write_reg(SWD_AP_TAR, addr);
-  data = dap_read_reg(SWD_AP_DRW);
+  dap_queue_write_reg(SWD_AP_TAR, addr);
+  dap_queue_read_reg(SWD_AP_DRW, &data);
+  dap_queue_flush();
 
   return (data >> ((addr & 2) * 8)) & 0xffff;
 }
@@ -449,83 +607,259 @@ uint16_t dap_read_half(uint32_t addr)
 //-----------------------------------------------------------------------------
 uint32_t dap_read_word(uint32_t addr)
 {
-  dap_set_transfer_size(AP_CSW_SIZE_WORD);
-  dap_write_reg(SWD_AP_TAR, addr);
-  return dap_read_reg(SWD_AP_DRW);
+  uint32_t data;
+
+  dap_queue_read_word(addr, &data);
+  dap_queue_flush();
+
+  return data;
 }
 
 //-----------------------------------------------------------------------------
 void dap_write_byte(uint32_t addr, uint8_t data)
 {
   dap_set_transfer_size(AP_CSW_SIZE_BYTE);
-  dap_write_reg(SWD_AP_TAR, addr);
-  dap_write_reg(SWD_AP_DRW, (uint32_t)data << ((addr & 3) * 8));
+  dap_queue_write_reg(SWD_AP_TAR, addr);
+  dap_queue_write_reg(SWD_AP_DRW, (uint32_t)data << ((addr & 3) * 8));
+  dap_queue_flush();
 }
 
 //-----------------------------------------------------------------------------
 void dap_write_half(uint32_t addr, uint16_t data)
 {
   dap_set_transfer_size(AP_CSW_SIZE_HALF);
-  dap_write_reg(SWD_AP_TAR, addr);
-  dap_write_reg(SWD_AP_DRW, (uint32_t)data << ((addr & 2) * 8));
+  dap_queue_write_reg(SWD_AP_TAR, addr);
+  dap_queue_write_reg(SWD_AP_DRW, (uint32_t)data << ((addr & 2) * 8));
+  dap_queue_flush();
 }
 
 //-----------------------------------------------------------------------------
 void dap_write_word(uint32_t addr, uint32_t data)
 {
-  dap_set_transfer_size(AP_CSW_SIZE_WORD);
-  dap_write_reg(SWD_AP_TAR, addr);
-  dap_write_reg(SWD_AP_DRW, data);
+  dap_queue_write_word(addr, data);
+  dap_queue_flush();
 }
 
 //-----------------------------------------------------------------------------
-void dap_read_block(uint32_t addr, uint8_t *data, int size)
+void dap_queue_read_word(uint32_t addr, uint32_t *data)
 {
-  int max_size = (dbg_get_report_size() - 5) & ~3;
-  int offs = 0;
+  dap_set_transfer_size(AP_CSW_SIZE_WORD);
+  dap_queue_write_reg(SWD_AP_TAR, addr);
+  dap_queue_read_reg(SWD_AP_DRW, data);
+}
 
+//-----------------------------------------------------------------------------
+void dap_queue_write_word(uint32_t addr, uint32_t data)
+{
   dap_set_transfer_size(AP_CSW_SIZE_WORD);
+  dap_queue_write_reg(SWD_AP_TAR, addr);
+  dap_queue_write_reg(SWD_AP_DRW, data);
+}
 
-  while (size)
+//-----------------------------------------------------------------------------
+static bool dap_wait(uint32_t addr, int size, uint32_t mask, uint32_t value, int timeout)
+{
+  uint32_t start = get_time_ms();
+
+  // The probe keeps re-reading DRW until the value matches or the match retry
+  // count runs out, so the address must not increment between the reads.
+  dap_set_transfer_mode(size, AP_CSW_ADDRINC_OFF);
+  dap_queue_write_reg(SWD_AP_TAR, addr);
+
+  while (1)
   {
-    int align, sz;
-    uint8_t buf[1024];
+    dap_queue_request(DAP_TRANSFER_MATCH_MASK, mask, NULL);
+    dap_queue_request(SWD_AP_DRW | DAP_TRANSFER_RnW | DAP_TRANSFER_MATCH_VALUE, value, NULL);
 
-    align = 0x400 - (addr - (addr & ~0x3ff));
-    sz = (size > max_size) ? max_size : size;
-    sz = (sz > align) ? align : sz;
+    if (dap_queue_execute(true))
+      return true;
+
+    if ((int)(get_time_ms() - start) > timeout)
+      return false;
+  }
+}
 
-    dap_write_reg(SWD_AP_TAR, addr);
+//-----------------------------------------------------------------------------
+bool dap_wait_byte(uint32_t addr, uint8_t mask, uint8_t value, int timeout)
+{
+  int shift = (addr & 3) * 8;
 
-    buf[0] = ID_DAP_TRANSFER_BLOCK;
-    buf[1] = 0x00; // DAP index
-    buf[2] = (sz / 4) & 0xff;
-    buf[3] = ((sz / 4) >> 8) & 0xff;
-    buf[4] = SWD_AP_DRW | DAP_TRANSFER_RnW | DAP_TRANSFER_APnDP;
-    dbg_dap_cmd(buf, sizeof(buf), 5);
+  return dap_wait(addr, AP_CSW_SIZE_BYTE, (uint32_t)mask << shift,
+      (uint32_t)value << shift, timeout);
+}
+
+//-----------------------------------------------------------------------------
+bool dap_wait_word(uint32_t addr, uint32_t mask, uint32_t value, int timeout)
+{
+  return dap_wait(addr, AP_CSW_SIZE_WORD, mask, value, timeout);
+}
+
+//-----------------------------------------------------------------------------
+static void dap_pipeline_recv(void)
+{
+  dap_pending_t *pending = &dap_pending[dap_pending_head];
+  uint8_t buf[1024];
 
-    if (DAP_TRANSFER_OK != buf[2])
+  dbg_dap_recv(pending->cmd, buf, sizeof(buf));
+
+  dap_pending_head = (dap_pending_head + 1) % DAP_MAX_PACKETS;
+  dap_pending_count--;
+
+  if (ID_DAP_TRANSFER == pending->cmd)
+  {
+    if (1 != buf[0] || DAP_TRANSFER_OK != buf[1])
     {
-      error_exit("invalid response while reading the block at 0x%08x (value = %d)",
-          addr, buf[2]);
+      error_exit("invalid response while writing the address 0x%08x (count = %d, value = %d)",
+          pending->addr, buf[0], buf[1]);
     }
+  }
+  else if (DAP_TRANSFER_OK != buf[2])
+  {
+    error_exit("invalid response while %s the block at 0x%08x (value = %d)",
+        pending->data ? "reading" : "writing", pending->addr, buf[2]);
+  }
+  else if (pending->data)
+  {
+    memcpy(pending->data, &buf[3], pending->size);
+  }
+}
 
-    memcpy(&data[offs], &buf[3], sz);
+//-----------------------------------------------------------------------------
+static void dap_pipeline_send(uint8_t *buf, int size, uint32_t addr, uint8_t *data, int dsize)
+{
+  dap_pending_t *pending;
 
-    size -= sz;
-    addr += sz;
-    offs += sz;
+  if (dap_pending_count == dap_packet_count)
+    dap_pipeline_recv();
+
+  pending = &dap_pending[(dap_pending_head + dap_pending_count) % DAP_MAX_PACKETS];
+  pending->cmd = buf[0];
+  pending->addr = addr;
+  pending->data = data;
+  pending->size = dsize;
+  dap_pending_count++;
+  dap_pending_sent++;
+
+  dbg_dap_send(buf, size);
+}
+
+//-----------------------------------------------------------------------------
+static void dap_pipeline_flush(void)
+{
+  while (dap_pending_count)
+    dap_pipeline_recv();
+}
+
+//-----------------------------------------------------------------------------
+static void dap_pipeline_write_tar(uint32_t addr)
+{
+  uint8_t buf[8];
+
+  buf[0] = ID_DAP_TRANSFER;
+  buf[1] = 0x00; // DAP index
+  buf[2] = 1; // Request size
+  buf[3] = SWD_AP_TAR;
+  buf[4] = addr & 0xff;
+  buf[5] = (addr >> 8) & 0xff;
+  buf[6] = (addr >> 16) & 0xff;
+  buf[7] = (addr >> 24) & 0xff;
+  dap_pipeline_send(buf, sizeof(buf), addr, NULL, 0);
+}
+
+//-----------------------------------------------------------------------------
+static int dap_csw_size(int width)
+{
+  if (4 == width)
+    return AP_CSW_SIZE_WORD;
+  else if (2 == width)
+    return AP_CSW_SIZE_HALF;
+  else
+    return AP_CSW_SIZE_BYTE;
+}
+
+//-----------------------------------------------------------------------------
+static bool dap_packed_supported(void)
+{
+  uint32_t csw;
+
+  // Packed transfers are optional, the ADDRINC field reads back as written
+  // only when they are implemented
+  if (-1 == dap_packed)
+  {
+    dap_set_transfer_mode(AP_CSW_SIZE_BYTE, AP_CSW_ADDRINC_PACKED);
+    dap_queue_read_reg(SWD_AP_CSW, &csw);
+    dap_queue_flush();
+
+    dap_packed = (AP_CSW_ADDRINC_PACKED == (csw & AP_CSW_ADDRINC_MASK));
+
+    if (!dap_packed)
+      dap_transfer_mode = (uint32_t)-1;
   }
+
+  return dap_packed;
 }
 
 //-----------------------------------------------------------------------------
-void dap_write_block(uint32_t addr, uint8_t *data, int size)
+static void dap_single_block(uint32_t addr, uint8_t *data, int size, int width, bool read)
+{
+  uint32_t values[DAP_SINGLE_COUNT];
+
+  while (size)
+  {
+    uint32_t start = addr;
+    int count = 0;
+
+    dap_set_transfer_size(dap_csw_size(width));
+    dap_queue_write_reg(SWD_AP_TAR, addr);
+
+    // Each access moves one element in its byte lanes, TAR is written again
+    // at a 1 KB boundary
+    do
+    {
+      uint32_t value = 0;
+
+      if (read)
+      {
+        dap_queue_read_reg(SWD_AP_DRW, &values[count]);
+      }
+      else
+      {
+        for (int i = 0; i < width; i++)
+          value |= (uint32_t)data[count * width + i] << (i * 8);
+
+        dap_queue_write_reg(SWD_AP_DRW, value << ((addr & 3) * 8));
+      }
+
+      count++;
+      size -= width;
+      addr += width;
+    } while (size && count < DAP_SINGLE_COUNT && (addr & 0x3ff));
+
+    dap_queue_flush();
+
+    for (int i = 0; read && i < count; i++)
+    {
+      uint32_t value = values[i] >> (((start + i * width) & 3) * 8);
+
+      for (int j = 0; j < width; j++)
+        data[i * width + j] = value >> (j * 8);
+    }
+
+    data += count * width;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void dap_pipeline_submit(uint32_t addr, uint8_t *data, int size, bool read)
 {
   int max_size = (dbg_get_report_size() - 5) & ~3;
   int offs = 0;
 
-  dap_set_transfer_size(AP_CSW_SIZE_WORD);
+  dap_queue_flush();
 
+  // TAR auto-increment is only guaranteed within a 1 KB boundary, so the
+  // address is written once per 1 KB and every command is sent without
+  // waiting for the previous response.
   while (size)
   {
     int align, sz;
@@ -535,20 +869,24 @@ void dap_write_block(uint32_t addr, uint8_t *data, int size)
     sz = (size > max_size) ? max_size : size;
     sz = (sz > align) ? align : sz;
 
-    dap_write_reg(SWD_AP_TAR, addr);
+    if (0 == offs || 0 == (addr & 0x3ff))
+      dap_pipeline_write_tar(addr);
 
     buf[0] = ID_DAP_TRANSFER_BLOCK;
     buf[1] = 0x00; // DAP index
     buf[2] = (sz / 4) & 0xff;
     buf[3] = ((sz / 4) >> 8) & 0xff;
-    buf[4] = SWD_AP_DRW | DAP_TRANSFER_APnDP;
-    memcpy(&buf[5], &data[offs], sz);
-    dbg_dap_cmd(buf, sizeof(buf), 5 + sz);
 
-    if (DAP_TRANSFER_OK != buf[2])
+    if (read)
     {
-      error_exit("invalid response while writing the block at 0x%08x (value = %d)",
-          addr, buf[2]);
+      buf[4] = SWD_AP_DRW | DAP_TRANSFER_RnW | DAP_TRANSFER_APnDP;
+      dap_pipeline_send(buf, 5, addr, &data[offs], sz);
+    }
+    else
+    {
+      buf[4] = SWD_AP_DRW | DAP_TRANSFER_APnDP;
+      memcpy(&buf[5], &data[offs], sz);
+      dap_pipeline_send(buf, 5 + sz, addr, NULL, 0);
     }
 
     size -= sz;
@@ -557,11 +895,124 @@ void dap_write_block(uint32_t addr, uint8_t *data, int size)
   }
 }
 
+//-----------------------------------------------------------------------------
+static void dap_pipeline_block(uint32_t addr, uint8_t *data, int size, bool read)
+{
+  dap_pipeline_submit(addr, data, size, read);
+  dap_pipeline_flush();
+}
+
+//-----------------------------------------------------------------------------
+static void dap_edge_block(uint32_t addr, uint8_t *data, int size, int width, bool read)
+{
+  // Less than a word, the widest access allowed by the alignment is used
+  while (size)
+  {
+    int w = (width > 1 && 0 == (addr & 1) && size >= 2) ? 2 : 1;
+
+    dap_single_block(addr, data, w, w, read);
+
+    addr += w;
+    data += w;
+    size -= w;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void dap_block(uint32_t addr, uint8_t *data, int size, int width, bool read)
+{
+  int head, body;
+
+  // Word blocks may start and end anywhere, the edges use narrower accesses
+  check(4 == width || (0 == (addr % width) && 0 == (size % width)),
+      "block at 0x%08x (size %d) is not aligned to %d bytes", addr, size, width);
+
+  stats_data(size);
+
+  head = (4 - (addr & 3)) & 3;
+  head = (head > size) ? size : head;
+  body = (size - head) & ~3;
+
+  dap_edge_block(addr, data, head, width, read);
+
+  addr += head;
+  data += head;
+  size -= head;
+
+  if (body && 4 == width)
+  {
+    dap_set_transfer_size(AP_CSW_SIZE_WORD);
+    dap_pipeline_block(addr, data, body, read);
+  }
+  else if (body && dap_packed_supported())
+  {
+    // Every DRW access moves a whole word of bytes or halfwords
+    dap_set_transfer_mode(dap_csw_size(width), AP_CSW_ADDRINC_PACKED);
+    dap_pipeline_block(addr, data, body, read);
+  }
+  else if (body)
+  {
+    dap_single_block(addr, data, body, width, read);
+  }
+
+  dap_edge_block(addr + body, data + body, size - body, width, read);
+}
+
+//-----------------------------------------------------------------------------
+void dap_read_block(uint32_t addr, uint8_t *data, int size)
+{
+  dap_block(addr, data, size, 4, true);
+}
+
+//-----------------------------------------------------------------------------
+void dap_write_block(uint32_t addr, uint8_t *data, int size)
+{
+  dap_block(addr, data, size, 4, false);
+}
+
+//-----------------------------------------------------------------------------
+int dap_read_block_start(uint32_t addr, uint8_t *data, int size)
+{
+  check(0 == (addr % 4) && 0 == (size % 4),
+      "block at 0x%08x (size %d) is not aligned to 4 bytes", addr, size);
+
+  stats_data(size);
+
+  dap_set_transfer_size(AP_CSW_SIZE_WORD);
+  dap_pipeline_submit(addr, data, size, true);
+
+  return dap_pending_sent;
+}
+
+//-----------------------------------------------------------------------------
+void dap_read_block_wait(int ticket)
+{
+  // Only the packets up to the ticket are received, the later ones stay in flight
+  while ((ticket - (dap_pending_sent - dap_pending_count)) > 0)
+    dap_pipeline_recv();
+}
+
+//-----------------------------------------------------------------------------
+void dap_read_block_width(uint32_t addr, uint8_t *data, int size, int width)
+{
+  check(1 == width || 2 == width, "invalid access width %d", width);
+  dap_block(addr, data, size, width, true);
+}
+
+//-----------------------------------------------------------------------------
+void dap_write_block_width(uint32_t addr, uint8_t *data, int size, int width)
+{
+  check(1 == width || 2 == width, "invalid access width %d", width);
+  dap_block(addr, data, size, width, false);
+}
+
 //-----------------------------------------------------------------------------
 void dap_reset_link(void)
 {
   uint8_t buf[128];
 
+  dap_queue_flush();
+
   //-------------
   buf[0] = ID_DAP_SWJ_SEQUENCE;
   buf[1] = (7 + 2 + 7 + 1) * 8;
@@ -583,7 +1034,7 @@ void dap_reset_link(void)
   buf[17] = 0xff;
   buf[18] = 0x00;
 
-  dbg_dap_cmd(buf, sizeof(buf), 19);
+  dap_cmd(buf, sizeof(buf), 19);
   check(DAP_OK == buf[0], "SWJ_SEQUENCE failed");
 
   //-------------
@@ -591,8 +1042,28 @@ void dap_reset_link(void)
   buf[1] = 0; // DAP index
   buf[2] = 1; // Request size
   buf[3] = SWD_DP_R_IDCODE | DAP_TRANSFER_RnW;
-  dbg_dap_cmd(buf, sizeof(buf), 4);
+  dap_cmd(buf, sizeof(buf), 4);
+
+  dap_is_prepared = false;
+  dap_packed = -1;
+}
+
+//-----------------------------------------------------------------------------
+void dap_discard(void)
+{
+  uint8_t buf[1024];
+
+  // Responses to the packets that are still in flight are received and dropped
+  while (dap_pending_count)
+  {
+    dbg_dap_recv(dap_pending[dap_pending_head].cmd, buf, sizeof(buf));
+    dap_pending_head = (dap_pending_head + 1) % DAP_MAX_PACKETS;
+    dap_pending_count--;
+  }
 
+  dap_queue_count = 0;
+  dap_queue_wsize = 0;
+  dap_queue_rsize = 0;
   dap_is_prepared = false;
 }
 
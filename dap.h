@@ -51,9 +51,21 @@ uint32_t dap_read_word(uint32_t addr);
 void dap_write_byte(uint32_t addr, uint8_t data);
 void dap_write_half(uint32_t addr, uint16_t data);
 void dap_write_word(uint32_t addr, uint32_t data);
+void dap_queue_read_reg(uint8_t reg, uint32_t *data);
+void dap_queue_write_reg(uint8_t reg, uint32_t data);
+void dap_queue_read_word(uint32_t addr, uint32_t *data);
+void dap_queue_write_word(uint32_t addr, uint32_t data);
+void dap_queue_flush(void);
+bool dap_wait_byte(uint32_t addr, uint8_t mask, uint8_t value, int timeout);
+bool dap_wait_word(uint32_t addr, uint32_t mask, uint32_t value, int timeout);
 void dap_read_block(uint32_t addr, uint8_t *data, int size);
 void dap_write_block(uint32_t addr, uint8_t *data, int size);
+int dap_read_block_start(uint32_t addr, uint8_t *data, int size);
+void dap_read_block_wait(int ticket);
+void dap_read_block_width(uint32_t addr, uint8_t *data, int size, int width);
+void dap_write_block_width(uint32_t addr, uint8_t *data, int size, int width);
 void dap_reset_link(void);
+void dap_discard(void);
 uint32_t dap_read_idcode(void);
 
 #endif // _DAP_H_
@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "edbg.h"
+#include "dbg.h"
+#include "stats.h"
+#include "trace.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define DBG_SLOTS          16
+#define DBG_BUFFER_SIZE    (1024 + 1)
+#define DBG_ERROR_SIZE     256
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  int      vid;
+  int      pid;
+} dbg_id_t;
+
+typedef struct
+{
+  uint8_t  request[DBG_BUFFER_SIZE];
+  uint8_t  response[DBG_BUFFER_SIZE];
+  uint8_t  *data;
+  int      size;
+  int      rsize;
+  uint8_t  cmd;
+} dbg_slot_t;
+
+// Requests are passed to the I/O thread through a single producer / single
+// consumer ring, the counters only ever increase
+typedef struct
+{
+  debugger_t       *debugger;
+  int              type;
+  int              report_size;
+
+  pthread_t        thread;
+  pthread_mutex_t  lock;
+  pthread_cond_t   cond;
+  atomic_int       sleepers;
+
+  atomic_uint      submitted;
+  atomic_uint      sent;
+  atomic_uint      wanted;
+  atomic_uint      received;
+  unsigned         consumed;
+
+  atomic_bool      opened;
+  atomic_bool      failed;
+  atomic_bool      stop;
+  char             error[DBG_ERROR_SIZE];
+
+  dbg_slot_t       slots[DBG_SLOTS];
+} dbg_io_t;
+
+/*- Variables ---------------------------------------------------------------*/
+static _Thread_local dbg_io_t *dbg_io = NULL;
+
+// Debuggers that are known to implement CMSIS-DAP
+static const dbg_id_t dbg_known_ids[] =
+{
+  { 0x03eb, 0x2111 }, // Atmel EDBG
+  { 0x03eb, 0x2141 }, // Atmel-ICE
+  { 0x03eb, 0x2145 }, // Atmel mEDBG
+  { 0x03eb, 0x2175 }, // Microchip nEDBG
+  { 0x0d28, 0x0204 }, // ARM DAPLink
+  { 0x1fc9, 0x0090 }, // NXP LPC-Link2
+};
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+bool dbg_known_id(int vid, int pid)
+{
+  for (int i = 0; i < (int)(sizeof(dbg_known_ids) / sizeof(dbg_id_t)); i++)
+  {
+    if (dbg_known_ids[i].vid == vid && dbg_known_ids[i].pid == pid)
+      return true;
+  }
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_enumerate(debugger_t *debuggers, int size, char *serial)
+{
+  int rsize;
+
+  rsize = dbg_hid_enumerate(debuggers, size, serial);
+
+  for (int i = 0; i < rsize; i++)
+    debuggers[i].type = DBG_TYPE_HID;
+
+#ifdef DBG_BULK
+  {
+    debugger_t bulk[size];
+    int n_bulk = dbg_bulk_enumerate(bulk, size, serial);
+
+    // Probes exposing both interfaces are listed once, using the bulk one
+    for (int i = 0; i < n_bulk; i++)
+    {
+      int index = rsize;
+
+      bulk[i].type = DBG_TYPE_BULK;
+
+      for (int j = 0; j < rsize; j++)
+      {
+        if (0 == strcmp(debuggers[j].serial, bulk[i].serial))
+        {
+          index = j;
+          break;
+        }
+      }
+
+      if (index < size)
+      {
+        debuggers[index] = bulk[i];
+
+        if (index == rsize)
+          rsize++;
+      }
+    }
+  }
+#endif
+
+  return rsize;
+}
+
+//-----------------------------------------------------------------------------
+static void dbg_io_wake(dbg_io_t *io)
+{
+  // The lock is only taken when somebody is sleeping
+  if (0 == atomic_load(&io->sleepers))
+    return;
+
+  pthread_mutex_lock(&io->lock);
+  pthread_cond_broadcast(&io->cond);
+  pthread_mutex_unlock(&io->lock);
+}
+
+//-----------------------------------------------------------------------------
+static void dbg_io_sleep(dbg_io_t *io, bool (*ready)(dbg_io_t *io))
+{
+  if (ready(io))
+    return;
+
+  pthread_mutex_lock(&io->lock);
+  atomic_fetch_add(&io->sleepers, 1);
+
+  while (!ready(io))
+    pthread_cond_wait(&io->cond, &io->lock);
+
+  atomic_fetch_sub(&io->sleepers, 1);
+  pthread_mutex_unlock(&io->lock);
+}
+
+//-----------------------------------------------------------------------------
+static bool dbg_io_opened(dbg_io_t *io)
+{
+  return atomic_load(&io->opened) || atomic_load(&io->failed);
+}
+
+//-----------------------------------------------------------------------------
+static bool dbg_io_stopped(dbg_io_t *io)
+{
+  return atomic_load(&io->stop);
+}
+
+//-----------------------------------------------------------------------------
+static bool dbg_io_received(dbg_io_t *io)
+{
+  return atomic_load(&io->received) != io->consumed || atomic_load(&io->failed);
+}
+
+//-----------------------------------------------------------------------------
+static bool dbg_io_pending(dbg_io_t *io)
+{
+  unsigned sent = atomic_load(&io->sent);
+  unsigned received = atomic_load(&io->received);
+
+  if (atomic_load(&io->stop) || sent != atomic_load(&io->submitted))
+    return true;
+
+  return received != sent && received != atomic_load(&io->wanted);
+}
+
+//-----------------------------------------------------------------------------
+static void dbg_io_check(dbg_io_t *io)
+{
+  if (atomic_load(&io->failed))
+    error_exit("%s", io->error);
+}
+
+//-----------------------------------------------------------------------------
+static void dbg_io_open(void *arg)
+{
+  dbg_io_t *io = (dbg_io_t *)arg;
+
+#ifdef DBG_BULK
+  if (DBG_TYPE_BULK == io->type)
+  {
+    dbg_bulk_open(io->debugger);
+    io->report_size = dbg_bulk_get_report_size();
+    return;
+  }
+#endif
+
+  dbg_hid_open(io->debugger);
+  io->report_size = dbg_hid_get_report_size();
+}
+
+//-----------------------------------------------------------------------------
+static void dbg_io_close(void *arg)
+{
+  dbg_io_t *io = (dbg_io_t *)arg;
+
+  (void)io;
+
+#ifdef DBG_BULK
+  if (DBG_TYPE_BULK == io->type)
+  {
+    dbg_bulk_close();
+    return;
+  }
+#endif
+
+  dbg_hid_close();
+}
+
+//-----------------------------------------------------------------------------
+static void dbg_io_run(void *arg)
+{
+  dbg_io_t *io = (dbg_io_t *)arg;
+
+  while (!atomic_load(&io->stop))
+  {
+    unsigned sent = atomic_load(&io->sent);
+    unsigned received = atomic_load(&io->received);
+    dbg_slot_t *slot;
+
+    // Requests go out as soon as they are submitted, responses are only read
+    // when the caller needs them, so a blocking read never delays a request
+    if (sent != atomic_load(&io->submitted))
+    {
+      slot = &io->slots[sent % DBG_SLOTS];
+
+#ifdef DBG_BULK
+      if (DBG_TYPE_BULK == io->type)
+        dbg_bulk_send(slot->request, slot->size);
+      else
+#endif
+        dbg_hid_send(slot->request, slot->size);
+
+      atomic_store(&io->sent, sent + 1);
+    }
+    else if (received != sent && received != atomic_load(&io->wanted))
+    {
+      slot = &io->slots[received % DBG_SLOTS];
+
+#ifdef DBG_BULK
+      if (DBG_TYPE_BULK == io->type)
+        slot->rsize = dbg_bulk_recv(slot->cmd, slot->response, &slot->data);
+      else
+#endif
+        slot->rsize = dbg_hid_recv(slot->cmd, slot->response, &slot->data);
+
+      atomic_store(&io->received, received + 1);
+      dbg_io_wake(io);
+    }
+    else
+    {
+      dbg_io_sleep(io, dbg_io_pending);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void *dbg_io_thread(void *arg)
+{
+  dbg_io_t *io = (dbg_io_t *)arg;
+  char error[sizeof(io->error)];
+
+  // The backend state belongs to this thread, all backend calls are made here
+  if (error_trap(dbg_io_open, io, io->error, sizeof(io->error)))
+  {
+    atomic_store(&io->opened, true);
+    dbg_io_wake(io);
+
+    if (!error_trap(dbg_io_run, io, io->error, sizeof(io->error)))
+      atomic_store(&io->failed, true);
+  }
+  else
+  {
+    atomic_store(&io->failed, true);
+  }
+
+  // The error is reported by the caller, which then closes the debugger
+  dbg_io_wake(io);
+  dbg_io_sleep(io, dbg_io_stopped);
+
+  error_trap(dbg_io_close, io, error, sizeof(error));
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_open(debugger_t *debugger)
+{
+  dbg_io_t *io = buf_alloc(sizeof(dbg_io_t));
+
+  memset(io, 0, sizeof(dbg_io_t));
+
+  io->debugger = debugger;
+  io->type = debugger->type;
+
+  // Padding bytes of the HID reports are not used, they are only set once
+  for (int i = 0; i < DBG_SLOTS; i++)
+    memset(io->slots[i].request, 0xff, DBG_BUFFER_SIZE);
+
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->cond, NULL);
+
+  dbg_io = io;
+
+  if (0 != pthread_create(&io->thread, NULL, dbg_io_thread, io))
+  {
+    dbg_io = NULL;
+    error_exit("unable to create the I/O thread");
+  }
+
+  dbg_io_sleep(io, dbg_io_opened);
+  dbg_io_check(io);
+}
+
+//-----------------------------------------------------------------------------
+void dbg_close(void)
+{
+  dbg_io_t *io = dbg_io;
+
+  if (NULL == io)
+    return;
+
+  dbg_io = NULL;
+
+  atomic_store(&io->stop, true);
+  dbg_io_wake(io);
+
+  pthread_join(io->thread, NULL);
+
+  pthread_cond_destroy(&io->cond);
+  pthread_mutex_destroy(&io->lock);
+  buf_free(io);
+}
+
+//-----------------------------------------------------------------------------
+int dbg_get_report_size(void)
+{
+  return dbg_io->report_size;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_dap_send(uint8_t *data, int size)
+{
+  dbg_io_t *io = dbg_io;
+  unsigned submitted = atomic_load(&io->submitted);
+  dbg_slot_t *slot;
+
+  dbg_io_check(io);
+
+  check(size <= io->report_size, "request (%d bytes) does not fit into the report", size);
+  check(submitted - io->consumed < DBG_SLOTS, "too many requests are pending");
+
+  trace_request(data, size);
+
+  // HID reports are always padded to the full report size
+  stats_send(size, (DBG_TYPE_BULK == io->type) ? size : io->report_size);
+
+  // Only the request itself is copied, the first byte is left for the report ID
+  slot = &io->slots[submitted % DBG_SLOTS];
+  memcpy(&slot->request[1], data, size);
+  slot->size = size;
+
+  atomic_store(&io->submitted, submitted + 1);
+  dbg_io_wake(io);
+}
+
+//-----------------------------------------------------------------------------
+int dbg_dap_recv(uint8_t cmd, uint8_t *data, int size)
+{
+  dbg_io_t *io = dbg_io;
+  dbg_slot_t *slot = &io->slots[io->consumed % DBG_SLOTS];
+  int rsize;
+
+  check(io->consumed != atomic_load(&io->submitted), "no response is pending");
+
+  slot->cmd = cmd;
+
+  atomic_store(&io->wanted, io->consumed + 1);
+  dbg_io_wake(io);
+
+  dbg_io_sleep(io, dbg_io_received);
+  dbg_io_check(io);
+
+  rsize = slot->rsize;
+  memcpy(data, slot->data, (rsize < size) ? rsize : size);
+  io->consumed++;
+
+  stats_recv(rsize + 1);
+  trace_response(cmd, data, (rsize < size) ? rsize : size);
+
+  return rsize;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_dap_cmd(uint8_t *data, int size, int rsize)
+{
+  dbg_dap_send(data, rsize);
+  return dbg_dap_recv(data[0], data, size);
+}
@@ -32,12 +32,20 @@
 /*- Includes ----------------------------------------------------------------*/
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 /*- Definitions -------------------------------------------------------------*/
 
 /*- Types -------------------------------------------------------------------*/
+enum
+{
+  DBG_TYPE_HID  = 0,
+  DBG_TYPE_BULK = 1,
+};
+
 typedef struct
 {
+  int      type;
   char     *path;
   char     *serial;
   wchar_t  *wserial;
@@ -48,11 +56,28 @@ typedef struct
 } debugger_t;
 
 /*- Prototypes --------------------------------------------------------------*/
-int dbg_enumerate(debugger_t *debuggers, int size);
+bool dbg_known_id(int vid, int pid);
+int dbg_enumerate(debugger_t *debuggers, int size, char *serial);
 void dbg_open(debugger_t *debugger);
 void dbg_close(void);
 int dbg_get_report_size(void);
+void dbg_dap_send(uint8_t *data, int size);
+int dbg_dap_recv(uint8_t cmd, uint8_t *data, int size);
 int dbg_dap_cmd(uint8_t *data, int size, int rsize);
 
+int dbg_hid_enumerate(debugger_t *debuggers, int size, char *serial);
+void dbg_hid_open(debugger_t *debugger);
+void dbg_hid_close(void);
+int dbg_hid_get_report_size(void);
+void dbg_hid_send(uint8_t *report, int size);
+int dbg_hid_recv(uint8_t cmd, uint8_t *report, uint8_t **data);
+
+int dbg_bulk_enumerate(debugger_t *debuggers, int size, char *serial);
+void dbg_bulk_open(debugger_t *debugger);
+void dbg_bulk_close(void);
+int dbg_bulk_get_report_size(void);
+void dbg_bulk_send(uint8_t *report, int size);
+int dbg_bulk_recv(uint8_t cmd, uint8_t *report, uint8_t **data);
+
 #endif // _DBG_H_
 
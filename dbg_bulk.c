@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <libusb.h>
+#include "edbg.h"
+#include "dbg.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define USB_TIMEOUT        5000
+#define MAX_STRING_SIZE    256
+#define MAX_PACKET_SIZE    1024
+
+// Only needed to query the packet size, the rest of the protocol is in dap.c
+#define ID_DAP_INFO           0x00
+#define DAP_INFO_PACKET_SIZE  0xff
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  int      interface;
+  uint8_t  ep_out;
+  uint8_t  ep_in;
+  int      ep_size;
+} bulk_interface_t;
+
+/*- Variables ---------------------------------------------------------------*/
+static libusb_context *usb_ctx = NULL;
+static _Thread_local libusb_device_handle *usb_handle = NULL;
+static _Thread_local bulk_interface_t usb_interface;
+static _Thread_local int packet_size = 0;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static void bulk_init(void)
+{
+  if (usb_ctx)
+    return;
+
+  if (libusb_init(&usb_ctx) < 0)
+    error_exit("unable to initialize libusb");
+}
+
+//-----------------------------------------------------------------------------
+static char *bulk_get_string(libusb_device_handle *handle, int index)
+{
+  char str[MAX_STRING_SIZE];
+
+  if (0 == index || libusb_get_string_descriptor_ascii(handle, index,
+      (unsigned char *)str, sizeof(str)) < 0)
+    return "<unknown>";
+
+  return strdup(str);
+}
+
+//-----------------------------------------------------------------------------
+static bool bulk_match_serial(libusb_device_handle *handle, int index, char *serial)
+{
+  char str[MAX_STRING_SIZE];
+
+  if (NULL == serial)
+    return true;
+
+  if (0 == index || libusb_get_string_descriptor_ascii(handle, index,
+      (unsigned char *)str, sizeof(str)) < 0)
+    return false;
+
+  return 0 == strcmp(str, serial);
+}
+
+//-----------------------------------------------------------------------------
+static bool bulk_find_interface(libusb_device *dev, libusb_device_handle *handle,
+    bulk_interface_t *bulk)
+{
+  struct libusb_config_descriptor *config;
+  bool found = false;
+
+  if (libusb_get_active_config_descriptor(dev, &config) < 0)
+    return false;
+
+  // CMSIS-DAP v2 interface is a vendor-specific interface with the string
+  // containing "CMSIS-DAP" and the bulk OUT and IN endpoints going first
+  for (int i = 0; i < config->bNumInterfaces && !found; i++)
+  {
+    const struct libusb_interface_descriptor *desc = &config->interface[i].altsetting[0];
+    const struct libusb_endpoint_descriptor *ep_out, *ep_in;
+    char str[MAX_STRING_SIZE];
+
+    if (LIBUSB_CLASS_VENDOR_SPEC != desc->bInterfaceClass || desc->bNumEndpoints < 2)
+      continue;
+
+    if (0 == desc->iInterface || libusb_get_string_descriptor_ascii(handle,
+        desc->iInterface, (unsigned char *)str, sizeof(str)) < 0)
+      continue;
+
+    if (NULL == strstr(str, "CMSIS-DAP"))
+      continue;
+
+    ep_out = &desc->endpoint[0];
+    ep_in = &desc->endpoint[1];
+
+    if (LIBUSB_TRANSFER_TYPE_BULK != (ep_out->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) ||
+        LIBUSB_TRANSFER_TYPE_BULK != (ep_in->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) ||
+        (ep_out->bEndpointAddress & LIBUSB_ENDPOINT_IN) ||
+        !(ep_in->bEndpointAddress & LIBUSB_ENDPOINT_IN))
+      continue;
+
+    bulk->interface = desc->bInterfaceNumber;
+    bulk->ep_out = ep_out->bEndpointAddress;
+    bulk->ep_in = ep_in->bEndpointAddress;
+    bulk->ep_size = ep_in->wMaxPacketSize;
+    found = true;
+  }
+
+  libusb_free_config_descriptor(config);
+
+  return found;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_bulk_enumerate(debugger_t *debuggers, int size, char *serial)
+{
+  libusb_device **list;
+  int count, rsize = 0;
+
+  bulk_init();
+
+  count = libusb_get_device_list(usb_ctx, &list);
+
+  for (int i = 0; i < count && rsize < size; i++)
+  {
+    struct libusb_device_descriptor desc;
+    libusb_device_handle *handle;
+    bulk_interface_t bulk;
+    char path[64];
+
+    if (libusb_get_device_descriptor(list[i], &desc) < 0)
+      continue;
+
+    if (libusb_open(list[i], &handle) < 0)
+      continue;
+
+    if (bulk_match_serial(handle, desc.iSerialNumber, serial) &&
+        bulk_find_interface(list[i], handle, &bulk))
+    {
+      snprintf(path, sizeof(path), "%d:%d", libusb_get_bus_number(list[i]),
+          libusb_get_device_address(list[i]));
+
+      debuggers[rsize].path = strdup(path);
+      debuggers[rsize].serial = bulk_get_string(handle, desc.iSerialNumber);
+      debuggers[rsize].wserial = NULL;
+      debuggers[rsize].manufacturer = bulk_get_string(handle, desc.iManufacturer);
+      debuggers[rsize].product = bulk_get_string(handle, desc.iProduct);
+      debuggers[rsize].vid = desc.idVendor;
+      debuggers[rsize].pid = desc.idProduct;
+      rsize++;
+    }
+
+    libusb_close(handle);
+
+    if (serial && rsize)
+      break;
+  }
+
+  if (count > 0)
+    libusb_free_device_list(list, 1);
+
+  return rsize;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_bulk_open(debugger_t *debugger)
+{
+  uint8_t buf[MAX_PACKET_SIZE + 1];
+  uint8_t *info;
+  libusb_device **list;
+  int count;
+
+  bulk_init();
+
+  count = libusb_get_device_list(usb_ctx, &list);
+
+  for (int i = 0; i < count && NULL == usb_handle; i++)
+  {
+    char path[64];
+
+    snprintf(path, sizeof(path), "%d:%d", libusb_get_bus_number(list[i]),
+        libusb_get_device_address(list[i]));
+
+    if (strcmp(path, debugger->path))
+      continue;
+
+    if (libusb_open(list[i], &usb_handle) < 0)
+      error_exit("unable to open device");
+
+    if (!bulk_find_interface(list[i], usb_handle, &usb_interface))
+      error_exit("CMSIS-DAP v2 interface not found");
+  }
+
+  if (count > 0)
+    libusb_free_device_list(list, 1);
+
+  check(usb_handle, "unable to open device");
+
+  libusb_set_auto_detach_kernel_driver(usb_handle, 1);
+
+  if (libusb_claim_interface(usb_handle, usb_interface.interface) < 0)
+    error_exit("unable to claim the debugger interface");
+
+  // Bulk packets are not padded to a fixed size, so the packet size is only
+  // known from the debugger itself
+  packet_size = usb_interface.ep_size;
+
+  buf[1] = ID_DAP_INFO;
+  buf[2] = DAP_INFO_PACKET_SIZE;
+  dbg_bulk_send(buf, 2);
+  dbg_bulk_recv(ID_DAP_INFO, buf, &info);
+
+  if (2 == info[0])
+    packet_size = info[1] | (info[2] << 8);
+
+  if (packet_size > MAX_PACKET_SIZE)
+    packet_size = MAX_PACKET_SIZE;
+
+  check(packet_size >= 64, "detected packet size (%d) is too small", packet_size);
+}
+
+//-----------------------------------------------------------------------------
+void dbg_bulk_close(void)
+{
+  if (NULL == usb_handle)
+    return;
+
+  libusb_release_interface(usb_handle, usb_interface.interface);
+  libusb_close(usb_handle);
+  usb_handle = NULL;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_bulk_get_report_size(void)
+{
+  return packet_size;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_bulk_send(uint8_t *report, int size)
+{
+  int res, transferred;
+
+  // Bulk transfers have no report ID, only the request itself is sent
+  res = libusb_bulk_transfer(usb_handle, usb_interface.ep_out, &report[1], size,
+      &transferred, USB_TIMEOUT);
+
+  if (res < 0)
+    error_exit("debugger write(): %s", libusb_strerror(res));
+
+  check(transferred == size, "incomplete request sent");
+}
+
+//-----------------------------------------------------------------------------
+int dbg_bulk_recv(uint8_t cmd, uint8_t *report, uint8_t **data)
+{
+  int res, transferred;
+
+  res = libusb_bulk_transfer(usb_handle, usb_interface.ep_in, report,
+      packet_size, &transferred, USB_TIMEOUT);
+
+  if (res < 0)
+    error_exit("debugger read(): %s", libusb_strerror(res));
+
+  check(transferred, "empty response received");
+
+  check(report[0] == cmd, "invalid response received");
+
+  *data = &report[1];
+
+  return transferred - 1;
+}
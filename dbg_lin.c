@@ -44,59 +44,133 @@
 #include "dbg.h"
 
 /*- Variables ---------------------------------------------------------------*/
-static int debugger_fd = -1;
-static uint8_t hid_buffer[1024 + 1];
-static int report_size = 0;
+static _Thread_local int debugger_fd = -1;
+static _Thread_local int report_size = 0;
 
 /*- Implementations ---------------------------------------------------------*/
 
 //-----------------------------------------------------------------------------
-int dbg_enumerate(debugger_t *debuggers, int size)
+static char *udev_attr_dup(struct udev_device *dev, char *name)
+{
+  const char *value = udev_device_get_sysattr_value(dev, name);
+
+  return value ? strdup(value) : "<unknown>";
+}
+
+//-----------------------------------------------------------------------------
+static bool udev_is_debugger(struct udev_device *dev, int vid, int pid)
+{
+  const char *product = NULL;
+
+  if (dbg_known_id(vid, pid))
+    return true;
+
+#ifdef DBG_KNOWN_IDS
+  (void)dev;
+#else
+  product = udev_device_get_sysattr_value(dev, "product");
+#endif
+
+  return product && strstr(product, "CMSIS-DAP");
+}
+
+//-----------------------------------------------------------------------------
+static int udev_add_hidraw(struct udev *udev, struct udev_device *parent, int vid, int pid,
+    debugger_t *debuggers, int size)
+{
+  struct udev_enumerate *enumerate;
+  struct udev_list_entry *dev_list_entry;
+  int rsize = 0;
+
+  enumerate = udev_enumerate_new(udev);
+  udev_enumerate_add_match_parent(enumerate, parent);
+  udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+  udev_enumerate_scan_devices(enumerate);
+
+  udev_list_entry_foreach(dev_list_entry, udev_enumerate_get_list_entry(enumerate))
+  {
+    struct udev_device *dev;
+    const char *node;
+
+    if (rsize == size)
+      break;
+
+    dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(dev_list_entry));
+
+    if (NULL == dev)
+      continue;
+
+    if (NULL != (node = udev_device_get_devnode(dev)))
+    {
+      debuggers[rsize].path = strdup(node);
+      debuggers[rsize].serial = udev_attr_dup(parent, "serial");
+      debuggers[rsize].manufacturer = udev_attr_dup(parent, "manufacturer");
+      debuggers[rsize].product = udev_attr_dup(parent, "product");
+      debuggers[rsize].vid = vid;
+      debuggers[rsize].pid = pid;
+      rsize++;
+    }
+
+    udev_device_unref(dev);
+  }
+
+  udev_enumerate_unref(enumerate);
+
+  return rsize;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_hid_enumerate(debugger_t *debuggers, int size, char *serial)
 {
   struct udev *udev;
   struct udev_enumerate *enumerate;
-  struct udev_list_entry *devices, *dev_list_entry;
-  struct udev_device *dev, *parent;
+  struct udev_list_entry *dev_list_entry;
   int rsize = 0;
 
   udev = udev_new();
   check(udev, "unable to create udev object");
 
+  // Only USB devices are scanned, the HID nodes are looked up for the
+  // matching ones, so the unrelated HID devices are never opened
   enumerate = udev_enumerate_new(udev);
-  udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+  udev_enumerate_add_match_subsystem(enumerate, "usb");
+  udev_enumerate_add_match_property(enumerate, "DEVTYPE", "usb_device");
+
+  if (serial)
+    udev_enumerate_add_match_sysattr(enumerate, "serial", serial);
+
   udev_enumerate_scan_devices(enumerate);
-  devices = udev_enumerate_get_list_entry(enumerate);
 
-  udev_list_entry_foreach(dev_list_entry, devices)
+  udev_list_entry_foreach(dev_list_entry, udev_enumerate_get_list_entry(enumerate))
   {
-    const char *path;
+    struct udev_device *dev;
+    const char *vid_str, *pid_str;
 
-    path = udev_list_entry_get_name(dev_list_entry);
-    dev = udev_device_new_from_syspath(udev, path);
+    if (rsize == size)
+      break;
 
-    parent = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
+    dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(dev_list_entry));
 
-    if (NULL == parent)
+    if (NULL == dev)
       continue;
 
-    if (rsize < size)
+    vid_str = udev_device_get_sysattr_value(dev, "idVendor");
+    pid_str = udev_device_get_sysattr_value(dev, "idProduct");
+
+    if (vid_str && pid_str)
     {
-      const char *serial = udev_device_get_sysattr_value(parent, "serial");
-      const char *manufacturer = udev_device_get_sysattr_value(parent, "manufacturer");
-      const char *product = udev_device_get_sysattr_value(parent, "product");
-
-      debuggers[rsize].path = strdup(udev_device_get_devnode(dev));
-      debuggers[rsize].serial = serial ? strdup(serial) : "<unknown>";
-      debuggers[rsize].manufacturer = manufacturer ? strdup(manufacturer) : "<unknown>";
-      debuggers[rsize].product = product ? strdup(product) : "<unknown>";
-      debuggers[rsize].vid = strtol(udev_device_get_sysattr_value(parent, "idVendor"), NULL, 16);
-      debuggers[rsize].pid = strtol(udev_device_get_sysattr_value(parent, "idProduct"), NULL, 16);
-
-      if (strstr(debuggers[rsize].product, "CMSIS-DAP"))
-        rsize++;
+      int vid = strtol(vid_str, NULL, 16);
+      int pid = strtol(pid_str, NULL, 16);
+
+      if (udev_is_debugger(dev, vid, pid))
+        rsize += udev_add_hidraw(udev, dev, vid, pid, &debuggers[rsize], size - rsize);
     }
 
-    udev_device_unref(parent);
+    udev_device_unref(dev);
+
+    // Serial numbers are unique, there is no need to look further
+    if (serial && rsize)
+      break;
   }
 
   udev_enumerate_unref(enumerate);
@@ -147,7 +221,7 @@ static int parse_hid_report_desc(uint8_t *data, int size)
 }
 
 //-----------------------------------------------------------------------------
-void dbg_open(debugger_t *debugger)
+void dbg_hid_open(debugger_t *debugger)
 {
   struct hidraw_report_descriptor rpt_desc;
   struct hidraw_devinfo info;
@@ -174,44 +248,46 @@ void dbg_open(debugger_t *debugger)
 }
 
 //-----------------------------------------------------------------------------
-void dbg_close(void)
+void dbg_hid_close(void)
 {
   if (debugger_fd)
     close(debugger_fd);
 }
 
 //-----------------------------------------------------------------------------
-int dbg_get_report_size(void)
+int dbg_hid_get_report_size(void)
 {
   return report_size;
 }
 
 //-----------------------------------------------------------------------------
-int dbg_dap_cmd(uint8_t *data, int size, int rsize)
+void dbg_hid_send(uint8_t *report, int size)
 {
-  char cmd = data[0];
   int res;
 
-  memset(hid_buffer, 0xff, report_size + 1);
+  (void)size;
 
-  hid_buffer[0] = 0x00; // Report ID
-  memcpy(&hid_buffer[1], data, rsize);
+  report[0] = 0x00; // Report ID
 
-  res = write(debugger_fd, hid_buffer, report_size + 1);
+  res = write(debugger_fd, report, report_size + 1);
   if (res < 0)
     perror_exit("debugger write()");
+}
+
+//-----------------------------------------------------------------------------
+int dbg_hid_recv(uint8_t cmd, uint8_t *report, uint8_t **data)
+{
+  int res;
 
-  res = read(debugger_fd, hid_buffer, report_size + 1);
+  res = read(debugger_fd, report, report_size + 1);
   if (res < 0)
     perror_exit("debugger read()");
 
   check(res, "empty response received");
 
-  check(hid_buffer[0] == cmd, "invalid response received");
+  check(report[0] == cmd, "invalid response received");
 
-  res--;
-  memcpy(data, &hid_buffer[1], (size < res) ? size : res);
+  *data = &report[1];
 
-  return res;
+  return res - 1;
 }
-
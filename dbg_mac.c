@@ -38,9 +38,8 @@
 #include "dbg.h"
 
 /*- Variables ---------------------------------------------------------------*/
-static hid_device *handle = NULL;
-static uint8_t hid_buffer[1024 + 1];
-static int report_size = 512; // TODO: read actual report size
+static _Thread_local hid_device *handle = NULL;
+static _Thread_local int report_size = 512; // TODO: read actual report size
 
 /*- Implementations ---------------------------------------------------------*/
 
@@ -60,7 +59,7 @@ char *wcstombsdup(const wchar_t * const src)
 }
 
 //-----------------------------------------------------------------------------
-int dbg_enumerate(debugger_t *debuggers, int size) 
+int dbg_hid_enumerate(debugger_t *debuggers, int size, char *serial)
 {
   struct hid_device_info *devs, *cur_dev;
   int rsize = 0;
@@ -73,6 +72,22 @@ int dbg_enumerate(debugger_t *debuggers, int size)
 
   for (cur_dev = devs; cur_dev && rsize < size; cur_dev = cur_dev->next)
   {
+#ifdef DBG_KNOWN_IDS
+    if (!dbg_known_id(cur_dev->vendor_id, cur_dev->product_id))
+      continue;
+#endif
+
+    if (serial)
+    {
+      char *sn = cur_dev->serial_number ? wcstombsdup(cur_dev->serial_number) : NULL;
+      bool match = sn && 0 == strcmp(sn, serial);
+
+      free(sn);
+
+      if (!match)
+        continue;
+    }
+
     debuggers[rsize].path = strdup(cur_dev->path);
     debuggers[rsize].serial = cur_dev->serial_number ? wcstombsdup(cur_dev->serial_number) : "<unknown>";
     debuggers[rsize].wserial = cur_dev->serial_number ? wcsdup(cur_dev->serial_number) : NULL;
@@ -91,7 +106,7 @@ int dbg_enumerate(debugger_t *debuggers, int size)
 }
 
 //-----------------------------------------------------------------------------
-void dbg_open(debugger_t *debugger)
+void dbg_hid_open(debugger_t *debugger)
 {
   handle = hid_open(debugger->vid, debugger->pid, debugger->wserial);
 
@@ -100,47 +115,49 @@ void dbg_open(debugger_t *debugger)
 }
 
 //-----------------------------------------------------------------------------
-void dbg_close(void)
+void dbg_hid_close(void)
 {
   if (handle)
     hid_close(handle);
 }
 
 //-----------------------------------------------------------------------------
-int dbg_get_report_size(void)
+int dbg_hid_get_report_size(void)
 {
   return report_size;
 }
 
 //-----------------------------------------------------------------------------
-int dbg_dap_cmd(uint8_t *data, int size, int rsize)
+void dbg_hid_send(uint8_t *report, int size)
 {
-  char cmd = data[0];
   int res;
 
-  memset(hid_buffer, 0xff, report_size + 1);
+  (void)size;
 
-  hid_buffer[0] = 0x00; // Report ID
-  memcpy(&hid_buffer[1], data, rsize);
+  report[0] = 0x00; // Report ID
 
-  res = hid_write(handle, hid_buffer, report_size + 1);
+  res = hid_write(handle, report, report_size + 1);
   if (res < 0)
   {
     message("Error: %ls\n", hid_error(handle));
     perror_exit("debugger write()");
   }
+}
 
-  res = hid_read(handle, hid_buffer, report_size + 1);
+//-----------------------------------------------------------------------------
+int dbg_hid_recv(uint8_t cmd, uint8_t *report, uint8_t **data)
+{
+  int res;
+
+  res = hid_read(handle, report, report_size + 1);
   if (res < 0)
     perror_exit("debugger read()");
 
   check(res, "empty response received");
 
-  check(hid_buffer[0] == cmd, "invalid response received");
+  check(report[0] == cmd, "invalid response received");
 
-  res--;
-  memcpy(data, &hid_buffer[1], (size < res) ? size : res);
+  *data = &report[1];
 
-  return res;
+  return res - 1;
 }
-
@@ -0,0 +1,1451 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "edbg.h"
+#include "dbg.h"
+#include "target.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define SIM_MAX_PROBES         8
+#define SIM_MAX_PACKETS        16
+#define SIM_MAX_REPORT_SIZE    1024
+#define SIM_MAX_PAGE_SIZE      512
+#define SIM_MAX_PLANES         2
+#define SIM_FRR_SIZE           8
+#define SIM_BOOTROM_QUEUE      4
+
+#define SIM_DEFAULT_TARGET     "atmel_cm0p"
+#define SIM_DEFAULT_LATENCY    1000 // us, round trip
+#define SIM_DEFAULT_PACKETS    4
+#define SIM_DEFAULT_REPORT     512
+#define SIM_DEFAULT_CLOCK      1000000 // Hz
+
+#define SIM_RAM_SIZE           (64 * 1024)
+#define SIM_AUX_ADDR           0x00800000
+#define SIM_AUX_SIZE           (64 * 1024)
+
+// Modeled timings, all in nanoseconds
+#define SIM_COMMAND_NS         10000ull
+#define SIM_PAGE_WRITE_NS      2500000ull
+#define SIM_ERASE_NS           6000000ull
+#define SIM_CHIP_ERASE_NS      250000000ull
+#define SIM_CRC_WORD_NS        50ull
+
+// Request, turnaround, acknowledge, turnaround, data and parity
+#define SIM_SWD_TRANSFER_BITS  46
+
+#define CPUID                  0xe000ed00
+#define DHCSR                  0xe000edf0
+
+#define DSU_CTRL_STATUS        0x41002100
+#define DSU_ADDR               0x41002104
+#define DSU_LENGTH             0x41002108
+#define DSU_DATA               0x4100210c
+#define DSU_BCC0               0x41002120
+#define DSU_BCC1               0x41002124
+
+#define DSU_CTRL_CRC           (1 << 2)
+#define DSU_CTRL_CE            (1 << 4)
+#define DSU_STATUSA_DONE       (1 << 0)
+#define DSU_STATUSA_BERR       (1 << 2)
+#define DSU_STATUSB_PROT       (1 << 0)
+#define DSU_STATUSB_BCCD1      (1 << 7)
+
+#define NVMCTRL_BASE           0x41004000
+#define NVMCTRL_SEC_BASE       0x41005000
+#define NVMCTRL_KEY            0xa5
+
+#define EEFC_KEY               0x5a
+
+#define BOOTROM_CMD_PREFIX     0x44424700
+#define BOOTROM_SIG_PREFIX     0xec000000
+
+enum
+{
+  SIM_SAMD,    // DSU and NVMCTRL with automatic page writes (SAM C/D/R/L2x)
+  SIM_SAMD5X,  // DSU and NVMCTRL with manual page writes (SAM D5x/E5x)
+  SIM_SAML1X,  // DSU, NVMCTRL and the BootROM interface (SAM L10/L11)
+  SIM_EEFC,    // CHIPID and one EEFC per flash plane (SAM3/4/G/E7x)
+};
+
+enum
+{
+  ID_DAP_INFO               = 0x00,
+  ID_DAP_LED                = 0x01,
+  ID_DAP_CONNECT            = 0x02,
+  ID_DAP_DISCONNECT         = 0x03,
+  ID_DAP_TRANSFER_CONFIGURE = 0x04,
+  ID_DAP_TRANSFER           = 0x05,
+  ID_DAP_TRANSFER_BLOCK     = 0x06,
+  ID_DAP_DELAY              = 0x09,
+  ID_DAP_RESET_TARGET       = 0x0a,
+  ID_DAP_SWJ_PINS           = 0x10,
+  ID_DAP_SWJ_CLOCK          = 0x11,
+  ID_DAP_SWJ_SEQUENCE       = 0x12,
+  ID_DAP_SWD_CONFIGURE      = 0x13,
+  ID_DAP_INVALID            = 0xff,
+};
+
+enum
+{
+  DAP_INFO_VENDOR           = 0x01,
+  DAP_INFO_PRODUCT          = 0x02,
+  DAP_INFO_SER_NUM          = 0x03,
+  DAP_INFO_FW_VER           = 0x04,
+  DAP_INFO_CAPABILITIES     = 0xf0,
+  DAP_INFO_PACKET_COUNT     = 0xfe,
+  DAP_INFO_PACKET_SIZE      = 0xff,
+};
+
+enum
+{
+  DAP_TRANSFER_APnDP        = 1 << 0,
+  DAP_TRANSFER_RnW          = 1 << 1,
+  DAP_TRANSFER_MATCH_VALUE  = 1 << 4,
+  DAP_TRANSFER_MATCH_MASK   = 1 << 5,
+};
+
+enum
+{
+  DAP_TRANSFER_OK           = 1 << 0,
+  DAP_TRANSFER_MISMATCH     = 1 << 4,
+};
+
+enum
+{
+  DAP_OK    = 0x00,
+  DAP_ERROR = 0xff,
+};
+
+enum
+{
+  BOOTROM_CMD_INIT      = 0x55,
+  BOOTROM_CMD_EXIT      = 0xaa,
+  BOOTROM_CMD_CE0       = 0xe0,
+  BOOTROM_CMD_CE1       = 0xe1,
+  BOOTROM_CMD_CE2       = 0xe2,
+  BOOTROM_CMD_CHIPERASE = 0xe3,
+};
+
+enum
+{
+  BOOTROM_SIG_NO          = 0x00,
+  BOOTROM_SIG_COMM        = 0x20,
+  BOOTROM_SIG_CMD_SUCCESS = 0x21,
+  BOOTROM_SIG_CMD_VALID   = 0x24,
+  BOOTROM_SIG_BOOTOK      = 0x39,
+};
+
+#define DAP_SWJ_nRESET         (1 << 7)
+
+#define AP_CSW_SIZE_MASK       (7 << 0)
+#define AP_CSW_ADDRINC_SINGLE  (1 << 4)
+#define AP_CSW_ADDRINC_PACKED  (2 << 4)
+#define AP_CSW_ADDRINC_MASK    (3 << 4)
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  char      *target;
+  char      *name;
+  int       model;
+  uint32_t  idcode;
+  uint32_t  cpuid;
+  uint32_t  chipid_addr;
+  uint32_t  chip_id;
+  uint32_t  chip_exid;
+  uint32_t  flash_addr;
+  uint32_t  flash_size;
+  uint32_t  page_size;
+  uint32_t  ram_addr;
+  int       n_planes;
+  uint32_t  eefc_base[SIM_MAX_PLANES];
+} sim_device_t;
+
+typedef struct
+{
+  uint8_t   data[SIM_MAX_REPORT_SIZE];
+  uint64_t  time;
+} sim_response_t;
+
+// Flash planes with separate controllers are busy and buffer page data independently
+typedef struct
+{
+  uint64_t  busy_until;
+  uint32_t  latch_addr;
+  uint8_t   latch[SIM_MAX_PAGE_SIZE];
+  bool      latch_valid[SIM_MAX_PAGE_SIZE];
+  bool      latch_used;
+} sim_bank_t;
+
+/*- Variables ---------------------------------------------------------------*/
+static sim_device_t sim_devices[] =
+{
+  { "atmel_cm0p",  "SAM D21J18A", SIM_SAMD,   0x0bc11477, 0x410cc601, 0x41002118, 0x10010000, 0,
+      0x00000000,  256*1024,  64, 0x20000000, 0, { 0 } },
+  { "atmel_cm3",   "ATSAM3X8E",   SIM_EEFC,   0x2ba01477, 0x412fc230, 0x400e0940, 0x285e0a60, 0,
+      0x00080000,  512*1024, 256, 0x20000000, 2, { 0x400e0a00, 0x400e0c00 } },
+  { "atmel_cm4",   "SAM G51G18",  SIM_EEFC,   0x2ba01477, 0x410fc241, 0x400e0740, 0x243b09e0, 0,
+      0x00400000,  256*1024, 512, 0x20000000, 1, { 0x400e0a00 } },
+  { "atmel_cm4",   "SAM4SD32C",   SIM_EEFC,   0x2ba01477, 0x410fc241, 0x400e0740, 0x29a70ee1, 0,
+      0x00400000, 2048*1024, 512, 0x20000000, 2, { 0x400e0a00, 0x400e0c00 } },
+  { "atmel_cm7",   "SAM E70Q21",  SIM_EEFC,   0x0bd11477, 0x410fc271, 0x400e0940, 0xa1020e00, 2,
+      0x00400000, 2048*1024, 512, 0x20400000, 1, { 0x400e0c00 } },
+  { "atmel_cm4v2", "SAM D51P20A", SIM_SAMD5X, 0x2ba01477, 0x410fc241, 0x41002118, 0x60060000, 0,
+      0x00000000, 1024*1024, 512, 0x20000000, 0, { 0 } },
+  { "mchp_cm23",   "SAM L10E16A", SIM_SAML1X, 0x0be12477, 0x411cd200, 0x41002118, 0x20840000, 0,
+      0x00000000,   64*1024,  64, 0x20000000, 0, { 0 } },
+  { NULL },
+};
+
+static char sim_serials[SIM_MAX_PROBES][16];
+
+static _Thread_local bool sim_opened = false;
+static _Thread_local char *sim_serial;
+static _Thread_local sim_device_t *sim_device;
+static _Thread_local int sim_report_size = 0;
+static _Thread_local int sim_packet_count;
+static _Thread_local uint64_t sim_latency;
+static _Thread_local bool sim_packed;
+
+static _Thread_local uint8_t *sim_flash;
+static _Thread_local uint8_t *sim_aux;
+static _Thread_local uint8_t *sim_ram;
+
+static _Thread_local sim_response_t sim_responses[SIM_MAX_PACKETS];
+static _Thread_local int sim_responses_head;
+static _Thread_local int sim_responses_count;
+
+static _Thread_local uint64_t sim_host_time;
+static _Thread_local uint64_t sim_device_time;
+static _Thread_local sim_bank_t sim_banks[SIM_MAX_PLANES];
+static _Thread_local sim_bank_t *sim_bank;
+static _Thread_local uint64_t sim_commands;
+static _Thread_local uint64_t sim_transfers;
+
+static _Thread_local uint32_t sim_clock;
+static _Thread_local int sim_idle_cycles;
+static _Thread_local int sim_match_retry;
+static _Thread_local uint32_t sim_match_mask;
+static _Thread_local uint8_t sim_pins;
+
+static _Thread_local uint32_t sim_dp_select;
+static _Thread_local uint32_t sim_dp_rdbuff;
+static _Thread_local uint32_t sim_ap_csw;
+static _Thread_local uint32_t sim_ap_tar;
+
+static _Thread_local bool sim_nvm_manual;
+static _Thread_local uint32_t sim_nvm_addr;
+
+static _Thread_local uint32_t sim_dsu_addr;
+static _Thread_local uint32_t sim_dsu_length;
+static _Thread_local uint32_t sim_dsu_data;
+static _Thread_local uint8_t sim_dsu_statusa;
+static _Thread_local bool sim_locked;
+static _Thread_local bool sim_bank_b; // Bank B is mapped at the start of the flash
+static _Thread_local int sim_dal;
+
+static _Thread_local uint32_t sim_bootrom_queue[SIM_BOOTROM_QUEUE];
+static _Thread_local int sim_bootrom_count;
+static _Thread_local uint32_t sim_bootrom_bcc1;
+static _Thread_local int sim_bootrom_data;
+
+static _Thread_local uint32_t sim_frr[SIM_MAX_PLANES][SIM_FRR_SIZE];
+static _Thread_local int sim_frr_head[SIM_MAX_PLANES];
+static _Thread_local int sim_frr_count[SIM_MAX_PLANES];
+static _Thread_local uint32_t sim_gpnvm;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static int sim_get_env(char *name, int value)
+{
+  char *str = getenv(name);
+
+  if (NULL == str)
+    return value;
+
+  return strtol(str, NULL, 0);
+}
+
+//-----------------------------------------------------------------------------
+static char *sim_state_file(void)
+{
+  static _Thread_local char name[256];
+  char *prefix = getenv("EDBG_SIM_STATE");
+
+  if (NULL == prefix)
+    return NULL;
+
+  snprintf(name, sizeof(name), "%s_%s.bin", prefix, sim_serial);
+
+  return name;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_load_state(void)
+{
+  char *name = sim_state_file();
+  FILE *file;
+
+  if (NULL == name || NULL == (file = fopen(name, "rb")))
+    return;
+
+  if (1 != fread(sim_flash, sim_device->flash_size, 1, file) ||
+      1 != fread(sim_aux, SIM_AUX_SIZE, 1, file))
+    warning("simulator state file %s is incomplete", name);
+
+  fclose(file);
+}
+
+//-----------------------------------------------------------------------------
+static void sim_save_state(void)
+{
+  char *name = sim_state_file();
+  FILE *file;
+
+  if (NULL == name)
+    return;
+
+  if (NULL == (file = fopen(name, "wb")))
+  {
+    warning("unable to save simulator state to %s", name);
+    return;
+  }
+
+  fwrite(sim_flash, sim_device->flash_size, 1, file);
+  fwrite(sim_aux, SIM_AUX_SIZE, 1, file);
+  fclose(file);
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *sim_memory(uint32_t addr, bool *nvm)
+{
+  *nvm = true;
+
+  if (addr >= sim_device->flash_addr && (addr - sim_device->flash_addr) < sim_device->flash_size)
+    return &sim_flash[addr - sim_device->flash_addr];
+
+  if (SIM_EEFC != sim_device->model && addr >= SIM_AUX_ADDR && (addr - SIM_AUX_ADDR) < SIM_AUX_SIZE)
+    return &sim_aux[addr - SIM_AUX_ADDR];
+
+  *nvm = false;
+
+  if (addr >= sim_device->ram_addr && (addr - sim_device->ram_addr) < SIM_RAM_SIZE)
+    return &sim_ram[addr - sim_device->ram_addr];
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_select_bank(int plane)
+{
+  sim_bank = &sim_banks[plane];
+}
+
+//-----------------------------------------------------------------------------
+static void sim_select_bank_addr(uint32_t addr)
+{
+  int plane = 0;
+
+  if (SIM_EEFC == sim_device->model)
+    plane = (addr - sim_device->flash_addr) / (sim_device->flash_size / sim_device->n_planes);
+
+  sim_select_bank(plane);
+}
+
+//-----------------------------------------------------------------------------
+static bool sim_ready(void)
+{
+  return sim_device_time >= sim_bank->busy_until;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_busy(uint64_t time)
+{
+  sim_bank->busy_until = sim_device_time + time;
+}
+
+//-----------------------------------------------------------------------------
+static uint64_t sim_next_ready(void)
+{
+  uint64_t next = 0;
+
+  // The earliest moment when any of the busy planes completes
+  for (int i = 0; i < SIM_MAX_PLANES; i++)
+  {
+    if (sim_banks[i].busy_until > sim_device_time && (0 == next || sim_banks[i].busy_until < next))
+      next = sim_banks[i].busy_until;
+  }
+
+  return next;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_erase(uint32_t addr, uint32_t size)
+{
+  bool nvm;
+  uint8_t *mem;
+
+  addr &= ~(size - 1);
+  mem = sim_memory(addr, &nvm);
+
+  if (mem && nvm)
+    memset(mem, 0xff, size);
+
+  sim_busy(SIM_ERASE_NS);
+}
+
+//-----------------------------------------------------------------------------
+static void sim_chip_erase(void)
+{
+  memset(sim_flash, 0xff, sim_device->flash_size);
+  sim_locked = false;
+  sim_dal = 2;
+  sim_busy(SIM_CHIP_ERASE_NS);
+}
+
+//-----------------------------------------------------------------------------
+static void sim_latch_clear(void)
+{
+  memset(sim_bank->latch_valid, 0, sizeof(sim_bank->latch_valid));
+  sim_bank->latch_used = false;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_latch_commit(void)
+{
+  bool nvm;
+  uint8_t *mem = sim_memory(sim_bank->latch_addr, &nvm);
+
+  // Flash cells can only be programmed from 1 to 0
+  for (uint32_t i = 0; mem && sim_bank->latch_used && i < sim_device->page_size; i++)
+  {
+    if (sim_bank->latch_valid[i])
+      mem[i] &= sim_bank->latch[i];
+  }
+
+  sim_latch_clear();
+  sim_busy(SIM_PAGE_WRITE_NS);
+}
+
+//-----------------------------------------------------------------------------
+static void sim_latch_write(uint32_t addr, uint32_t data, uint32_t mask)
+{
+  uint32_t page = addr & ~(sim_device->page_size - 1);
+  uint32_t offs = addr - page;
+
+  sim_select_bank_addr(addr);
+
+  // EEFC page buffer belongs to the controller while it is writing the page,
+  // NVMCTRL stalls the bus instead
+  check(SIM_EEFC != sim_device->model || sim_ready(),
+      "simulated flash write at 0x%08x while the controller is busy", addr);
+
+  if (sim_bank->latch_used && page != sim_bank->latch_addr)
+    sim_latch_clear();
+
+  sim_bank->latch_addr = page;
+  sim_bank->latch_used = true;
+
+  for (int i = 0; i < 4; i++)
+  {
+    if (mask & (0xff << (i * 8)))
+    {
+      sim_bank->latch[offs + i] = data >> (i * 8);
+      sim_bank->latch_valid[offs + i] = true;
+    }
+  }
+
+  // Writing the last word of a page starts the page write in the automatic mode
+  if ((SIM_SAMD == sim_device->model || SIM_SAML1X == sim_device->model) &&
+      !sim_nvm_manual && (sim_device->page_size - 4) == offs)
+    sim_latch_commit();
+}
+
+//-----------------------------------------------------------------------------
+static void sim_dsu_crc32(void)
+{
+  uint32_t addr = sim_dsu_addr & ~3;
+  uint32_t size = sim_dsu_length & ~3;
+  uint8_t *start, *end;
+  bool nvm_start, nvm_end;
+
+  start = sim_memory(addr, &nvm_start);
+  end = size ? sim_memory(addr + size - 1, &nvm_end) : start;
+
+  if (NULL == start || NULL == end || (end - start) != (int)(size ? size - 1 : 0))
+  {
+    sim_dsu_statusa |= DSU_STATUSA_BERR | DSU_STATUSA_DONE;
+    return;
+  }
+
+  sim_dsu_data = target_crc32(sim_dsu_data, start, size);
+  sim_dsu_statusa |= DSU_STATUSA_DONE;
+  sim_busy(SIM_CRC_WORD_NS * (size / 4));
+}
+
+//-----------------------------------------------------------------------------
+static void sim_bootrom_respond(uint32_t sig)
+{
+  if (sim_bootrom_count < SIM_BOOTROM_QUEUE)
+    sim_bootrom_queue[sim_bootrom_count++] = BOOTROM_SIG_PREFIX | sig;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_bootrom_write(uint32_t value)
+{
+  if (sim_bootrom_data)
+  {
+    // The last key word starts the erase
+    if (0 == --sim_bootrom_data)
+    {
+      sim_chip_erase();
+      sim_bootrom_respond(BOOTROM_SIG_CMD_SUCCESS);
+    }
+    return;
+  }
+
+  if (BOOTROM_CMD_PREFIX != (value & 0xffffff00))
+    return;
+
+  switch (value & 0xff)
+  {
+    case BOOTROM_CMD_INIT:
+      sim_bootrom_respond(BOOTROM_SIG_COMM);
+      break;
+
+    case BOOTROM_CMD_EXIT:
+      sim_bootrom_respond(BOOTROM_SIG_BOOTOK);
+      break;
+
+    case BOOTROM_CMD_CE0:
+    case BOOTROM_CMD_CE1:
+    case BOOTROM_CMD_CHIPERASE:
+      sim_bootrom_respond(BOOTROM_SIG_CMD_VALID);
+      sim_chip_erase();
+      sim_bootrom_respond(BOOTROM_SIG_CMD_SUCCESS);
+      break;
+
+    case BOOTROM_CMD_CE2:
+      sim_bootrom_respond(BOOTROM_SIG_CMD_VALID);
+      sim_bootrom_data = 4;
+      break;
+
+    default:
+      sim_bootrom_respond(BOOTROM_SIG_NO);
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t sim_bootrom_read(void)
+{
+  if (sim_bootrom_count && sim_ready())
+  {
+    sim_bootrom_bcc1 = sim_bootrom_queue[0];
+    memmove(&sim_bootrom_queue[0], &sim_bootrom_queue[1],
+        (--sim_bootrom_count) * sizeof(uint32_t));
+  }
+
+  return sim_bootrom_bcc1;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t sim_dsu_read(uint32_t addr)
+{
+  uint8_t statusa = sim_dsu_statusa;
+  uint8_t statusb;
+
+  if (!sim_ready())
+    statusa &= ~DSU_STATUSA_DONE;
+
+  if (SIM_SAML1X == sim_device->model)
+    statusb = sim_dal | ((sim_bootrom_count && sim_ready()) ? DSU_STATUSB_BCCD1 : 0);
+  else
+    statusb = sim_locked ? DSU_STATUSB_PROT : 0;
+
+  switch (addr)
+  {
+    case DSU_CTRL_STATUS: return ((uint32_t)statusb << 16) | ((uint32_t)statusa << 8);
+    case DSU_ADDR:        return sim_dsu_addr;
+    case DSU_LENGTH:      return sim_dsu_length;
+    case DSU_DATA:        return sim_dsu_data;
+    case DSU_BCC1:        return sim_bootrom_read();
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_dsu_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  switch (addr)
+  {
+    case DSU_CTRL_STATUS:
+    {
+      // STATUSA flags are cleared by writing ones
+      if (mask & 0x0000ff00)
+        sim_dsu_statusa &= ~(value >> 8);
+
+      if ((mask & 0xff) && (value & DSU_CTRL_CE))
+      {
+        sim_chip_erase();
+        sim_dsu_statusa |= DSU_STATUSA_DONE;
+      }
+
+      if ((mask & 0xff) && (value & DSU_CTRL_CRC))
+        sim_dsu_crc32();
+    } break;
+
+    case DSU_ADDR:   sim_dsu_addr = value; break;
+    case DSU_LENGTH: sim_dsu_length = value; break;
+    case DSU_DATA:   sim_dsu_data = value; break;
+
+    case DSU_BCC0:
+    {
+      if (SIM_SAML1X == sim_device->model)
+        sim_bootrom_write(value);
+    } break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void sim_bank_swap(void)
+{
+  uint32_t size = sim_device->flash_size / 2;
+  uint8_t *buf = buf_alloc(size);
+
+  // The banks trade places in the memory map, the reset is not modeled
+  memcpy(buf, sim_flash, size);
+  memcpy(sim_flash, &sim_flash[size], size);
+  memcpy(&sim_flash[size], buf, size);
+
+  buf_free(buf);
+
+  sim_bank_b = !sim_bank_b;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_nvmctrl_command(uint32_t cmd)
+{
+  uint32_t row = sim_device->page_size * 4;
+  uint32_t addr = (SIM_SAMD == sim_device->model) ? (sim_nvm_addr << 1) : sim_nvm_addr;
+
+  if (NVMCTRL_KEY != ((cmd >> 8) & 0xff))
+    return;
+
+  if (SIM_SAMD5X == sim_device->model)
+  {
+    switch (cmd & 0x7f)
+    {
+      case 0x00: sim_erase(addr, sim_device->page_size); break; // EP
+      case 0x01: sim_erase(addr, sim_device->page_size * 16); break; // EB
+      case 0x03: // WP
+      case 0x04: sim_latch_commit(); break; // WQW
+      case 0x15: sim_latch_clear(); break; // PBC
+      case 0x16: sim_locked = true; break; // SSB
+      case 0x17: sim_bank_swap(); break; // BKSWRST
+    }
+  }
+  else
+  {
+    switch (cmd & 0x7f)
+    {
+      case 0x02: // ER
+      case 0x05: sim_erase(addr, row); break; // EAR
+      case 0x04: // WP
+      case 0x06: sim_latch_commit(); break; // WAP
+      case 0x44: sim_latch_clear(); break; // PBC
+      case 0x45: sim_locked = true; break; // SSB
+      case 0x4b: sim_dal = 0; break; // SDAL0
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t sim_nvmctrl_read(uint32_t offs)
+{
+  if (SIM_SAMD5X == sim_device->model)
+  {
+    if (0x10 == offs)
+      return (sim_ready() ? (1 << 16) : 0) | (sim_bank_b ? 0 : (1 << 20)); // STATUS.AFIRST
+    else if (0x14 == offs)
+      return sim_nvm_addr;
+  }
+  else
+  {
+    if (0x14 == offs)
+      return sim_ready() ? (1 << 0) : 0;
+    else if (0x18 == offs)
+      return sim_ready() ? (1 << 2) : 0;
+    else if (0x1c == offs)
+      return sim_nvm_addr;
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_nvmctrl_write(uint32_t offs, uint32_t value)
+{
+  if (SIM_SAMD5X == sim_device->model)
+  {
+    if (0x00 == offs || 0x04 == offs)
+      sim_nvmctrl_command(value);
+    else if (0x14 == offs)
+      sim_nvm_addr = value;
+  }
+  else
+  {
+    if (0x00 == offs)
+      sim_nvmctrl_command(value);
+    else if (0x04 == offs || 0x08 == offs)
+      sim_nvm_manual = (0 != value);
+    else if (0x1c == offs)
+      sim_nvm_addr = value;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void sim_eefc_command(int plane, uint32_t value)
+{
+  uint32_t farg = (value >> 8) & 0xffff;
+  uint32_t *frr = sim_frr[plane];
+  uint32_t plane_size = sim_device->flash_size / sim_device->n_planes;
+
+  if (EEFC_KEY != (value >> 24))
+    return;
+
+  sim_select_bank(plane);
+
+  check(sim_ready(), "simulated flash command 0x%02x while the controller is busy", value & 0xff);
+
+  switch (value & 0xff)
+  {
+    case 0x00: // GETD
+    {
+      frr[0] = 0x00000001; // FL_ID
+      frr[1] = plane_size;
+      frr[2] = sim_device->page_size;
+      frr[3] = 1; // FL_NB_PLANE
+      frr[4] = plane_size;
+      frr[5] = 1; // FL_NB_LOCK
+      frr[6] = plane_size;
+      sim_frr_count[plane] = 7;
+    } break;
+
+    case 0x01: // WP
+      sim_latch_commit();
+      break;
+
+    case 0x03: // EWP
+    {
+      sim_erase(sim_bank->latch_addr, sim_device->page_size);
+      sim_latch_commit();
+    } break;
+
+    case 0x05: // EA
+      sim_chip_erase();
+      break;
+
+    case 0x07: // EPA
+    {
+      uint32_t count = 4 << (farg & 3);
+      uint32_t page = farg & ~(count - 1);
+
+      sim_erase(sim_device->flash_addr + page * sim_device->page_size,
+          count * sim_device->page_size);
+    } break;
+
+    case 0x0b: // SGPB
+      sim_gpnvm |= (1 << farg);
+      sim_busy(SIM_PAGE_WRITE_NS);
+      break;
+
+    case 0x0c: // CGPB
+      sim_gpnvm &= ~(1 << farg);
+      sim_busy(SIM_PAGE_WRITE_NS);
+      break;
+
+    case 0x0d: // GGPB
+    {
+      frr[0] = sim_gpnvm;
+      sim_frr_count[plane] = 1;
+    } break;
+  }
+
+  sim_frr_head[plane] = 0;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t sim_eefc_read(int plane, uint32_t offs)
+{
+  sim_select_bank(plane);
+
+  if (0x08 == offs)
+    return sim_ready() ? 1 : 0; // FSR.FRDY
+
+  if (0x0c == offs && sim_frr_head[plane] < sim_frr_count[plane])
+    return sim_frr[plane][sim_frr_head[plane]++];
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t sim_read_reg(uint32_t addr)
+{
+  if (addr == sim_device->chipid_addr)
+    return sim_device->chip_id;
+
+  if (CPUID == addr)
+    return sim_device->cpuid;
+
+  if (SIM_EEFC == sim_device->model)
+  {
+    if (addr == sim_device->chipid_addr + 4)
+      return sim_device->chip_exid;
+
+    for (int i = 0; i < sim_device->n_planes; i++)
+    {
+      if (addr >= sim_device->eefc_base[i] && addr < sim_device->eefc_base[i] + 0x10)
+        return sim_eefc_read(i, addr - sim_device->eefc_base[i]);
+    }
+  }
+  else
+  {
+    if ((addr & ~0xff) == DSU_CTRL_STATUS)
+      return sim_dsu_read(addr);
+
+    if ((addr & ~0xff) == NVMCTRL_BASE ||
+        (SIM_SAML1X == sim_device->model && (addr & ~0xff) == NVMCTRL_SEC_BASE))
+      return sim_nvmctrl_read(addr & 0xff);
+  }
+
+  // The core is always reported as halted
+  if (DHCSR == addr)
+    return 0x00030003;
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_write_reg(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  if (SIM_EEFC == sim_device->model)
+  {
+    for (int i = 0; i < sim_device->n_planes; i++)
+    {
+      if (addr == sim_device->eefc_base[i] + 4) // FCR
+        sim_eefc_command(i, value & mask);
+    }
+  }
+  else
+  {
+    if ((addr & ~0xff) == DSU_CTRL_STATUS)
+      sim_dsu_write(addr, value & mask, mask);
+    else if ((addr & ~0xff) == NVMCTRL_BASE ||
+        (SIM_SAML1X == sim_device->model && (addr & ~0xff) == NVMCTRL_SEC_BASE))
+      sim_nvmctrl_write(addr & 0xff, value & mask);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t sim_read_word(uint32_t addr)
+{
+  bool nvm;
+  uint8_t *mem;
+
+  addr &= ~3;
+  mem = sim_memory(addr, &nvm);
+
+  if (mem)
+    return ((uint32_t)mem[3] << 24) | ((uint32_t)mem[2] << 16) | ((uint32_t)mem[1] << 8) | mem[0];
+
+  return sim_read_reg(addr);
+}
+
+//-----------------------------------------------------------------------------
+static void sim_write_word(uint32_t addr, uint32_t data, uint32_t mask)
+{
+  bool nvm;
+  uint8_t *mem;
+
+  addr &= ~3;
+  mem = sim_memory(addr, &nvm);
+
+  if (mem && nvm)
+  {
+    sim_latch_write(addr, data, mask);
+  }
+  else if (mem)
+  {
+    for (int i = 0; i < 4; i++)
+    {
+      if (mask & (0xff << (i * 8)))
+        mem[i] = data >> (i * 8);
+    }
+  }
+  else
+  {
+    sim_write_reg(addr, data, mask);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint64_t sim_transfer_time(void)
+{
+  return (SIM_SWD_TRANSFER_BITS + sim_idle_cycles) * 1000000000ull / sim_clock;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t sim_access_drw(bool read, uint32_t data)
+{
+  int size = sim_ap_csw & AP_CSW_SIZE_MASK;
+  int inc = sim_ap_csw & AP_CSW_ADDRINC_MASK;
+  int lane = sim_ap_tar & (3 & ~((1 << size) - 1));
+  uint32_t mask = (0 == size) ? 0xff : ((1 == size) ? 0xffff : 0xffffffff);
+  uint32_t value = 0;
+
+  // A packed access covers all lanes from TAR up to the end of the word
+  if (AP_CSW_ADDRINC_PACKED == inc)
+    mask = 0xffffffff;
+
+  mask <<= lane * 8;
+
+  if (read)
+    value = sim_read_word(sim_ap_tar);
+  else
+    sim_write_word(sim_ap_tar, data, mask);
+
+  // Automatic address increment wraps at 1 KB boundaries, just like the real MEM-AP
+  if (AP_CSW_ADDRINC_SINGLE == inc)
+    sim_ap_tar = (sim_ap_tar & ~0x3ff) | ((sim_ap_tar + (1 << size)) & 0x3ff);
+  else if (AP_CSW_ADDRINC_PACKED == inc)
+    sim_ap_tar = (sim_ap_tar & ~0x3ff) | ((sim_ap_tar + 4 - lane) & 0x3ff);
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t sim_transfer(uint8_t req, uint32_t data)
+{
+  uint32_t value = 0;
+  int reg = req & 0x0c;
+  bool read = req & DAP_TRANSFER_RnW;
+
+  sim_device_time += sim_transfer_time();
+  sim_transfers++;
+
+  if (0 == (req & DAP_TRANSFER_APnDP))
+  {
+    if (!read && 0x08 == reg)
+      sim_dp_select = data;
+    else if (read && 0x00 == reg)
+      value = sim_device->idcode;
+    else if (read && 0x04 == reg)
+      value = 0xf0000000; // Power-up requests are acknowledged
+    else if (read)
+      value = sim_dp_rdbuff;
+
+    return value;
+  }
+
+  reg |= sim_dp_select & 0xf0;
+
+  if (0x00 == reg)
+  {
+    if (read)
+      value = sim_ap_csw;
+    else
+      sim_ap_csw = data;
+
+    // Without packed transfers support the ADDRINC field ignores that value
+    if (!sim_packed && AP_CSW_ADDRINC_PACKED == (sim_ap_csw & AP_CSW_ADDRINC_MASK))
+      sim_ap_csw &= ~AP_CSW_ADDRINC_MASK;
+  }
+  else if (0x04 == reg)
+  {
+    if (read)
+      value = sim_ap_tar;
+    else
+      sim_ap_tar = data;
+  }
+  else if (0x0c == reg)
+  {
+    value = sim_access_drw(read, data);
+  }
+  else if (0xfc == reg && read)
+  {
+    value = 0x24770011; // AHB-AP
+  }
+
+  sim_dp_rdbuff = value;
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static bool sim_transfer_match(uint8_t req, uint32_t match)
+{
+  uint64_t transfer_time = sim_transfer_time();
+
+  for (int retry = 0; ; retry++)
+  {
+    uint32_t value = sim_transfer(req & ~DAP_TRANSFER_MATCH_VALUE, 0);
+
+    if ((value & sim_match_mask) == match)
+      return true;
+
+    if (retry >= sim_match_retry)
+      return false;
+
+    // Reads that would only observe the busy state are accounted for without running them
+    if (sim_next_ready())
+    {
+      uint64_t count = (sim_next_ready() - sim_device_time) / transfer_time;
+
+      if (count > (uint64_t)(sim_match_retry - retry))
+        count = sim_match_retry - retry;
+
+      retry += count;
+      sim_transfers += count;
+      sim_device_time += count * transfer_time;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t sim_get_word(uint8_t *buf)
+{
+  return ((uint32_t)buf[3] << 24) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[1] << 8) | buf[0];
+}
+
+//-----------------------------------------------------------------------------
+static void sim_put_word(uint8_t *buf, uint32_t value)
+{
+  buf[0] = value & 0xff;
+  buf[1] = (value >> 8) & 0xff;
+  buf[2] = (value >> 16) & 0xff;
+  buf[3] = (value >> 24) & 0xff;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_cmd_transfer(uint8_t *req, uint8_t *resp)
+{
+  int count = req[2];
+  int roffs = 3;
+  int woffs = 3;
+  int done = 0;
+  uint8_t ack = DAP_TRANSFER_OK;
+
+  for (; done < count; done++)
+  {
+    uint8_t r = req[roffs++];
+
+    if (!(r & DAP_TRANSFER_RnW) || (r & DAP_TRANSFER_MATCH_VALUE))
+    {
+      uint32_t data = sim_get_word(&req[roffs]);
+
+      roffs += 4;
+
+      if (r & DAP_TRANSFER_MATCH_MASK)
+      {
+        sim_match_mask = data;
+      }
+      else if (r & DAP_TRANSFER_MATCH_VALUE)
+      {
+        if (!sim_transfer_match(r, data))
+        {
+          ack |= DAP_TRANSFER_MISMATCH;
+          break;
+        }
+      }
+      else
+      {
+        sim_transfer(r, data);
+      }
+    }
+    else
+    {
+      sim_put_word(&resp[woffs], sim_transfer(r, 0));
+      woffs += 4;
+    }
+
+    check(roffs <= sim_report_size && woffs <= sim_report_size,
+        "simulated DAP_TRANSFER does not fit into the report");
+  }
+
+  resp[1] = done;
+  resp[2] = ack;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_cmd_transfer_block(uint8_t *req, uint8_t *resp)
+{
+  int count = req[2] | (req[3] << 8);
+  uint8_t r = req[4];
+  int offs = 4;
+
+  check(5 + ((r & DAP_TRANSFER_RnW) ? 0 : count * 4) <= sim_report_size &&
+      4 + ((r & DAP_TRANSFER_RnW) ? count * 4 : 0) <= sim_report_size,
+      "simulated DAP_TRANSFER_BLOCK does not fit into the report");
+
+  for (int i = 0; i < count; i++)
+  {
+    if (r & DAP_TRANSFER_RnW)
+    {
+      sim_put_word(&resp[offs], sim_transfer(r, 0));
+      offs += 4;
+    }
+    else
+    {
+      sim_transfer(r, sim_get_word(&req[5 + i * 4]));
+    }
+  }
+
+  resp[1] = count & 0xff;
+  resp[2] = (count >> 8) & 0xff;
+  resp[3] = DAP_TRANSFER_OK;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_info_string(uint8_t *resp, char *str)
+{
+  resp[1] = strlen(str) + 1;
+  strcpy((char *)&resp[2], str);
+}
+
+//-----------------------------------------------------------------------------
+static void sim_cmd_info(uint8_t *req, uint8_t *resp)
+{
+  switch (req[1])
+  {
+    case DAP_INFO_VENDOR:   sim_info_string(resp, "edbg"); break;
+    case DAP_INFO_PRODUCT:  sim_info_string(resp, "Simulated CMSIS-DAP"); break;
+    case DAP_INFO_SER_NUM:  sim_info_string(resp, sim_serial); break;
+    case DAP_INFO_FW_VER:   sim_info_string(resp, "2.0.0"); break;
+
+    case DAP_INFO_CAPABILITIES:
+    {
+      resp[1] = 1;
+      resp[2] = 0x01; // SWD
+    } break;
+
+    case DAP_INFO_PACKET_COUNT:
+    {
+      resp[1] = 1;
+      resp[2] = sim_packet_count;
+    } break;
+
+    case DAP_INFO_PACKET_SIZE:
+    {
+      resp[1] = 2;
+      resp[2] = sim_report_size & 0xff;
+      resp[3] = (sim_report_size >> 8) & 0xff;
+    } break;
+
+    default:
+      resp[1] = 0;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void sim_reset(void)
+{
+  for (int i = 0; i < SIM_MAX_PLANES; i++)
+  {
+    sim_select_bank(i);
+    sim_latch_clear();
+  }
+
+  sim_select_bank(0);
+  sim_bootrom_count = 0;
+  sim_bootrom_data = 0;
+  sim_bootrom_bcc1 = BOOTROM_SIG_PREFIX | BOOTROM_SIG_BOOTOK;
+}
+
+//-----------------------------------------------------------------------------
+static void sim_execute(uint8_t *req, uint8_t *resp)
+{
+  resp[0] = req[0];
+  resp[1] = DAP_OK;
+
+  switch (req[0])
+  {
+    case ID_DAP_INFO:
+      sim_cmd_info(req, resp);
+      break;
+
+    case ID_DAP_LED:
+    case ID_DAP_DISCONNECT:
+    case ID_DAP_SWD_CONFIGURE:
+      break;
+
+    case ID_DAP_CONNECT:
+      resp[1] = (req[1] <= 1) ? 1 : 0;
+      break;
+
+    case ID_DAP_TRANSFER_CONFIGURE:
+    {
+      sim_idle_cycles = req[1];
+      sim_match_retry = req[4] | (req[5] << 8);
+    } break;
+
+    case ID_DAP_TRANSFER:
+      sim_cmd_transfer(req, resp);
+      break;
+
+    case ID_DAP_TRANSFER_BLOCK:
+      sim_cmd_transfer_block(req, resp);
+      break;
+
+    case ID_DAP_DELAY:
+      sim_device_time += (req[1] | (req[2] << 8)) * 1000ull;
+      break;
+
+    case ID_DAP_RESET_TARGET:
+    {
+      sim_reset();
+      resp[2] = 1;
+    } break;
+
+    case ID_DAP_SWJ_PINS:
+    {
+      uint8_t pins = (sim_pins & ~req[2]) | (req[1] & req[2]);
+
+      if (!(sim_pins & DAP_SWJ_nRESET) && (pins & DAP_SWJ_nRESET))
+        sim_reset();
+
+      sim_pins = pins;
+      resp[1] = sim_pins;
+    } break;
+
+    case ID_DAP_SWJ_CLOCK:
+    {
+      uint32_t clock = sim_get_word(&req[1]);
+
+      if (clock)
+        sim_clock = clock;
+      else
+        resp[1] = DAP_ERROR;
+    } break;
+
+    case ID_DAP_SWJ_SEQUENCE:
+    {
+      int bits = req[1] ? req[1] : 256;
+
+      sim_device_time += bits * 1000000000ull / sim_clock;
+    } break;
+
+    default:
+      resp[0] = ID_DAP_INVALID;
+  }
+}
+
+//-----------------------------------------------------------------------------
+int dbg_hid_enumerate(debugger_t *debuggers, int size, char *serial)
+{
+  int count = sim_get_env("EDBG_SIM_PROBES", 1);
+  int rsize = 0;
+
+  if (count > SIM_MAX_PROBES)
+    count = SIM_MAX_PROBES;
+
+  for (int i = 0; i < count && rsize < size; i++)
+  {
+    snprintf(sim_serials[i], sizeof(sim_serials[i]), "SIM%05d", i + 1);
+
+    if (serial && strcmp(serial, sim_serials[i]))
+      continue;
+
+    debuggers[rsize].path = "sim";
+    debuggers[rsize].serial = sim_serials[i];
+    debuggers[rsize].wserial = NULL;
+    debuggers[rsize].manufacturer = "edbg";
+    debuggers[rsize].product = "Simulated CMSIS-DAP";
+    debuggers[rsize].vid = 0;
+    debuggers[rsize].pid = 0;
+    rsize++;
+  }
+
+  return rsize;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_hid_open(debugger_t *debugger)
+{
+  char *target = getenv("EDBG_SIM_TARGET");
+  char *name = getenv("EDBG_SIM_DEVICE");
+
+  if (NULL == target)
+    target = SIM_DEFAULT_TARGET;
+
+  sim_device = NULL;
+
+  for (sim_device_t *device = sim_devices; NULL != device->target; device++)
+  {
+    if (0 == strcmp(device->target, target) && (NULL == name || 0 == strcmp(device->name, name)))
+    {
+      sim_device = device;
+      break;
+    }
+  }
+
+  check(sim_device, "unknown simulated target type (%s)", target);
+
+  sim_report_size = sim_get_env("EDBG_SIM_REPORT_SIZE", SIM_DEFAULT_REPORT);
+  sim_packet_count = sim_get_env("EDBG_SIM_PACKETS", SIM_DEFAULT_PACKETS);
+  sim_latency = sim_get_env("EDBG_SIM_LATENCY", SIM_DEFAULT_LATENCY) * 1000ull;
+  sim_packed = sim_get_env("EDBG_SIM_PACKED", 1);
+
+  if (64 != sim_report_size && 512 != sim_report_size && 1024 != sim_report_size)
+    error_exit("simulated report size (%d) is not 64, 512 or 1024", sim_report_size);
+
+  if (sim_packet_count < 1 || sim_packet_count > SIM_MAX_PACKETS)
+    error_exit("simulated packet count must be between 1 and %d", SIM_MAX_PACKETS);
+
+  sim_serial = debugger->serial;
+
+  sim_flash = buf_alloc(sim_device->flash_size);
+  sim_aux = buf_alloc(SIM_AUX_SIZE);
+  sim_ram = buf_alloc(SIM_RAM_SIZE);
+  memset(sim_flash, 0xff, sim_device->flash_size);
+  memset(sim_aux, 0xff, SIM_AUX_SIZE);
+  memset(sim_ram, 0, SIM_RAM_SIZE);
+
+  sim_load_state();
+
+  sim_responses_head = 0;
+  sim_responses_count = 0;
+  sim_host_time = 0;
+  sim_device_time = 0;
+  memset(sim_banks, 0, sizeof(sim_banks));
+  sim_select_bank(0);
+  sim_commands = 0;
+  sim_transfers = 0;
+  sim_clock = SIM_DEFAULT_CLOCK;
+  sim_idle_cycles = 0;
+  sim_match_retry = 0;
+  sim_match_mask = 0xffffffff;
+  sim_pins = DAP_SWJ_nRESET;
+  sim_nvm_manual = false;
+  sim_locked = false;
+  sim_bank_b = false;
+  sim_dal = 2;
+  sim_gpnvm = 0;
+  sim_reset();
+
+  sim_opened = true;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_hid_close(void)
+{
+  if (!sim_opened)
+    return;
+
+  sim_opened = false;
+
+  message("Simulator (%s, %s): %llu commands, %llu SWD transfers, modeled time %.3f ms\n",
+      sim_serial, sim_device->name, (unsigned long long)sim_commands,
+      (unsigned long long)sim_transfers, sim_host_time / 1000000.0);
+
+  sim_save_state();
+
+  buf_free(sim_flash);
+  buf_free(sim_aux);
+  buf_free(sim_ram);
+}
+
+//-----------------------------------------------------------------------------
+int dbg_hid_get_report_size(void)
+{
+  return sim_report_size;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_hid_send(uint8_t *report, int size)
+{
+  uint8_t req[SIM_MAX_REPORT_SIZE];
+  sim_response_t *response;
+  uint64_t arrival;
+
+  check(size <= sim_report_size, "request (%d bytes) does not fit into the report", size);
+
+  // A real debugger would silently drop the extra packets
+  if (sim_responses_count == sim_packet_count)
+    error_exit("simulated debugger packet buffer overflow (%d packets)", sim_packet_count);
+
+  memset(req, 0xff, sim_report_size);
+  memcpy(req, &report[1], size);
+
+  response = &sim_responses[(sim_responses_head + sim_responses_count) % SIM_MAX_PACKETS];
+  memset(response->data, 0, sim_report_size);
+
+  // Commands are executed one at a time in the order of arrival
+  arrival = sim_host_time + sim_latency / 2;
+
+  if (sim_device_time < arrival)
+    sim_device_time = arrival;
+
+  sim_device_time += SIM_COMMAND_NS;
+
+  sim_execute(req, response->data);
+
+  response->time = sim_device_time + sim_latency / 2;
+  sim_responses_count++;
+  sim_commands++;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_hid_recv(uint8_t cmd, uint8_t *report, uint8_t **data)
+{
+  sim_response_t *response = &sim_responses[sim_responses_head];
+
+  check(sim_responses_count, "no response is pending from the simulated debugger");
+
+  sim_responses_head = (sim_responses_head + 1) % SIM_MAX_PACKETS;
+  sim_responses_count--;
+
+  if (sim_host_time < response->time)
+    sim_host_time = response->time;
+
+  check(response->data[0] == cmd, "invalid response received");
+
+  memcpy(report, response->data, sim_report_size);
+  *data = &report[1];
+
+  return sim_report_size - 1;
+}
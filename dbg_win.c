@@ -40,14 +40,13 @@
 #define MAX_STRING_SIZE   256
 
 /*- Variables ---------------------------------------------------------------*/
-static HANDLE debugger_handle = INVALID_HANDLE_VALUE;
-static uint8_t hid_buffer[1024 + 1];
-static int report_size = 0;
+static _Thread_local HANDLE debugger_handle = INVALID_HANDLE_VALUE;
+static _Thread_local int report_size = 0;
 
 /*- Implementations ---------------------------------------------------------*/
 
 //-----------------------------------------------------------------------------
-int dbg_enumerate(debugger_t *debuggers, int size)
+int dbg_hid_enumerate(debugger_t *debuggers, int size, char *serial)
 {
   GUID hid_guid;
   HDEVINFO hid_dev_info;
@@ -85,6 +84,7 @@ int dbg_enumerate(debugger_t *debuggers, int size)
     {
       wchar_t wstr[MAX_STRING_SIZE];
       char str[MAX_STRING_SIZE];
+      bool skip;
 
       wstr[0] = 0;
       str[0] = 0;
@@ -92,25 +92,33 @@ int dbg_enumerate(debugger_t *debuggers, int size)
       hid_attr.Size = sizeof(hid_attr);
       HidD_GetAttributes(handle, &hid_attr);
 
-      debuggers[rsize].path = strdup(detail_data->DevicePath);
-
       HidD_GetSerialNumberString(handle, (PVOID)wstr, MAX_STRING_SIZE);
       wcstombs(str, wstr, MAX_STRING_SIZE);
-      debuggers[rsize].serial = strdup(str);
 
-      HidD_GetManufacturerString(handle, (PVOID)wstr, MAX_STRING_SIZE);
-      wcstombs(str, wstr, MAX_STRING_SIZE);
-      debuggers[rsize].manufacturer = strdup(str);
+      skip = (serial && strcmp(str, serial));
+#ifdef DBG_KNOWN_IDS
+      skip = skip || !dbg_known_id(hid_attr.VendorID, hid_attr.ProductID);
+#endif
 
-      HidD_GetProductString(handle, (PVOID)wstr, MAX_STRING_SIZE);
-      wcstombs(str, wstr, MAX_STRING_SIZE);
-      debuggers[rsize].product = strdup(str);
+      if (!skip)
+      {
+        debuggers[rsize].path = strdup(detail_data->DevicePath);
+        debuggers[rsize].serial = strdup(str);
 
-      debuggers[rsize].vid = hid_attr.VendorID;
-      debuggers[rsize].pid = hid_attr.ProductID;
+        HidD_GetManufacturerString(handle, (PVOID)wstr, MAX_STRING_SIZE);
+        wcstombs(str, wstr, MAX_STRING_SIZE);
+        debuggers[rsize].manufacturer = strdup(str);
 
-      if (strstr(debuggers[rsize].product, "CMSIS-DAP"))
-        rsize++;
+        HidD_GetProductString(handle, (PVOID)wstr, MAX_STRING_SIZE);
+        wcstombs(str, wstr, MAX_STRING_SIZE);
+        debuggers[rsize].product = strdup(str);
+
+        debuggers[rsize].vid = hid_attr.VendorID;
+        debuggers[rsize].pid = hid_attr.ProductID;
+
+        if (strstr(debuggers[rsize].product, "CMSIS-DAP"))
+          rsize++;
+      }
 
       CloseHandle(handle);
     }
@@ -124,7 +132,7 @@ int dbg_enumerate(debugger_t *debuggers, int size)
 }
 
 //-----------------------------------------------------------------------------
-void dbg_open(debugger_t *debugger)
+void dbg_hid_open(debugger_t *debugger)
 {
   HIDP_CAPS caps;
   PHIDP_PREPARSED_DATA prep;
@@ -152,40 +160,46 @@ void dbg_open(debugger_t *debugger)
 }
 
 //-----------------------------------------------------------------------------
-void dbg_close(void)
+void dbg_hid_close(void)
 {
   if (INVALID_HANDLE_VALUE != debugger_handle)
+  {
     CloseHandle(debugger_handle);
+    debugger_handle = INVALID_HANDLE_VALUE;
+  }
 }
 
 //-----------------------------------------------------------------------------
-int dbg_get_report_size(void)
+int dbg_hid_get_report_size(void)
 {
   return report_size;
 }
 
 //-----------------------------------------------------------------------------
-int dbg_dap_cmd(uint8_t *data, int size, int rsize)
+void dbg_hid_send(uint8_t *report, int size)
 {
-  char cmd = data[0];
-  unsigned long res;
+  DWORD res;
 
-  memset(hid_buffer, 0xff, report_size + 1);
+  (void)size;
 
-  hid_buffer[0] = 0x00; // Report ID
-  memcpy(&hid_buffer[1], data, rsize);
+  report[0] = 0x00; // Report ID
 
-  if (FALSE == WriteFile(debugger_handle, (LPCVOID)hid_buffer, report_size + 1, &res, NULL))
+  if (FALSE == WriteFile(debugger_handle, (LPCVOID)report, report_size + 1, &res, NULL))
     error_exit("debugger write()");
+}
+
+//-----------------------------------------------------------------------------
+int dbg_hid_recv(uint8_t cmd, uint8_t *report, uint8_t **data)
+{
+  DWORD res;
 
-  if (FALSE == ReadFile(debugger_handle, (LPVOID)hid_buffer, report_size + 1, &res, NULL))
+  if (FALSE == ReadFile(debugger_handle, (LPVOID)report, report_size + 1, &res, NULL))
     error_exit("debugger read()");
 
-  check(hid_buffer[1] == cmd, "invalid response received");
+  check(report[1] == cmd, "invalid response received");
 
-  res -= 2;
-  memcpy(data, &hid_buffer[2], (size < (int)res) ? size : (int)res);
+  *data = &report[2];
 
-  return res;
+  return res - 2;
 }
 
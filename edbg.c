@@ -36,6 +36,9 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <pthread.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -46,79 +49,218 @@
 #include "edbg.h"
 #include "dap.h"
 #include "dbg.h"
+#include "stats.h"
+#include "trace.h"
+#include "server.h"
+#include "manifest.h"
+#include "rtt.h"
+#include "memory.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define VERSION           "v0.9"
 
 #define MAX_DEBUGGERS     20
+#define MAX_PRELOADED     2
+#define MAX_ERROR_SIZE    256
+#define MAX_JOB_LINE      1024
+#define MAX_JOB_ARGS      64
+#define MAX_JOB_WORDS     65536
+
+#define STREAM_CHUNK_SIZE 65536
+#define STREAM_CHUNKS     4
+
+#define ARRAY_SIZE(a)     ((int)(sizeof(a) / sizeof((a)[0])))
+
+#define CLOCK_AUTO        0
+#define CLOCK_TEST_SIZE   1024
+#define CLOCK_TEST_PASSES 3
+
+#define RTT_MAX_IDLE_MS   16
 
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
 /*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  debugger_t   *debugger;
+  bool         passed;
+  char         error[MAX_ERROR_SIZE];
+  jmp_buf      trap;
+} probe_t;
+
+typedef struct
+{
+  char         *name;
+  uint8_t      *data;
+  int          size;
+} preloaded_file_t;
+
+typedef struct
+{
+  int          fd;
+  pthread_t    thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint8_t      *data[STREAM_CHUNKS];
+  int          size[STREAM_CHUNKS];
+  int          head;
+  int          count;
+  int          tail;
+  bool         done;
+  int          error;
+} stream_t;
 
 /*- Variables ---------------------------------------------------------------*/
+static bool g_verbose = false;
+static char *g_clock_cache = NULL;
+static char *g_manifest = NULL;
+static FILE *g_output = NULL;
+
+static preloaded_file_t g_preloaded[MAX_PRELOADED];
+static int g_preloaded_count = 0;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local probe_t *g_probe = NULL;
+static _Thread_local jmp_buf *g_trap = NULL;
+static _Thread_local char g_error[MAX_ERROR_SIZE];
+static _Thread_local long g_swd_clock;
+static _Thread_local stream_t *g_stream = NULL;
+static bool g_stream_stdout = false;
+
+// Clock frequencies tried by the calibration, from the fastest
+static const long g_clock_steps[] =
+{
+  24000000, 16000000, 12000000, 8000000, 6000000, 4000000,
+  2000000, 1000000, 500000, 200000, 100000,
+};
+
+// Command line front end, not a part of the library build
+#ifndef EDBG_LIBRARY
 static const struct option long_options[] =
 {
   { "help",      no_argument,        0, 'h' },
   { "verbose",   no_argument,        0, 'b' },
   { "erase",     no_argument,        0, 'e' },
   { "program",   no_argument,        0, 'p' },
+  { "incremental", no_argument,      0, 'i' },
+  { "loader",    no_argument,        0, 'L' },
+  { "compress",  no_argument,        0, 'Z' },
+  { "bank-swap", no_argument,        0, 'B' },
   { "verify",    no_argument,        0, 'v' },
+  { "fast-verify", no_argument,      0, 'V' },
+  { "verify-all",  no_argument,      0, 'y' },
   { "lock",      no_argument,        0, 'k' },
   { "read",      no_argument,        0, 'r' },
   { "file",      required_argument,  0, 'f' },
   { "target",    required_argument,  0, 't' },
   { "list",      no_argument,        0, 'l' },
   { "serial",    required_argument,  0, 's' },
+  { "all",       no_argument,        0, 'a' },
+  { "jobs",      required_argument,  0, 'j' },
   { "clock",     required_argument,  0, 'c' },
+  { "clock-cache", required_argument,  0, 'C' },
+  { "manifest",    required_argument,  0, 'm' },
   { "offset",    required_argument,  0, 'o' },
   { "size",      required_argument,  0, 'z' },
   { "fuse",      required_argument,  0, 'F' },
+  { "stats",     required_argument,  0, 'S' },
+  { "trace",     required_argument,  0, 'T' },
+  { "analyze",   required_argument,  0, 'A' },
+  { "server",    required_argument,  0, 'd' },
+  { "rtt",       no_argument,        0, 'R' },
+  { "mem-read",  required_argument,  0, 'M' },
+  { "mem-write", required_argument,  0, 'W' },
+  { "mem-fill",  required_argument,  0, 'X' },
   { 0, 0, 0, 0 }
 };
 
-static const char *short_options = "hbepvkrf:t:ls:c:o:z:F:";
+static const char *short_options = "hbepiLZBvVykrf:t:ls:aj:c:C:m:o:z:F:S:T:A:d:RM:W:X:";
+
+// Options that only affect the operations and may be sent as server jobs
+static const char *job_options = "bepiLZBvVykrfozF";
 
 static char *g_serial = NULL;
+static bool g_all = false;
+static int g_jobs = 0;
 static bool g_list = false;
 static char *g_target = NULL;
-static bool g_verbose = false;
 static long g_clock = 16000000;
+static bool g_stats = false;
+static bool g_stats_json = false;
+static char *g_trace = NULL;
+static char *g_analyze = NULL;
+static char *g_server = NULL;
+static bool g_job = false;
+static bool g_rtt = false;
+static volatile sig_atomic_t g_rtt_stop = 0;
+static bool g_mem_read = false;
+static uint32_t g_mem_read_addr;
+static uint32_t g_mem_read_size;
+static bool g_mem_write = false;
+static uint32_t g_mem_write_addr;
+static char *g_mem_write_name = NULL;
+static bool g_mem_fill = false;
+static uint32_t g_mem_fill_addr;
+static uint32_t g_mem_fill_size;
+static uint32_t g_mem_fill_value;
 
 static target_options_t g_target_options =
 {
   .erase        = false,
   .program      = false,
+  .incremental  = false,
+  .loader       = false,
+  .compress     = false,
+  .bank_swap    = false,
   .verify       = false,
+  .fast_verify  = false,
+  .verify_all   = false,
   .lock         = false,
   .read         = false,
   .fuse         = false,
-  .fuse_read    = false,
-  .fuse_write   = false,
-  .fuse_verify  = false,
-  .fuse_section = 0,
-  .fuse_name    = NULL,
+  .n_fuse_ops   = 0,
   .name         = NULL,
   .offset       = -1,
   .size         = -1,
 };
 
+static probe_t *g_probes[MAX_DEBUGGERS];
+static int g_probes_count = 0;
+static int g_probes_next = 0;
+#endif // EDBG_LIBRARY
+
+/*- Prototypes --------------------------------------------------------------*/
+static int stream_finish(void);
+
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static FILE *output(FILE *file)
+{
+  // While a server job is running, all output goes to the client
+  if (g_output)
+    return g_output;
+
+  // Messages must not get mixed with the data streamed to stdout
+  return g_stream_stdout ? stderr : file;
+}
+
 //-----------------------------------------------------------------------------
 void verbose(char *fmt, ...)
 {
   va_list args;
 
-  if (g_verbose)
+  // Progress output from several probes at once would be unreadable
+  if (g_verbose && NULL == g_probe)
   {
     va_start(args, fmt);
-    vprintf(fmt, args);
+    vfprintf(output(stdout), fmt, args);
     va_end(args);
 
-    fflush(stdout);
+    fflush(output(stdout));
   }
 }
 
@@ -127,23 +269,57 @@ void message(char *fmt, ...)
 {
   va_list args;
 
+  pthread_mutex_lock(&g_lock);
+
   va_start(args, fmt);
-  vprintf(fmt, args);
+  vfprintf(output(stdout), fmt, args);
   va_end(args);
 
-  fflush(stdout);
+  fflush(output(stdout));
+
+  pthread_mutex_unlock(&g_lock);
 }
 
 //-----------------------------------------------------------------------------
 void warning(char *fmt, ...)
 {
+  FILE *file = output(stderr);
   va_list args;
  
+  pthread_mutex_lock(&g_lock);
+
   va_start(args, fmt);
-  fprintf(stderr, "Warning: ");
+  if (g_probe)
+    fprintf(file, "Warning (%s): ", g_probe->debugger->serial);
+  else
+    fprintf(file, "Warning: ");
+  vfprintf(file, fmt, args);
+  fprintf(file, "\n");
+  va_end(args);
+
+  pthread_mutex_unlock(&g_lock);
+}
+
+//-----------------------------------------------------------------------------
+static void error_report(char *fmt, va_list args)
+{
+  // The data read so far is kept
+  stream_finish();
+
+  // A trapped error leaves the debugger open, the handler decides what to do
+  if (g_trap)
+  {
+    vsnprintf(g_error, sizeof(g_error), fmt, args);
+    longjmp(*g_trap, 1);
+  }
+
+  dbg_close();
+
+  fprintf(stderr, "Error: ");
   vfprintf(stderr, fmt, args);
   fprintf(stderr, "\n");
-  va_end(args);
+
+  exit(1);
 }
 
 //-----------------------------------------------------------------------------
@@ -153,15 +329,9 @@ void check(bool cond, char *fmt, ...)
   {
     va_list args;
 
-    dbg_close();
-
     va_start(args, fmt);
-    fprintf(stderr, "Error: ");
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
+    error_report(fmt, args);
     va_end(args);
-
-    exit(1);
   }
 }
 
@@ -170,23 +340,36 @@ void error_exit(char *fmt, ...)
 {
   va_list args;
 
-  dbg_close();
-
   va_start(args, fmt);
-  fprintf(stderr, "Error: ");
-  vfprintf(stderr, fmt, args);
-  fprintf(stderr, "\n");
+  error_report(fmt, args);
   va_end(args);
-
-  exit(1);
 }
 
 //-----------------------------------------------------------------------------
 void perror_exit(char *text)
 {
-  dbg_close();
-  perror(text);
-  exit(1);
+  error_exit("%s: %s", text, strerror(errno));
+}
+
+//-----------------------------------------------------------------------------
+bool error_trap(void (*func)(void *arg), void *arg, char *error, int size)
+{
+  jmp_buf *saved = g_trap;
+  jmp_buf trap;
+
+  g_trap = &trap;
+
+  if (0 == setjmp(trap))
+  {
+    func(arg);
+    g_trap = saved;
+    return true;
+  }
+
+  g_trap = saved;
+  snprintf(error, size, "%s", g_error);
+
+  return false;
 }
 
 //-----------------------------------------------------------------------------
@@ -204,6 +387,39 @@ void sleep_ms(int ms)
 #endif
 }
 
+//-----------------------------------------------------------------------------
+uint32_t get_time_ms(void)
+{
+#ifdef _WIN32
+  return GetTickCount();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+uint64_t get_time_us(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER freq, counter;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&counter);
+
+  return counter.QuadPart * 1000000 / freq.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
 //-----------------------------------------------------------------------------
 void *buf_alloc(int size)
 {
@@ -215,12 +431,40 @@ void *buf_alloc(int size)
   return buf;
 }
 
+//-----------------------------------------------------------------------------
+void *buf_realloc(void *buf, int size)
+{
+  if (NULL == (buf = realloc(buf, size)))
+    error_exit("out of memory");
+
+  return buf;
+}
+
 //-----------------------------------------------------------------------------
 void buf_free(void *buf)
 {
   free(buf);
 }
 
+//-----------------------------------------------------------------------------
+int get_file_size(char *name)
+{
+  struct stat stat_buf;
+
+  check(NULL != name, "input file name is not specified");
+
+  for (int i = 0; i < g_preloaded_count; i++)
+  {
+    if (0 == strcmp(name, g_preloaded[i].name))
+      return g_preloaded[i].size;
+  }
+
+  if (stat(name, &stat_buf) < 0)
+    perror_exit("stat()");
+
+  return stat_buf.st_size;
+}
+
 //-----------------------------------------------------------------------------
 int load_file(char *name, uint8_t *data, int size)
 {
@@ -229,6 +473,19 @@ int load_file(char *name, uint8_t *data, int size)
 
   check(NULL != name, "input file name is not specified");
 
+  for (int i = 0; i < g_preloaded_count; i++)
+  {
+    if (0 == strcmp(name, g_preloaded[i].name))
+    {
+      if (g_preloaded[i].size < size)
+        size = g_preloaded[i].size;
+
+      memcpy(data, g_preloaded[i].data, size);
+
+      return size;
+    }
+  }
+
   fd = open(name, O_RDONLY | O_BINARY);
 
   if (fd < 0)
@@ -273,6 +530,193 @@ void save_file(char *name, uint8_t *data, int size)
   close(fd);
 }
 
+//-----------------------------------------------------------------------------
+static void *stream_writer(void *arg)
+{
+  stream_t *stream = (stream_t *)arg;
+
+  pthread_mutex_lock(&stream->lock);
+
+  while (1)
+  {
+    uint8_t *data;
+    int size;
+
+    while (0 == stream->count && !stream->done)
+      pthread_cond_wait(&stream->cond, &stream->lock);
+
+    if (0 == stream->count)
+      break;
+
+    data = stream->data[stream->head];
+    size = stream->size[stream->head];
+
+    pthread_mutex_unlock(&stream->lock);
+
+    // After a failure the chunks are only released, the reader reports the error
+    while (size > 0 && 0 == stream->error)
+    {
+      int rsize = write(stream->fd, data, size);
+
+      if (rsize < 0 && EINTR == errno)
+        continue;
+
+      if (rsize <= 0)
+        stream->error = (rsize < 0) ? errno : EIO;
+
+      data += rsize;
+      size -= rsize;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+
+    stream->head = (stream->head + 1) % STREAM_CHUNKS;
+    stream->count--;
+    pthread_cond_signal(&stream->cond);
+  }
+
+  pthread_mutex_unlock(&stream->lock);
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+void stream_open(char *name)
+{
+  stream_t *stream;
+
+  check(NULL != name, "output file name is not specified");
+
+  stream = buf_alloc(sizeof(stream_t));
+  memset(stream, 0, sizeof(stream_t));
+
+  if (0 == strcmp(name, "-"))
+  {
+    stream->fd = STDOUT_FILENO;
+    g_stream_stdout = true;
+#ifdef _WIN32
+    setmode(STDOUT_FILENO, O_BINARY);
+#endif
+  }
+  else
+  {
+    stream->fd = open(name, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY, 0644);
+
+    if (stream->fd < 0)
+    {
+      buf_free(stream);
+      perror_exit("open()");
+    }
+  }
+
+  for (int i = 0; i < STREAM_CHUNKS; i++)
+    stream->data[i] = buf_alloc(STREAM_CHUNK_SIZE);
+
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->cond, NULL);
+
+  if (0 != pthread_create(&stream->thread, NULL, stream_writer, stream))
+    error_exit("unable to create a thread");
+
+  g_stream = stream;
+}
+
+//-----------------------------------------------------------------------------
+static void stream_submit(stream_t *stream)
+{
+  pthread_mutex_lock(&stream->lock);
+
+  stream->count++;
+  stream->tail = (stream->tail + 1) % STREAM_CHUNKS;
+  pthread_cond_signal(&stream->cond);
+
+  // The next chunk to fill must be released by the writer
+  while (STREAM_CHUNKS == stream->count)
+    pthread_cond_wait(&stream->cond, &stream->lock);
+
+  stream->size[stream->tail] = 0;
+
+  pthread_mutex_unlock(&stream->lock);
+}
+
+//-----------------------------------------------------------------------------
+void stream_write(uint8_t *data, int size)
+{
+  stream_t *stream = g_stream;
+
+  while (size)
+  {
+    int offs = stream->size[stream->tail];
+    int sz = STREAM_CHUNK_SIZE - offs;
+
+    sz = (sz > size) ? size : sz;
+
+    memcpy(&stream->data[stream->tail][offs], data, sz);
+    stream->size[stream->tail] += sz;
+
+    if (STREAM_CHUNK_SIZE == stream->size[stream->tail])
+      stream_submit(stream);
+
+    data += sz;
+    size -= sz;
+  }
+
+  if (stream->error)
+  {
+    errno = stream->error;
+    perror_exit("write()");
+  }
+}
+
+//-----------------------------------------------------------------------------
+static int stream_finish(void)
+{
+  stream_t *stream = g_stream;
+  int error;
+
+  if (NULL == stream)
+    return 0;
+
+  g_stream = NULL;
+
+  if (stream->size[stream->tail])
+    stream_submit(stream);
+
+  pthread_mutex_lock(&stream->lock);
+  stream->done = true;
+  pthread_cond_signal(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+
+  pthread_join(stream->thread, NULL);
+
+  if (STDOUT_FILENO != stream->fd)
+    close(stream->fd);
+
+  error = stream->error;
+
+  pthread_mutex_destroy(&stream->lock);
+  pthread_cond_destroy(&stream->cond);
+
+  for (int i = 0; i < STREAM_CHUNKS; i++)
+    buf_free(stream->data[i]);
+
+  buf_free(stream);
+
+  return error;
+}
+
+//-----------------------------------------------------------------------------
+void stream_close(void)
+{
+  int error = stream_finish();
+
+  if (error)
+  {
+    errno = error;
+    perror_exit("write()");
+  }
+}
+
 //-----------------------------------------------------------------------------
 uint32_t extract_value(uint8_t *buf, int start, int end)
 {
@@ -345,37 +789,416 @@ void reconnect_debugger(void)
   dap_swd_configure(0);
   dap_led(0, 1);
   dap_reset_link();
-  dap_swj_clock(g_clock);
+  dap_swj_clock(g_swd_clock);
 }
 
 //-----------------------------------------------------------------------------
-static void print_help(char *name, char *param)
+static long clock_cache_lookup(char *serial, char *target)
 {
-  message("CMSIS-DAP SWD programmer " VERSION ", built " __DATE__ " " __TIME__ " \n\n");
+  char line[256], s[128], t[64];
+  long clock = 0, value;
+  FILE *file;
 
-  if (0 == strcmp(param, "fuse"))
+  if (NULL == g_clock_cache)
+    return 0;
+
+  pthread_mutex_lock(&g_lock);
+
+  if (NULL != (file = fopen(g_clock_cache, "r")))
   {
-    message(
-      "Fuse operations format: <actions><section>,<index/range>,<value>\n"
-      "  <actions>     - any combination of 'r' (read), 'w' (write), 'v' (verify)\n"
-      "  <section>     - index of the fuse section, may be omitted if device has only\n"
-      "                  one section (as most do)\n"
-      "  <index/range> - index of the fuse, or a range of fuses (limits separated by ':')\n"
-      "                  specify ':' to read all fuses\n"
-      "                  specify '*' to read and write values from a file\n"
-      "  <value>       - fuses value or file name for write and verify operations\n"
-      "                  immediate values must be 32 bits or less\n"
-      "\n"
-      "Exact fuse bits locations and values are target-dependent.\n"
-      "\n"
-      "Examples:\n"
-      "  -F w,1,1                -- set fuse bit 1\n"
-      "  -F w,8:7,0              -- clear fuse bits 8 and 7\n"
-      "  -F v,31:0,0x12345678    -- verify that fuse bits 31-0 are equal to 0x12345678\n"
-      "  -F wv,5,1               -- set and verify fuse bit 5\n"
-      "  -F r,:,                 -- read all fuses\n"
-      "  -F wv,*,fuses.bin       -- write and verify all fuses from a file\n"
-    );
+    while (fgets(line, sizeof(line), file))
+    {
+      if (3 == sscanf(line, "%127s %63s %ld", s, t, &value) &&
+          0 == strcmp(s, serial) && 0 == strcmp(t, target))
+        clock = value;
+    }
+
+    fclose(file);
+  }
+
+  pthread_mutex_unlock(&g_lock);
+
+  return clock;
+}
+
+//-----------------------------------------------------------------------------
+static void clock_cache_store(char *serial, char *target, long clock)
+{
+  char line[256], s[128], t[64];
+  char *data = NULL;
+  int size = 0;
+  FILE *file;
+
+  if (NULL == g_clock_cache)
+    return;
+
+  pthread_mutex_lock(&g_lock);
+
+  // Keep the entries for other debuggers and targets
+  if (NULL != (file = fopen(g_clock_cache, "r")))
+  {
+    while (fgets(line, sizeof(line), file))
+    {
+      int len = strlen(line);
+
+      if (2 == sscanf(line, "%127s %63s", s, t) && 0 == strcmp(s, serial) &&
+          0 == strcmp(t, target))
+        continue;
+
+      data = buf_realloc(data, size + len);
+      memcpy(&data[size], line, len);
+      size += len;
+    }
+
+    fclose(file);
+  }
+
+  if (NULL != (file = fopen(g_clock_cache, "w")))
+  {
+    fwrite(data, 1, size, file);
+    fprintf(file, "%s %s %ld\n", serial, target, clock);
+    fclose(file);
+  }
+  else
+  {
+    warning("unable to update the clock cache file '%s'", g_clock_cache);
+  }
+
+  free(data);
+
+  pthread_mutex_unlock(&g_lock);
+}
+
+static void clock_test(long clock, uint32_t idcode, uint32_t ram_addr, uint8_t *saved)
+{
+  uint8_t wbuf[CLOCK_TEST_SIZE], rbuf[CLOCK_TEST_SIZE];
+  uint32_t value = clock;
+
+  dap_swj_clock(clock);
+  dap_reset_link();
+
+  check(dap_read_idcode() == idcode, "IDCODE mismatch");
+
+  if (0 == ram_addr)
+    return;
+
+  for (int pass = 0; pass < CLOCK_TEST_PASSES; pass++)
+  {
+    for (int i = 0; i < CLOCK_TEST_SIZE; i++)
+    {
+      value = value * 1103515245 + 12345;
+      wbuf[i] = value >> 16;
+    }
+
+    dap_write_block(ram_addr, wbuf, CLOCK_TEST_SIZE);
+    dap_read_block(ram_addr, rbuf, CLOCK_TEST_SIZE);
+
+    // The original content is put back before anything else can go wrong
+    dap_write_block(ram_addr, saved, CLOCK_TEST_SIZE);
+
+    check(0 == memcmp(wbuf, rbuf, CLOCK_TEST_SIZE), "RAM pattern mismatch");
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void clock_recover(void)
+{
+  // The link is left in an unknown state after a failure
+  dap_discard();
+  dap_swj_clock(g_clock_steps[ARRAY_SIZE(g_clock_steps) - 1]);
+  dap_reset_link();
+}
+
+//-----------------------------------------------------------------------------
+static bool clock_try(long clock, uint32_t idcode, uint32_t ram_addr, uint8_t *saved)
+{
+  jmp_buf *saved_trap = g_trap;
+  jmp_buf trap;
+
+  g_trap = &trap;
+
+  if (0 == setjmp(trap))
+  {
+    clock_test(clock, idcode, ram_addr, saved);
+    g_trap = saved_trap;
+    return true;
+  }
+
+  g_trap = saved_trap;
+
+  clock_recover();
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+static bool clock_save(uint32_t ram_addr, uint8_t *saved)
+{
+  jmp_buf *saved_trap = g_trap;
+  jmp_buf trap;
+
+  g_trap = &trap;
+
+  if (0 == setjmp(trap))
+  {
+    dap_read_block(ram_addr, saved, CLOCK_TEST_SIZE);
+    g_trap = saved_trap;
+    return true;
+  }
+
+  g_trap = saved_trap;
+
+  clock_recover();
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+static long clock_calibrate(debugger_t *debugger, target_t *target, bool ram)
+{
+  int steps = ARRAY_SIZE(g_clock_steps);
+  long slowest = g_clock_steps[steps - 1];
+  uint32_t ram_addr = ram ? target->ram_addr : 0;
+  uint8_t saved[CLOCK_TEST_SIZE];
+  uint32_t idcode;
+  long clock;
+
+  // The reference IDCODE and the RAM content are read at the lowest frequency
+  idcode = dap_read_idcode();
+
+  if (ram_addr && !clock_save(ram_addr, saved))
+  {
+    warning("RAM is not accessible, the clock is calibrated using IDCODE only");
+    ram_addr = 0;
+  }
+
+  clock = clock_cache_lookup(debugger->serial, target->name);
+
+  if (clock && clock_try(clock, idcode, ram_addr, saved))
+  {
+    verbose("Using cached clock frequency\n");
+    return clock;
+  }
+
+  if (!clock_try(slowest, idcode, ram_addr, saved))
+  {
+    warning("RAM is not accessible, the clock is calibrated using IDCODE only");
+    ram_addr = 0;
+    check(clock_try(slowest, idcode, ram_addr, saved), "unable to communicate with the target");
+  }
+
+  clock = slowest;
+
+  for (int i = 0; i < steps; i++)
+  {
+    if (clock_try(g_clock_steps[i], idcode, ram_addr, saved))
+    {
+      // One step down from the fastest working frequency leaves a safety margin
+      clock = g_clock_steps[(i + 1 < steps) ? (i + 1) : i];
+      break;
+    }
+  }
+
+  // A failed test may have left its pattern behind, the frequency now works
+  if (ram_addr)
+    dap_write_block(ram_addr, saved, CLOCK_TEST_SIZE);
+
+  clock_cache_store(debugger->serial, target->name, clock);
+
+  return clock;
+}
+
+//-----------------------------------------------------------------------------
+void connect_target(debugger_t *debugger, target_t *target, long clock, bool reset)
+{
+  stats_phase_start(STATS_CONNECT);
+
+  dbg_open(debugger);
+
+  // Without the reset the debugger only attaches to the running target
+  if (reset)
+    dap_reset_target_hw(1);
+
+  g_swd_clock = (CLOCK_AUTO == clock) ? g_clock_steps[ARRAY_SIZE(g_clock_steps) - 1] : clock;
+
+  reconnect_debugger();
+
+  dap_get_debugger_info();
+
+  if (CLOCK_AUTO == clock)
+  {
+    // A running target is not reset, its RAM is not touched either
+    g_swd_clock = clock_calibrate(debugger, target, reset);
+    reconnect_debugger();
+  }
+
+  print_clock_freq(g_swd_clock);
+
+  manifest_open(g_manifest, debugger->serial);
+}
+
+//-----------------------------------------------------------------------------
+static void report_fuse_op(target_fuse_op_t *op)
+{
+  verbose("Fuse section %d ", op->section);
+
+  if (op->actions & TARGET_FUSE_READ)
+  {
+    verbose("read");
+  }
+
+  if (op->actions & TARGET_FUSE_WRITE)
+  {
+    if (op->actions & TARGET_FUSE_READ)
+      verbose(", ");
+
+    verbose("write");
+  }
+
+  if (op->actions & TARGET_FUSE_VERIFY)
+  {
+    if (op->actions & TARGET_FUSE_WRITE)
+      verbose(", ");
+
+    verbose("verify");
+  }
+
+  if (op->name || -1 == op->end)
+  {
+    verbose(" all");
+  }
+  else if (op->start == op->end)
+  {
+    verbose(" bit %d", op->start);
+  }
+  else
+  {
+    verbose(" bits %d:%d", op->end, op->start);
+  }
+
+  verbose(", ");
+
+  if (op->name)
+  {
+    verbose("file '%s'\n", op->name);
+  }
+  else
+  {
+    verbose("value 0x%x (%u)\n", op->value, op->value);
+  }
+}
+
+//-----------------------------------------------------------------------------
+void run_operations(target_t *target, target_options_t *options)
+{
+  stats_phase_start(STATS_SELECT);
+
+  target->ops->select(options);
+
+  if (options->erase)
+  {
+    stats_phase_start(STATS_ERASE);
+    verbose("Erasing... ");
+    target->ops->erase();
+    verbose(" done.\n");
+  }
+
+  if (options->program)
+  {
+    stats_phase_start(STATS_PROGRAM);
+    verbose("Programming...");
+    target->ops->program();
+    verbose(" done.\n");
+  }
+
+  if (options->verify)
+  {
+    stats_phase_start(STATS_VERIFY);
+    verbose("Verification...");
+    target->ops->verify();
+    verbose(" done.\n");
+  }
+
+  if (options->lock)
+  {
+    stats_phase_start(STATS_LOCK);
+    verbose("Locking... ");
+    target->ops->lock();
+    verbose(" done.\n");
+  }
+
+  if (options->read)
+  {
+    stats_phase_start(STATS_READ);
+    verbose("Reading...");
+    target->ops->read();
+    verbose(" done.\n");
+  }
+
+  if (options->fuse)
+  {
+    stats_phase_start(STATS_FUSE);
+
+    for (int i = 0; i < options->n_fuse_ops; i++)
+      report_fuse_op(&options->fuse_ops[i]);
+
+    target->ops->fuse();
+
+    verbose("done.\n");
+  }
+
+  stats_phase_end();
+
+  target->ops->deselect();
+}
+
+//-----------------------------------------------------------------------------
+void disconnect_target(bool reset)
+{
+  if (reset)
+    dap_reset_target_hw(1);
+
+  dap_disconnect();
+  dap_led(0, 0);
+
+  dbg_close();
+}
+
+// Command line front end, the library build has its own entry points in libedbg.c
+#ifndef EDBG_LIBRARY
+
+//-----------------------------------------------------------------------------
+static void print_help(char *name, char *param)
+{
+  message("CMSIS-DAP SWD programmer " VERSION ", built " __DATE__ " " __TIME__ " \n\n");
+
+  if (0 == strcmp(param, "fuse"))
+  {
+    message(
+      "Fuse operations format: <actions><section>,<index/range>,<value>\n"
+      "  <actions>     - any combination of 'r' (read), 'w' (write), 'v' (verify)\n"
+      "  <section>     - index of the fuse section, may be omitted if device has only\n"
+      "                  one section (as most do)\n"
+      "  <index/range> - index of the fuse, or a range of fuses (limits separated by ':')\n"
+      "                  specify ':' to read all fuses\n"
+      "                  specify '*' to read and write values from a file\n"
+      "  <value>       - fuses value or file name for write and verify operations\n"
+      "                  immediate values must be 32 bits or less\n"
+      "\n"
+      "Exact fuse bits locations and values are target-dependent.\n"
+      "\n"
+      "Several '-F' options are merged into a single update of each fuse section;\n"
+      "only the changed fuses are written, nothing is written if there are no changes.\n"
+      "\n"
+      "Examples:\n"
+      "  -F w,1,1                -- set fuse bit 1\n"
+      "  -F w,8:7,0              -- clear fuse bits 8 and 7\n"
+      "  -F v,31:0,0x12345678    -- verify that fuse bits 31-0 are equal to 0x12345678\n"
+      "  -F wv,5,1               -- set and verify fuse bit 5\n"
+      "  -F r,:,                 -- read all fuses\n"
+      "  -F wv,*,fuses.bin       -- write and verify all fuses from a file\n"
+      "  -F wv,1,1 -F wv,8:7,0   -- set bit 1 and clear bits 8 and 7 in one update\n"
+    );
   }
   else
   {
@@ -386,17 +1209,48 @@ static void print_help(char *name, char *param)
       "  -b, --verbose              print verbose messages\n"
       "  -e, --erase                perform a chip erase before programming\n"
       "  -p, --program              program the chip\n"
+      "  -i, --incremental          program only erase units that differ from the file\n"
+      "  -L, --loader               program using a flash loader in the target RAM where supported\n"
+      "  -Z, --compress             compress the data sent to the flash loader (implies -L)\n"
+      "  -B, --bank-swap            program and verify the inactive flash bank while the core\n"
+      "                             keeps running, then swap the banks and reset\n"
       "  -v, --verify               verify memory\n"
+      "  -V, --fast-verify          verify memory using on-chip CRC where supported\n"
+      "  -y, --verify-all           verify memory and report all mismatching ranges\n"
       "  -k, --lock                 lock the chip (set security bit)\n"
       "  -r, --read                 read the whole content of the chip flash\n"
-      "  -f, --file <file>          binary file to be programmed or verified; also read output file name\n"
-      "  -t, --target <name>        specify a target type (use '-t list' for a list of supported target types)\n"
+      "  -f, --file <file>          binary, Intel HEX or ELF file to be programmed or verified;\n"
+      "                             also read output file name ('-' for stdout)\n"
+      "  -t, --target <name>        specify a target type (use '-t list' for a list of supported target types,\n"
+      "                             '-t auto' to detect the target type)\n"
       "  -l, --list                 list all available debuggers\n"
-      "  -s, --serial <number>      use a debugger with a specified serial number\n"
-      "  -c, --clock <freq>         interface clock frequency in kHz (default 16000)\n"
+      "  -s, --serial <number>      use a debugger with a specified serial number; a comma-separated\n"
+      "                             list of serial numbers programs all of them in parallel\n"
+      "  -a, --all                  use all attached debuggers in parallel\n"
+      "  -j, --jobs <n>             maximum number of debuggers used at the same time (default all)\n"
+      "  -c, --clock <freq>         interface clock frequency in kHz (default 16000),\n"
+      "                             'auto' to find the fastest reliable frequency\n"
+      "                             (tests and restores the first 1 KB of the target RAM)\n"
+      "  -C, --clock-cache <file>   file to store the results of the clock calibration\n"
+      "  -m, --manifest <file>      file to store the hashes of the programmed erase units,\n"
+      "                             only the units that changed are programmed\n"
       "  -o, --offset <offset>      offset for the operation\n"
       "  -z, --size <size>          size for the operation\n"
       "  -F, --fuse <options>       operations on the fuses (use '-h fuse' for details)\n"
+      "  -S, --stats <format>       print timing and transfer statistics ('text' or 'json')\n"
+      "  -T, --trace <file>         record all debugger commands and responses into a file\n"
+      "  -A, --analyze <file>       decode a recorded trace and report wasteful access patterns;\n"
+      "                             use '-b' to print the register access sequence\n"
+      "  -d, --server <socket>      keep the debugger connected and run the jobs received\n"
+      "                             through a local socket (see README for the protocol)\n"
+      "  -R, --rtt                  stream the RTT up-buffer 0 into the file (stdout by default)\n"
+      "                             without halting the core, '-o' and '-z' set the search range\n"
+      "  -M, --mem-read <addr:size> read a memory range into the file (stdout by default)\n"
+      "  -W, --mem-write <spec>     write a binary file into the memory, <spec> is <addr:file>\n"
+      "  -X, --mem-fill <spec>      fill a memory range with a 32-bit pattern, <spec> is\n"
+      "                             <addr:size:value>; the memory operations do not select\n"
+      "                             the target ('-t' is optional) and run in the order\n"
+      "                             write, fill, read\n"
     );
   }
 
@@ -406,29 +1260,32 @@ static void print_help(char *name, char *param)
 //-----------------------------------------------------------------------------
 static void parse_fuse_options(char *str)
 {
+  target_fuse_op_t *op = &g_target_options.fuse_ops[g_target_options.n_fuse_ops];
   bool expect_name = false;
 
+  check(g_target_options.n_fuse_ops < MAX_FUSE_OPS, "too many fuse operations specified");
+
+  memset(op, 0, sizeof(target_fuse_op_t));
+
   while (*str)
   {
     if ('r' == *str)
-      g_target_options.fuse_read = true;
+      op->actions |= TARGET_FUSE_READ;
     else if ('w' == *str)
-      g_target_options.fuse_write = true;
+      op->actions |= TARGET_FUSE_WRITE;
     else if ('v' == *str)
-      g_target_options.fuse_verify = true;
+      op->actions |= TARGET_FUSE_VERIFY;
     else
       break;
 
-    g_target_options.fuse = true;
-
     str++;
   }
 
-  check(g_target_options.fuse, "no fuse operations spefified");
+  check(op->actions, "no fuse operations spefified");
 
   if (',' != *str)
   {
-    g_target_options.fuse_section = (uint32_t)strtoul(str, &str, 0);
+    op->section = (uint32_t)strtoul(str, &str, 0);
   }
 
   if (',' == *str)
@@ -443,21 +1300,21 @@ static void parse_fuse_options(char *str)
     else if (':' == *str)
     {
       str++;
-      g_target_options.fuse_end = -1;
-      g_target_options.fuse_start = -1;
+      op->end = -1;
+      op->start = -1;
     }
     else
     {
-      g_target_options.fuse_end = (uint32_t)strtoul(str, &str, 0);
+      op->end = (uint32_t)strtoul(str, &str, 0);
 
       if (':' == *str)
       {
         str++;
-        g_target_options.fuse_start = (uint32_t)strtoul(str, &str, 0);
+        op->start = (uint32_t)strtoul(str, &str, 0);
       }
       else
       {
-        g_target_options.fuse_start = g_target_options.fuse_end;
+        op->start = op->end;
       }
     }
   }
@@ -471,22 +1328,82 @@ static void parse_fuse_options(char *str)
     str++;
 
     if (expect_name)
-      g_target_options.fuse_name = strdup(str);
+      op->name = strdup(str);
     else
-      g_target_options.fuse_value = (uint32_t)strtoul(str, &str, 0);
+      op->value = (uint32_t)strtoul(str, &str, 0);
   }
-  else if (g_target_options.fuse_write || g_target_options.fuse_verify)
+  else if (op->actions & (TARGET_FUSE_WRITE | TARGET_FUSE_VERIFY))
   {
     error_exit("value or name is required for fuse write and verify operations");
   }
 
   check(expect_name || 0 == *str, "junk at the end of fuse operations: '%s'", str);
 
-  check(g_target_options.fuse_end >= g_target_options.fuse_start,
-      "fuse bit range must be specified in a descending order");
+  check(op->end >= op->start, "fuse bit range must be specified in a descending order");
+
+  check((op->end - op->start) <= 32, "fuse bit range must be 32 bits or less");
+
+  if (op->name && (op->actions & TARGET_FUSE_READ))
+  {
+    check(0 == (op->actions & (TARGET_FUSE_WRITE | TARGET_FUSE_VERIFY)),
+        "mutually exclusive fuse actions specified");
+  }
+
+  g_target_options.fuse = true;
+  g_target_options.n_fuse_ops++;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t parse_memory_word(char **str, bool last)
+{
+  char *end;
+  uint32_t value;
+
+  value = (uint32_t)strtoul(*str, &end, 0);
+
+  if (end == *str || (last ? (0 != *end) : (':' != *end)))
+    error_exit("malformed memory operation options");
+
+  *str = end + 1;
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static void parse_memory_options(int option, char *str)
+{
+  if ('M' == option)
+  {
+    g_mem_read = true;
+    g_mem_read_addr = parse_memory_word(&str, false);
+    g_mem_read_size = parse_memory_word(&str, true);
+  }
+  else if ('W' == option)
+  {
+    g_mem_write = true;
+    g_mem_write_addr = parse_memory_word(&str, false);
+    check(0 != *str, "malformed memory operation options");
+    g_mem_write_name = str;
+  }
+  else
+  {
+    g_mem_fill = true;
+    g_mem_fill_addr = parse_memory_word(&str, false);
+    g_mem_fill_size = parse_memory_word(&str, false);
+    g_mem_fill_value = parse_memory_word(&str, true);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void parse_stats_options(char *str)
+{
+  if (0 == strcmp(str, "json"))
+    g_stats_json = true;
+  else if (0 != strcmp(str, "text"))
+    error_exit("unknown statistics format '%s'", str);
 
-  check((g_target_options.fuse_end - g_target_options.fuse_start) <= 32,
-      "fuse bit range must be 32 bits or less");
+  g_stats = true;
+  stats_enable();
 }
 
 //-----------------------------------------------------------------------------
@@ -497,23 +1414,44 @@ static void parse_command_line(int argc, char **argv)
 
   while ((c = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1)
   {
+    if (g_job && ('?' == c || NULL == strchr(job_options, c)))
+      error_exit("option is not supported in server jobs");
+
     switch (c)
     {
       case 'h': print_help(argv[0], (optind < argc) ? argv[optind] : ""); break;
       case 'e': g_target_options.erase = true; break;
       case 'p': g_target_options.program = true; break;
+      case 'i': g_target_options.program = g_target_options.incremental = true; break;
+      case 'L': g_target_options.loader = true; break;
+      case 'Z': g_target_options.loader = g_target_options.compress = true; break;
+      case 'B': g_target_options.bank_swap = true; break;
       case 'v': g_target_options.verify = true; break;
+      case 'V': g_target_options.verify = g_target_options.fast_verify = true; break;
+      case 'y': g_target_options.verify = g_target_options.verify_all = true; break;
       case 'k': g_target_options.lock = true; break;
       case 'r': g_target_options.read = true; break;
       case 'f': g_target_options.name = optarg; break;
       case 't': g_target = optarg; break;
       case 'l': g_list = true; break;
       case 's': g_serial = optarg; break;
-      case 'c': g_clock = strtoul(optarg, NULL, 0) * 1000; break;
+      case 'a': g_all = true; break;
+      case 'j': g_jobs = strtoul(optarg, NULL, 0); break;
+      case 'c': g_clock = strcmp(optarg, "auto") ? (long)strtoul(optarg, NULL, 0) * 1000 : CLOCK_AUTO; break;
+      case 'C': g_clock_cache = optarg; break;
+      case 'm': g_manifest = optarg; break;
       case 'b': g_verbose = true; break;
       case 'o': g_target_options.offset = (uint32_t)strtoul(optarg, NULL, 0); break;
       case 'z': g_target_options.size = (uint32_t)strtoul(optarg, NULL, 0); break;
       case 'F': parse_fuse_options(optarg); break;
+      case 'S': parse_stats_options(optarg); break;
+      case 'T': g_trace = optarg; break;
+      case 'A': g_analyze = optarg; break;
+      case 'd': g_server = optarg; break;
+      case 'R': g_rtt = true; break;
+      case 'M':
+      case 'W':
+      case 'X': parse_memory_options(c, optarg); break;
       default: exit(1); break;
     }
   }
@@ -522,186 +1460,636 @@ static void parse_command_line(int argc, char **argv)
 }
 
 //-----------------------------------------------------------------------------
-int main(int argc, char **argv)
+static bool has_actions(void)
 {
-  debugger_t debuggers[MAX_DEBUGGERS];
-  int n_debuggers = 0;
-  int debugger = -1;
-  target_t *target;
+  return g_target_options.erase || g_target_options.program || g_target_options.verify ||
+      g_target_options.lock || g_target_options.read || g_target_options.fuse;
+}
 
-  parse_command_line(argc, argv);
+//-----------------------------------------------------------------------------
+static bool has_memory_actions(void)
+{
+  return g_mem_read || g_mem_write || g_mem_fill;
+}
 
-  if (!(g_target_options.erase || g_target_options.program || g_target_options.verify ||
-      g_target_options.lock || g_target_options.read || g_target_options.fuse ||
-      g_list || g_target))
-    error_exit("no actions specified");
+//-----------------------------------------------------------------------------
+static bool has_fuse_actions(int actions)
+{
+  for (int i = 0; i < g_target_options.n_fuse_ops; i++)
+  {
+    if (g_target_options.fuse_ops[i].actions & actions)
+      return true;
+  }
 
-  if (g_target_options.read && (g_target_options.erase || g_target_options.program ||
-      g_target_options.verify || g_target_options.lock))
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+static void check_actions(void)
+{
+  if (g_target_options.read && (g_target_options.erase || g_target_options.program ||
+      g_target_options.verify || g_target_options.lock))
     error_exit("mutually exclusive actions specified");
+}
 
-  n_debuggers = dbg_enumerate(debuggers, MAX_DEBUGGERS);
+//-----------------------------------------------------------------------------
+static void run_session(debugger_t *debugger, target_t *target)
+{
+  // In the bank swap mode BKSWRST is the only reset, the application keeps
+  // running until the new image is in place
+  bool reset = !g_target_options.bank_swap;
 
-  if (g_list)
+  connect_target(debugger, target, g_clock, reset);
+  run_operations(target, &g_target_options);
+  disconnect_target(reset);
+
+  if (g_stats)
+    stats_report(debugger->serial, g_stats_json);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t parse_job_word(char *str, char *name)
+{
+  char *end;
+  uint32_t value;
+
+  check(NULL != str, "%s is not specified", name);
+
+  value = (uint32_t)strtoul(str, &end, 0);
+
+  check(0 == *end, "invalid %s '%s'", name, str);
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static void server_memory_read(char **argv, int argc)
+{
+  uint32_t addr = parse_job_word(argv[1], "address");
+  int count = (argc > 2) ? (int)parse_job_word(argv[2], "count") : 1;
+  uint32_t *data;
+
+  check(0 == (addr % 4), "address must be word aligned");
+  check(count > 0 && count <= MAX_JOB_WORDS, "word count must be between 1 and %d", MAX_JOB_WORDS);
+
+  data = buf_alloc(count * sizeof(uint32_t));
+
+  dap_read_block(addr, (uint8_t *)data, count * sizeof(uint32_t));
+
+  for (int i = 0; i < count; i++)
+    message("0x%08x: 0x%08x\n", addr + i * 4, data[i]);
+
+  buf_free(data);
+}
+
+//-----------------------------------------------------------------------------
+static void server_memory_write(char **argv, int argc)
+{
+  uint32_t addr = parse_job_word(argv[1], "address");
+  uint32_t data[MAX_JOB_ARGS];
+  int count = argc - 2;
+
+  check(0 == (addr % 4), "address must be word aligned");
+  check(count > 0, "no values specified");
+
+  for (int i = 0; i < count; i++)
+    data[i] = parse_job_word(argv[i + 2], "value");
+
+  dap_write_block(addr, (uint8_t *)data, count * sizeof(uint32_t));
+}
+
+//-----------------------------------------------------------------------------
+static void server_job(target_t *target, char **argv, int argc, bool recover)
+{
+  check(argc <= MAX_JOB_ARGS, "too many arguments");
+
+  // A failed job leaves the link in an unknown state
+  if (recover)
   {
-    message("Attached debuggers:\n");
-    for (int i = 0; i < n_debuggers; i++)
-      message("  %s - %s %s\n", debuggers[i].serial, debuggers[i].manufacturer, debuggers[i].product);
-    return 0;
+    dap_discard();
+    reconnect_debugger();
   }
 
-  if (NULL == g_target)
-    error_exit("no target type specified (use '-t' option)");
+  if (0 == strcmp(argv[1], "mr"))
+  {
+    server_memory_read(&argv[1], argc - 1);
+  }
+  else if (0 == strcmp(argv[1], "mw"))
+  {
+    server_memory_write(&argv[1], argc - 1);
+  }
+  else
+  {
+    // optind = 0 makes getopt reinitialize for the new argument vector
+    optind = 0;
+    opterr = 0;
+    parse_command_line(argc, argv);
 
-  if (0 == strcmp("list", g_target))
+    check(has_actions(), "no actions specified");
+    check_actions();
+
+    run_operations(target, &g_target_options);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static bool server_run_job(target_t *target, char **argv, int argc, bool recover)
+{
+  jmp_buf trap;
+
+  g_trap = &trap;
+
+  if (0 == setjmp(trap))
   {
-    target_list();
-    return 0;
+    server_job(target, argv, argc, recover);
+    g_trap = NULL;
+    return true;
   }
 
-  target = target_get_ops(g_target);
+  g_trap = NULL;
 
-  if (g_serial)
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+static int split_job_line(char *line, char **argv)
+{
+  int argc = 1;
+
+  // Options are parsed as if the line followed the program name
+  argv[0] = "edbg";
+
+  for (char *arg = strtok(line, " \t\r\n"); arg; arg = strtok(NULL, " \t\r\n"))
   {
-    for (int i = 0; i < n_debuggers; i++)
+    if (argc < MAX_JOB_ARGS)
+      argv[argc] = arg;
+
+    argc++;
+  }
+
+  argv[(argc < MAX_JOB_ARGS) ? argc : MAX_JOB_ARGS] = NULL;
+
+  return argc;
+}
+
+//-----------------------------------------------------------------------------
+static bool server_client(target_t *target, FILE *in, FILE *out, bool *recover)
+{
+  target_options_t defaults = g_target_options;
+  bool verbose = g_verbose;
+  char line[MAX_JOB_LINE];
+  char *argv[MAX_JOB_ARGS + 1];
+
+  while (fgets(line, sizeof(line), in))
+  {
+    int argc = split_job_line(line, argv);
+
+    if (1 == argc)
+      continue;
+
+    if (0 == strcmp(argv[1], "quit"))
+      return true;
+
+    if (0 == strcmp(argv[1], "shutdown"))
+      return false;
+
+    g_output = out;
+
+    if (server_run_job(target, argv, argc, *recover))
     {
-      if (0 == strcmp(debuggers[i].serial, g_serial))
-      {
-        debugger = i;
-        break;
-      }
+      *recover = false;
+      fprintf(out, "OK\n");
+    }
+    else
+    {
+      *recover = true;
+      fprintf(out, "ERROR: %s\n", g_error);
     }
 
-    if (-1 == debugger)
-      error_exit("unable to find a debugger with a specified serial number");
+    fflush(out);
+
+    g_output = NULL;
+
+    for (int i = defaults.n_fuse_ops; i < g_target_options.n_fuse_ops; i++)
+      free(g_target_options.fuse_ops[i].name);
+
+    g_target_options = defaults;
+    g_verbose = verbose;
   }
 
-  if (0 == n_debuggers)
-    error_exit("no debuggers found");
-  else if (1 == n_debuggers)
-    debugger = 0;
-  else if (n_debuggers > 1 && -1 == debugger)
-    error_exit("more than one debugger found, please specify a serial number");
+  return true;
+}
 
-  dbg_open(&debuggers[debugger]);
+//-----------------------------------------------------------------------------
+static void run_server(debugger_t *debugger, target_t *target)
+{
+  bool recover = false;
+  bool running = true;
+  FILE *in, *out;
 
-  dap_reset_target_hw(1);
+  connect_target(debugger, target, g_clock, true);
 
-  reconnect_debugger();
+  server_open(g_server);
 
-  dap_get_debugger_info();
+  g_job = true;
+
+  message("Server is listening on %s\n", g_server);
+
+  while (running && server_accept(&in, &out))
+  {
+    running = server_client(target, in, out, &recover);
+
+    fclose(in);
+    fclose(out);
+  }
+
+  g_job = false;
 
-  print_clock_freq(g_clock);
+  server_close();
 
-  target->ops->select(&g_target_options);
+  disconnect_target(true);
 
-  if (g_target_options.erase)
+  if (g_stats)
+    stats_report(debugger->serial, g_stats_json);
+}
+
+//-----------------------------------------------------------------------------
+static void rtt_signal(int sig)
+{
+  (void)sig;
+  g_rtt_stop = 1;
+}
+
+//-----------------------------------------------------------------------------
+static void run_rtt(debugger_t *debugger, target_t *target)
+{
+  uint32_t size = (-1 == g_target_options.size) ? RTT_SEARCH_SIZE : (uint32_t)g_target_options.size;
+  char *name = g_target_options.name ? g_target_options.name : "-";
+  int idle = 0;
+  uint32_t addr;
+
+  // The connection messages must not get into the data either
+  g_stream_stdout = (0 == strcmp(name, "-"));
+
+  // The target is not selected or reset, the core keeps running
+  connect_target(debugger, target, g_clock, false);
+
+  // The detection only reads the ID registers, the core keeps running
+  if (-1 == g_target_options.offset && 0 == target->ram_addr)
+    target = target_detect();
+
+  addr = (-1 == g_target_options.offset) ? target->ram_addr : (uint32_t)g_target_options.offset;
+
+  rtt_open(addr, size);
+
+  stream_open(name);
+
+  message("RTT capture is running, press Ctrl+C to stop\n");
+
+  signal(SIGINT, rtt_signal);
+
+  while (!g_rtt_stop)
   {
-    verbose("Erasing... ");
-    target->ops->erase();
-    verbose(" done.\n");
+    // An idle target is polled less and less often, any data restores the full rate
+    if (rtt_read())
+    {
+      idle = 0;
+    }
+    else
+    {
+      sleep_ms(idle);
+      idle = (0 == idle) ? 1 : (2 * idle > RTT_MAX_IDLE_MS) ? RTT_MAX_IDLE_MS : 2 * idle;
+    }
   }
 
-  if (g_target_options.program)
+  signal(SIGINT, SIG_DFL);
+
+  stream_close();
+
+  rtt_close();
+
+  disconnect_target(false);
+
+  if (g_stats)
+    stats_report(debugger->serial, g_stats_json);
+}
+
+//-----------------------------------------------------------------------------
+static void run_memory(debugger_t *debugger, target_t *target)
+{
+  char *name = g_target_options.name ? g_target_options.name : "-";
+
+  if (g_mem_read)
+    g_stream_stdout = (0 == strcmp(name, "-"));
+
+  // The target is not selected, there are no flash geometry checks either
+  connect_target(debugger, target, g_clock, false);
+
+  if (g_mem_write)
   {
-    verbose("Programming...");
-    target->ops->program();
+    stats_phase_start(STATS_PROGRAM);
+    verbose("Writing memory...");
+    memory_write(g_mem_write_addr, g_mem_write_name);
     verbose(" done.\n");
   }
 
-  if (g_target_options.verify)
+  if (g_mem_fill)
   {
-    verbose("Verification...");
-    target->ops->verify();
+    stats_phase_start(STATS_PROGRAM);
+    verbose("Filling memory...");
+    memory_fill(g_mem_fill_addr, g_mem_fill_size, g_mem_fill_value);
     verbose(" done.\n");
   }
 
-  if (g_target_options.lock)
+  if (g_mem_read)
   {
-    verbose("Locking... ");
-    target->ops->lock();
+    stats_phase_start(STATS_READ);
+    verbose("Reading memory...");
+    memory_read(g_mem_read_addr, g_mem_read_size, name);
     verbose(" done.\n");
   }
 
-  if (g_target_options.read)
+  stats_phase_end();
+
+  disconnect_target(false);
+
+  if (g_stats)
+    stats_report(debugger->serial, g_stats_json);
+}
+
+//-----------------------------------------------------------------------------
+static void run_probe(probe_t *probe, target_t *target)
+{
+  g_probe = probe;
+  g_trap = &probe->trap;
+
+  stats_reset();
+
+  // Errors inside the session return here instead of terminating the process
+  if (0 == setjmp(probe->trap))
   {
-    verbose("Reading...");
-    target->ops->read();
-    verbose(" done.\n");
+    run_session(probe->debugger, target);
+    probe->passed = true;
+  }
+  else
+  {
+    strcpy(probe->error, g_error);
+    dbg_close();
   }
 
-  if (g_target_options.fuse)
+  g_trap = NULL;
+  g_probe = NULL;
+}
+
+//-----------------------------------------------------------------------------
+static void *gang_worker(void *arg)
+{
+  target_t *target = (target_t *)arg;
+
+  while (1)
   {
-    if (g_target_options.fuse_name)
-    {
-      if (g_target_options.fuse_read && (g_target_options.fuse_write ||
-          g_target_options.fuse_verify))
-      error_exit("mutually exclusive fuse actions specified");
-    }
+    probe_t *probe = NULL;
 
-    verbose("Fuse section %d ", g_target_options.fuse_section);
+    pthread_mutex_lock(&g_lock);
+    if (g_probes_next < g_probes_count)
+      probe = g_probes[g_probes_next++];
+    pthread_mutex_unlock(&g_lock);
 
-    if (g_target_options.fuse_read)
-    {
-      verbose("read");
-    }
+    if (NULL == probe)
+      break;
 
-    if (g_target_options.fuse_write)
-    {
-      if (g_target_options.fuse_read)
-        verbose(", ");
+    run_probe(probe, target);
+  }
 
-      verbose("write");
-    }
+  return NULL;
+}
 
-    if (g_target_options.fuse_verify)
-    {
-      if (g_target_options.fuse_write)
-        verbose(", ");
+//-----------------------------------------------------------------------------
+static void preload_file(char *name)
+{
+  preloaded_file_t *file = &g_preloaded[g_preloaded_count];
+  int size;
 
-      verbose("verify");
-    }
+  if (NULL == name || g_preloaded_count == MAX_PRELOADED)
+    return;
 
-    if (g_target_options.fuse_name || -1 == g_target_options.fuse_end)
-    {
-      verbose(" all");
-    }
-    else if (g_target_options.fuse_start == g_target_options.fuse_end)
+  size = get_file_size(name);
+
+  file->data = buf_alloc(size + 1);
+  file->size = load_file(name, file->data, size);
+  file->name = name;
+
+  g_preloaded_count++;
+}
+
+//-----------------------------------------------------------------------------
+static int run_gang(debugger_t *debuggers, int n_debuggers, target_t *target)
+{
+  pthread_t threads[MAX_DEBUGGERS];
+  int n_threads, failed = 0;
+
+  for (int i = 0; i < n_debuggers; i++)
+  {
+    probe_t *probe = buf_alloc(sizeof(probe_t));
+
+    memset(probe, 0, sizeof(probe_t));
+    probe->debugger = &debuggers[i];
+    g_probes[g_probes_count++] = probe;
+  }
+
+  // The image is read once and shared by all probes
+  if (g_target_options.program || g_target_options.verify)
+    preload_file(g_target_options.name);
+
+  for (int i = 0; i < g_target_options.n_fuse_ops; i++)
+  {
+    if (g_target_options.fuse_ops[i].actions & (TARGET_FUSE_WRITE | TARGET_FUSE_VERIFY))
+      preload_file(g_target_options.fuse_ops[i].name);
+  }
+
+  n_threads = (g_jobs > 0 && g_jobs < n_debuggers) ? g_jobs : n_debuggers;
+
+  message("Programming %d debuggers using %d threads...\n", n_debuggers, n_threads);
+
+  for (int i = 0; i < n_threads; i++)
+  {
+    if (0 != pthread_create(&threads[i], NULL, gang_worker, target))
+      error_exit("unable to create a thread");
+  }
+
+  for (int i = 0; i < n_threads; i++)
+    pthread_join(threads[i], NULL);
+
+  message("Results:\n");
+
+  for (int i = 0; i < g_probes_count; i++)
+  {
+    probe_t *probe = g_probes[i];
+
+    if (probe->passed)
     {
-      verbose(" bit %d", g_target_options.fuse_start);
+      message("  %s - pass\n", probe->debugger->serial);
     }
     else
     {
-      verbose(" bits %d:%d", g_target_options.fuse_end,
-          g_target_options.fuse_start);
+      message("  %s - FAIL: %s\n", probe->debugger->serial, probe->error);
+      failed++;
     }
 
-    verbose(", ");
+    buf_free(probe);
+  }
+
+  message("%d passed, %d failed\n", g_probes_count - failed, failed);
+
+  return failed ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+static int select_debuggers(debugger_t *debuggers, int n_debuggers)
+{
+  debugger_t selected[MAX_DEBUGGERS];
+  int n_selected = 0;
+  char *serials, *serial;
 
-    if (g_target_options.fuse_name)
+  if (g_all)
+    return n_debuggers;
+
+  serials = strdup(g_serial);
+
+  for (serial = strtok(serials, ","); serial; serial = strtok(NULL, ","))
+  {
+    int debugger = -1;
+
+    for (int i = 0; i < n_debuggers; i++)
     {
-      verbose("file '%s'\n", g_target_options.fuse_name);
+      if (0 == strcmp(debuggers[i].serial, serial))
+      {
+        debugger = i;
+        break;
+      }
     }
-    else
+
+    if (-1 == debugger)
+      error_exit("unable to find a debugger with a serial number %s", serial);
+
+    selected[n_selected++] = debuggers[debugger];
+  }
+
+  free(serials);
+
+  memcpy(debuggers, selected, n_selected * sizeof(debugger_t));
+
+  return n_selected;
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  debugger_t debuggers[MAX_DEBUGGERS];
+  int n_debuggers = 0;
+  int debugger = -1;
+  target_t *target;
+
+  parse_command_line(argc, argv);
+
+  if (g_analyze)
+  {
+    trace_analyze(g_analyze);
+    return 0;
+  }
+
+  if (!(has_actions() || g_list || g_target || g_rtt || has_memory_actions()))
+    error_exit("no actions specified");
+
+  check_actions();
+
+  check(!g_server || !has_actions(), "actions must be sent as server jobs in server mode");
+  check(!g_rtt || !(has_actions() || g_server), "RTT capture can not be combined with other actions");
+  check(!has_memory_actions() || !(has_actions() || g_server || g_rtt),
+      "memory operations can not be combined with other actions");
+
+  stats_phase_start(STATS_ENUMERATE);
+  // A single requested debugger is looked up directly
+  n_debuggers = dbg_enumerate(debuggers, MAX_DEBUGGERS,
+      (g_serial && !strchr(g_serial, ',')) ? g_serial : NULL);
+  stats_phase_end();
+
+  if (g_list)
+  {
+    message("Attached debuggers:\n");
+    for (int i = 0; i < n_debuggers; i++)
+      message("  %s - %s %s\n", debuggers[i].serial, debuggers[i].manufacturer, debuggers[i].product);
+    return 0;
+  }
+
+  // Memory operations do not select the target, without a target type the clock
+  // calibration only checks the IDCODE
+  if (NULL == g_target && has_memory_actions())
+    g_target = "auto";
+
+  if (NULL == g_target)
+    error_exit("no target type specified (use '-t' option)");
+
+  if (0 == strcmp("list", g_target))
+  {
+    target_list();
+    return 0;
+  }
+
+  target = target_get_ops(g_target);
+
+  if (g_all || (g_serial && strchr(g_serial, ',')))
+  {
+    check(!g_target_options.read && !has_fuse_actions(TARGET_FUSE_READ),
+        "read operations are not supported with multiple debuggers");
+    check(!g_trace, "trace capture is not supported with multiple debuggers");
+    check(!g_server, "server mode is not supported with multiple debuggers");
+    check(!g_rtt, "RTT capture is not supported with multiple debuggers");
+    check(!has_memory_actions(), "memory operations are not supported with multiple debuggers");
+
+    n_debuggers = select_debuggers(debuggers, n_debuggers);
+    check(n_debuggers > 0, "no debuggers found");
+
+    return run_gang(debuggers, n_debuggers, target);
+  }
+
+  if (g_serial)
+  {
+    for (int i = 0; i < n_debuggers; i++)
     {
-      verbose("value 0x%x (%u)\n", g_target_options.fuse_value,
-          g_target_options.fuse_value);
+      if (0 == strcmp(debuggers[i].serial, g_serial))
+      {
+        debugger = i;
+        break;
+      }
     }
 
-    target->ops->fuse();
-
-    verbose("done.\n");
+    if (-1 == debugger)
+      error_exit("unable to find a debugger with a specified serial number");
   }
 
-  target->ops->deselect();
+  if (0 == n_debuggers)
+    error_exit("no debuggers found");
+  else if (1 == n_debuggers)
+    debugger = 0;
+  else if (n_debuggers > 1 && -1 == debugger)
+    error_exit("more than one debugger found, please specify a serial number");
 
-  dap_reset_target_hw(1);
+  if (g_trace)
+    trace_open(g_trace);
 
-  dap_disconnect();
-  dap_led(0, 0);
+  if (g_server)
+    run_server(&debuggers[debugger], target);
+  else if (g_rtt)
+    run_rtt(&debuggers[debugger], target);
+  else if (has_memory_actions())
+    run_memory(&debuggers[debugger], target);
+  else
+    run_session(&debuggers[debugger], target);
 
-  dbg_close();
+  trace_close();
 
   return 0;
 }
 
+#endif // EDBG_LIBRARY
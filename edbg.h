@@ -33,6 +33,8 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "dbg.h"
+#include "target.h"
 
 /*- Prototypes --------------------------------------------------------------*/
 void verbose(char *fmt, ...);
@@ -41,14 +43,25 @@ void warning(char *fmt, ...);
 void check(bool cond, char *fmt, ...);
 void error_exit(char *fmt, ...);
 void sleep_ms(int ms);
+uint32_t get_time_ms(void);
+uint64_t get_time_us(void);
 void perror_exit(char *text);
+bool error_trap(void (*func)(void *arg), void *arg, char *error, int size);
 void *buf_alloc(int size);
+void *buf_realloc(void *buf, int size);
 void buf_free(void *buf);
+int get_file_size(char *name);
 int load_file(char *name, uint8_t *data, int size);
 void save_file(char *name, uint8_t *data, int size);
+void stream_open(char *name);
+void stream_write(uint8_t *data, int size);
+void stream_close(void);
 uint32_t extract_value(uint8_t *buf, int start, int end);
 void apply_value(uint8_t *buf, uint32_t value, int start, int end);
 void reconnect_debugger(void);
+void connect_target(debugger_t *debugger, target_t *target, long clock, bool reset);
+void run_operations(target_t *target, target_options_t *options);
+void disconnect_target(bool reset);
 
 #endif // _EDBG_H_
 
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include "edbg.h"
+#include "image.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define ELF_HEADER_SIZE        52
+#define ELF_PHDR_SIZE          32
+#define ELF_CLASS_32           1
+#define ELF_DATA_LSB           1
+#define ELF_PT_LOAD            1
+
+#define HEX_DATA               0x00
+#define HEX_EOF                0x01
+#define HEX_EXT_SEGMENT        0x02
+#define HEX_EXT_LINEAR         0x04
+
+/*- Variables ---------------------------------------------------------------*/
+static _Thread_local image_segment_t *image_segments;
+static _Thread_local int image_count;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static uint32_t get_u16(uint8_t *buf)
+{
+  return buf[0] | (buf[1] << 8);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t get_u32(uint8_t *buf)
+{
+  return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+//-----------------------------------------------------------------------------
+static void add_data(uint32_t addr, uint8_t *data, uint32_t size)
+{
+  image_segment_t *last = image_count ? &image_segments[image_count - 1] : NULL;
+
+  if (0 == size)
+    return;
+
+  // Records are usually sequential, so they are merged as they come
+  if (last && (last->addr + last->size) == addr)
+  {
+    last->data = buf_realloc(last->data, last->size + size);
+    memcpy(&last->data[last->size], data, size);
+    last->size += size;
+    return;
+  }
+
+  image_segments = buf_realloc(image_segments, (image_count + 1) * sizeof(image_segment_t));
+  last = &image_segments[image_count++];
+
+  last->addr = addr;
+  last->size = size;
+  last->data = buf_alloc(size);
+  memcpy(last->data, data, size);
+}
+
+//-----------------------------------------------------------------------------
+static void load_elf(uint8_t *buf, int size)
+{
+  uint32_t phoff, phentsize, phnum;
+
+  check(size >= ELF_HEADER_SIZE, "ELF file is too small");
+  check(ELF_CLASS_32 == buf[4] && ELF_DATA_LSB == buf[5],
+      "only 32-bit little-endian ELF files are supported");
+
+  phoff = get_u32(&buf[0x1c]);
+  phentsize = get_u16(&buf[0x2a]);
+  phnum = get_u16(&buf[0x2c]);
+
+  check(phentsize >= ELF_PHDR_SIZE && (phoff + phnum * phentsize) <= (uint32_t)size,
+      "malformed ELF program header table");
+
+  for (uint32_t i = 0; i < phnum; i++)
+  {
+    uint8_t *phdr = &buf[phoff + i * phentsize];
+    uint32_t offset = get_u32(&phdr[0x04]);
+    uint32_t paddr = get_u32(&phdr[0x0c]);
+    uint32_t filesz = get_u32(&phdr[0x10]);
+
+    if (ELF_PT_LOAD != get_u32(&phdr[0x00]) || 0 == filesz)
+      continue;
+
+    check((offset + filesz) <= (uint32_t)size, "malformed ELF segment");
+
+    // Load addresses are used, so initialized data goes to its flash copy
+    add_data(paddr, &buf[offset], filesz);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static int hex_value(char *str, int digits)
+{
+  int value = 0;
+
+  for (int i = 0; i < digits; i++)
+  {
+    int c = tolower((unsigned char)str[i]);
+
+    if (c >= '0' && c <= '9')
+      value = (value << 4) | (c - '0');
+    else if (c >= 'a' && c <= 'f')
+      value = (value << 4) | (c - 'a' + 10);
+    else
+      return -1;
+  }
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static void load_hex(char *buf, int size)
+{
+  uint32_t base = 0;
+  bool eof = false;
+  int line = 0;
+  char *ptr = buf;
+  char *end = buf + size;
+
+  while (ptr < end && !eof)
+  {
+    uint8_t record[256 + 5];
+    char *eol = memchr(ptr, '\n', end - ptr);
+    int len, count;
+    uint8_t sum = 0;
+
+    if (NULL == eol)
+      eol = end;
+
+    line++;
+    len = eol - ptr;
+
+    while (len && isspace((unsigned char)ptr[len - 1]))
+      len--;
+
+    if (0 == len)
+    {
+      ptr = eol + 1;
+      continue;
+    }
+
+    check(':' == ptr[0] && len >= 11 && (len % 2), "malformed HEX record at line %d", line);
+
+    count = (len - 1) / 2;
+
+    for (int i = 0; i < count; i++)
+    {
+      int value = hex_value(&ptr[1 + i * 2], 2);
+
+      check(value >= 0, "invalid character in HEX record at line %d", line);
+      record[i] = value;
+      sum += value;
+    }
+
+    check(count == record[0] + 5, "invalid HEX record length at line %d", line);
+    check(0 == sum, "invalid HEX record checksum at line %d", line);
+
+    switch (record[3])
+    {
+      case HEX_DATA:
+        add_data(base + ((record[1] << 8) | record[2]), &record[4], record[0]);
+        break;
+
+      case HEX_EOF:
+        eof = true;
+        break;
+
+      case HEX_EXT_SEGMENT:
+        base = ((record[4] << 8) | record[5]) << 4;
+        break;
+
+      case HEX_EXT_LINEAR:
+        base = ((record[4] << 8) | record[5]) << 16;
+        break;
+
+      default: // Start address records are not relevant for programming
+        break;
+    }
+
+    ptr = eol + 1;
+  }
+
+  check(eof, "HEX file has no end of file record");
+}
+
+//-----------------------------------------------------------------------------
+static bool is_hex_name(char *name)
+{
+  char *ext = strrchr(name, '.');
+  char str[8];
+  int i;
+
+  if (NULL == ext || strlen(ext) >= sizeof(str))
+    return false;
+
+  for (i = 0; ext[i]; i++)
+    str[i] = tolower((unsigned char)ext[i]);
+  str[i] = 0;
+
+  return 0 == strcmp(str, ".hex") || 0 == strcmp(str, ".ihex") || 0 == strcmp(str, ".ihx");
+}
+
+//-----------------------------------------------------------------------------
+int image_load(char *name, image_segment_t **segments)
+{
+  uint8_t magic[4] = { 0 };
+  uint8_t *buf;
+  bool elf;
+  int size;
+
+  check(NULL != name, "input file name is not specified");
+
+  load_file(name, magic, sizeof(magic));
+  elf = (0 == memcmp(magic, "\x7f" "ELF", sizeof(magic)));
+
+  // Anything else is a plain binary image
+  if (!elf && !is_hex_name(name))
+    return -1;
+
+  size = get_file_size(name);
+  buf = buf_alloc(size + 1);
+  size = load_file(name, buf, size);
+
+  image_segments = NULL;
+  image_count = 0;
+
+  if (elf)
+    load_elf(buf, size);
+  else
+    load_hex((char *)buf, size);
+
+  buf_free(buf);
+
+  check(image_count > 0, "file '%s' contains no data to program", name);
+
+  *segments = image_segments;
+
+  return image_count;
+}
+
+//-----------------------------------------------------------------------------
+void image_free(image_segment_t *segments, int count)
+{
+  for (int i = 0; i < count; i++)
+    buf_free(segments[i].data);
+
+  buf_free(segments);
+}
+
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "edbg.h"
+#include "dap.h"
+#include "dbg.h"
+#include "target.h"
+#include "libedbg.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define LIB_MAX_DEBUGGERS      20
+#define LIB_MAX_ERROR_SIZE     256
+
+/*- Types -------------------------------------------------------------------*/
+struct edbg_t
+{
+  debugger_t        debugger;
+  target_t          *target;
+  bool              connected;
+  bool              recover;
+  bool              bank_swapped;
+};
+
+typedef struct
+{
+  edbg_t            *edbg;
+  const char        *serial;
+  const char        *target;
+  long              clock;
+  target_options_t  options;
+  uint32_t          addr;
+  uint32_t          *data;
+  int               count;
+} lib_request_t;
+
+/*- Variables ---------------------------------------------------------------*/
+static _Thread_local edbg_t *lib_session = NULL;
+static _Thread_local char lib_error[LIB_MAX_ERROR_SIZE];
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static int lib_call(void (*func)(void *arg), lib_request_t *request)
+{
+  if (error_trap(func, request, lib_error, sizeof(lib_error)))
+    return EDBG_OK;
+
+  // A failed call leaves the link in an unknown state
+  if (request->edbg && request->edbg == lib_session)
+    request->edbg->recover = request->edbg->connected;
+
+  return EDBG_ERROR;
+}
+
+//-----------------------------------------------------------------------------
+static void lib_check_session(edbg_t *edbg, bool connected)
+{
+  check(NULL != edbg && edbg == lib_session, "invalid session or the session belongs to another thread");
+  check(!connected || edbg->connected, "the target is not connected");
+
+  if (edbg->recover)
+  {
+    dap_discard();
+    reconnect_debugger();
+    edbg->recover = false;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void lib_options(lib_request_t *request, const char *file, int32_t offset, int32_t size)
+{
+  memset(&request->options, 0, sizeof(target_options_t));
+
+  request->options.name = (char *)file;
+  request->options.offset = offset;
+  request->options.size = size;
+}
+
+//-----------------------------------------------------------------------------
+static void lib_list(void *arg)
+{
+  lib_request_t *request = (lib_request_t *)arg;
+  debugger_t debuggers[LIB_MAX_DEBUGGERS];
+  int n_debuggers = dbg_enumerate(debuggers, LIB_MAX_DEBUGGERS, NULL);
+  const char **serials = (const char **)request->data;
+
+  for (int i = 0; i < n_debuggers && i < request->count; i++)
+    serials[i] = debuggers[i].serial;
+
+  request->count = n_debuggers;
+}
+
+//-----------------------------------------------------------------------------
+int edbg_list(const char **serials, int size)
+{
+  lib_request_t request = { .data = (uint32_t *)serials, .count = size };
+
+  if (EDBG_OK != lib_call(lib_list, &request))
+    return EDBG_ERROR;
+
+  return request.count;
+}
+
+//-----------------------------------------------------------------------------
+static void lib_open(void *arg)
+{
+  lib_request_t *request = (lib_request_t *)arg;
+  debugger_t debuggers[LIB_MAX_DEBUGGERS];
+  int n_debuggers, debugger = -1;
+
+  check(NULL == lib_session, "a session is already open in this thread");
+
+  n_debuggers = dbg_enumerate(debuggers, LIB_MAX_DEBUGGERS, (char *)request->serial);
+
+  for (int i = 0; i < n_debuggers && request->serial; i++)
+  {
+    if (0 == strcmp(debuggers[i].serial, request->serial))
+      debugger = i;
+  }
+
+  if (NULL == request->serial && 1 == n_debuggers)
+    debugger = 0;
+
+  if (request->serial)
+  {
+    check(-1 != debugger, "unable to find a debugger with a specified serial number");
+  }
+  else
+  {
+    check(n_debuggers > 0, "no debuggers found");
+    check(1 == n_debuggers, "more than one debugger found, please specify a serial number");
+  }
+
+  request->edbg = buf_alloc(sizeof(edbg_t));
+  memset(request->edbg, 0, sizeof(edbg_t));
+  request->edbg->debugger = debuggers[debugger];
+
+  lib_session = request->edbg;
+}
+
+//-----------------------------------------------------------------------------
+int edbg_open(edbg_t **edbg, const char *serial)
+{
+  lib_request_t request = { .serial = serial };
+  int rc = lib_call(lib_open, &request);
+
+  *edbg = request.edbg;
+
+  return rc;
+}
+
+//-----------------------------------------------------------------------------
+static void lib_connect(void *arg)
+{
+  lib_request_t *request = (lib_request_t *)arg;
+  edbg_t *edbg = request->edbg;
+
+  lib_check_session(edbg, false);
+  check(!edbg->connected, "the target is already connected");
+
+  edbg->target = target_get_ops((char *)request->target);
+
+  connect_target(&edbg->debugger, edbg->target, request->clock * 1000, true);
+
+  edbg->connected = true;
+}
+
+//-----------------------------------------------------------------------------
+int edbg_connect(edbg_t *edbg, const char *target, long clock_khz)
+{
+  lib_request_t request = { .edbg = edbg, .target = target, .clock = clock_khz };
+  int rc = lib_call(lib_connect, &request);
+
+  // The debugger is left closed after a failed connection
+  if (EDBG_OK != rc && edbg == lib_session && !edbg->connected)
+    dbg_close();
+
+  return rc;
+}
+
+//-----------------------------------------------------------------------------
+static void lib_operations(void *arg)
+{
+  lib_request_t *request = (lib_request_t *)arg;
+
+  lib_check_session(request->edbg, true);
+  run_operations(request->edbg->target, &request->options);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_select(edbg_t *edbg)
+{
+  lib_request_t request = { .edbg = edbg };
+
+  lib_options(&request, NULL, -1, -1);
+
+  return lib_call(lib_operations, &request);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_erase(edbg_t *edbg)
+{
+  lib_request_t request = { .edbg = edbg };
+
+  lib_options(&request, NULL, -1, -1);
+  request.options.erase = true;
+
+  return lib_call(lib_operations, &request);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_program(edbg_t *edbg, const char *file, int32_t offset, int32_t size, int flags)
+{
+  lib_request_t request = { .edbg = edbg };
+  int rc;
+
+  lib_options(&request, file, offset, size);
+  request.options.program = true;
+  request.options.incremental = (flags & EDBG_INCREMENTAL) != 0;
+  request.options.loader = (flags & (EDBG_LOADER | EDBG_COMPRESS)) != 0;
+  request.options.compress = (flags & EDBG_COMPRESS) != 0;
+  request.options.bank_swap = (flags & EDBG_BANK_SWAP) != 0;
+
+  rc = lib_call(lib_operations, &request);
+
+  // The bank swap has already reset the device
+  if (EDBG_OK == rc && request.options.bank_swap)
+    edbg->bank_swapped = true;
+
+  return rc;
+}
+
+//-----------------------------------------------------------------------------
+int edbg_verify(edbg_t *edbg, const char *file, int32_t offset, int32_t size, int flags)
+{
+  lib_request_t request = { .edbg = edbg };
+
+  lib_options(&request, file, offset, size);
+  request.options.verify = true;
+  request.options.fast_verify = (flags & EDBG_FAST_VERIFY) != 0;
+  request.options.verify_all = (flags & EDBG_VERIFY_ALL) != 0;
+
+  return lib_call(lib_operations, &request);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_read(edbg_t *edbg, const char *file, int32_t offset, int32_t size)
+{
+  lib_request_t request = { .edbg = edbg };
+
+  lib_options(&request, file, offset, size);
+  request.options.read = true;
+
+  return lib_call(lib_operations, &request);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_lock(edbg_t *edbg)
+{
+  lib_request_t request = { .edbg = edbg };
+
+  lib_options(&request, NULL, -1, -1);
+  request.options.lock = true;
+
+  return lib_call(lib_operations, &request);
+}
+
+//-----------------------------------------------------------------------------
+static void lib_read_memory(void *arg)
+{
+  lib_request_t *request = (lib_request_t *)arg;
+
+  lib_check_session(request->edbg, true);
+  check(0 == (request->addr % 4), "address must be word aligned");
+  check(request->count > 0, "word count must be positive");
+
+  dap_read_block(request->addr, (uint8_t *)request->data, request->count * sizeof(uint32_t));
+}
+
+//-----------------------------------------------------------------------------
+int edbg_read_memory(edbg_t *edbg, uint32_t addr, uint32_t *data, int count)
+{
+  lib_request_t request = { .edbg = edbg, .addr = addr, .data = data, .count = count };
+
+  return lib_call(lib_read_memory, &request);
+}
+
+//-----------------------------------------------------------------------------
+static void lib_write_memory(void *arg)
+{
+  lib_request_t *request = (lib_request_t *)arg;
+
+  lib_check_session(request->edbg, true);
+  check(0 == (request->addr % 4), "address must be word aligned");
+  check(request->count > 0, "word count must be positive");
+
+  dap_write_block(request->addr, (uint8_t *)request->data, request->count * sizeof(uint32_t));
+}
+
+//-----------------------------------------------------------------------------
+int edbg_write_memory(edbg_t *edbg, uint32_t addr, uint32_t *data, int count)
+{
+  lib_request_t request = { .edbg = edbg, .addr = addr, .data = data, .count = count };
+
+  return lib_call(lib_write_memory, &request);
+}
+
+//-----------------------------------------------------------------------------
+static void lib_close(void *arg)
+{
+  lib_request_t *request = (lib_request_t *)arg;
+
+  if (request->edbg->connected)
+    disconnect_target(!request->edbg->bank_swapped);
+}
+
+//-----------------------------------------------------------------------------
+void edbg_close(edbg_t *edbg)
+{
+  lib_request_t request = { .edbg = edbg };
+
+  if (NULL == edbg || edbg != lib_session)
+    return;
+
+  // The debugger is closed even if the link is not responding any more
+  if (EDBG_OK != lib_call(lib_close, &request))
+    dbg_close();
+
+  lib_session = NULL;
+  buf_free(edbg);
+}
+
+//-----------------------------------------------------------------------------
+const char *edbg_error(void)
+{
+  return lib_error;
+}
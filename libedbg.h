@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LIBEDBG_H_
+#define _LIBEDBG_H_
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*- Definitions -------------------------------------------------------------*/
+#define EDBG_OK            0
+#define EDBG_ERROR         (-1)
+
+#define EDBG_CLOCK_AUTO    0
+
+enum
+{
+  EDBG_INCREMENTAL = (1 << 0),
+  EDBG_LOADER      = (1 << 1),
+  EDBG_COMPRESS    = (1 << 2),
+  EDBG_FAST_VERIFY = (1 << 3),
+  EDBG_VERIFY_ALL  = (1 << 4),
+  EDBG_BANK_SWAP   = (1 << 5),
+};
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct edbg_t edbg_t;
+
+/*- Prototypes --------------------------------------------------------------*/
+// All functions return EDBG_OK or EDBG_ERROR, edbg_error() returns the message
+// of the last error. A session belongs to the thread that opened it, each
+// thread may have one open session.
+int edbg_list(const char **serials, int size);
+int edbg_open(edbg_t **edbg, const char *serial);
+int edbg_connect(edbg_t *edbg, const char *target, long clock_khz);
+int edbg_select(edbg_t *edbg);
+int edbg_erase(edbg_t *edbg);
+int edbg_program(edbg_t *edbg, const char *file, int32_t offset, int32_t size, int flags);
+int edbg_verify(edbg_t *edbg, const char *file, int32_t offset, int32_t size, int flags);
+int edbg_read(edbg_t *edbg, const char *file, int32_t offset, int32_t size);
+int edbg_lock(edbg_t *edbg);
+int edbg_read_memory(edbg_t *edbg, uint32_t addr, uint32_t *data, int count);
+int edbg_write_memory(edbg_t *edbg, uint32_t addr, uint32_t *data, int count);
+void edbg_close(edbg_t *edbg);
+const char *edbg_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBEDBG_H_
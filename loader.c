@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "edbg.h"
+#include "dap.h"
+#include "loader.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define DHCSR                  0xe000edf0
+#define DCRSR                  0xe000edf4
+#define DCRDR                  0xe000edf8
+
+#define DHCSR_KEY              0xa05f0000
+#define DHCSR_C_DEBUGEN        (1 << 0)
+#define DHCSR_C_HALT           (1 << 1)
+#define DHCSR_S_REGRDY         (1 << 16)
+#define DHCSR_S_HALT           (1 << 17)
+
+#define DCRSR_REGWnR           (1 << 16)
+
+#define REG_R0                 0
+#define REG_SP                 13
+#define REG_PC                 15
+#define REG_XPSR               16
+
+#define XPSR_T                 (1 << 24)
+
+// RAM layout, the code must fit into the first 512 bytes. The buffers are
+// followed by the area the packed data is inflated into.
+#define LOADER_CODE            0x000
+#define LOADER_PARAMS          0x200
+#define LOADER_DESC            0x240
+#define LOADER_STACK           0x400
+#define LOADER_BUFFERS         0x400
+
+#define LOADER_MAX_BUFFERS     8
+
+enum
+{
+  P_DESC       = 0x00,
+  P_COUNT      = 0x04,
+  P_PAGE_SIZE  = 0x08,
+  P_ERASE_SIZE = 0x0c,
+  P_STATUS     = 0x10,
+  P_ERROR_ADDR = 0x14,
+  P_ARG0       = 0x18,
+  P_INFLATE    = 0x24,
+};
+
+enum
+{
+  D_STATE      = 0x00,
+  D_ADDR       = 0x04,
+  D_SIZE       = 0x08,
+  D_FLAGS      = 0x0c,
+  D_NVM        = 0x10,
+  D_PAGE       = 0x14,
+  D_BUF        = 0x18,
+  D_PACKED     = 0x1c,
+  D_SIZEOF     = 0x20,
+};
+
+enum
+{
+  STATE_IDLE   = 0,
+  STATE_READY  = 1,
+  STATE_EXIT   = 2,
+};
+
+#define LOADER_TIMEOUT         5000 // ms
+
+// Packed data format, see the inflate routine in loader/loader.inc
+#define PACK_MAX_LITERALS      128
+#define PACK_MIN_MATCH         3
+#define PACK_MAX_MATCH         (0x7f + PACK_MIN_MATCH)
+#define PACK_MAX_DISTANCE      0xffff
+#define PACK_HASH_BITS         12
+#define PACK_HASH_SIZE         (1 << PACK_HASH_BITS)
+
+/*- Variables ---------------------------------------------------------------*/
+// Generated from the sources in the loader/ directory:
+//   llvm-mc -triple=thumbv6m-none-eabi -filetype=obj <name>.s -o <name>.o
+//   llvm-objcopy -O binary -j .text <name>.o <name>.bin
+static const uint8_t loader_nvmctrl[] =
+{
+  0x04, 0x46, 0xa0, 0x68, 0x82, 0x46, 0x00, 0x26, 0x25, 0x68, 0x70, 0x01,
+  0x2d, 0x18, 0x28, 0x68, 0x01, 0x28, 0x02, 0xd0, 0x02, 0x28, 0xfa, 0xd1,
+  0x00, 0xbe, 0x2f, 0x69, 0x69, 0x68, 0xaa, 0x69, 0xe8, 0x69, 0x00, 0x28,
+  0x01, 0xd0, 0x00, 0xf0, 0x36, 0xf8, 0xa8, 0x68, 0x40, 0x18, 0x80, 0x46,
+  0x68, 0x69, 0x81, 0x46, 0x41, 0x45, 0x10, 0xd2, 0xe0, 0x68, 0x40, 0x1e,
+  0x08, 0x42, 0x03, 0xd1, 0x00, 0xf0, 0x53, 0xf8, 0x00, 0x28, 0x10, 0xd1,
+  0x00, 0xf0, 0x60, 0xf8, 0x00, 0x28, 0x0c, 0xd1, 0x51, 0x44, 0x52, 0x44,
+  0x01, 0x20, 0x81, 0x44, 0xec, 0xe7, 0x00, 0x20, 0x28, 0x60, 0x76, 0x1c,
+  0x60, 0x68, 0x86, 0x42, 0xd0, 0xd1, 0x00, 0x26, 0xce, 0xe7, 0x20, 0x61,
+  0x61, 0x61, 0x01, 0xbe, 0x0a, 0xb4, 0x53, 0x46, 0x00, 0x20, 0xc0, 0x43,
+  0x1b, 0x1f, 0xd1, 0x58, 0x08, 0x40, 0x00, 0x2b, 0xfa, 0xd1, 0xc0, 0x43,
+  0x0a, 0xbc, 0x70, 0x47, 0x00, 0x23, 0xd0, 0x58, 0xc8, 0x50, 0x1b, 0x1d,
+  0x53, 0x45, 0xfa, 0xd1, 0x70, 0x47, 0xe2, 0xb5, 0x13, 0x18, 0x61, 0x6a,
+  0x9a, 0x42, 0x1b, 0xd2, 0x10, 0x78, 0x52, 0x1c, 0x7f, 0x25, 0x05, 0x40,
+  0x00, 0x06, 0x07, 0xd4, 0x6d, 0x1c, 0x10, 0x78, 0x08, 0x70, 0x52, 0x1c,
+  0x49, 0x1c, 0x6d, 0x1e, 0xf9, 0xd1, 0xef, 0xe7, 0xed, 0x1c, 0x10, 0x78,
+  0x56, 0x78, 0x92, 0x1c, 0x36, 0x02, 0x06, 0x43, 0x8f, 0x1b, 0x38, 0x78,
+  0x08, 0x70, 0x7f, 0x1c, 0x49, 0x1c, 0x6d, 0x1e, 0xf9, 0xd1, 0xe1, 0xe7,
+  0x62, 0x6a, 0xe2, 0xbd, 0x78, 0x69, 0x01, 0x23, 0x18, 0x42, 0xfb, 0xd0,
+  0x02, 0x23, 0x18, 0x40, 0x70, 0x47, 0x00, 0xb5, 0x48, 0x08, 0xf8, 0x61,
+  0x0b, 0x48, 0x38, 0x60, 0xff, 0xf7, 0xf2, 0xff, 0x00, 0x28, 0x06, 0xd1,
+  0xe8, 0x68, 0x00, 0x28, 0x03, 0xd0, 0x08, 0x48, 0x38, 0x60, 0xff, 0xf7,
+  0xe9, 0xff, 0x00, 0xbd, 0x00, 0xb5, 0xff, 0xf7, 0xaf, 0xff, 0x00, 0x28,
+  0x03, 0xd0, 0xff, 0xf7, 0xb7, 0xff, 0xff, 0xf7, 0xdf, 0xff, 0x00, 0xbd,
+  0x41, 0xa5, 0x00, 0x00, 0x02, 0xa5, 0x00, 0x00,
+};
+
+static const uint8_t loader_nvmctrl_v2[] =
+{
+  0x04, 0x46, 0xa0, 0x68, 0x82, 0x46, 0x00, 0x26, 0x25, 0x68, 0x70, 0x01,
+  0x2d, 0x18, 0x28, 0x68, 0x01, 0x28, 0x02, 0xd0, 0x02, 0x28, 0xfa, 0xd1,
+  0x00, 0xbe, 0x2f, 0x69, 0x69, 0x68, 0xaa, 0x69, 0xe8, 0x69, 0x00, 0x28,
+  0x01, 0xd0, 0x00, 0xf0, 0x36, 0xf8, 0xa8, 0x68, 0x40, 0x18, 0x80, 0x46,
+  0x68, 0x69, 0x81, 0x46, 0x41, 0x45, 0x10, 0xd2, 0xe0, 0x68, 0x40, 0x1e,
+  0x08, 0x42, 0x03, 0xd1, 0x00, 0xf0, 0x52, 0xf8, 0x00, 0x28, 0x10, 0xd1,
+  0x00, 0xf0, 0x5e, 0xf8, 0x00, 0x28, 0x0c, 0xd1, 0x51, 0x44, 0x52, 0x44,
+  0x01, 0x20, 0x81, 0x44, 0xec, 0xe7, 0x00, 0x20, 0x28, 0x60, 0x76, 0x1c,
+  0x60, 0x68, 0x86, 0x42, 0xd0, 0xd1, 0x00, 0x26, 0xce, 0xe7, 0x20, 0x61,
+  0x61, 0x61, 0x01, 0xbe, 0x0a, 0xb4, 0x53, 0x46, 0x00, 0x20, 0xc0, 0x43,
+  0x1b, 0x1f, 0xd1, 0x58, 0x08, 0x40, 0x00, 0x2b, 0xfa, 0xd1, 0xc0, 0x43,
+  0x0a, 0xbc, 0x70, 0x47, 0x00, 0x23, 0xd0, 0x58, 0xc8, 0x50, 0x1b, 0x1d,
+  0x53, 0x45, 0xfa, 0xd1, 0x70, 0x47, 0xe2, 0xb5, 0x13, 0x18, 0x61, 0x6a,
+  0x9a, 0x42, 0x1b, 0xd2, 0x10, 0x78, 0x52, 0x1c, 0x7f, 0x25, 0x05, 0x40,
+  0x00, 0x06, 0x07, 0xd4, 0x6d, 0x1c, 0x10, 0x78, 0x08, 0x70, 0x52, 0x1c,
+  0x49, 0x1c, 0x6d, 0x1e, 0xf9, 0xd1, 0xef, 0xe7, 0xed, 0x1c, 0x10, 0x78,
+  0x56, 0x78, 0x92, 0x1c, 0x36, 0x02, 0x06, 0x43, 0x8f, 0x1b, 0x38, 0x78,
+  0x08, 0x70, 0x7f, 0x1c, 0x49, 0x1c, 0x6d, 0x1e, 0xf9, 0xd1, 0xe1, 0xe7,
+  0x62, 0x6a, 0xe2, 0xbd, 0x38, 0x69, 0x43, 0x0c, 0xfc, 0xd3, 0x4e, 0x23,
+  0x18, 0x40, 0x70, 0x47, 0x00, 0xb5, 0x79, 0x61, 0x10, 0x48, 0x78, 0x60,
+  0xff, 0xf7, 0xf4, 0xff, 0x00, 0x28, 0x06, 0xd1, 0xe8, 0x68, 0x00, 0x28,
+  0x03, 0xd0, 0x0d, 0x48, 0x78, 0x60, 0xff, 0xf7, 0xeb, 0xff, 0x00, 0xbd,
+  0x00, 0xb5, 0xff, 0xf7, 0xb1, 0xff, 0x00, 0x28, 0x0c, 0xd0, 0x79, 0x61,
+  0x08, 0x48, 0x78, 0x60, 0xff, 0xf7, 0xe0, 0xff, 0x00, 0x28, 0x05, 0xd1,
+  0xff, 0xf7, 0xb2, 0xff, 0x05, 0x48, 0x78, 0x60, 0xff, 0xf7, 0xd8, 0xff,
+  0x00, 0xbd, 0x00, 0x00, 0x12, 0xa5, 0x00, 0x00, 0x01, 0xa5, 0x00, 0x00,
+  0x15, 0xa5, 0x00, 0x00, 0x03, 0xa5, 0x00, 0x00,
+};
+
+static const uint8_t loader_eefc[] =
+{
+  0x04, 0x46, 0xa0, 0x68, 0x82, 0x46, 0x00, 0x26, 0x25, 0x68, 0x70, 0x01,
+  0x2d, 0x18, 0x28, 0x68, 0x01, 0x28, 0x02, 0xd0, 0x02, 0x28, 0xfa, 0xd1,
+  0x00, 0xbe, 0x2f, 0x69, 0x69, 0x68, 0xaa, 0x69, 0xe8, 0x69, 0x00, 0x28,
+  0x01, 0xd0, 0x00, 0xf0, 0x36, 0xf8, 0xa8, 0x68, 0x40, 0x18, 0x80, 0x46,
+  0x68, 0x69, 0x81, 0x46, 0x41, 0x45, 0x10, 0xd2, 0xe0, 0x68, 0x40, 0x1e,
+  0x08, 0x42, 0x03, 0xd1, 0x00, 0xf0, 0x5b, 0xf8, 0x00, 0x28, 0x10, 0xd1,
+  0x00, 0xf0, 0x60, 0xf8, 0x00, 0x28, 0x0c, 0xd1, 0x51, 0x44, 0x52, 0x44,
+  0x01, 0x20, 0x81, 0x44, 0xec, 0xe7, 0x00, 0x20, 0x28, 0x60, 0x76, 0x1c,
+  0x60, 0x68, 0x86, 0x42, 0xd0, 0xd1, 0x00, 0x26, 0xce, 0xe7, 0x20, 0x61,
+  0x61, 0x61, 0x01, 0xbe, 0x0a, 0xb4, 0x53, 0x46, 0x00, 0x20, 0xc0, 0x43,
+  0x1b, 0x1f, 0xd1, 0x58, 0x08, 0x40, 0x00, 0x2b, 0xfa, 0xd1, 0xc0, 0x43,
+  0x0a, 0xbc, 0x70, 0x47, 0x00, 0x23, 0xd0, 0x58, 0xc8, 0x50, 0x1b, 0x1d,
+  0x53, 0x45, 0xfa, 0xd1, 0x70, 0x47, 0xe2, 0xb5, 0x13, 0x18, 0x61, 0x6a,
+  0x9a, 0x42, 0x1b, 0xd2, 0x10, 0x78, 0x52, 0x1c, 0x7f, 0x25, 0x05, 0x40,
+  0x00, 0x06, 0x07, 0xd4, 0x6d, 0x1c, 0x10, 0x78, 0x08, 0x70, 0x52, 0x1c,
+  0x49, 0x1c, 0x6d, 0x1e, 0xf9, 0xd1, 0xef, 0xe7, 0xed, 0x1c, 0x10, 0x78,
+  0x56, 0x78, 0x92, 0x1c, 0x36, 0x02, 0x06, 0x43, 0x8f, 0x1b, 0x38, 0x78,
+  0x08, 0x70, 0x7f, 0x1c, 0x49, 0x1c, 0x6d, 0x1e, 0xf9, 0xd1, 0xe1, 0xe7,
+  0x62, 0x6a, 0xe2, 0xbd, 0xb8, 0x68, 0x01, 0x23, 0x18, 0x42, 0xfb, 0xd0,
+  0x0e, 0x23, 0x18, 0x40, 0x70, 0x47, 0x00, 0xb5, 0x48, 0x46, 0x00, 0x02,
+  0x18, 0x43, 0x78, 0x60, 0xff, 0xf7, 0xf2, 0xff, 0x00, 0xbd, 0x00, 0x20,
+  0xeb, 0x68, 0x00, 0x2b, 0x03, 0xd0, 0xa3, 0x69, 0x00, 0x2b, 0x00, 0xd0,
+  0xef, 0xe7, 0x70, 0x47, 0x00, 0xb5, 0xe3, 0x69, 0xe8, 0x68, 0x00, 0x28,
+  0x03, 0xd0, 0x23, 0x6a, 0xa0, 0x69, 0x00, 0x28, 0x03, 0xd0, 0xff, 0xf7,
+  0xa7, 0xff, 0x00, 0x28, 0x06, 0xd0, 0x08, 0xb4, 0xff, 0xf7, 0xae, 0xff,
+  0x08, 0xbc, 0xff, 0xf7, 0xdc, 0xff, 0x00, 0xbd, 0x00, 0x20, 0x00, 0xbd,
+};
+
+static _Thread_local loader_t loader;
+static _Thread_local int loader_index;
+static _Thread_local bool loader_busy[LOADER_MAX_BUFFERS];
+
+static _Thread_local uint8_t *stage_data;
+static _Thread_local uint8_t *pack_data;
+static _Thread_local uint32_t stage_addr;
+static _Thread_local uint32_t stage_size;
+static _Thread_local uint32_t stage_nvm;
+static _Thread_local uint32_t stage_page;
+static _Thread_local bool stage_erase;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static void write_core_reg(int reg, uint32_t value)
+{
+  dap_queue_write_word(DCRDR, value);
+  dap_queue_write_word(DCRSR, DCRSR_REGWnR | reg);
+
+  check(dap_wait_word(DHCSR, DHCSR_S_REGRDY, DHCSR_S_REGRDY, LOADER_TIMEOUT),
+      "timeout while writing the core register %d", reg);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t desc_addr(int index)
+{
+  return loader.ram_addr + LOADER_DESC + index * D_SIZEOF;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t buf_addr(int index)
+{
+  return loader.ram_addr + LOADER_BUFFERS + index * loader.buf_size;
+}
+
+//-----------------------------------------------------------------------------
+static void check_status(void)
+{
+  uint32_t params = loader.ram_addr + LOADER_PARAMS;
+  uint32_t status, addr;
+
+  dap_queue_read_word(params + P_STATUS, &status);
+  dap_queue_read_word(params + P_ERROR_ADDR, &addr);
+  dap_queue_flush();
+
+  if (status)
+    error_exit("flash loader failed at 0x%08x (status = 0x%x)", addr, status);
+}
+
+//-----------------------------------------------------------------------------
+static void wait_idle(int index)
+{
+  if (!loader_busy[index])
+    return;
+
+  if (!dap_wait_word(desc_addr(index) + D_STATE, 0xffffffff, STATE_IDLE, LOADER_TIMEOUT))
+  {
+    check_status();
+    error_exit("timeout while waiting for the flash loader");
+  }
+
+  loader_busy[index] = false;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t pack_hash(uint8_t *data)
+{
+  uint32_t value = data[0] | (data[1] << 8) | (data[2] << 16);
+
+  return (value * 2654435761u) >> (32 - PACK_HASH_BITS);
+}
+
+//-----------------------------------------------------------------------------
+static bool pack_literals(uint8_t *src, uint32_t count, uint32_t *size, uint32_t limit)
+{
+  if (0 == count)
+    return true;
+
+  if (*size + 1 + count > limit)
+    return false;
+
+  pack_data[(*size)++] = count - 1;
+  memcpy(&pack_data[*size], src, count);
+  *size += count;
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Greedy LZ77 with a single entry hash table. Returns the packed size, or 0 if
+// the data does not get any smaller.
+static uint32_t pack(uint8_t *src, uint32_t size)
+{
+  int32_t head[PACK_HASH_SIZE];
+  uint32_t packed = 0;
+  uint32_t literals = 0;
+  uint32_t i = 0;
+
+  for (int j = 0; j < PACK_HASH_SIZE; j++)
+    head[j] = -1;
+
+  while (i < size)
+  {
+    uint32_t len = 0;
+    uint32_t dist = 0;
+
+    if (i + PACK_MIN_MATCH <= size)
+    {
+      uint32_t hash = pack_hash(&src[i]);
+      int32_t ref = head[hash];
+
+      head[hash] = i;
+
+      if (ref >= 0 && (i - ref) <= PACK_MAX_DISTANCE)
+      {
+        uint32_t max = size - i;
+
+        max = (max < PACK_MAX_MATCH) ? max : PACK_MAX_MATCH;
+
+        while (len < max && src[ref + len] == src[i + len])
+          len++;
+
+        dist = i - ref;
+      }
+    }
+
+    if (len < PACK_MIN_MATCH)
+    {
+      literals++;
+      i++;
+
+      if (PACK_MAX_LITERALS == literals)
+      {
+        if (!pack_literals(&src[i - literals], literals, &packed, size))
+          return 0;
+
+        literals = 0;
+      }
+
+      continue;
+    }
+
+    if (!pack_literals(&src[i - literals], literals, &packed, size) || packed + 3 > size)
+      return 0;
+
+    literals = 0;
+
+    pack_data[packed++] = 0x80 | (len - PACK_MIN_MATCH);
+    pack_data[packed++] = dist & 0xff;
+    pack_data[packed++] = dist >> 8;
+
+    for (uint32_t j = 1; j < len && i + j + PACK_MIN_MATCH <= size; j++)
+      head[pack_hash(&src[i + j])] = i + j;
+
+    i += len;
+  }
+
+  if (!pack_literals(&src[i - literals], literals, &packed, size) || packed >= size)
+    return 0;
+
+  return packed;
+}
+
+//-----------------------------------------------------------------------------
+static void submit(void)
+{
+  uint32_t desc = desc_addr(loader_index);
+  uint32_t packed = 0;
+
+  if (0 == stage_size)
+    return;
+
+  if (loader.compress)
+    packed = pack(stage_data, stage_size);
+
+  wait_idle(loader_index);
+
+  // The stub inflates the packed data, the write is padded to whole words
+  if (packed)
+    dap_write_block(buf_addr(loader_index), pack_data, (packed + 3) & ~3);
+  else
+    dap_write_block(buf_addr(loader_index), stage_data, stage_size);
+
+  // The state is written last, it hands the buffer over to the stub
+  dap_queue_write_word(desc + D_ADDR, stage_addr);
+  dap_queue_write_word(desc + D_SIZE, stage_size);
+  dap_queue_write_word(desc + D_PACKED, packed);
+  dap_queue_write_word(desc + D_FLAGS, stage_erase);
+  dap_queue_write_word(desc + D_NVM, stage_nvm);
+  dap_queue_write_word(desc + D_PAGE, stage_page);
+  dap_queue_write_word(desc + D_STATE, STATE_READY);
+
+  loader_busy[loader_index] = true;
+  loader_index = (loader_index + 1) % loader.buf_count;
+  stage_size = 0;
+}
+
+//-----------------------------------------------------------------------------
+void loader_start(loader_t *config)
+{
+  uint32_t params;
+  const uint8_t *code;
+  int code_size;
+
+  loader = *config;
+  loader_index = 0;
+  stage_size = 0;
+
+  check(loader.buf_count >= 2 && loader.buf_count <= LOADER_MAX_BUFFERS,
+      "internal error: invalid number of loader buffers");
+
+  if (LOADER_NVMCTRL == loader.type)
+  {
+    code = loader_nvmctrl;
+    code_size = sizeof(loader_nvmctrl);
+  }
+  else if (LOADER_NVMCTRL_V2 == loader.type)
+  {
+    code = loader_nvmctrl_v2;
+    code_size = sizeof(loader_nvmctrl_v2);
+  }
+  else
+  {
+    code = loader_eefc;
+    code_size = sizeof(loader_eefc);
+  }
+
+  check(!loader.compress || loader.buf_size <= PACK_MAX_DISTANCE,
+      "internal error: loader buffer is too large for compression");
+
+  stage_data = buf_alloc(loader.buf_size);
+  pack_data = buf_alloc(loader.buf_size + 4);
+
+  // The core is expected to be halted at this point
+  memcpy(stage_data, code, code_size);
+  dap_write_block(loader.ram_addr + LOADER_CODE, stage_data, (code_size + 3) & ~3);
+
+  params = loader.ram_addr + LOADER_PARAMS;
+  dap_queue_write_word(params + P_DESC, desc_addr(0));
+  dap_queue_write_word(params + P_COUNT, loader.buf_count);
+  dap_queue_write_word(params + P_PAGE_SIZE, loader.page_size);
+  dap_queue_write_word(params + P_ERASE_SIZE, loader.erase_size);
+  dap_queue_write_word(params + P_STATUS, 0);
+  dap_queue_write_word(params + P_ERROR_ADDR, 0);
+  dap_queue_write_word(params + P_INFLATE, buf_addr(loader.buf_count));
+
+  for (int i = 0; i < 3; i++)
+    dap_queue_write_word(params + P_ARG0 + i * 4, loader.arg[i]);
+
+  for (int i = 0; i < loader.buf_count; i++)
+  {
+    dap_queue_write_word(desc_addr(i) + D_STATE, STATE_IDLE);
+    dap_queue_write_word(desc_addr(i) + D_BUF, buf_addr(i));
+    loader_busy[i] = false;
+  }
+
+  write_core_reg(REG_R0, params);
+  write_core_reg(REG_SP, loader.ram_addr + LOADER_STACK);
+  write_core_reg(REG_PC, loader.ram_addr + LOADER_CODE);
+  write_core_reg(REG_XPSR, XPSR_T);
+
+  dap_write_word(DHCSR, DHCSR_KEY | DHCSR_C_DEBUGEN);
+}
+
+//-----------------------------------------------------------------------------
+void loader_write(uint32_t addr, uint8_t *data, uint32_t size, uint32_t nvm,
+    uint32_t page, bool erase)
+{
+  while (size)
+  {
+    uint32_t sz;
+
+    // Contiguous writes with the same attributes share a buffer
+    if (stage_size && (stage_addr + stage_size != addr || stage_nvm != nvm ||
+        stage_erase != erase || stage_page + stage_size / loader.page_size != page ||
+        stage_size == loader.buf_size))
+      submit();
+
+    if (0 == stage_size)
+    {
+      stage_addr = addr;
+      stage_nvm = nvm;
+      stage_page = page;
+      stage_erase = erase;
+    }
+
+    sz = loader.buf_size - stage_size;
+    sz = (size < sz) ? size : sz;
+
+    memcpy(&stage_data[stage_size], data, sz);
+    stage_size += sz;
+
+    addr += sz;
+    data += sz;
+    page += sz / loader.page_size;
+    size -= sz;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void loader_finish(void)
+{
+  submit();
+
+  for (int i = 0; i < loader.buf_count; i++)
+    wait_idle((loader_index + i) % loader.buf_count);
+
+  dap_write_word(desc_addr(loader_index) + D_STATE, STATE_EXIT);
+
+  check(dap_wait_word(DHCSR, DHCSR_S_HALT, DHCSR_S_HALT, LOADER_TIMEOUT),
+      "timeout while waiting for the flash loader to stop");
+
+  check_status();
+
+  buf_free(stage_data);
+  buf_free(pack_data);
+}
@@ -0,0 +1,71 @@
+@ Flash loader for the EEFC (SAM3, SAM4, SAM G and SAM E7x/S7x/V7x series)
+@
+@ P_ARG0 - erase command (with the page count argument), 0 if not supported
+@ P_ARG1 - write command
+@ P_ARG2 - write command used when the page must be erased (EWP or WP)
+
+  .include "loader.inc"
+
+  .equ EEFC_FCR,        0x04
+  .equ EEFC_FSR,        0x08
+
+@ Waits for FSR.FRDY, returns FSR error bits
+wait:
+  ldr   r0, [r7, #EEFC_FSR]
+  movs  r3, #1
+  tst   r0, r3
+  beq   wait
+  movs  r3, #0x0e
+  ands  r0, r3
+  bx    lr
+
+@ Sends a command in r3 with the current page number as an argument
+command:
+  push  {lr}
+  mov   r0, r9
+  lsls  r0, r0, #8
+  orrs  r0, r3
+  str   r0, [r7, #EEFC_FCR]
+  bl    wait
+  pop   {pc}
+
+@ Erases the group of pages if requested and supported
+erase:
+  movs  r0, #0
+  ldr   r3, [r5, #D_FLAGS]
+  cmp   r3, #0
+  beq   1f
+  ldr   r3, [r4, #P_ARG0]
+  cmp   r3, #0
+  beq   1f
+  b     command
+1:
+  bx    lr
+
+@ Fills the latch buffer and writes the page. Blank pages are skipped unless
+@ they still have to be erased by the write command itself.
+write:
+  push  {lr}
+  ldr   r3, [r4, #P_ARG1]
+  ldr   r0, [r5, #D_FLAGS]
+  cmp   r0, #0
+  beq   1f
+  ldr   r3, [r4, #P_ARG2]
+  ldr   r0, [r4, #P_ARG0]
+  cmp   r0, #0
+  beq   2f
+1:
+  bl    blank
+  cmp   r0, #0
+  beq   3f
+2:
+  push  {r3}
+  bl    copy
+  pop   {r3}
+  bl    command
+  pop   {pc}
+3:
+  movs  r0, #0
+  pop   {pc}
+
+  .ltorg
@@ -0,0 +1,49 @@
+@ Flash loader for the NVMCTRL (SAM C/D/R series)
+
+  .include "loader.inc"
+
+  .equ NVMCTRL_CTRLA,   0x00
+  .equ NVMCTRL_INTFLAG, 0x14
+  .equ NVMCTRL_ADDR,    0x1c
+
+@ Waits for INTFLAG.READY, returns INTFLAG.ERROR
+wait:
+  ldr   r0, [r7, #NVMCTRL_INTFLAG]
+  movs  r3, #1
+  tst   r0, r3
+  beq   wait
+  movs  r3, #2
+  ands  r0, r3
+  bx    lr
+
+@ Unlocks the region and erases the row unless the flash is already erased
+erase:
+  push  {lr}
+  lsrs  r0, r1, #1
+  str   r0, [r7, #NVMCTRL_ADDR]
+  ldr   r0, =0xa541
+  str   r0, [r7, #NVMCTRL_CTRLA]
+  bl    wait
+  cmp   r0, #0
+  bne   1f
+  ldr   r0, [r5, #D_FLAGS]
+  cmp   r0, #0
+  beq   1f
+  ldr   r0, =0xa502
+  str   r0, [r7, #NVMCTRL_CTRLA]
+  bl    wait
+1:
+  pop   {pc}
+
+@ Blank pages are skipped, others are written automatically after the copy
+write:
+  push  {lr}
+  bl    blank
+  cmp   r0, #0
+  beq   1f
+  bl    copy
+  bl    wait
+1:
+  pop   {pc}
+
+  .ltorg
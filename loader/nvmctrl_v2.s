@@ -0,0 +1,55 @@
+@ Flash loader for the NVMCTRL v2 (SAM D5x/E5x series)
+
+  .include "loader.inc"
+
+  .equ NVMCTRL_CTRLB,   0x04
+  .equ NVMCTRL_INTFLAG, 0x10
+  .equ NVMCTRL_ADDR,    0x14
+
+@ Waits for STATUS.READY, returns INTFLAG error bits
+wait:
+  ldr   r0, [r7, #NVMCTRL_INTFLAG]
+  lsrs  r3, r0, #17
+  bcc   wait
+  movs  r3, #0x4e
+  ands  r0, r3
+  bx    lr
+
+@ Unlocks the region and erases the block unless the flash is already erased
+erase:
+  push  {lr}
+  str   r1, [r7, #NVMCTRL_ADDR]
+  ldr   r0, =0xa512
+  str   r0, [r7, #NVMCTRL_CTRLB]
+  bl    wait
+  cmp   r0, #0
+  bne   1f
+  ldr   r0, [r5, #D_FLAGS]
+  cmp   r0, #0
+  beq   1f
+  ldr   r0, =0xa501
+  str   r0, [r7, #NVMCTRL_CTRLB]
+  bl    wait
+1:
+  pop   {pc}
+
+@ Clears the page buffer, fills it and writes the page, blank pages are skipped
+write:
+  push  {lr}
+  bl    blank
+  cmp   r0, #0
+  beq   1f
+  str   r1, [r7, #NVMCTRL_ADDR]
+  ldr   r0, =0xa515
+  str   r0, [r7, #NVMCTRL_CTRLB]
+  bl    wait
+  cmp   r0, #0
+  bne   1f
+  bl    copy
+  ldr   r0, =0xa503
+  str   r0, [r7, #NVMCTRL_CTRLB]
+  bl    wait
+1:
+  pop   {pc}
+
+  .ltorg
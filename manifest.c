@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "edbg.h"
+#include "target.h"
+#include "manifest.h"
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t     crc;
+  bool         valid;
+  bool         confirmed;
+} manifest_unit_t;
+
+/*- Variables ---------------------------------------------------------------*/
+static pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local char *manifest_name = NULL;
+static _Thread_local char *manifest_serial = NULL;
+static _Thread_local uint32_t manifest_chip_id;
+static _Thread_local uint32_t manifest_flash_addr;
+static _Thread_local uint32_t manifest_unit_size;
+static _Thread_local int manifest_n_units = 0;
+static _Thread_local manifest_unit_t *manifest_units = NULL;
+static _Thread_local bool manifest_changed = false;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static manifest_unit_t *manifest_get_unit(uint32_t addr)
+{
+  uint32_t index;
+
+  if (NULL == manifest_units || addr < manifest_flash_addr)
+    return NULL;
+
+  index = (addr - manifest_flash_addr) / manifest_unit_size;
+
+  if (index >= (uint32_t)manifest_n_units)
+    return NULL;
+
+  return &manifest_units[index];
+}
+
+//-----------------------------------------------------------------------------
+static bool manifest_is_cached(uint32_t addr, uint8_t *data)
+{
+  manifest_unit_t *unit = manifest_get_unit(addr);
+
+  return unit && unit->valid &&
+      unit->crc == target_crc32(0xffffffff, data, manifest_unit_size);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t manifest_align(uint32_t size)
+{
+  // Segment data is padded with 0xff up to the erase unit boundary
+  return (size + manifest_unit_size - 1) / manifest_unit_size * manifest_unit_size;
+}
+
+//-----------------------------------------------------------------------------
+void manifest_open(char *name, char *serial)
+{
+  manifest_name = name;
+  manifest_serial = serial;
+}
+
+//-----------------------------------------------------------------------------
+void manifest_select(uint32_t chip_id, uint32_t flash_addr, uint32_t flash_size, uint32_t unit)
+{
+  char line[256], serial[128];
+  uint32_t chip, addr, crc;
+  FILE *file;
+
+  if (NULL == manifest_name)
+    return;
+
+  if (manifest_units)
+    buf_free(manifest_units);
+
+  manifest_chip_id = chip_id;
+  manifest_flash_addr = flash_addr;
+  manifest_unit_size = unit;
+  manifest_n_units = flash_size / unit;
+  manifest_units = buf_alloc(manifest_n_units * sizeof(manifest_unit_t));
+  memset(manifest_units, 0, manifest_n_units * sizeof(manifest_unit_t));
+  manifest_changed = false;
+
+  pthread_mutex_lock(&manifest_lock);
+
+  if (NULL != (file = fopen(manifest_name, "r")))
+  {
+    while (fgets(line, sizeof(line), file))
+    {
+      manifest_unit_t *entry;
+
+      if (4 != sscanf(line, "%127s %x %x %x", serial, &chip, &addr, &crc) ||
+          0 != strcmp(serial, manifest_serial) || chip != chip_id)
+        continue;
+
+      if (0 != ((addr - flash_addr) % unit) || NULL == (entry = manifest_get_unit(addr)))
+        continue;
+
+      entry->crc = crc;
+      entry->valid = true;
+    }
+
+    fclose(file);
+  }
+
+  pthread_mutex_unlock(&manifest_lock);
+}
+
+//-----------------------------------------------------------------------------
+void manifest_check(uint32_t addr, uint8_t *data, uint32_t size, manifest_check_t check)
+{
+  uint32_t end, start, offs;
+
+  if (NULL == manifest_units)
+    return;
+
+  end = addr + manifest_align(size);
+  start = addr;
+
+  // Units listed with the same contents are confirmed in runs, one check per run
+  while (start < end)
+  {
+    for (offs = start; offs < end; offs += manifest_unit_size)
+    {
+      if (!manifest_is_cached(offs, &data[offs - addr]))
+        break;
+    }
+
+    if (offs > start && check(start, &data[start - addr], offs - start))
+    {
+      for (uint32_t a = start; a < offs; a += manifest_unit_size)
+        manifest_get_unit(a)->confirmed = true;
+    }
+
+    start = (offs > start) ? offs : (start + manifest_unit_size);
+  }
+}
+
+//-----------------------------------------------------------------------------
+bool manifest_skip(uint32_t addr)
+{
+  manifest_unit_t *unit = manifest_get_unit(addr);
+
+  return unit && unit->confirmed;
+}
+
+//-----------------------------------------------------------------------------
+void manifest_update(uint32_t addr, uint8_t *data, uint32_t size)
+{
+  uint32_t end;
+
+  if (NULL == manifest_units)
+    return;
+
+  end = addr + manifest_align(size);
+
+  for (uint32_t offs = addr; offs < end; offs += manifest_unit_size)
+  {
+    manifest_unit_t *unit = manifest_get_unit(offs);
+
+    unit->crc = target_crc32(0xffffffff, &data[offs - addr], manifest_unit_size);
+    unit->valid = true;
+  }
+
+  manifest_changed = true;
+}
+
+//-----------------------------------------------------------------------------
+void manifest_erase(void)
+{
+  if (NULL == manifest_units)
+    return;
+
+  memset(manifest_units, 0, manifest_n_units * sizeof(manifest_unit_t));
+  manifest_changed = true;
+}
+
+//-----------------------------------------------------------------------------
+void manifest_close(void)
+{
+  char line[256], serial[128];
+  uint32_t chip;
+  char *data = NULL;
+  int size = 0;
+  FILE *file;
+
+  if (NULL == manifest_units)
+    return;
+
+  if (!manifest_changed)
+  {
+    buf_free(manifest_units);
+    manifest_units = NULL;
+    return;
+  }
+
+  pthread_mutex_lock(&manifest_lock);
+
+  // Keep the entries for other debuggers and devices
+  if (NULL != (file = fopen(manifest_name, "r")))
+  {
+    while (fgets(line, sizeof(line), file))
+    {
+      int len = strlen(line);
+
+      if (2 == sscanf(line, "%127s %x", serial, &chip) &&
+          0 == strcmp(serial, manifest_serial) && chip == manifest_chip_id)
+        continue;
+
+      data = buf_realloc(data, size + len);
+      memcpy(&data[size], line, len);
+      size += len;
+    }
+
+    fclose(file);
+  }
+
+  if (NULL != (file = fopen(manifest_name, "w")))
+  {
+    fwrite(data, 1, size, file);
+
+    for (int i = 0; i < manifest_n_units; i++)
+    {
+      if (manifest_units[i].valid)
+      {
+        fprintf(file, "%s 0x%08x 0x%08x 0x%08x\n", manifest_serial, manifest_chip_id,
+            manifest_flash_addr + i * manifest_unit_size, manifest_units[i].crc);
+      }
+    }
+
+    fclose(file);
+  }
+  else
+  {
+    warning("unable to update the manifest file '%s'", manifest_name);
+  }
+
+  free(data);
+
+  pthread_mutex_unlock(&manifest_lock);
+
+  buf_free(manifest_units);
+  manifest_units = NULL;
+}
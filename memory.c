@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "edbg.h"
+#include "dap.h"
+#include "memory.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define MEMORY_BLOCK_SIZE      (64 * 1024)
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static uint32_t memory_block_size(uint32_t size)
+{
+  return (size < MEMORY_BLOCK_SIZE) ? size : MEMORY_BLOCK_SIZE;
+}
+
+//-----------------------------------------------------------------------------
+void memory_read(uint32_t addr, uint32_t size, char *name)
+{
+  uint8_t *buf = buf_alloc(MEMORY_BLOCK_SIZE);
+
+  check(size > 0, "memory read size is not specified");
+  check((addr + size - 1) >= addr, "memory read range is outside of the address space");
+
+  stream_open(name);
+
+  while (size)
+  {
+    uint32_t block = memory_block_size(size);
+
+    dap_read_block(addr, buf, block);
+    stream_write(buf, block);
+
+    addr += block;
+    size -= block;
+
+    verbose(".");
+  }
+
+  stream_close();
+
+  buf_free(buf);
+}
+
+//-----------------------------------------------------------------------------
+void memory_write(uint32_t addr, char *name)
+{
+  uint8_t *buf = buf_alloc(MEMORY_BLOCK_SIZE);
+  FILE *file;
+  size_t block;
+
+  check(NULL != name, "input file name is not specified");
+
+  if (NULL == (file = fopen(name, "rb")))
+    perror_exit("fopen()");
+
+  // The file is written as it is read, its size is not limited by the host memory
+  while (0 < (block = fread(buf, 1, MEMORY_BLOCK_SIZE, file)))
+  {
+    check((addr + block - 1) >= addr, "memory write range is outside of the address space");
+
+    dap_write_block(addr, buf, block);
+    addr += block;
+
+    verbose(".");
+  }
+
+  if (ferror(file))
+    perror_exit("fread()");
+
+  fclose(file);
+
+  buf_free(buf);
+}
+
+//-----------------------------------------------------------------------------
+void memory_fill(uint32_t addr, uint32_t size, uint32_t value)
+{
+  uint8_t *buf = buf_alloc(MEMORY_BLOCK_SIZE);
+
+  check(size > 0, "memory fill size is not specified");
+  check((addr + size - 1) >= addr, "memory fill range is outside of the address space");
+
+  // The pattern starts at the first byte of the range, whatever its alignment
+  for (int i = 0; i < MEMORY_BLOCK_SIZE; i++)
+    buf[i] = value >> ((i % 4) * 8);
+
+  while (size)
+  {
+    uint32_t block = memory_block_size(size);
+
+    dap_write_block(addr, buf, block);
+
+    addr += block;
+    size -= block;
+
+    verbose(".");
+  }
+
+  buf_free(buf);
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "edbg.h"
+#include "dap.h"
+#include "rtt.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define RTT_ID_SIZE            16
+#define RTT_SEARCH_BLOCK       1024
+#define RTT_MAX_BUFFERS        32
+#define RTT_QUEUE_SIZE         32 // Fills up to this size are read with the offsets
+
+// Control block
+#define RTT_MAX_UP_BUFFERS     0x10
+#define RTT_UP_BUFFERS         0x18
+
+// Buffer descriptor
+#define RTT_BUF_BUFFER         0x04
+#define RTT_BUF_SIZE           0x08
+#define RTT_BUF_WR_OFF         0x0c
+#define RTT_BUF_RD_OFF         0x10
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t     addr;
+  uint8_t      *data;
+  int          size;
+} rtt_block_t;
+
+/*- Variables ---------------------------------------------------------------*/
+static const char rtt_id[RTT_ID_SIZE] = "SEGGER RTT";
+
+static _Thread_local uint32_t rtt_desc;
+static _Thread_local uint32_t rtt_buffer;
+static _Thread_local uint32_t rtt_size;
+static _Thread_local uint32_t rtt_wr_off;
+static _Thread_local uint32_t rtt_rd_off;
+static _Thread_local bool rtt_aligned;
+static _Thread_local uint8_t *rtt_data = NULL;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static void rtt_read_block(void *arg)
+{
+  rtt_block_t *block = (rtt_block_t *)arg;
+
+  dap_read_block(block->addr, block->data, block->size);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t rtt_search(uint32_t addr, uint32_t size)
+{
+  uint8_t data[RTT_ID_SIZE + RTT_SEARCH_BLOCK];
+  char error[256];
+  rtt_block_t block;
+  int kept = 0;
+
+  for (uint32_t offs = 0; offs < size; offs += RTT_SEARCH_BLOCK)
+  {
+    int count;
+
+    block.addr = addr + offs;
+    block.data = &data[kept];
+    block.size = ((size - offs) < RTT_SEARCH_BLOCK) ? (size - offs) : RTT_SEARCH_BLOCK;
+
+    // The search ends at the first address that does not respond
+    if (!error_trap(rtt_read_block, &block, error, sizeof(error)))
+    {
+      verbose("RTT search stopped at 0x%08x: %s\n", block.addr, error);
+      dap_discard();
+      reconnect_debugger();
+      break;
+    }
+
+    count = kept + block.size;
+
+    // The control block is word aligned
+    for (int i = 0; i <= count - RTT_ID_SIZE; i += 4)
+    {
+      if (0 == memcmp(&data[i], rtt_id, RTT_ID_SIZE))
+        return block.addr - kept + i;
+    }
+
+    kept = (count < (RTT_ID_SIZE - 4)) ? count : (RTT_ID_SIZE - 4);
+    memmove(data, &data[count - kept], kept);
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+void rtt_open(uint32_t addr, uint32_t size)
+{
+  uint32_t cb, max_up;
+
+  check(0 == (addr & 3), "RTT search address must be word aligned");
+
+  cb = rtt_search(addr, size);
+
+  if (0 == cb)
+    error_exit("RTT control block is not found in 0x%08x - 0x%08x", addr, addr + size - 1);
+
+  rtt_desc = cb + RTT_UP_BUFFERS;
+
+  dap_queue_read_word(cb + RTT_MAX_UP_BUFFERS, &max_up);
+  dap_queue_read_word(rtt_desc + RTT_BUF_BUFFER, &rtt_buffer);
+  dap_queue_read_word(rtt_desc + RTT_BUF_SIZE, &rtt_size);
+  dap_queue_read_word(rtt_desc + RTT_BUF_WR_OFF, &rtt_wr_off);
+  dap_queue_read_word(rtt_desc + RTT_BUF_RD_OFF, &rtt_rd_off);
+  dap_queue_flush();
+
+  check(0 < max_up && max_up <= RTT_MAX_BUFFERS, "invalid RTT control block at 0x%08x", cb);
+  check(rtt_buffer && rtt_size && rtt_wr_off < rtt_size && rtt_rd_off < rtt_size,
+      "RTT up-buffer 0 is not configured");
+
+  // Short fills are read as words, which must not go past the end of the buffer
+  rtt_aligned = (0 == (rtt_buffer & 3)) && (0 == (rtt_size & 3));
+
+  rtt_data = buf_alloc(rtt_size);
+
+  verbose("RTT control block at 0x%08x, up-buffer 0 at 0x%08x (%u bytes)\n",
+      cb, rtt_buffer, rtt_size);
+}
+
+//-----------------------------------------------------------------------------
+static int rtt_queue_read(uint32_t offs, uint32_t size, uint32_t *words)
+{
+  uint32_t first = offs & ~3;
+  int count = (offs + size - first + 3) / 4;
+
+  for (int i = 0; i < count; i++)
+    dap_queue_read_word(rtt_buffer + first + i * 4, &words[i]);
+
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+int rtt_read(void)
+{
+  uint32_t words[RTT_QUEUE_SIZE / 4 + 4];
+  uint32_t offs[2], size[2];
+  int parts = 0, total = 0, count = 0;
+  bool queued;
+
+  // Only the filled part of the buffer is read, in two parts when it wraps around
+  if (rtt_wr_off < rtt_rd_off)
+  {
+    offs[parts] = rtt_rd_off;
+    size[parts++] = rtt_size - rtt_rd_off;
+
+    if (rtt_wr_off)
+    {
+      offs[parts] = 0;
+      size[parts++] = rtt_wr_off;
+    }
+  }
+  else if (rtt_wr_off > rtt_rd_off)
+  {
+    offs[parts] = rtt_rd_off;
+    size[parts++] = rtt_wr_off - rtt_rd_off;
+  }
+
+  for (int i = 0; i < parts; i++)
+    total += size[i];
+
+  // Short fills go into the same command that releases them and polls the write offset
+  queued = rtt_aligned && total <= RTT_QUEUE_SIZE;
+
+  for (int i = 0, n = 0; i < parts; i++)
+  {
+    if (queued)
+      count += rtt_queue_read(offs[i], size[i], &words[count]);
+    else
+      dap_read_block(rtt_buffer + offs[i], &rtt_data[n], size[i]);
+
+    n += size[i];
+  }
+
+  rtt_rd_off = rtt_wr_off;
+
+  if (total)
+    dap_queue_write_word(rtt_desc + RTT_BUF_RD_OFF, rtt_rd_off);
+
+  dap_queue_read_word(rtt_desc + RTT_BUF_WR_OFF, &rtt_wr_off);
+  dap_queue_flush();
+
+  check(rtt_wr_off < rtt_size, "invalid RTT write offset 0x%08x", rtt_wr_off);
+
+  if (queued)
+  {
+    for (int i = 0, n = 0, base = 0; i < parts; i++)
+    {
+      int first = offs[i] & 3;
+
+      for (uint32_t j = 0; j < size[i]; j++)
+        rtt_data[n++] = words[base + (first + j) / 4] >> (((first + j) % 4) * 8);
+
+      base += (first + size[i] + 3) / 4;
+    }
+  }
+
+  if (total)
+    stream_write(rtt_data, total);
+
+  return total;
+}
+
+//-----------------------------------------------------------------------------
+void rtt_close(void)
+{
+  buf_free(rtt_data);
+  rtt_data = NULL;
+}
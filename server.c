@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include "edbg.h"
+#include "server.h"
+
+/*- Variables ---------------------------------------------------------------*/
+static int server_fd = -1;
+static char *server_path = NULL;
+
+/*- Implementations ---------------------------------------------------------*/
+
+#ifdef _WIN32
+
+//-----------------------------------------------------------------------------
+void server_open(char *path)
+{
+  (void)path;
+  error_exit("server mode is not supported on this platform");
+}
+
+//-----------------------------------------------------------------------------
+bool server_accept(FILE **in, FILE **out)
+{
+  (void)in;
+  (void)out;
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+void server_close(void)
+{
+}
+
+#else
+
+//-----------------------------------------------------------------------------
+void server_open(char *path)
+{
+  struct sockaddr_un addr;
+
+  check(strlen(path) < sizeof(addr.sun_path), "socket path is too long");
+
+  // A client closing the connection early must not terminate the server
+  signal(SIGPIPE, SIG_IGN);
+
+  server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (server_fd < 0)
+    perror_exit("unable to create a socket");
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  // A socket left over from a previous run would make bind() fail
+  unlink(path);
+
+  if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    perror_exit("unable to bind the socket");
+
+  if (listen(server_fd, 1) < 0)
+    perror_exit("unable to listen on the socket");
+
+  server_path = path;
+}
+
+//-----------------------------------------------------------------------------
+bool server_accept(FILE **in, FILE **out)
+{
+  int fd = accept(server_fd, NULL, NULL);
+
+  if (fd < 0)
+    return false;
+
+  *in = fdopen(fd, "r");
+  *out = fdopen(dup(fd), "w");
+
+  check(*in && *out, "unable to open the client connection");
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+void server_close(void)
+{
+  if (server_fd < 0)
+    return;
+
+  close(server_fd);
+  unlink(server_path);
+
+  server_fd = -1;
+}
+
+#endif
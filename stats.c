@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "edbg.h"
+#include "stats.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define STATS_BUCKETS          10
+#define STATS_IN_FLIGHT        16
+#define STATS_REPORT_SIZE      4096
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  uint64_t     time;
+  uint32_t     transactions;
+  uint64_t     tx_bytes;
+  uint64_t     tx_padded;
+  uint64_t     rx_bytes;
+  uint64_t     data_bytes;
+} stats_counters_t;
+
+/*- Variables ---------------------------------------------------------------*/
+static const char *stats_phase_names[STATS_PHASES] =
+{
+  "enumerate", "connect", "select", "erase", "program", "verify", "lock", "read", "fuse",
+};
+
+// Upper limits of the latency histogram buckets in microseconds, the last one is open
+static const uint32_t stats_bucket_limits[STATS_BUCKETS - 1] =
+{
+  125, 250, 500, 1000, 2000, 4000, 8000, 16000, 32000,
+};
+
+static bool stats_enabled = false;
+
+static _Thread_local stats_counters_t stats_total;
+static _Thread_local stats_counters_t stats_phases[STATS_PHASES];
+static _Thread_local stats_counters_t stats_phase_begin;
+static _Thread_local int stats_phase = -1;
+static _Thread_local uint64_t stats_phase_time;
+static _Thread_local uint32_t stats_latency[STATS_BUCKETS];
+static _Thread_local uint64_t stats_latency_sum;
+static _Thread_local uint64_t stats_sent[STATS_IN_FLIGHT];
+static _Thread_local int stats_sent_head;
+static _Thread_local int stats_sent_count;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+void stats_enable(void)
+{
+  stats_enabled = true;
+}
+
+//-----------------------------------------------------------------------------
+void stats_reset(void)
+{
+  memset(&stats_total, 0, sizeof(stats_total));
+  memset(stats_phases, 0, sizeof(stats_phases));
+  memset(stats_latency, 0, sizeof(stats_latency));
+  stats_latency_sum = 0;
+  stats_phase = -1;
+  stats_sent_head = 0;
+  stats_sent_count = 0;
+}
+
+//-----------------------------------------------------------------------------
+void stats_phase_start(int phase)
+{
+  if (!stats_enabled)
+    return;
+
+  stats_phase_end();
+
+  stats_phase = phase;
+  stats_phase_begin = stats_total;
+  stats_phase_time = get_time_us();
+}
+
+//-----------------------------------------------------------------------------
+void stats_phase_end(void)
+{
+  stats_counters_t *counters;
+
+  if (!stats_enabled || stats_phase < 0)
+    return;
+
+  counters = &stats_phases[stats_phase];
+  counters->time += get_time_us() - stats_phase_time;
+  counters->transactions += stats_total.transactions - stats_phase_begin.transactions;
+  counters->tx_bytes += stats_total.tx_bytes - stats_phase_begin.tx_bytes;
+  counters->tx_padded += stats_total.tx_padded - stats_phase_begin.tx_padded;
+  counters->rx_bytes += stats_total.rx_bytes - stats_phase_begin.rx_bytes;
+  counters->data_bytes += stats_total.data_bytes - stats_phase_begin.data_bytes;
+
+  stats_phase = -1;
+}
+
+//-----------------------------------------------------------------------------
+void stats_send(int size, int report_size)
+{
+  if (!stats_enabled)
+    return;
+
+  stats_total.transactions++;
+  stats_total.tx_bytes += size;
+  stats_total.tx_padded += (report_size > size) ? report_size : size;
+
+  // Responses come back in order, so send times are kept in a FIFO
+  if (stats_sent_count < STATS_IN_FLIGHT)
+  {
+    stats_sent[(stats_sent_head + stats_sent_count) % STATS_IN_FLIGHT] = get_time_us();
+    stats_sent_count++;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void stats_recv(int size)
+{
+  uint64_t latency;
+  int bucket = 0;
+
+  if (!stats_enabled)
+    return;
+
+  stats_total.rx_bytes += size;
+
+  if (0 == stats_sent_count)
+    return;
+
+  latency = get_time_us() - stats_sent[stats_sent_head];
+  stats_sent_head = (stats_sent_head + 1) % STATS_IN_FLIGHT;
+  stats_sent_count--;
+
+  while (bucket < (STATS_BUCKETS - 1) && latency >= stats_bucket_limits[bucket])
+    bucket++;
+
+  stats_latency[bucket]++;
+  stats_latency_sum += latency;
+}
+
+//-----------------------------------------------------------------------------
+void stats_data(int size)
+{
+  if (!stats_enabled)
+    return;
+
+  stats_total.data_bytes += size;
+}
+
+//-----------------------------------------------------------------------------
+static double stats_rate(stats_counters_t *counters)
+{
+  if (0 == counters->time)
+    return 0.0;
+
+  return (counters->data_bytes / 1024.0) / (counters->time / 1000000.0);
+}
+
+//-----------------------------------------------------------------------------
+static int report_text(char *buf, int size, char *serial)
+{
+  uint32_t count = 0;
+  int len = 0;
+
+  if (serial)
+    len += snprintf(&buf[len], size - len, "Statistics for %s:\n", serial);
+  else
+    len += snprintf(&buf[len], size - len, "Statistics:\n");
+
+  len += snprintf(&buf[len], size - len,
+      "  %-10s %10s %8s %10s %10s %10s\n", "phase", "time, ms", "packets",
+      "USB bytes", "data bytes", "KB/s");
+
+  for (int i = 0; i < STATS_PHASES; i++)
+  {
+    stats_counters_t *c = &stats_phases[i];
+
+    if (0 == c->time && 0 == c->transactions)
+      continue;
+
+    len += snprintf(&buf[len], size - len,
+        "  %-10s %10.1f %8u %10llu %10llu %10.1f\n", stats_phase_names[i],
+        c->time / 1000.0, c->transactions, (unsigned long long)(c->tx_padded + c->rx_bytes),
+        (unsigned long long)c->data_bytes, stats_rate(c));
+  }
+
+  len += snprintf(&buf[len], size - len,
+      "  USB: %u transactions, sent %llu bytes in %llu bytes of reports (%.0f%% used), "
+      "received %llu bytes\n", stats_total.transactions,
+      (unsigned long long)stats_total.tx_bytes, (unsigned long long)stats_total.tx_padded,
+      stats_total.tx_padded ? (100.0 * stats_total.tx_bytes / stats_total.tx_padded) : 0.0,
+      (unsigned long long)stats_total.rx_bytes);
+
+  for (int i = 0; i < STATS_BUCKETS; i++)
+    count += stats_latency[i];
+
+  len += snprintf(&buf[len], size - len, "  Round trip latency (average %.0f us):\n",
+      count ? ((double)stats_latency_sum / count) : 0.0);
+
+  for (int i = 0; i < STATS_BUCKETS; i++)
+  {
+    if (0 == stats_latency[i])
+      continue;
+
+    if (i < (STATS_BUCKETS - 1))
+      len += snprintf(&buf[len], size - len, "    < %5u us: %u\n", stats_bucket_limits[i], stats_latency[i]);
+    else
+      len += snprintf(&buf[len], size - len, "   >= %5u us: %u\n", stats_bucket_limits[i - 1], stats_latency[i]);
+  }
+
+  return len;
+}
+
+//-----------------------------------------------------------------------------
+static int report_json(char *buf, int size, char *serial)
+{
+  int len = 0;
+  bool first = true;
+
+  len += snprintf(&buf[len], size - len, "{\"serial\":\"%s\",\"phases\":{", serial ? serial : "");
+
+  for (int i = 0; i < STATS_PHASES; i++)
+  {
+    stats_counters_t *c = &stats_phases[i];
+
+    if (0 == c->time && 0 == c->transactions)
+      continue;
+
+    len += snprintf(&buf[len], size - len,
+        "%s\"%s\":{\"time_us\":%llu,\"transactions\":%u,\"tx_bytes\":%llu,"
+        "\"tx_report_bytes\":%llu,\"rx_bytes\":%llu,\"data_bytes\":%llu,\"kbps\":%.1f}",
+        first ? "" : ",", stats_phase_names[i], (unsigned long long)c->time, c->transactions,
+        (unsigned long long)c->tx_bytes, (unsigned long long)c->tx_padded,
+        (unsigned long long)c->rx_bytes, (unsigned long long)c->data_bytes, stats_rate(c));
+
+    first = false;
+  }
+
+  len += snprintf(&buf[len], size - len,
+      "},\"usb\":{\"transactions\":%u,\"tx_bytes\":%llu,\"tx_report_bytes\":%llu,"
+      "\"rx_bytes\":%llu,\"latency_sum_us\":%llu,\"latency_us\":[",
+      stats_total.transactions, (unsigned long long)stats_total.tx_bytes,
+      (unsigned long long)stats_total.tx_padded, (unsigned long long)stats_total.rx_bytes,
+      (unsigned long long)stats_latency_sum);
+
+  for (int i = 0; i < STATS_BUCKETS; i++)
+  {
+    if (i < (STATS_BUCKETS - 1))
+      len += snprintf(&buf[len], size - len, "%s{\"lt\":%u,\"count\":%u}", i ? "," : "",
+          stats_bucket_limits[i], stats_latency[i]);
+    else
+      len += snprintf(&buf[len], size - len, ",{\"lt\":null,\"count\":%u}", stats_latency[i]);
+  }
+
+  len += snprintf(&buf[len], size - len, "]}}\n");
+
+  return len;
+}
+
+//-----------------------------------------------------------------------------
+void stats_report(char *serial, bool json)
+{
+  char buf[STATS_REPORT_SIZE];
+
+  if (!stats_enabled)
+    return;
+
+  stats_phase_end();
+
+  // The report is printed at once, so reports from several threads do not mix
+  if (json)
+    report_json(buf, sizeof(buf), serial);
+  else
+    report_text(buf, sizeof(buf), serial);
+
+  message("%s", buf);
+}
+
@@ -27,14 +27,53 @@
  */
 
 /*- Includes ----------------------------------------------------------------*/
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "image.h"
+#include "manifest.h"
 
 /*- Definitions -------------------------------------------------------------*/
+#define MAX_PLANES     4
+#define VERIFY_SIZE    (16 * 1024) // Largest block read for the verification
+
+#define MAX_TARGET_IDS 256
+#define MAX_ID_REGS    8
+
+#define SCB_CPUID      0xe000ed00
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t     addr;
+  uint32_t     size;
+} flash_range_t;
+
+typedef struct
+{
+  target_id_t  id;
+  target_t     *target;
+} target_index_t;
+
+typedef struct
+{
+  int          count;
+  uint32_t     addr[MAX_ID_REGS];
+  uint32_t     value[MAX_ID_REGS];
+} target_regs_t;
+
+typedef struct
+{
+  bool          all;
+  int           count;
+  uint32_t      bytes;
+  flash_range_t *ranges;
+} flash_mismatch_t;
 
 /*- Variables ---------------------------------------------------------------*/
 extern target_ops_t target_atmel_cm0p_ops;
@@ -43,16 +82,26 @@ extern target_ops_t target_atmel_cm4_ops;
 extern target_ops_t target_atmel_cm7_ops;
 extern target_ops_t target_atmel_cm4v2_ops;
 extern target_ops_t target_mchp_cm23_ops;
+extern target_ops_t target_auto_ops;
+
+static _Thread_local target_flash_t *flash_current;
+static _Thread_local flash_mismatch_t flash_mismatch;
+static _Thread_local target_t *target_detected;
+
+static pthread_once_t target_index_once = PTHREAD_ONCE_INIT;
+static target_index_t target_index[MAX_TARGET_IDS];
+static int target_index_count = 0;
 
 static target_t targets[] =
 {
-  { "atmel_cm0p",	"Atmel SAM C/D/R series",	&target_atmel_cm0p_ops },
-  { "atmel_cm3",	"Atmel SAM3X/A series",		&target_atmel_cm3_ops },
-  { "atmel_cm4",	"Atmel SAM G and SAM4 series",	&target_atmel_cm4_ops },
-  { "atmel_cm7",	"Atmel SAM E7x/S7x/V7x series",	&target_atmel_cm7_ops },
-  { "atmel_cm4v2",	"Atmel SAM D5x/E5x",		&target_atmel_cm4v2_ops },
-  { "mchp_cm23",	"Microchip SAM L10/L11",	&target_mchp_cm23_ops },
-  { NULL, NULL, NULL },
+  { "atmel_cm0p",	"Atmel SAM C/D/R series",	0x20000000, &target_atmel_cm0p_ops },
+  { "atmel_cm3",	"Atmel SAM3X/A series",		0x20000000, &target_atmel_cm3_ops },
+  { "atmel_cm4",	"Atmel SAM G and SAM4 series",	0x20000000, &target_atmel_cm4_ops },
+  { "atmel_cm7",	"Atmel SAM E7x/S7x/V7x series",	0x20400000, &target_atmel_cm7_ops },
+  { "atmel_cm4v2",	"Atmel SAM D5x/E5x",		0x20000000, &target_atmel_cm4v2_ops },
+  { "mchp_cm23",	"Microchip SAM L10/L11",	0x20000000, &target_mchp_cm23_ops },
+  { "auto",		"Detect the target type",	0,          &target_auto_ops },
+  { NULL, NULL, 0, NULL },
 };
 
 /*- Implementations ---------------------------------------------------------*/
@@ -81,10 +130,226 @@ target_t *target_get_ops(char *name)
 }
 
 //-----------------------------------------------------------------------------
-void target_check_options(target_options_t *options, int size, int align, int fuse_size)
+static void target_index_build(void)
+{
+  target_id_t ids[MAX_TARGET_IDS];
+
+  // All device tables in one list, built once for all the threads
+  for (target_t *target = targets; NULL != target->name; target++)
+  {
+    int count;
+
+    if (NULL == target->ops->ids)
+      continue;
+
+    count = target->ops->ids(ids, MAX_TARGET_IDS - target_index_count);
+
+    for (int i = 0; i < count; i++)
+    {
+      target_index[target_index_count].id = ids[i];
+      target_index[target_index_count].target = target;
+      target_index_count++;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void target_add_reg(target_regs_t *regs, uint32_t addr)
+{
+  for (int i = 0; i < regs->count; i++)
+  {
+    if (addr == regs->addr[i])
+      return;
+  }
+
+  check(regs->count < MAX_ID_REGS, "too many target ID registers");
+
+  regs->addr[regs->count] = addr;
+  regs->value[regs->count] = 0;
+  regs->count++;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t target_reg_value(target_regs_t *regs, uint32_t addr)
+{
+  for (int i = 0; i < regs->count; i++)
+  {
+    if (addr == regs->addr[i])
+      return regs->value[i];
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void target_read_regs(void *arg)
+{
+  target_regs_t *regs = (target_regs_t *)arg;
+
+  for (int i = 0; i < regs->count; i++)
+    dap_queue_read_word(regs->addr[i], &regs->value[i]);
+
+  dap_queue_flush();
+}
+
+//-----------------------------------------------------------------------------
+target_t *target_detect(void)
+{
+  target_regs_t regs = { .count = 0 };
+  char error[256];
+  uint32_t cpu;
+
+  pthread_once(&target_index_once, target_index_build);
+
+  cpu = (dap_read_word(SCB_CPUID) >> 4) & 0xfff;
+
+  for (int i = 0; i < target_index_count; i++)
+  {
+    target_id_t *id = &target_index[i].id;
+
+    if (id->cpu != cpu)
+      continue;
+
+    target_add_reg(&regs, id->addr);
+
+    if (id->ext_addr)
+      target_add_reg(&regs, id->ext_addr);
+  }
+
+  check(regs.count > 0, "unsupported core (CPUID part number 0x%03x)", cpu);
+
+  // All candidates are read in one transfer. A register that does not exist on
+  // the device faults it, then the registers are read one by one.
+  if (!error_trap(target_read_regs, &regs, error, sizeof(error)))
+  {
+    verbose("Target ID registers are read one by one: %s\n", error);
+
+    for (int i = 0; i < regs.count; i++)
+    {
+      target_regs_t reg = { .count = 1, .addr = { regs.addr[i] } };
+
+      dap_discard();
+      reconnect_debugger();
+
+      regs.value[i] = error_trap(target_read_regs, &reg, error, sizeof(error)) ? reg.value[0] : 0;
+    }
+
+    dap_discard();
+    reconnect_debugger();
+  }
+
+  for (int i = 0; i < target_index_count; i++)
+  {
+    target_id_t *id = &target_index[i].id;
+
+    if (id->cpu == cpu && id->value == (target_reg_value(&regs, id->addr) & id->mask) &&
+        (0 == id->ext_addr || id->ext_value == target_reg_value(&regs, id->ext_addr)))
+      return target_index[i].target;
+  }
+
+  error_exit("unable to detect the target type (CPUID part number 0x%03x)", cpu);
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+static int compare_segments(const void *a, const void *b)
+{
+  const image_segment_t *sa = a;
+  const image_segment_t *sb = b;
+
+  return (sa->addr > sb->addr) - (sa->addr < sb->addr);
+}
+
+//-----------------------------------------------------------------------------
+static void load_segments(target_options_t *options, image_segment_t *image, int count,
+    uint32_t flash_addr, target_offset_t flash_offset, int align)
+{
+  uint32_t *offsets = buf_alloc(count * sizeof(uint32_t));
+  uint32_t *addrs = buf_alloc(count * sizeof(uint32_t));
+  target_segment_t *segment = NULL;
+
+  qsort(image, count, sizeof(image_segment_t), compare_segments);
+
+  options->segments = buf_alloc(count * sizeof(target_segment_t));
+  options->n_segments = 0;
+
+  // Addresses of the segments are turned into the offsets in the linear flash
+  // space, the target hook also rejects the gaps between the flash planes
+  for (int i = 0; i < count; i++)
+  {
+    bool valid;
+
+    if (flash_offset)
+    {
+      valid = flash_offset(image[i].addr, image[i].size, &offsets[i]);
+    }
+    else
+    {
+      offsets[i] = image[i].addr - flash_addr;
+      valid = (image[i].addr >= flash_addr);
+    }
+
+    check(valid && (uint32_t)options->offset <= offsets[i] &&
+        (offsets[i] + image[i].size) <= (uint32_t)(options->offset + options->size),
+        "segment at 0x%08x (%u bytes) is outside of the flash", image[i].addr, image[i].size);
+  }
+
+  // Segments are extended to the erase unit boundaries and merged if they overlap
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t seg_start, seg_end;
+
+    seg_start = offsets[i] / align * align;
+    seg_end = (offsets[i] + image[i].size + align - 1) / align * align;
+
+    if (segment && seg_start <= (segment->offset + segment->size))
+    {
+      if (seg_end > (segment->offset + segment->size))
+        segment->size = seg_end - segment->offset;
+      continue;
+    }
+
+    addrs[options->n_segments] = image[i].addr - (offsets[i] - seg_start);
+
+    segment = &options->segments[options->n_segments++];
+    segment->offset = seg_start;
+    segment->size = seg_end - seg_start;
+  }
+
+  for (int i = 0; i < options->n_segments; i++)
+  {
+    options->segments[i].data = buf_alloc(options->segments[i].size);
+    memset(options->segments[i].data, 0xff, options->segments[i].size);
+  }
+
+  for (int i = 0, j = 0; i < count; i++)
+  {
+    while ((options->segments[j].offset + options->segments[j].size) <= offsets[i])
+      j++;
+
+    memcpy(&options->segments[j].data[offsets[i] - options->segments[j].offset],
+        image[i].data, image[i].size);
+  }
+
+  for (int i = 0; i < options->n_segments; i++)
+  {
+    verbose("Segment: 0x%08x - 0x%08x\n", addrs[i], addrs[i] + options->segments[i].size - 1);
+  }
+
+  buf_free(addrs);
+  buf_free(offsets);
+}
+
+//-----------------------------------------------------------------------------
+void target_check_options(target_options_t *options, uint32_t flash_addr,
+    target_offset_t flash_offset, int size, int align, int fuse_size)
 {
+  options->flash_erased = false;
   options->file_data = NULL;
   options->file_size = 0;
+  options->segments = NULL;
+  options->n_segments = 0;
 
   if (-1 == options->offset)
     options->offset = 0;
@@ -103,38 +368,777 @@ void target_check_options(target_options_t *options, int size, int align, int fu
 
   if (options->program || options->verify)
   {
-    options->file_data = buf_alloc(options->size);
-    options->file_size = load_file(options->name, options->file_data, options->size);
-    memset(&options->file_data[options->file_size], 0xff, options->size - options->file_size);
+    image_segment_t *image;
+    int count = image_load(options->name, &image);
+
+    if (count > 0)
+    {
+      load_segments(options, image, count, flash_addr, flash_offset, align);
+      image_free(image, count);
+    }
+    else
+    {
+      options->file_data = buf_alloc(options->size);
+      options->file_size = load_file(options->name, options->file_data, options->size);
+      memset(&options->file_data[options->file_size], 0xff, options->size - options->file_size);
+
+      check((options->file_size + options->offset) <= size, "file is too big for the selected target");
 
-    check((options->file_size + options->offset) <= size, "file is too big for the selected target");
+      // A binary file is a single segment at the specified offset
+      options->segments = buf_alloc(sizeof(target_segment_t));
+      options->segments[0].offset = options->offset;
+      options->segments[0].size = options->file_size;
+      options->segments[0].data = options->file_data;
+      options->n_segments = 1;
+    }
   }
-  else if (options->read)
+
+  for (int i = 0; i < options->n_fuse_ops; i++)
   {
-    options->file_data = buf_alloc(options->size);
-    options->file_size = options->size;
+    target_fuse_op_t *op = &options->fuse_ops[i];
+
+    op->size = 0;
+    op->data = NULL;
+
+    if (op->name && (op->actions & (TARGET_FUSE_WRITE | TARGET_FUSE_VERIFY)))
+    {
+      op->data = buf_alloc(fuse_size);
+      memset(op->data, 0xff, fuse_size);
+      op->size = load_file(op->name, op->data, fuse_size);
+    }
   }
+}
 
-  if (options->fuse_name)
+//-----------------------------------------------------------------------------
+void target_free_options(target_options_t *options)
+{
+  for (int i = 0; i < options->n_segments; i++)
+  {
+    if (options->segments[i].data != options->file_data)
+      buf_free(options->segments[i].data);
+  }
+
+  if (options->segments)
+    buf_free(options->segments);
+
+  if (options->file_data)
+    buf_free(options->file_data);
+
+  for (int i = 0; i < options->n_fuse_ops; i++)
+  {
+    if (options->fuse_ops[i].data)
+      buf_free(options->fuse_ops[i].data);
+  }
+}
+
+//-----------------------------------------------------------------------------
+void target_fuse_check(target_options_t *options, int sections)
+{
+  for (int i = 0; i < options->n_fuse_ops; i++)
   {
-    options->fuse_data = buf_alloc(fuse_size);
-    memset(options->fuse_data, 0xff, fuse_size);
+    int section = options->fuse_ops[i].section;
 
-    if (options->fuse_write || options->fuse_verify)
+    check(section < sections, "unsupported fuse section %d", section);
+  }
+}
+
+//-----------------------------------------------------------------------------
+bool target_fuse_section(target_options_t *options, int section)
+{
+  for (int i = 0; i < options->n_fuse_ops; i++)
+  {
+    if (section == options->fuse_ops[i].section)
+      return true;
+  }
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+void target_fuse_read(target_options_t *options, int section, uint8_t *buf, int size,
+    char *title, char *value_title)
+{
+  for (int i = 0; i < options->n_fuse_ops; i++)
+  {
+    target_fuse_op_t *op = &options->fuse_ops[i];
+
+    if (section != op->section || 0 == (op->actions & TARGET_FUSE_READ))
+      continue;
+
+    if (op->name)
+    {
+      save_file(op->name, buf, size);
+    }
+    else if (-1 == op->start && size <= 4)
     {
-      options->fuse_size = load_file(options->fuse_name, options->fuse_data, fuse_size);
+      message("%s: 0x%02x\n", title, extract_value(buf, 0, size * 8 - 1));
+    }
+    else if (-1 == op->start)
+    {
+      message("%s: ", title);
+
+      for (int j = 0; j < size; j++)
+        message("%02x ", buf[j]);
+
+      message("\n");
     }
-    else if (options->fuse_read)
+    else
     {
-      options->file_size = fuse_size;
+      uint32_t value = extract_value(buf, op->start, op->end);
+
+      // Word sized sections (GPNVM bits) always print at least two digits
+      if (size <= 4)
+        message("%s: 0x%02x (%d)\n", value_title, value, value);
+      else
+        message("%s: 0x%x (%d)\n", value_title, value, value);
     }
   }
 }
 
 //-----------------------------------------------------------------------------
-void target_free_options(target_options_t *options)
+bool target_fuse_apply(target_options_t *options, int section, uint8_t *buf, uint8_t *fuses, int size)
 {
-  if (options->file_data)
-    buf_free(options->file_data);
+  // All the writes of the section are merged into one new content
+  memcpy(fuses, buf, size);
+
+  for (int i = 0; i < options->n_fuse_ops; i++)
+  {
+    target_fuse_op_t *op = &options->fuse_ops[i];
+
+    if (section != op->section || 0 == (op->actions & TARGET_FUSE_WRITE))
+      continue;
+
+    if (op->name)
+      memcpy(fuses, op->data, (op->size < size) ? op->size : size);
+    else
+      apply_value(fuses, op->value, op->start, op->end);
+  }
+
+  return 0 != memcmp(fuses, buf, size);
+}
+
+//-----------------------------------------------------------------------------
+void target_fuse_verify(target_options_t *options, int section, uint8_t *buf, int size)
+{
+  for (int i = 0; i < options->n_fuse_ops; i++)
+  {
+    target_fuse_op_t *op = &options->fuse_ops[i];
+    uint32_t value;
+
+    if (section != op->section || 0 == (op->actions & TARGET_FUSE_VERIFY))
+      continue;
+
+    if (op->name)
+    {
+      for (int j = 0; j < op->size && j < size; j++)
+      {
+        if (op->data[j] != buf[j])
+        {
+          message("fuse byte %d expected 0x%02x, got 0x%02x", j, op->data[j], buf[j]);
+          error_exit("fuse verification failed");
+        }
+      }
+
+      continue;
+    }
+
+    if (-1 == op->start)
+    {
+      check(size <= 4, "please specify fuse bit range for verification");
+      value = extract_value(buf, 0, size * 8 - 1);
+    }
+    else
+    {
+      value = extract_value(buf, op->start, op->end);
+    }
+
+    if (op->value != value)
+    {
+      error_exit("fuse verification failed: expected 0x%x (%u), got 0x%x (%u)",
+          op->value, op->value, value, value);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+uint32_t target_crc32(uint32_t crc, uint8_t *data, int size)
+{
+  // Reflected CRC-32 (IEEE 802.3) without the final inversion, this is what
+  // the DSU produces when DATA is initialized with 0xffffffff
+  for (int i = 0; i < size; i++)
+  {
+    crc ^= data[i];
+
+    for (int j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+  }
+
+  return crc;
+}
+
+//-----------------------------------------------------------------------------
+bool target_compare_block(uint32_t addr, uint8_t *data, int size)
+{
+  uint8_t *buf = buf_alloc(size);
+  bool match;
+
+  dap_read_block(addr, buf, size);
+  match = (0 == memcmp(buf, data, size));
+  buf_free(buf);
+
+  return match;
+}
+
+//-----------------------------------------------------------------------------
+bool target_is_blank(uint8_t *data, int size)
+{
+  for (int i = 0; i < size; i++)
+  {
+    if (0xff != data[i])
+      return false;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t flash_map(target_flash_t *flash, uint32_t addr)
+{
+  return flash->map ? flash->map(addr) : addr;
+}
+
+//-----------------------------------------------------------------------------
+static bool flash_compare(uint32_t addr, uint8_t *data, uint32_t size)
+{
+  target_flash_t *flash = flash_current;
+  uint32_t start = 0;
+
+  if (flash->crc)
+    return flash->crc(addr, data, size);
+
+  // The range is read in one block as long as it is contiguous in the memory map
+  for (uint32_t offs = flash->page_size; offs <= size; offs += flash->page_size)
+  {
+    if (offs < size && flash_map(flash, addr + offs) ==
+        (flash_map(flash, addr + start) + offs - start))
+      continue;
+
+    if (!target_compare_block(flash_map(flash, addr + start), &data[start], offs - start))
+      return false;
+
+    start = offs;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static void flash_plane_ranges(target_flash_t *flash, uint32_t addr, uint32_t count,
+    uint32_t size, uint32_t *start, uint32_t *end)
+{
+  for (int plane = 0; plane < MAX_PLANES; plane++)
+    start[plane] = end[plane] = 0;
+
+  for (uint32_t i = count; i > 0; i--)
+  {
+    int plane = flash->plane ? flash->plane(addr + (i - 1) * size) : 0;
+
+    if (0 == end[plane])
+      end[plane] = i;
+
+    start[plane] = i - 1;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void flash_wait(target_flash_t *flash, bool *busy)
+{
+  for (int plane = 0; plane < MAX_PLANES; plane++)
+  {
+    if (busy[plane])
+      flash->wait(plane);
+
+    busy[plane] = false;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void flash_erase_units(target_flash_t *flash, uint32_t addr, uint32_t count,
+    uint8_t *skip, bool erase)
+{
+  uint32_t next[MAX_PLANES], end[MAX_PLANES];
+  bool busy[MAX_PLANES] = { false };
+  bool pending = true;
+
+  flash_plane_ranges(flash, addr, count, flash->erase_size, next, end);
+
+  // The planes take turns, so one plane erases while the other one is set up
+  while (pending)
+  {
+    pending = false;
+
+    for (int plane = 0; plane < MAX_PLANES; plane++)
+    {
+      uint32_t unit = next[plane];
+      uint32_t unit_addr = addr + unit * flash->erase_size;
+
+      if (unit >= end[plane])
+        continue;
+
+      next[plane]++;
+      pending = true;
+
+      verbose(".");
+
+      if (skip[unit])
+        continue;
+
+      if (busy[plane])
+      {
+        flash->wait(plane);
+        busy[plane] = false;
+      }
+
+      if (flash->unlock)
+        flash->unlock(unit_addr);
+
+      if (erase && flash->erase)
+      {
+        flash->erase(unit_addr);
+        busy[plane] = (NULL != flash->wait);
+      }
+    }
+  }
+
+  flash_wait(flash, busy);
+}
+
+//-----------------------------------------------------------------------------
+static void flash_write_pages(target_flash_t *flash, uint32_t addr, uint8_t *data,
+    uint32_t count, uint8_t *skip, bool erase)
+{
+  uint32_t pages_in_unit = flash->erase_size / flash->page_size;
+  uint32_t next[MAX_PLANES], end[MAX_PLANES], unit[MAX_PLANES];
+  bool busy[MAX_PLANES] = { false };
+  bool pending = true;
+  bool erased;
+
+  // Blank pages can be left alone only if the whole unit is erased
+  erased = !erase || NULL != flash->erase;
+
+  flash_plane_ranges(flash, addr, count * pages_in_unit, flash->page_size, next, end);
+
+  for (int plane = 0; plane < MAX_PLANES; plane++)
+    unit[plane] = count;
+
+  // The page buffer of one plane is filled while the other plane commits its page
+  while (pending)
+  {
+    pending = false;
+
+    for (int plane = 0; plane < MAX_PLANES; plane++)
+    {
+      uint32_t page = next[plane];
+      uint32_t offs = page * flash->page_size;
+
+      while (page < end[plane] && (skip[page / pages_in_unit] ||
+          (erased && target_is_blank(&data[offs], flash->page_size))))
+      {
+        page++;
+        offs += flash->page_size;
+      }
+
+      next[plane] = page + 1;
+
+      if (page >= end[plane])
+        continue;
+
+      pending = true;
+
+      if (busy[plane])
+      {
+        flash->wait(plane);
+        busy[plane] = false;
+      }
+
+      flash->write(addr + offs, &data[offs], !erased);
+      busy[plane] = (NULL != flash->wait);
+
+      if (unit[plane] != page / pages_in_unit)
+      {
+        unit[plane] = page / pages_in_unit;
+        verbose(".");
+      }
+    }
+  }
+
+  flash_wait(flash, busy);
+}
+
+//-----------------------------------------------------------------------------
+static void flash_program_segment(target_flash_t *flash, target_options_t *options,
+    target_segment_t *segment)
+{
+  uint32_t addr = flash->flash_addr + segment->offset;
+  uint32_t count = (segment->size + flash->erase_size - 1) / flash->erase_size;
+  uint8_t *data = segment->data;
+  bool erase = !options->flash_erased;
+  uint8_t *skip;
+
+  manifest_check(addr, data, segment->size, flash_compare);
+
+  skip = buf_alloc(count);
+
+  // All units are checked before any of the planes gets busy, segment data is
+  // padded with 0xff up to the erase unit boundary
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t unit_addr = addr + i * flash->erase_size;
+    uint8_t *unit_data = &data[i * flash->erase_size];
+
+    if (options->flash_erased)
+      skip[i] = target_is_blank(unit_data, flash->erase_size);
+    else
+      skip[i] = manifest_skip(unit_addr) || (options->incremental &&
+          flash_compare(unit_addr, unit_data, flash->erase_size));
+  }
+
+  if (options->loader && flash->loader)
+  {
+    flash->loader(addr, data, count, skip, erase);
+  }
+  else
+  {
+    // Erase units are prepared first, so the writes do not wait for the erases
+    if (flash->unlock || (erase && flash->erase))
+    {
+      flash_erase_units(flash, addr, count, skip, erase);
+      verbose(",");
+    }
+
+    flash_write_pages(flash, addr, data, count, skip, erase);
+  }
+
+  buf_free(skip);
+
+  manifest_update(addr, data, segment->size);
+}
+
+//-----------------------------------------------------------------------------
+static void flash_check_bank_swap(target_flash_t *flash, target_options_t *options)
+{
+  check(!options->bank_swap || flash->bank_swap, "bank swap is not supported by the target");
+}
+
+//-----------------------------------------------------------------------------
+void target_flash_program(target_flash_t *flash, target_options_t *options)
+{
+  flash_check_bank_swap(flash, options);
+
+  flash_current = flash;
+
+  for (int i = 0; i < options->n_segments; i++)
+    flash_program_segment(flash, options, &options->segments[i]);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t flash_verify_size(target_flash_t *flash, uint32_t addr, uint32_t size)
+{
+  uint32_t base = flash_map(flash, addr);
+
+  size = (size > VERIFY_SIZE) ? VERIFY_SIZE : size;
+
+  // A block must be contiguous in the memory map
+  for (uint32_t offs = flash->read_size - (addr % flash->read_size); flash->map && offs < size;
+      offs += flash->read_size)
+  {
+    if (flash_map(flash, addr + offs) != (base + offs))
+      return offs;
+  }
+
+  return size;
+}
+
+//-----------------------------------------------------------------------------
+static int flash_verify_submit(target_flash_t *flash, uint32_t addr, uint8_t *buf, uint32_t size)
+{
+  uint32_t map = flash_map(flash, addr);
+  uint32_t head = map & 3;
+
+  return dap_read_block_start(map - head, buf, (head + size + 3) & ~3);
+}
+
+//-----------------------------------------------------------------------------
+static void flash_mismatch_add(uint32_t addr, uint32_t size)
+{
+  flash_range_t *ranges = flash_mismatch.ranges;
+  int count = flash_mismatch.count;
+
+  flash_mismatch.bytes += size;
+
+  if (count && (ranges[count - 1].addr + ranges[count - 1].size) == addr)
+  {
+    ranges[count - 1].size += size;
+    return;
+  }
+
+  ranges = buf_realloc(ranges, (count + 1) * sizeof(flash_range_t));
+  ranges[count].addr = addr;
+  ranges[count].size = size;
+
+  flash_mismatch.ranges = ranges;
+  flash_mismatch.count = count + 1;
+}
+
+//-----------------------------------------------------------------------------
+static bool flash_verify_compare(uint32_t addr, uint8_t *bufa, uint8_t *bufb, uint32_t size)
+{
+  uint32_t i = 0;
+
+  if (0 == memcmp(bufa, bufb, size))
+    return true;
+
+  if (!flash_mismatch.all)
+  {
+    while (bufa[i] == bufb[i])
+      i++;
+
+    verbose("\nat address 0x%x expected 0x%02x, read 0x%02x\n", addr + i, bufa[i], bufb[i]);
+
+    return false;
+  }
+
+  while (i < size)
+  {
+    uint32_t start = i;
+
+    if (bufa[i] == bufb[i])
+    {
+      i++;
+      continue;
+    }
+
+    while (i < size && bufa[i] != bufb[i])
+      i++;
+
+    flash_mismatch_add(addr + start, i - start);
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static void flash_verify_range(target_flash_t *flash, uint32_t addr, uint8_t *bufa,
+    uint32_t size)
+{
+  uint32_t block_size[2];
+  uint8_t *bufb[2];
+  int ticket[2], last;
+  uint32_t offs = 0;
+  bool match = true;
+  int cur = 0;
+
+  bufb[0] = buf_alloc(VERIFY_SIZE + 8);
+  bufb[1] = buf_alloc(VERIFY_SIZE + 8);
+
+  block_size[0] = flash_verify_size(flash, addr, size);
+  ticket[0] = last = flash_verify_submit(flash, addr, bufb[0], block_size[0]);
+
+  // The next block is read while the current one is compared
+  while (match && offs < size)
+  {
+    uint32_t next = offs + block_size[cur];
+
+    if (next < size)
+    {
+      block_size[!cur] = flash_verify_size(flash, addr + next, size - next);
+      ticket[!cur] = last = flash_verify_submit(flash, addr + next, bufb[!cur], block_size[!cur]);
+    }
+
+    dap_read_block_wait(ticket[cur]);
+
+    match = flash_verify_compare(addr + offs, &bufa[offs],
+        &bufb[cur][flash_map(flash, addr + offs) & 3], block_size[cur]);
+
+    offs = next;
+    cur = !cur;
+
+    if (match)
+      verbose(".");
+  }
+
+  // A block still in flight after a mismatch must not land in a freed buffer
+  dap_read_block_wait(last);
+
+  buf_free(bufb[0]);
+  buf_free(bufb[1]);
+
+  if (!match)
+    error_exit("verification failed");
+}
+
+//-----------------------------------------------------------------------------
+static void flash_verify_segment(target_flash_t *flash, target_options_t *options,
+    target_segment_t *segment)
+{
+  uint32_t addr = flash->flash_addr + segment->offset;
+  uint8_t *bufa = segment->data;
+  uint32_t size = segment->size;
+
+  if (!options->fast_verify || NULL == flash->crc)
+  {
+    flash_verify_range(flash, addr, bufa, size);
+    return;
+  }
+
+  if (flash->crc(addr, bufa, size))
+    return;
+
+  // Only read back the blocks that do not match
+  for (uint32_t offs = 0; offs < size; offs += flash->crc_block_size)
+  {
+    uint32_t block_size = ((size - offs) > flash->crc_block_size) ?
+        flash->crc_block_size : (size - offs);
+
+    if (flash->crc(addr + offs, &bufa[offs], block_size))
+      verbose(".");
+    else
+      flash_verify_range(flash, addr + offs, &bufa[offs], block_size);
+  }
+}
+
+//-----------------------------------------------------------------------------
+void target_flash_verify(target_flash_t *flash, target_options_t *options)
+{
+  uint32_t bytes;
+  int count;
+
+  flash_check_bank_swap(flash, options);
+
+  // The ranges of a verification interrupted by an error are dropped here
+  buf_free(flash_mismatch.ranges);
+
+  flash_mismatch.all = options->verify_all;
+  flash_mismatch.count = 0;
+  flash_mismatch.bytes = 0;
+  flash_mismatch.ranges = NULL;
+
+  for (int i = 0; i < options->n_segments; i++)
+    flash_verify_segment(flash, options, &options->segments[i]);
+
+  if (0 == flash_mismatch.count)
+    return;
+
+  message("\nMismatching ranges:\n");
+
+  for (int i = 0; i < flash_mismatch.count; i++)
+  {
+    flash_range_t *range = &flash_mismatch.ranges[i];
+
+    message("  0x%08x - 0x%08x (%u bytes)\n", range->addr, range->addr + range->size - 1,
+        range->size);
+  }
+
+  bytes = flash_mismatch.bytes;
+  count = flash_mismatch.count;
+
+  buf_free(flash_mismatch.ranges);
+  flash_mismatch.ranges = NULL;
+
+  error_exit("verification failed, %u bytes differ in %d ranges", bytes, count);
 }
 
+//-----------------------------------------------------------------------------
+void target_flash_read(target_flash_t *flash, target_options_t *options)
+{
+  uint32_t addr = flash->flash_addr + options->offset;
+  uint32_t size = options->size;
+  uint8_t *buf;
+
+  flash_check_bank_swap(flash, options);
+
+  buf = buf_alloc(flash->read_size);
+
+  stream_open(options->name);
+
+  while (size)
+  {
+    dap_read_block(flash_map(flash, addr), buf, flash->read_size);
+    stream_write(buf, flash->read_size);
+
+    addr += flash->read_size;
+    size -= flash->read_size;
+
+    verbose(".");
+  }
+
+  stream_close();
+
+  buf_free(buf);
+}
+
+//-----------------------------------------------------------------------------
+static void target_auto_select(target_options_t *options)
+{
+  target_detected = target_detect();
+
+  verbose("Target type: %s (%s)\n", target_detected->name, target_detected->description);
+
+  target_detected->ops->select(options);
+}
+
+//-----------------------------------------------------------------------------
+static void target_auto_deselect(void)
+{
+  target_detected->ops->deselect();
+}
+
+//-----------------------------------------------------------------------------
+static void target_auto_erase(void)
+{
+  target_detected->ops->erase();
+}
+
+//-----------------------------------------------------------------------------
+static void target_auto_lock(void)
+{
+  target_detected->ops->lock();
+}
+
+//-----------------------------------------------------------------------------
+static void target_auto_program(void)
+{
+  target_detected->ops->program();
+}
+
+//-----------------------------------------------------------------------------
+static void target_auto_verify(void)
+{
+  target_detected->ops->verify();
+}
+
+//-----------------------------------------------------------------------------
+static void target_auto_read(void)
+{
+  target_detected->ops->read();
+}
+
+//-----------------------------------------------------------------------------
+static void target_auto_fuse(void)
+{
+  target_detected->ops->fuse();
+}
+
+//-----------------------------------------------------------------------------
+target_ops_t target_auto_ops =
+{
+  .ids      = NULL,
+  .select   = target_auto_select,
+  .deselect = target_auto_deselect,
+  .erase    = target_auto_erase,
+  .lock     = target_auto_lock,
+  .program  = target_auto_program,
+  .verify   = target_auto_verify,
+  .read     = target_auto_read,
+  .fuse     = target_auto_fuse,
+};
\ No newline at end of file
@@ -42,37 +42,114 @@ enum
   TARGET_FUSE_VERIFY = (1 << 2),
 };
 
+#define MAX_FUSE_OPS       16
+
+// CPUID part numbers of the supported cores
+#define CPUID_CORTEX_M0P   0xc60
+#define CPUID_CORTEX_M3    0xc23
+#define CPUID_CORTEX_M4    0xc24
+#define CPUID_CORTEX_M7    0xc27
+#define CPUID_CORTEX_M23   0xd20
+
 /*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t     offset;
+  uint32_t     size;
+  uint8_t      *data;
+} target_segment_t;
+
+// Offset in the linear flash space of an absolute address range, false when the
+// range is not entirely in the flash
+typedef bool (*target_offset_t)(uint32_t addr, uint32_t size, uint32_t *offset);
+
+// One '-F' expression
+typedef struct
+{
+  int          actions;    // TARGET_FUSE_READ/WRITE/VERIFY
+  int          section;
+  int          start;      // -1 for all the fuses
+  int          end;
+  uint32_t     value;
+  char         *name;
+
+  // For target use only
+  int          size;
+  uint8_t      *data;
+} target_fuse_op_t;
+
 typedef struct
 {
   bool         erase;
   bool         program;
+  bool         incremental;
+  bool         loader;
+  bool         compress;
+  bool         bank_swap;
   bool         verify;
+  bool         fast_verify;
+  bool         verify_all;
   bool         lock;
   bool         read;
   bool         fuse;
-  bool         fuse_read;
-  bool         fuse_write;
-  bool         fuse_verify;
-  int          fuse_section;
-  int          fuse_start;
-  int          fuse_end;
-  uint32_t     fuse_value;
-  char         *fuse_name;
+  int          n_fuse_ops;
+  target_fuse_op_t fuse_ops[MAX_FUSE_OPS];
   char         *name;
   int32_t      offset;
   int32_t      size;
 
   // For target use only
+  bool         flash_erased;
   int          file_size;
   uint8_t      *file_data;
 
-  int          fuse_size;
-  uint8_t      *fuse_data;
+  int          n_segments;
+  target_segment_t *segments;
 } target_options_t;
 
+// Flash geometry and controller hooks for the shared program, verify and read
+// code. The optional hooks are NULL when not supported.
+typedef struct
+{
+  uint32_t     flash_addr;     // Address of the segment offset 0
+  uint32_t     erase_size;     // Erase unit, also the unit of the skip checks
+  uint32_t     page_size;      // Write unit
+  uint32_t     read_size;      // Read and verification block size
+  uint32_t     crc_block_size; // Fast verification block size
+  bool         bank_swap;      // The inactive bank may be programmed while the core runs
+
+  // On-chip CRC of the range compared with the data, a read back is used without it
+  bool (*crc)(uint32_t addr, uint8_t *data, uint32_t size);
+  // Translation into the memory map address, identity without it
+  uint32_t (*map)(uint32_t addr);
+  // Plane of the address, planes are written in turns and must be contiguous
+  int (*plane)(uint32_t addr);
+  // Preparation of the erase unit before the erase or write
+  void (*unlock)(uint32_t addr);
+  // Erase unit erase, without it pages are erased by the write when erase is set
+  void (*erase)(uint32_t addr);
+  void (*write)(uint32_t addr, uint8_t *data, bool erase);
+  // Wait for the operation started on the plane, the hooks wait themselves without it
+  void (*wait)(int plane);
+  // Programming of count erase units through a flash loader
+  void (*loader)(uint32_t addr, uint8_t *data, uint32_t count, uint8_t *skip, bool erase);
+} target_flash_t;
+
+// Identification of a device for the target type detection
+typedef struct
+{
+  uint32_t     cpu;        // CPUID part number of the core
+  uint32_t     addr;       // ID register
+  uint32_t     mask;       // Bits of the ID register that identify the device
+  uint32_t     value;
+  uint32_t     ext_addr;   // Extension ID register, 0 when not used
+  uint32_t     ext_value;
+} target_id_t;
+
 typedef struct
 {
+  // Identification of the supported devices, returns the number of entries
+  int (*ids)(target_id_t *ids, int size);
   void (*select)(target_options_t *options);
   void (*deselect)(void);
   void (*erase)(void);
@@ -87,14 +164,29 @@ typedef struct
 {
   char         *name;
   char         *description;
+  uint32_t     ram_addr;
   target_ops_t *ops;
 } target_t;
 
 /*- Prototypes --------------------------------------------------------------*/
 void target_list(void);
 target_t *target_get_ops(char *name);
-void target_check_options(target_options_t *options, int size, int align, int fuse_size);
+target_t *target_detect(void);
+void target_check_options(target_options_t *options, uint32_t flash_addr,
+    target_offset_t flash_offset, int size, int align, int fuse_size);
 void target_free_options(target_options_t *options);
+void target_fuse_check(target_options_t *options, int sections);
+bool target_fuse_section(target_options_t *options, int section);
+void target_fuse_read(target_options_t *options, int section, uint8_t *buf, int size,
+    char *title, char *value_title);
+bool target_fuse_apply(target_options_t *options, int section, uint8_t *buf, uint8_t *fuses, int size);
+void target_fuse_verify(target_options_t *options, int section, uint8_t *buf, int size);
+uint32_t target_crc32(uint32_t crc, uint8_t *data, int size);
+bool target_compare_block(uint32_t addr, uint8_t *data, int size);
+bool target_is_blank(uint8_t *data, int size);
+void target_flash_program(target_flash_t *flash, target_options_t *options);
+void target_flash_verify(target_flash_t *flash, target_options_t *options);
+void target_flash_read(target_flash_t *flash, target_options_t *options);
 
 #endif // _TARGET_H_
 
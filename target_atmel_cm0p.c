@@ -35,12 +35,16 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "loader.h"
+#include "manifest.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_ADDR             0
 #define FLASH_ROW_SIZE         256
 #define FLASH_PAGE_SIZE        64
 
+#define SRAM_ADDR              0x20000000
+
 #define USER_ROW_ADDR          0x00804000
 #define USER_ROW_SIZE          256
 
@@ -49,8 +53,15 @@
 #define AIRCR                  0xe000ed0c
 
 #define DSU_CTRL_STATUS        0x41002100
+#define DSU_ADDR               0x41002104
+#define DSU_LENGTH             0x41002108
+#define DSU_DATA               0x4100210c
 #define DSU_DID                0x41002118
 
+#define DSU_CTRL_CRC           (1 << 2)
+#define DSU_STATUSA_DONE       (1 << 8)
+#define DSU_STATUSA_BERR       (1 << 10)
+
 #define NVMCTRL_CTRLA          0x41004000
 #define NVMCTRL_CTRLB          0x41004004
 #define NVMCTRL_PARAM          0x41004008
@@ -71,6 +82,12 @@
 #define DEVICE_REV_SHIFT       8
 #define DEVICE_REV_MASK        0xf
 
+#define NVM_TIMEOUT            1000 // ms
+#define ERASE_TIMEOUT          30000 // ms
+#define CRC_TIMEOUT            1000 // ms
+
+#define CRC_BLOCK_SIZE         8192
+
 /*- Types -------------------------------------------------------------------*/
 typedef struct
 {
@@ -121,19 +138,73 @@ static device_t devices[] =
   { 0 },
 };
 
-static device_t target_device;
-static target_options_t target_options;
+static _Thread_local device_t target_device;
+static _Thread_local target_options_t target_options;
 
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static void nvmctrl_wait_ready(void)
+{
+  check(dap_wait_word(NVMCTRL_INTFLAG, 1, 1, NVM_TIMEOUT),
+      "timeout while waiting for the NVM controller");
+}
+
+//-----------------------------------------------------------------------------
+static bool dsu_crc32(uint32_t addr, uint32_t size, uint32_t *crc)
+{
+  uint32_t status;
+
+  dap_queue_write_word(DSU_CTRL_STATUS, DSU_STATUSA_DONE | DSU_STATUSA_BERR); // Clear flags
+  dap_queue_write_word(DSU_ADDR, addr);
+  dap_queue_write_word(DSU_LENGTH, size);
+  dap_queue_write_word(DSU_DATA, 0xffffffff);
+  dap_queue_write_word(DSU_CTRL_STATUS, DSU_CTRL_CRC);
+
+  if (!dap_wait_word(DSU_CTRL_STATUS, DSU_STATUSA_DONE, DSU_STATUSA_DONE, CRC_TIMEOUT))
+    return false;
+
+  dap_queue_read_word(DSU_CTRL_STATUS, &status);
+  dap_queue_read_word(DSU_DATA, crc);
+  dap_queue_flush();
+
+  return 0 == (status & DSU_STATUSA_BERR);
+}
+
+//-----------------------------------------------------------------------------
+static bool verify_crc(uint32_t addr, uint8_t *data, uint32_t size)
+{
+  uint32_t crc;
+
+  // The DSU works with whole words, the file buffer is padded with 0xff
+  if (!dsu_crc32(addr, (size + 3) & ~3, &crc))
+    return false;
+
+  return crc == target_crc32(0xffffffff, data, (size + 3) & ~3);
+}
+
+//-----------------------------------------------------------------------------
+static int target_ids(target_id_t *ids, int size)
+{
+  int count = 0;
+
+  for (device_t *device = devices; device->dsu_did > 0 && count < size; device++)
+  {
+    ids[count++] = (target_id_t){ .cpu = CPUID_CORTEX_M0P, .addr = DSU_DID,
+        .mask = DEVICE_ID_MASK, .value = device->dsu_did };
+  }
+
+  return count;
+}
+
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
   uint32_t dsu_did, id, rev;
 
   // Stop the core
-  dap_write_word(DHCSR, 0xa05f0003);
-  dap_write_word(DEMCR, 0x00000001);
+  dap_queue_write_word(DHCSR, 0xa05f0003);
+  dap_queue_write_word(DEMCR, 0x00000001);
   dap_write_word(AIRCR, 0x05fa0004);
 
   dsu_did = dap_read_word(DSU_DID);
@@ -149,9 +220,11 @@ static void target_select(target_options_t *options)
       target_device = *device;
       target_options = *options;
 
-      target_check_options(&target_options, device->flash_size,
+      target_check_options(&target_options, FLASH_ADDR, NULL, device->flash_size,
           FLASH_ROW_SIZE, USER_ROW_SIZE);
 
+      manifest_select(dsu_did, FLASH_ADDR, device->flash_size, FLASH_ROW_SIZE);
+
       return;
     }
   }
@@ -162,19 +235,24 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
-  dap_write_word(DEMCR, 0x00000000);
+  dap_queue_write_word(DEMCR, 0x00000000);
   dap_write_word(AIRCR, 0x05fa0004);
 
+  manifest_close();
   target_free_options(&target_options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_erase(void)
 {
-  dap_write_word(DSU_CTRL_STATUS, 0x00001f00); // Clear flags
+  dap_queue_write_word(DSU_CTRL_STATUS, 0x00001f00); // Clear flags
   dap_write_word(DSU_CTRL_STATUS, 0x00000010); // Chip erase
   sleep_ms(100);
-  while (0 == (dap_read_word(DSU_CTRL_STATUS) & 0x00000100));
+  check(dap_wait_word(DSU_CTRL_STATUS, 0x00000100, 0x00000100, ERASE_TIMEOUT),
+      "timeout while waiting for the chip erase");
+
+  target_options.flash_erased = true;
+  manifest_erase();
 }
 
 //-----------------------------------------------------------------------------
@@ -184,203 +262,140 @@ static void target_lock(void)
 }
 
 //-----------------------------------------------------------------------------
-static void target_program(void)
+static void flash_unlock(uint32_t addr)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
-  uint32_t offs = 0;
-  uint32_t number_of_rows;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
-
-  if (dap_read_word(DSU_CTRL_STATUS) & 0x00010000)
-    error_exit("device is locked, perform a chip erase before programming");
+  dap_queue_write_word(NVMCTRL_ADDR, addr >> 1);
+  dap_queue_write_word(NVMCTRL_CTRLA, NVMCTRL_CMD_UR); // Unlock Region
+  nvmctrl_wait_ready();
+}
 
-  number_of_rows = (size + FLASH_ROW_SIZE - 1) / FLASH_ROW_SIZE;
+//-----------------------------------------------------------------------------
+static void flash_erase(uint32_t addr)
+{
+  dap_queue_write_word(NVMCTRL_ADDR, addr >> 1);
+  dap_queue_write_word(NVMCTRL_CTRLA, NVMCTRL_CMD_ER); // Erase Row
+  nvmctrl_wait_ready();
+}
 
-  dap_write_word(NVMCTRL_CTRLB, 0); // Enable automatic write
+//-----------------------------------------------------------------------------
+static void flash_write(uint32_t addr, uint8_t *data, bool erase)
+{
+  // Pages are written automatically
+  dap_write_block(addr, data, FLASH_PAGE_SIZE);
+  (void)erase;
+}
 
-  for (uint32_t row = 0; row < number_of_rows; row++)
+//-----------------------------------------------------------------------------
+static void program_with_loader(uint32_t addr, uint8_t *buf, uint32_t number_of_rows,
+    uint8_t *skip, bool erase)
+{
+  loader_t loader =
   {
-    dap_write_word(NVMCTRL_ADDR, addr >> 1);
-
-    dap_write_word(NVMCTRL_CTRLA, NVMCTRL_CMD_UR); // Unlock Region
-    while (0 == (dap_read_word(NVMCTRL_INTFLAG) & 1));
+    .type       = LOADER_NVMCTRL,
+    .ram_addr   = SRAM_ADDR,
+    .buf_size   = 1024,
+    .buf_count  = 2,
+    .page_size  = FLASH_PAGE_SIZE,
+    .erase_size = FLASH_ROW_SIZE,
+  };
 
-    dap_write_word(NVMCTRL_CTRLA, NVMCTRL_CMD_ER); // Erase Row
-    while (0 == (dap_read_word(NVMCTRL_INTFLAG) & 1));
+  dap_write_word(NVMCTRL_INTFLAG, 0x02); // Clear ERROR flag
 
-    dap_write_block(addr, &buf[offs], FLASH_ROW_SIZE);
+  loader_start(&loader);
 
-    addr += FLASH_ROW_SIZE;
-    offs += FLASH_ROW_SIZE;
+  for (uint32_t row = 0; row < number_of_rows; row++)
+  {
+    if (!skip[row])
+    {
+      loader_write(addr + row * FLASH_ROW_SIZE, &buf[row * FLASH_ROW_SIZE],
+          FLASH_ROW_SIZE, NVMCTRL_CTRLA, 0, erase);
+    }
 
     verbose(".");
   }
+
+  loader_finish();
 }
 
 //-----------------------------------------------------------------------------
-static void target_verify(void)
+static target_flash_t target_flash =
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
-  uint32_t block_size;
-  uint32_t offs = 0;
-  uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  .flash_addr     = FLASH_ADDR,
+  .erase_size     = FLASH_ROW_SIZE,
+  .page_size      = FLASH_PAGE_SIZE,
+  .read_size      = FLASH_ROW_SIZE,
+  .crc_block_size = CRC_BLOCK_SIZE,
+  .crc            = verify_crc,
+  .unlock         = flash_unlock,
+  .erase          = flash_erase,
+  .write          = flash_write,
+  .loader         = program_with_loader,
+};
 
+//-----------------------------------------------------------------------------
+static void target_program(void)
+{
   if (dap_read_word(DSU_CTRL_STATUS) & 0x00010000)
-    error_exit("device is locked, unable to verify");
-
-  bufb = buf_alloc(FLASH_ROW_SIZE);
-
-  while (size)
-  {
-    dap_read_block(addr, bufb, FLASH_ROW_SIZE);
-
-    block_size = (size > FLASH_ROW_SIZE) ? FLASH_ROW_SIZE : size;
+    error_exit("device is locked, perform a chip erase before programming");
 
-    for (int i = 0; i < (int)block_size; i++)
-    {
-      if (bufa[offs + i] != bufb[i])
-      {
-        verbose("\nat address 0x%x expected 0x%02x, read 0x%02x\n",
-            addr + i, bufa[offs + i], bufb[i]);
-        buf_free(bufb);
-        error_exit("verification failed");
-      }
-    }
+  dap_write_word(NVMCTRL_CTRLB, 0); // Enable automatic write
 
-    addr += FLASH_ROW_SIZE;
-    offs += FLASH_ROW_SIZE;
-    size -= block_size;
+  target_flash_program(&target_flash, &target_options);
+}
 
-    verbose(".");
-  }
+//-----------------------------------------------------------------------------
+static void target_verify(void)
+{
+  if (dap_read_word(DSU_CTRL_STATUS) & 0x00010000)
+    error_exit("device is locked, unable to verify");
 
-  buf_free(bufb);
+  target_flash_verify(&target_flash, &target_options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
-  uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
-
   if (dap_read_word(DSU_CTRL_STATUS) & 0x00010000)
     error_exit("device is locked, unable to read");
 
-  while (size)
-  {
-    dap_read_block(addr, &buf[offs], FLASH_ROW_SIZE);
-
-    addr += FLASH_ROW_SIZE;
-    offs += FLASH_ROW_SIZE;
-    size -= FLASH_ROW_SIZE;
-
-    verbose(".");
-  }
-
-  save_file(target_options.name, buf, target_options.size);
+  target_flash_read(&target_flash, &target_options);
 }
 
-
 //-----------------------------------------------------------------------------
 static void target_fuse(void)
 {
-  uint8_t buf[USER_ROW_SIZE];
-  bool read_all = (-1 == target_options.fuse_start);
-  int size = (target_options.fuse_size < USER_ROW_SIZE) ?
-      target_options.fuse_size : USER_ROW_SIZE;
+  uint8_t buf[USER_ROW_SIZE], fuses[USER_ROW_SIZE];
 
-  check(0 == target_options.fuse_section, "unsupported fuse section %d",
-      target_options.fuse_section);
+  target_fuse_check(&target_options, 1);
 
   dap_read_block(USER_ROW_ADDR, buf, USER_ROW_SIZE);
 
-  if (target_options.fuse_read)
-  {
-    if (target_options.fuse_name)
-    {
-      save_file(target_options.fuse_name, buf, USER_ROW_SIZE);
-    }
-    else if (read_all)
-    {
-      message("Fuses (user row): ");
-
-      for (int i = 0; i < USER_ROW_SIZE; i++)
-        message("%02x ", buf[i]);
-
-      message("\n");
-    }
-    else
-    {
-      uint32_t value = extract_value(buf, target_options.fuse_start,
-          target_options.fuse_end);
+  target_fuse_read(&target_options, 0, buf, USER_ROW_SIZE, "Fuses (user row)", "Fuses");
 
-      message("Fuses: 0x%x (%d)\n", value, value);
-    }
-  }
-
-  if (target_options.fuse_write)
+  if (target_fuse_apply(&target_options, 0, buf, fuses, USER_ROW_SIZE))
   {
-    if (target_options.fuse_name)
-    {
-      for (int i = 0; i < size; i++)
-        buf[i] = target_options.fuse_data[i];
-    }
-    else
+    dap_queue_write_word(NVMCTRL_CTRLB, 0);
+    dap_queue_write_word(NVMCTRL_ADDR, USER_ROW_ADDR >> 1);
+    dap_queue_write_word(NVMCTRL_CTRLA, NVMCTRL_CMD_EAR);
+    nvmctrl_wait_ready();
+
+    // Pages that stay erased are not written
+    for (int offs = 0; offs < USER_ROW_SIZE; offs += FLASH_PAGE_SIZE)
     {
-      apply_value(buf, target_options.fuse_value, target_options.fuse_start,
-          target_options.fuse_end);
+      if (!target_is_blank(&fuses[offs], FLASH_PAGE_SIZE))
+        dap_write_block(USER_ROW_ADDR + offs, &fuses[offs], FLASH_PAGE_SIZE);
     }
 
-    dap_write_word(NVMCTRL_CTRLB, 0);
-    dap_write_word(NVMCTRL_ADDR, USER_ROW_ADDR >> 1);
-    dap_write_word(NVMCTRL_CTRLA, NVMCTRL_CMD_EAR);
-    while (0 == (dap_read_word(NVMCTRL_INTFLAG) & 1));
-
-    dap_write_block(USER_ROW_ADDR, buf, USER_ROW_SIZE);
-  }
-
-  if (target_options.fuse_verify)
-  {
     dap_read_block(USER_ROW_ADDR, buf, USER_ROW_SIZE);
-
-    if (target_options.fuse_name)
-    {
-      for (int i = 0; i < size; i++)
-      {
-        if (target_options.fuse_data[i] != buf[i])
-        {
-          message("fuse byte %d expected 0x%02x, got 0x%02x", i,
-              target_options.fuse_data[i], buf[i]);
-          error_exit("fuse verification failed");
-        }
-      }
-    }
-    else if (read_all)
-    {
-      error_exit("please specify fuse bit range for verification");
-    }
-    else
-    {
-      uint32_t value = extract_value(buf, target_options.fuse_start,
-          target_options.fuse_end);
-
-      if (target_options.fuse_value != value)
-      {
-        error_exit("fuse verification failed: expected 0x%x (%u), got 0x%x (%u)",
-            target_options.fuse_value, target_options.fuse_value, value, value);
-      }
-    }
   }
+
+  target_fuse_verify(&target_options, 0, buf, USER_ROW_SIZE);
 }
 
 //-----------------------------------------------------------------------------
 target_ops_t target_atmel_cm0p_ops =
 {
+  .ids      = target_ids,
   .select   = target_select,
   .deselect = target_deselect,
   .erase    = target_erase,
@@ -35,6 +35,8 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "loader.h"
+#include "manifest.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define ARM_DAP_DHCSR          0xe000edf0
@@ -51,6 +53,7 @@
 #define FSR_FRDY               (1ul)
 
 #define CMD_GETD               0x5a000000 // Get Flash Descriptor
+#define CMD_WP                 0x5a000001 // Write page
 #define CMD_EWP                0x5a000003 // Erase page and write page
 #define CMD_EA                 0x5a000005 // Erase all
 #define CMD_SGPB               0x5a00000b // Set GPNVM Bit
@@ -58,11 +61,15 @@
 #define CMD_GGPB               0x5a00000d // Get GPNVM Bit
 
 #define FLASH_PAGE_SIZE        256
+#define SRAM_ADDR              0x20000000
 #define CHIPID_EXID_VALUE      0
 
 #define GPNVM_SIZE             1
 #define GPNVM_SIZE_BITS        8
 
+#define EEFC_TIMEOUT           2000 // ms
+#define ERASE_TIMEOUT          30000 // ms
+
 /*- Types -------------------------------------------------------------------*/
 typedef struct
 {
@@ -99,8 +106,8 @@ static device_t devices[] =
   { 0, "", 0, 0, {{ 0, 0, 0 }} },
 };
 
-static device_t target_device;
-static target_options_t target_options;
+static _Thread_local device_t target_device;
+static _Thread_local target_options_t target_options;
 
 /*- Implementations ---------------------------------------------------------*/
 
@@ -122,6 +129,43 @@ static uint32_t get_flash_addr(uint32_t addr)
   return 0;
 }
 
+//-----------------------------------------------------------------------------
+static bool get_flash_offset(uint32_t addr, uint32_t size, uint32_t *offset)
+{
+  uint32_t offs = 0;
+
+  for (int i = 0; i < target_device.n_planes; i++)
+  {
+    uint32_t plane_addr = target_device.plane[i].addr;
+    uint32_t plane_size = target_device.plane[i].size;
+
+    if (addr >= plane_addr && (addr - plane_addr) < plane_size)
+    {
+      uint32_t end = addr + size;
+
+      *offset = offs + (addr - plane_addr);
+
+      // A range may only continue into the next plane if there is no gap
+      for (; i < target_device.n_planes; i++)
+      {
+        plane_addr = target_device.plane[i].addr;
+        plane_size = target_device.plane[i].size;
+
+        if (end <= plane_addr + plane_size)
+          return true;
+
+        if ((i + 1) == target_device.n_planes ||
+            target_device.plane[i + 1].addr != (plane_addr + plane_size))
+          return false;
+      }
+    }
+
+    offs += plane_size;
+  }
+
+  return false;
+}
+
 //-----------------------------------------------------------------------------
 static uint32_t get_eefc_base(uint32_t addr)
 {
@@ -141,20 +185,43 @@ static uint32_t get_eefc_base(uint32_t addr)
   return 0;
 }
 
+//-----------------------------------------------------------------------------
+static void eefc_wait_ready(uint32_t eefc_base)
+{
+  check(dap_wait_word(EEFC_FSR(eefc_base), FSR_FRDY, FSR_FRDY, EEFC_TIMEOUT),
+      "timeout while waiting for the flash controller");
+}
+
+//-----------------------------------------------------------------------------
+static int target_ids(target_id_t *ids, int size)
+{
+  int count = 0;
+
+  for (device_t *device = devices; device->chip_id > 0 && count < size; device++)
+  {
+    ids[count++] = (target_id_t){ .cpu = CPUID_CORTEX_M3,
+        .addr = CHIPID_CIDR(device->chipid_base), .mask = 0xffffffff, .value = device->chip_id,
+        .ext_addr = CHIPID_EXID(device->chipid_base), .ext_value = CHIPID_EXID_VALUE };
+  }
+
+  return count;
+}
+
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
   // Stop the core
-  dap_write_word(ARM_DAP_DHCSR, 0xa05f0003);
-  dap_write_word(ARM_DAP_DEMCR, 0x00000001);
+  dap_queue_write_word(ARM_DAP_DHCSR, 0xa05f0003);
+  dap_queue_write_word(ARM_DAP_DEMCR, 0x00000001);
   dap_write_word(ARM_SCB_AIRCR, 0x05fa0004);
 
   for (device_t *device = devices; device->chip_id > 0; device++)
   {
     uint32_t chip_id, chip_exid;
 
-    chip_id = dap_read_word(CHIPID_CIDR(device->chipid_base));
-    chip_exid = dap_read_word(CHIPID_EXID(device->chipid_base));
+    dap_queue_read_word(CHIPID_CIDR(device->chipid_base), &chip_id);
+    dap_queue_read_word(CHIPID_EXID(device->chipid_base), &chip_exid);
+    dap_queue_flush();
 
     if (device->chip_id == chip_id && CHIPID_EXID_VALUE == chip_exid)
     {
@@ -167,25 +234,27 @@ static void target_select(target_options_t *options)
       {
         uint32_t eefc_base = device->plane[i].eefc_base;
 
-        dap_write_word(EEFC_FCR(eefc_base), CMD_GETD);
-        while (0 == (dap_read_word(EEFC_FSR(eefc_base)) & FSR_FRDY));
+        dap_queue_write_word(EEFC_FCR(eefc_base), CMD_GETD);
+        eefc_wait_ready(eefc_base);
 
-        fl_id = dap_read_word(EEFC_FRR(eefc_base));
-        check(fl_id, "Cannot read flash descriptor, check Erase pin state");
+        dap_queue_read_word(EEFC_FRR(eefc_base), &fl_id);
+        dap_queue_read_word(EEFC_FRR(eefc_base), &fl_size);
+        dap_queue_read_word(EEFC_FRR(eefc_base), &fl_page_size);
+        dap_queue_read_word(EEFC_FRR(eefc_base), &fl_nb_palne);
+        dap_queue_flush();
 
-        fl_size = dap_read_word(EEFC_FRR(eefc_base));
+        check(fl_id, "Cannot read flash descriptor, check Erase pin state");
         check(fl_size == device->plane[i].size, "Invalid reported Flash size (%d)", fl_size);
-
-        fl_page_size = dap_read_word(EEFC_FRR(eefc_base));
         check(fl_page_size == FLASH_PAGE_SIZE, "Invalid reported page size (%d)", fl_page_size);
 
-        fl_nb_palne = dap_read_word(EEFC_FRR(eefc_base));
         for (uint32_t i = 0; i < fl_nb_palne; i++)
-          dap_read_word(EEFC_FRR(eefc_base));
+          dap_queue_read_word(EEFC_FRR(eefc_base), NULL);
+        dap_queue_read_word(EEFC_FRR(eefc_base), &fl_nb_lock);
+        dap_queue_flush();
 
-        fl_nb_lock =  dap_read_word(EEFC_FRR(eefc_base));
         for (uint32_t i = 0; i < fl_nb_lock; i++)
-          dap_read_word(EEFC_FRR(eefc_base));
+          dap_queue_read_word(EEFC_FRR(eefc_base), NULL);
+        dap_queue_flush();
 
         flash_size += fl_size;
       }
@@ -193,7 +262,10 @@ static void target_select(target_options_t *options)
       target_device = *device;
       target_options = *options;
 
-      target_check_options(&target_options, flash_size, FLASH_PAGE_SIZE, GPNVM_SIZE);
+      target_check_options(&target_options, device->plane[0].addr, get_flash_offset,
+          flash_size, FLASH_PAGE_SIZE, GPNVM_SIZE);
+
+      manifest_select(chip_id, 0, flash_size, FLASH_PAGE_SIZE);
 
       return;
     }
@@ -205,9 +277,10 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
-  dap_write_word(ARM_DAP_DEMCR, 0x00000000);
+  dap_queue_write_word(ARM_DAP_DEMCR, 0x00000000);
   dap_write_word(ARM_SCB_AIRCR, 0x05fa0004);
 
+  manifest_close();
   target_free_options(&target_options);
 }
 
@@ -215,10 +288,17 @@ static void target_deselect(void)
 static void target_erase(void)
 {
   for (int i = 0; i < target_device.n_planes; i++)
-    dap_write_word(EEFC_FCR(target_device.plane[i].eefc_base), CMD_EA);
+    dap_queue_write_word(EEFC_FCR(target_device.plane[i].eefc_base), CMD_EA);
+  dap_queue_flush();
 
   for (int i = 0; i < target_device.n_planes; i++)
-    while (0 == (dap_read_word(EEFC_FSR(target_device.plane[i].eefc_base)) & FSR_FRDY));
+  {
+    check(dap_wait_word(EEFC_FSR(target_device.plane[i].eefc_base), FSR_FRDY, FSR_FRDY,
+        ERASE_TIMEOUT), "timeout while waiting for the chip erase");
+  }
+
+  target_options.flash_erased = true;
+  manifest_erase();
 }
 
 //-----------------------------------------------------------------------------
@@ -229,194 +309,148 @@ static void target_lock(void)
 }
 
 //-----------------------------------------------------------------------------
-static void target_program(void)
+static int flash_plane(uint32_t addr)
 {
-  uint32_t addr = target_options.offset;
-  uint32_t number_of_pages, eefc_base;
-  uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
-
-  number_of_pages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+  uint32_t offs = addr;
 
-  for (uint32_t page = 0; page < number_of_pages; page++)
+  for (int i = 0; i < target_device.n_planes; i++)
   {
-    eefc_base = get_eefc_base(addr);
+    if (offs < target_device.plane[i].size)
+      return i;
 
-    dap_write_block(get_flash_addr(addr), &buf[offs], FLASH_PAGE_SIZE);
-
-    dap_write_word(EEFC_FCR(eefc_base), CMD_EWP | (page << 8));
-    while (0 == (dap_read_word(EEFC_FSR(eefc_base)) & FSR_FRDY));
+    offs -= target_device.plane[i].size;
+  }
 
-    addr += FLASH_PAGE_SIZE;
-    offs += FLASH_PAGE_SIZE;
+  error_exit("internal error in flash_plane()");
 
-    verbose(".");
-  }
+  return 0;
 }
 
 //-----------------------------------------------------------------------------
-static void target_verify(void)
+static void flash_write(uint32_t addr, uint8_t *data, bool erase)
 {
-  uint32_t addr = target_options.offset;
-  uint32_t block_size;
-  uint32_t offs = 0;
-  uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  dap_write_block(get_flash_addr(addr), data, FLASH_PAGE_SIZE);
 
-  bufb = buf_alloc(FLASH_PAGE_SIZE);
+  // After a chip erase the page does not need to be erased again
+  dap_queue_write_word(EEFC_FCR(get_eefc_base(addr)), (erase ? CMD_EWP : CMD_WP) |
+      ((addr / FLASH_PAGE_SIZE) << 8));
+}
 
-  while (size)
+//-----------------------------------------------------------------------------
+static void flash_wait(int plane)
+{
+  eefc_wait_ready(target_device.plane[plane].eefc_base);
+}
+
+//-----------------------------------------------------------------------------
+static void program_with_loader(uint32_t addr, uint8_t *buf, uint32_t number_of_pages,
+    uint8_t *skip, bool erase)
+{
+  loader_t loader =
   {
-    dap_read_block(get_flash_addr(addr), bufb, FLASH_PAGE_SIZE);
+    .type       = LOADER_EEFC,
+    .ram_addr   = SRAM_ADDR,
+    .buf_size   = FLASH_PAGE_SIZE * 8,
+    .buf_count  = 2,
+    .page_size  = FLASH_PAGE_SIZE,
+    .erase_size = FLASH_PAGE_SIZE,
+    .arg        = { 0, CMD_WP, CMD_EWP },
+    .compress   = target_options.compress,
+  };
 
-    block_size = (size > FLASH_PAGE_SIZE) ? FLASH_PAGE_SIZE : size;
+  for (int i = 0; i < target_device.n_planes; i++)
+    dap_read_word(EEFC_FSR(target_device.plane[i].eefc_base)); // Clear error flags
 
-    for (int i = 0; i < (int)block_size; i++)
+  loader_start(&loader);
+
+  for (uint32_t page = 0; page < number_of_pages; page++)
+  {
+    uint32_t offs = page * FLASH_PAGE_SIZE;
+
+    if (!skip[page])
     {
-      if (bufa[offs + i] != bufb[i])
-      {
-        verbose("\nat address 0x%x expected 0x%02x, read 0x%02x\n",
-            addr + i, bufa[offs + i], bufb[i]);
-        buf_free(bufb);
-        error_exit("verification failed");
-      }
+      loader_write(get_flash_addr(addr + offs), &buf[offs], FLASH_PAGE_SIZE,
+          get_eefc_base(addr + offs), (addr + offs) / FLASH_PAGE_SIZE, erase);
     }
 
-    addr += FLASH_PAGE_SIZE;
-    offs += FLASH_PAGE_SIZE;
-    size -= block_size;
-
     verbose(".");
   }
 
-  buf_free(bufb);
+  loader_finish();
 }
 
 //-----------------------------------------------------------------------------
-static void target_read(void)
+static target_flash_t target_flash =
 {
-  uint32_t addr = target_options.offset;
-  uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
-
-  while (size)
-  {
-    dap_read_block(get_flash_addr(addr), &buf[offs], FLASH_PAGE_SIZE);
+  .flash_addr     = 0,
+  .erase_size     = FLASH_PAGE_SIZE,
+  .page_size      = FLASH_PAGE_SIZE,
+  .read_size      = FLASH_PAGE_SIZE,
+  .map            = get_flash_addr,
+  .plane          = flash_plane,
+  .write          = flash_write,
+  .wait           = flash_wait,
+  .loader         = program_with_loader,
+};
 
-    addr += FLASH_PAGE_SIZE;
-    offs += FLASH_PAGE_SIZE;
-    size -= FLASH_PAGE_SIZE;
+//-----------------------------------------------------------------------------
+static void target_program(void)
+{
+  target_flash_program(&target_flash, &target_options);
+}
 
-    verbose(".");
-  }
+//-----------------------------------------------------------------------------
+static void target_verify(void)
+{
+  target_flash_verify(&target_flash, &target_options);
+}
 
-  save_file(target_options.name, buf, target_options.size);
+//-----------------------------------------------------------------------------
+static void target_read(void)
+{
+  target_flash_read(&target_flash, &target_options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_fuse(void)
 {
-  bool read_all = (-1 == target_options.fuse_start);
-  uint32_t gpnvm;
-  uint8_t *buf = (uint8_t *)&gpnvm;
-  int size = (target_options.fuse_size < GPNVM_SIZE) ?
-      target_options.fuse_size : GPNVM_SIZE;
+  uint32_t gpnvm, fuses;
 
-  check(0 == target_options.fuse_section, "unsupported fuse section %d",
-      target_options.fuse_section);
+  target_fuse_check(&target_options, 1);
 
-  dap_write_word(EEFC_FCR(get_eefc_base(0)), CMD_GGPB);
-  while (0 == (dap_read_word(EEFC_FSR(get_eefc_base(0))) & FSR_FRDY));
+  dap_queue_write_word(EEFC_FCR(get_eefc_base(0)), CMD_GGPB);
+  eefc_wait_ready(get_eefc_base(0));
   gpnvm = dap_read_word(EEFC_FRR(get_eefc_base(0)));
 
-  if (target_options.fuse_read)
-  {
-    if (target_options.fuse_name)
-    {
-      save_file(target_options.fuse_name, buf, sizeof(gpnvm));
-    }
-    else if (read_all)
-    {
-      message("GPNVM Bits: 0x%02x\n", gpnvm);
-    }
-    else
-    {
-      uint32_t value = extract_value(buf, target_options.fuse_start,
-          target_options.fuse_end);
-
-      message("GPNVM Bits: 0x%02x (%d)\n", value, value);
-    }
-  }
+  target_fuse_read(&target_options, 0, (uint8_t *)&gpnvm, sizeof(gpnvm),
+      "GPNVM Bits", "GPNVM Bits");
 
-  if (target_options.fuse_write)
+  if (target_fuse_apply(&target_options, 0, (uint8_t *)&gpnvm, (uint8_t *)&fuses, sizeof(gpnvm)))
   {
-    if (target_options.fuse_name)
-    {
-      for (int i = 0; i < size; i++)
-        buf[i] = target_options.fuse_data[i];
-    }
-    else
-    {
-      apply_value(buf, target_options.fuse_value, target_options.fuse_start,
-          target_options.fuse_end);
-    }
-
+    // Each bit is a separate flash operation, only the changed ones are written
     for (int i = 0; i < GPNVM_SIZE_BITS; i++)
     {
-      if (gpnvm & (1 << i))
-        dap_write_word(EEFC_FCR(get_eefc_base(0)), CMD_SGPB | (i << 8));
-      else
-        dap_write_word(EEFC_FCR(get_eefc_base(0)), CMD_CGPB | (i << 8));
-    }
-  }
+      uint32_t bit = (1 << i);
 
-  if (target_options.fuse_verify)
-  {
-    dap_write_word(EEFC_FCR(get_eefc_base(0)), CMD_GGPB);
-    while (0 == (dap_read_word(EEFC_FSR(get_eefc_base(0))) & FSR_FRDY));
-    gpnvm = dap_read_word(EEFC_FRR(get_eefc_base(0)));
+      if (0 == ((gpnvm ^ fuses) & bit))
+        continue;
 
-    if (target_options.fuse_name)
-    {
-      for (int i = 0; i < size; i++)
-      {
-        if (target_options.fuse_data[i] != buf[i])
-        {
-          message("fuse byte %d expected 0x%02x, got 0x%02x", i,
-              target_options.fuse_data[i], buf[i]);
-          error_exit("fuse verification failed");
-        }
-      }
+      dap_queue_write_word(EEFC_FCR(get_eefc_base(0)), ((fuses & bit) ? CMD_SGPB : CMD_CGPB) | (i << 8));
+      eefc_wait_ready(get_eefc_base(0));
     }
-    else
-    {
-      uint32_t value;
 
-      if (read_all)
-      {
-        value = gpnvm;
-      }
-      else
-      {
-        value = extract_value(buf, target_options.fuse_start,
-          target_options.fuse_end);
-      }
-
-      if (target_options.fuse_value != value)
-      {
-        error_exit("fuse verification failed: expected 0x%x (%u), got 0x%x (%u)",
-            target_options.fuse_value, target_options.fuse_value, value, value);
-      }
-    }
+    dap_queue_write_word(EEFC_FCR(get_eefc_base(0)), CMD_GGPB);
+    eefc_wait_ready(get_eefc_base(0));
+    gpnvm = dap_read_word(EEFC_FRR(get_eefc_base(0)));
   }
+
+  target_fuse_verify(&target_options, 0, (uint8_t *)&gpnvm, sizeof(gpnvm));
 }
 
 //-----------------------------------------------------------------------------
 target_ops_t target_atmel_cm3_ops =
 {
+  .ids      = target_ids,
   .select   = target_select,
   .deselect = target_deselect,
   .erase    = target_erase,
@@ -34,12 +34,15 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "loader.h"
+#include "manifest.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_ADDR             0
 #define FLASH_ROW_SIZE         8192
 #define FLASH_PAGE_SIZE        512
-#define PAGES_IN_ERASE_BLOCK   (FLASH_ROW_SIZE / FLASH_PAGE_SIZE)
+
+#define SRAM_ADDR              0x20000000
 
 #define USER_ROW_ADDR          0x00804000
 #define USER_ROW_SIZE          512
@@ -50,11 +53,16 @@
 #define AIRCR                  0xe000ed0c
 
 #define DSU_CTRL_STATUS        0x41002100
+#define DSU_ADDR               0x41002104
+#define DSU_LENGTH             0x41002108
+#define DSU_DATA               0x4100210c
 #define DSU_DID                0x41002118
 
+#define DSU_CTRL_CRC           (1 << 2)
 #define DSU_CTRL_CE            (1 << 4)
 
 #define DSU_STATUSA_DONE       (1 << 8)
+#define DSU_STATUSA_BERR       (1 << 10)
 #define DSU_STATUSB_PROT       (1 << 16)
 
 #define NVMCTRL_CTRLA          0x41004000
@@ -64,9 +72,11 @@
 #define NVMCTRL_ADDR           0x41004014
 
 #define NVMCTRL_STATUS_READY   (1 << 16)
+#define NVMCTRL_STATUS_AFIRST  (1 << 20)
 
 #define NVMCTRL_CTRLA_AUTOWS     (1 << 2)
 #define NVMCTRL_CTRLA_WMODE_MAN  (0 << 4)
+#define NVMCTRL_CTRLA_WMODE_MASK (3 << 4)
 #define NVMCTRL_CTRLA_PRM_MANUAL (3 << 6)
 #define NVMCTRL_CTRLA_CACHEDIS0  (1 << 14)
 #define NVMCTRL_CTRLA_CACHEDIS1  (1 << 15)
@@ -78,11 +88,18 @@
 #define NVMCTRL_CMD_UR         0xa512
 #define NVMCTRL_CMD_PBC        0xa515
 #define NVMCTRL_CMD_SSB        0xa516
+#define NVMCTRL_CMD_BKSWRST    0xa517
 
 #define DEVICE_ID_MASK         0xfffff0ff
 #define DEVICE_REV_SHIFT       8
 #define DEVICE_REV_MASK        0xf
 
+#define NVM_TIMEOUT            1000 // ms
+#define ERASE_TIMEOUT          30000 // ms
+#define CRC_TIMEOUT            1000 // ms
+
+#define CRC_BLOCK_SIZE         FLASH_ROW_SIZE
+
 /*- Types -------------------------------------------------------------------*/
 typedef struct
 {
@@ -99,20 +116,91 @@ static device_t devices[] =
   { 0 },
 };
 
-static device_t target_device;
-static target_options_t target_options;
+static _Thread_local device_t target_device;
+static _Thread_local target_options_t target_options;
+static _Thread_local uint32_t target_bank_offset;
 
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static void nvmctrl_wait_ready(void)
+{
+  check(dap_wait_word(NVMCTRL_INTFLAG_STATUS, NVMCTRL_STATUS_READY, NVMCTRL_STATUS_READY,
+      NVM_TIMEOUT), "timeout while waiting for the NVM controller");
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t bank_addr(uint32_t addr)
+{
+  // The inactive bank is always mapped into the upper half of the flash
+  return addr + target_bank_offset;
+}
+
+//-----------------------------------------------------------------------------
+static bool dsu_crc32(uint32_t addr, uint32_t size, uint32_t *crc)
+{
+  uint32_t status;
+
+  dap_queue_write_word(DSU_CTRL_STATUS, DSU_STATUSA_DONE | DSU_STATUSA_BERR); // Clear flags
+  dap_queue_write_word(DSU_ADDR, addr);
+  dap_queue_write_word(DSU_LENGTH, size);
+  dap_queue_write_word(DSU_DATA, 0xffffffff);
+  dap_queue_write_word(DSU_CTRL_STATUS, DSU_CTRL_CRC);
+
+  if (!dap_wait_word(DSU_CTRL_STATUS, DSU_STATUSA_DONE, DSU_STATUSA_DONE, CRC_TIMEOUT))
+    return false;
+
+  dap_queue_read_word(DSU_CTRL_STATUS, &status);
+  dap_queue_read_word(DSU_DATA, crc);
+  dap_queue_flush();
+
+  return 0 == (status & DSU_STATUSA_BERR);
+}
+
+//-----------------------------------------------------------------------------
+static bool verify_crc(uint32_t addr, uint8_t *data, uint32_t size)
+{
+  uint32_t crc;
+
+  // The DSU works with whole words, the file buffer is padded with 0xff
+  if (!dsu_crc32(bank_addr(addr), (size + 3) & ~3, &crc))
+    return false;
+
+  return crc == target_crc32(0xffffffff, data, (size + 3) & ~3);
+}
+
+//-----------------------------------------------------------------------------
+static int target_ids(target_id_t *ids, int size)
+{
+  int count = 0;
+
+  for (device_t *device = devices; device->dsu_did > 0 && count < size; device++)
+  {
+    ids[count++] = (target_id_t){ .cpu = CPUID_CORTEX_M4, .addr = DSU_DID,
+        .mask = DEVICE_ID_MASK, .value = device->dsu_did };
+  }
+
+  return count;
+}
+
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
   uint32_t dsu_did, id, rev;
 
-  // Stop the core
-  dap_write_word(DHCSR, 0xa05f0003);
-  dap_write_word(DEMCR, 0x00000001);
-  dap_write_word(AIRCR, 0x05fa0004);
+  if (options->bank_swap)
+  {
+    // The application keeps running from the active bank
+    check(!options->erase, "chip erase can not be combined with the bank swap");
+    check(!options->loader, "flash loader can not be used with the bank swap");
+  }
+  else
+  {
+    // Stop the core
+    dap_queue_write_word(DHCSR, 0xa05f0003);
+    dap_queue_write_word(DEMCR, 0x00000001);
+    dap_write_word(AIRCR, 0x05fa0004);
+  }
 
   dsu_did = dap_read_word(DSU_DID);
   id = dsu_did & DEVICE_ID_MASK;
@@ -126,9 +214,21 @@ static void target_select(target_options_t *options)
 
       target_device = *device;
       target_options = *options;
+      target_bank_offset = options->bank_swap ? device->flash_size / 2 : 0;
+
+      target_check_options(&target_options, FLASH_ADDR, NULL,
+          device->flash_size - target_bank_offset, FLASH_ROW_SIZE, USER_ROW_SIZE);
 
-      target_check_options(&target_options, device->flash_size,
-          FLASH_ROW_SIZE, USER_ROW_SIZE);
+      // The manifest is kept by address, it can not follow the banks through the swap
+      if (options->bank_swap)
+      {
+        verbose("Inactive bank: %c\n", (dap_read_word(NVMCTRL_INTFLAG_STATUS) &
+            NVMCTRL_STATUS_AFIRST) ? 'B' : 'A');
+      }
+      else
+      {
+        manifest_select(dsu_did, FLASH_ADDR, device->flash_size, FLASH_ROW_SIZE);
+      }
 
       return;
     }
@@ -140,9 +240,19 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
-  dap_write_word(DEMCR, 0x00000000);
-  dap_write_word(AIRCR, 0x05fa0004);
+  if (!target_options.bank_swap)
+  {
+    dap_queue_write_word(DEMCR, 0x00000000);
+    dap_write_word(AIRCR, 0x05fa0004);
+  }
+  else if (target_options.program)
+  {
+    // The new image starts right away, the command resets the device
+    verbose("Swapping the banks...\n");
+    dap_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_BKSWRST);
+  }
 
+  manifest_close();
   target_free_options(&target_options);
 }
 
@@ -151,7 +261,11 @@ static void target_erase(void)
 {
   dap_write_word(DSU_CTRL_STATUS, DSU_CTRL_CE); // Chip erase
   sleep_ms(100);
-  while (0 == (dap_read_word(DSU_CTRL_STATUS) & DSU_STATUSA_DONE));
+  check(dap_wait_word(DSU_CTRL_STATUS, DSU_STATUSA_DONE, DSU_STATUSA_DONE, ERASE_TIMEOUT),
+      "timeout while waiting for the chip erase");
+
+  target_options.flash_erased = true;
+  manifest_erase();
 }
 
 //-----------------------------------------------------------------------------
@@ -161,226 +275,172 @@ static void target_lock(void)
 }
 
 //-----------------------------------------------------------------------------
-static void target_program(void)
+static void flash_unlock(uint32_t addr)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
-  uint32_t offs = 0;
-  uint32_t number_of_rows;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  dap_queue_write_word(NVMCTRL_ADDR, bank_addr(addr));
+  dap_queue_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_UR); // Unlock Region
+  nvmctrl_wait_ready();
+}
 
-  if (dap_read_word(DSU_CTRL_STATUS) & DSU_STATUSB_PROT)
-    error_exit("device is locked, perform a chip erase before programming");
+//-----------------------------------------------------------------------------
+static void flash_erase(uint32_t addr)
+{
+  dap_queue_write_word(NVMCTRL_ADDR, bank_addr(addr));
+  dap_queue_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_EB);
+  nvmctrl_wait_ready();
+}
 
-  dap_write_word(NVMCTRL_CTRLA, NVMCTRL_CTRLA_AUTOWS | NVMCTRL_CTRLA_WMODE_MAN |
-      NVMCTRL_CTRLA_PRM_MANUAL | NVMCTRL_CTRLA_CACHEDIS0 | NVMCTRL_CTRLA_CACHEDIS1);
+//-----------------------------------------------------------------------------
+static void flash_write(uint32_t addr, uint8_t *data, bool erase)
+{
+  addr = bank_addr(addr);
 
-  number_of_rows = (size + FLASH_ROW_SIZE - 1) / FLASH_ROW_SIZE;
+  dap_queue_write_word(NVMCTRL_ADDR, addr);
 
-  for (uint32_t row = 0; row < number_of_rows; row++)
-  {
-    dap_write_word(NVMCTRL_ADDR, addr);
+  dap_queue_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_PBC);
+  nvmctrl_wait_ready();
 
-    dap_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_UR); // Unlock Region
-    while (0 == (dap_read_word(NVMCTRL_INTFLAG_STATUS) & NVMCTRL_STATUS_READY));
+  dap_write_block(addr, data, FLASH_PAGE_SIZE);
 
-    dap_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_EB);
-    while (0 == (dap_read_word(NVMCTRL_INTFLAG_STATUS) & NVMCTRL_STATUS_READY));
+  dap_queue_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_WP); // Write page
+  nvmctrl_wait_ready();
 
-    for (int page = 0; page < PAGES_IN_ERASE_BLOCK; page++)
-    {
-      dap_write_word(NVMCTRL_ADDR, addr);
+  (void)erase;
+}
 
-      dap_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_PBC);
-      while (0 == (dap_read_word(NVMCTRL_INTFLAG_STATUS) & NVMCTRL_STATUS_READY));
+//-----------------------------------------------------------------------------
+static void program_with_loader(uint32_t addr, uint8_t *buf, uint32_t number_of_rows,
+    uint8_t *skip, bool erase)
+{
+  loader_t loader =
+  {
+    .type       = LOADER_NVMCTRL_V2,
+    .ram_addr   = SRAM_ADDR,
+    .buf_size   = FLASH_ROW_SIZE,
+    .buf_count  = 4,
+    .page_size  = FLASH_PAGE_SIZE,
+    .erase_size = FLASH_ROW_SIZE,
+    .compress   = target_options.compress,
+  };
 
-      dap_write_block(addr, &buf[offs], FLASH_PAGE_SIZE);
+  dap_write_word(NVMCTRL_INTFLAG_STATUS, 0x0000ffff); // Clear flags
 
-      dap_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_WP); // Write page
-      while (0 == (dap_read_word(NVMCTRL_INTFLAG_STATUS) & NVMCTRL_STATUS_READY));
+  loader_start(&loader);
 
-      addr += FLASH_PAGE_SIZE;
-      offs += FLASH_PAGE_SIZE;
+  for (uint32_t row = 0; row < number_of_rows; row++)
+  {
+    if (!skip[row])
+    {
+      loader_write(addr + row * FLASH_ROW_SIZE, &buf[row * FLASH_ROW_SIZE],
+          FLASH_ROW_SIZE, NVMCTRL_CTRLA, 0, erase);
     }
 
     verbose(".");
   }
+
+  loader_finish();
 }
 
 //-----------------------------------------------------------------------------
-static void target_verify(void)
+static target_flash_t target_flash =
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
-  uint32_t block_size;
-  uint32_t offs = 0;
-  uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  .flash_addr     = FLASH_ADDR,
+  .erase_size     = FLASH_ROW_SIZE,
+  .page_size      = FLASH_PAGE_SIZE,
+  .read_size      = FLASH_PAGE_SIZE,
+  .crc_block_size = CRC_BLOCK_SIZE,
+  .bank_swap      = true,
+  .crc            = verify_crc,
+  .map            = bank_addr,
+  .unlock         = flash_unlock,
+  .erase          = flash_erase,
+  .write          = flash_write,
+  .loader         = program_with_loader,
+};
 
-  bufb = buf_alloc(FLASH_PAGE_SIZE);
+//-----------------------------------------------------------------------------
+static void target_program(void)
+{
+  if (dap_read_word(DSU_CTRL_STATUS) & DSU_STATUSB_PROT)
+    error_exit("device is locked, perform a chip erase before programming");
 
-  while (size)
+  if (target_options.bank_swap)
   {
-    dap_read_block(addr, bufb, FLASH_PAGE_SIZE);
+    // Only the write mode changes, wait states and caches stay as the application set them
+    uint32_t ctrla = dap_read_word(NVMCTRL_CTRLA);
 
-    block_size = (size > FLASH_PAGE_SIZE) ? FLASH_PAGE_SIZE : size;
-
-    for (int i = 0; i < (int)block_size; i++)
-    {
-      if (bufa[offs + i] != bufb[i])
-      {
-        verbose("\nat address 0x%x expected 0x%02x, read 0x%02x\n",
-            addr + i, bufa[offs + i], bufb[i]);
-        buf_free(bufb);
-        error_exit("verification failed");
-      }
-    }
+    dap_write_word(NVMCTRL_CTRLA, (ctrla & ~NVMCTRL_CTRLA_WMODE_MASK) | NVMCTRL_CTRLA_WMODE_MAN);
+  }
+  else
+  {
+    dap_write_word(NVMCTRL_CTRLA, NVMCTRL_CTRLA_AUTOWS | NVMCTRL_CTRLA_WMODE_MAN |
+        NVMCTRL_CTRLA_PRM_MANUAL | NVMCTRL_CTRLA_CACHEDIS0 | NVMCTRL_CTRLA_CACHEDIS1);
+  }
 
-    addr += FLASH_PAGE_SIZE;
-    offs += FLASH_PAGE_SIZE;
-    size -= block_size;
+  target_flash_program(&target_flash, &target_options);
 
-    verbose(".");
-  }
+  // The banks are only swapped over a verified image
+  if (target_options.bank_swap && !target_options.verify)
+    target_flash_verify(&target_flash, &target_options);
+}
 
-  buf_free(bufb);
+//-----------------------------------------------------------------------------
+static void target_verify(void)
+{
+  target_flash_verify(&target_flash, &target_options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
-  uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
-
-  while (size)
-  {
-    dap_read_block(addr, &buf[offs], FLASH_PAGE_SIZE);
-
-    addr += FLASH_PAGE_SIZE;
-    offs += FLASH_PAGE_SIZE;
-    size -= FLASH_PAGE_SIZE;
-
-    verbose(".");
-  }
-
-  save_file(target_options.name, buf, target_options.size);
+  target_flash_read(&target_flash, &target_options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_fuse(void)
 {
-  uint8_t buf[USER_ROW_SIZE];
-  bool read_all = (-1 == target_options.fuse_start);
-  int size = (target_options.fuse_size < USER_ROW_SIZE) ?
-      target_options.fuse_size : USER_ROW_SIZE;
-  uint32_t addr, offs;
+  uint8_t buf[USER_ROW_SIZE], fuses[USER_ROW_SIZE];
 
-  check(0 == target_options.fuse_section, "unsupported fuse section %d",
-      target_options.fuse_section);
+  target_fuse_check(&target_options, 1);
 
   dap_read_block(USER_ROW_ADDR, buf, USER_ROW_SIZE);
 
-  if (target_options.fuse_read)
-  {
-    if (target_options.fuse_name)
-    {
-      save_file(target_options.fuse_name, buf, USER_ROW_SIZE);
-    }
-    else if (read_all)
-    {
-      message("Fuses (user row): ");
-
-      for (int i = 0; i < USER_ROW_SIZE; i++)
-        message("%02x ", buf[i]);
-
-      message("\n");
-    }
-    else
-    {
-      uint32_t value = extract_value(buf, target_options.fuse_start,
-          target_options.fuse_end);
-
-      message("Fuses: 0x%x (%d)\n", value, value);
-    }
-  }
+  target_fuse_read(&target_options, 0, buf, USER_ROW_SIZE, "Fuses (user row)", "Fuses");
 
-  if (target_options.fuse_write)
+  if (target_fuse_apply(&target_options, 0, buf, fuses, USER_ROW_SIZE))
   {
-    if (target_options.fuse_name)
-    {
-      for (int i = 0; i < size; i++)
-        buf[i] = target_options.fuse_data[i];
-    }
-    else
-    {
-      apply_value(buf, target_options.fuse_value, target_options.fuse_start,
-          target_options.fuse_end);
-    }
-
-    dap_write_word(NVMCTRL_ADDR, USER_ROW_ADDR);
-
-    dap_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_EP);
-    while (0 == (dap_read_word(NVMCTRL_INTFLAG_STATUS) & NVMCTRL_STATUS_READY));
+    dap_queue_write_word(NVMCTRL_ADDR, USER_ROW_ADDR);
 
-    dap_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_PBC);
-    while (0 == (dap_read_word(NVMCTRL_INTFLAG_STATUS) & NVMCTRL_STATUS_READY));
+    dap_queue_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_EP);
+    nvmctrl_wait_ready();
 
-    addr = USER_ROW_ADDR;
-    offs = 0;
+    dap_queue_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_PBC);
+    nvmctrl_wait_ready();
 
-    for (int i = 0; i < (USER_ROW_SIZE / USER_ROW_PAGE_SIZE); i++)
+    // Quad words that stay erased are not written
+    for (int offs = 0; offs < USER_ROW_SIZE; offs += USER_ROW_PAGE_SIZE)
     {
-      dap_write_word(NVMCTRL_ADDR, USER_ROW_ADDR);
+      if (target_is_blank(&fuses[offs], USER_ROW_PAGE_SIZE))
+        continue;
 
-      dap_write_block(addr, &buf[offs], USER_ROW_PAGE_SIZE);
+      dap_queue_write_word(NVMCTRL_ADDR, USER_ROW_ADDR + offs);
 
-      dap_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_WQW);
-      while (0 == (dap_read_word(NVMCTRL_INTFLAG_STATUS) & NVMCTRL_STATUS_READY));
+      dap_write_block(USER_ROW_ADDR + offs, &fuses[offs], USER_ROW_PAGE_SIZE);
 
-      addr += USER_ROW_PAGE_SIZE;
-      offs += USER_ROW_PAGE_SIZE;
+      dap_queue_write_word(NVMCTRL_CTRLB, NVMCTRL_CMD_WQW);
+      nvmctrl_wait_ready();
     }
-  }
 
-  if (target_options.fuse_verify)
-  {
     dap_read_block(USER_ROW_ADDR, buf, USER_ROW_SIZE);
-
-    if (target_options.fuse_name)
-    {
-      for (int i = 0; i < size; i++)
-      {
-        if (target_options.fuse_data[i] != buf[i])
-        {
-          message("fuse byte %d expected 0x%02x, got 0x%02x", i,
-              target_options.fuse_data[i], buf[i]);
-          error_exit("fuse verification failed");
-        }
-      }
-    }
-    else if (read_all)
-    {
-      error_exit("please specify fuse bit range for verification");
-    }
-    else
-    {
-      uint32_t value = extract_value(buf, target_options.fuse_start,
-          target_options.fuse_end);
-
-      if (target_options.fuse_value != value)
-      {
-        error_exit("fuse verification failed: expected 0x%x (%u), got 0x%x (%u)",
-            target_options.fuse_value, target_options.fuse_value, value, value);
-      }
-    }
   }
+
+  target_fuse_verify(&target_options, 0, buf, USER_ROW_SIZE);
 }
 
 //-----------------------------------------------------------------------------
 target_ops_t target_atmel_cm4v2_ops = 
 {
+  .ids      = target_ids,
   .select   = target_select,
   .deselect = target_deselect,
   .erase    = target_erase,
@@ -34,11 +34,15 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "loader.h"
+#include "manifest.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_START            0x00400000
 #define FLASH_PAGE_SIZE        512
 
+#define SRAM_ADDR              0x20400000
+
 #define DHCSR                  0xe000edf0
 #define DEMCR                  0xe000edfc
 #define AIRCR                  0xe000ed0c
@@ -65,6 +69,9 @@
 #define GPNVM_SIZE             2
 #define GPNVM_SIZE_BITS        9
 
+#define EEFC_TIMEOUT           2000 // ms
+#define ERASE_TIMEOUT          30000 // ms
+
 /*- Types -------------------------------------------------------------------*/
 typedef struct
 {
@@ -115,23 +122,45 @@ static device_t devices[] =
   { 0, 0, "", 0 },
 };
 
-static device_t target_device;
-static target_options_t target_options;
+static _Thread_local device_t target_device;
+static _Thread_local target_options_t target_options;
 
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static void eefc_wait_ready(void)
+{
+  check(dap_wait_word(EEFC_FSR, FSR_FRDY, FSR_FRDY, EEFC_TIMEOUT),
+      "timeout while waiting for the flash controller");
+}
+
+//-----------------------------------------------------------------------------
+static int target_ids(target_id_t *ids, int size)
+{
+  int count = 0;
+
+  for (device_t *device = devices; device->chip_id > 0 && count < size; device++)
+  {
+    ids[count++] = (target_id_t){ .cpu = CPUID_CORTEX_M7, .addr = CHIPID_CIDR, .mask = 0xffffffff,
+        .value = device->chip_id, .ext_addr = CHIPID_EXID, .ext_value = device->chip_exid };
+  }
+
+  return count;
+}
+
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
   uint32_t chip_id, chip_exid;
 
   // Stop the core
-  dap_write_word(DHCSR, 0xa05f0003);
-  dap_write_word(DEMCR, 0x00000001);
+  dap_queue_write_word(DHCSR, 0xa05f0003);
+  dap_queue_write_word(DEMCR, 0x00000001);
   dap_write_word(AIRCR, 0x05fa0004);
 
-  chip_id = dap_read_word(CHIPID_CIDR);
-  chip_exid = dap_read_word(CHIPID_EXID);
+  dap_queue_read_word(CHIPID_CIDR, &chip_id);
+  dap_queue_read_word(CHIPID_EXID, &chip_exid);
+  dap_queue_flush();
 
   for (device_t *device = devices; device->chip_id > 0; device++)
   {
@@ -141,32 +170,38 @@ static void target_select(target_options_t *options)
 
       verbose("Target: %s\n", device->name);
 
-      dap_write_word(EEFC_FCR, CMD_GETD);
-      while (0 == (dap_read_word(EEFC_FSR) & FSR_FRDY));
+      dap_queue_write_word(EEFC_FCR, CMD_GETD);
+      eefc_wait_ready();
 
-      fl_id = dap_read_word(EEFC_FRR);
-      check(fl_id, "Cannot read flash descriptor, check Erase pin state");
+      dap_queue_read_word(EEFC_FRR, &fl_id);
+      dap_queue_read_word(EEFC_FRR, &fl_size);
+      dap_queue_read_word(EEFC_FRR, &fl_page_size);
+      dap_queue_read_word(EEFC_FRR, &fl_nb_palne);
+      dap_queue_flush();
 
-      fl_size = dap_read_word(EEFC_FRR);
+      check(fl_id, "Cannot read flash descriptor, check Erase pin state");
       check(fl_size == device->flash_size, "Invalid reported Flash size (%d)", fl_size);
-
-      fl_page_size = dap_read_word(EEFC_FRR);
       check(fl_page_size == FLASH_PAGE_SIZE, "Invalid reported page size (%d)", fl_page_size);
 
-      fl_nb_palne = dap_read_word(EEFC_FRR);
       for (uint32_t i = 0; i < fl_nb_palne; i++)
-        dap_read_word(EEFC_FRR);
+        dap_queue_read_word(EEFC_FRR, NULL);
+      dap_queue_read_word(EEFC_FRR, &fl_nb_lock);
+      dap_queue_flush();
 
-      fl_nb_lock =  dap_read_word(EEFC_FRR);
       for (uint32_t i = 0; i < fl_nb_lock; i++)
-        dap_read_word(EEFC_FRR);
+        dap_queue_read_word(EEFC_FRR, NULL);
+      dap_queue_flush();
 
       target_device = *device;
       target_options = *options;
 
-      target_check_options(&target_options, device->flash_size,
+      target_check_options(&target_options, FLASH_START, NULL,
+          device->flash_size,
           FLASH_PAGE_SIZE * PAGES_IN_ERASE_BLOCK, GPNVM_SIZE);
 
+      manifest_select(chip_id, FLASH_START, device->flash_size,
+          FLASH_PAGE_SIZE * PAGES_IN_ERASE_BLOCK);
+
       return;
     }
   }
@@ -177,18 +212,23 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
-  dap_write_word(DHCSR, 0xa05f0000);
-  dap_write_word(DEMCR, 0x00000000);
+  dap_queue_write_word(DHCSR, 0xa05f0000);
+  dap_queue_write_word(DEMCR, 0x00000000);
   dap_write_word(AIRCR, 0x05fa0004);
 
+  manifest_close();
   target_free_options(&target_options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_erase(void)
 {
-  dap_write_word(EEFC_FCR, CMD_EA);
-  while (0 == (dap_read_word(EEFC_FSR) & FSR_FRDY));
+  dap_queue_write_word(EEFC_FCR, CMD_EA);
+  check(dap_wait_word(EEFC_FSR, FSR_FRDY, FSR_FRDY, ERASE_TIMEOUT),
+      "timeout while waiting for the chip erase");
+
+  target_options.flash_erased = true;
+  manifest_erase();
 }
 
 //-----------------------------------------------------------------------------
@@ -198,202 +238,138 @@ static void target_lock(void)
 }
 
 //-----------------------------------------------------------------------------
-static void target_program(void)
+static void flash_erase(uint32_t addr)
 {
-  uint32_t addr = FLASH_START + target_options.offset;
-  uint32_t number_of_pages, page_offset;
-  uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint32_t page = (addr - FLASH_START) / FLASH_PAGE_SIZE;
 
-  number_of_pages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
-  page_offset = target_options.offset / FLASH_PAGE_SIZE;
-
-  for (uint32_t page = 0; page < number_of_pages; page += PAGES_IN_ERASE_BLOCK)
-  {
-    dap_write_word(EEFC_FCR, CMD_EPA | (((page_offset + page) | 2) << 8));
-    while (0 == (dap_read_word(EEFC_FSR) & FSR_FRDY));
-
-    verbose(".");
-  }
+  dap_queue_write_word(EEFC_FCR, CMD_EPA | ((page | 2) << 8));
+}
 
-  verbose(",");
+//-----------------------------------------------------------------------------
+static void flash_write(uint32_t addr, uint8_t *data, bool erase)
+{
+  uint32_t page = (addr - FLASH_START) / FLASH_PAGE_SIZE;
 
-  for (uint32_t page = 0; page < number_of_pages; page++)
-  {
-    dap_write_block(addr, &buf[offs], FLASH_PAGE_SIZE);
-    addr += FLASH_PAGE_SIZE;
-    offs += FLASH_PAGE_SIZE;
+  dap_write_block(addr, data, FLASH_PAGE_SIZE);
+  dap_queue_write_word(EEFC_FCR, CMD_WP | (page << 8));
 
-    dap_write_word(EEFC_FCR, CMD_WP | ((page + page_offset) << 8));
-    while (0 == (dap_read_word(EEFC_FSR) & FSR_FRDY));
+  (void)erase;
+}
 
-    verbose(".");
-  }
+//-----------------------------------------------------------------------------
+static void flash_wait(int plane)
+{
+  eefc_wait_ready();
+  (void)plane;
 }
 
 //-----------------------------------------------------------------------------
-static void target_verify(void)
+static void program_with_loader(uint32_t addr, uint8_t *buf, uint32_t number_of_blocks,
+    uint8_t *skip, bool erase)
 {
-  uint32_t addr = FLASH_START + target_options.offset;
-  uint32_t block_size;
-  uint32_t offs = 0;
-  uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint32_t page_offset = (addr - FLASH_START) / FLASH_PAGE_SIZE;
+  loader_t loader =
+  {
+    .type       = LOADER_EEFC,
+    .ram_addr   = SRAM_ADDR,
+    .buf_size   = FLASH_PAGE_SIZE * PAGES_IN_ERASE_BLOCK,
+    .buf_count  = 4,
+    .page_size  = FLASH_PAGE_SIZE,
+    .erase_size = FLASH_PAGE_SIZE * PAGES_IN_ERASE_BLOCK,
+    .arg        = { CMD_EPA | (2 << 8), CMD_WP, CMD_WP },
+  };
 
-  bufb = buf_alloc(FLASH_PAGE_SIZE);
+  dap_read_word(EEFC_FSR); // Clear error flags
 
-  while (size)
-  {
-    dap_read_block(addr, bufb, FLASH_PAGE_SIZE);
+  loader_start(&loader);
 
-    block_size = (size > FLASH_PAGE_SIZE) ? FLASH_PAGE_SIZE : size;
+  for (uint32_t block = 0; block < number_of_blocks; block++)
+  {
+    uint32_t page = block * PAGES_IN_ERASE_BLOCK;
 
-    for (int i = 0; i < (int)block_size; i++)
+    if (!skip[block])
     {
-      if (bufa[offs + i] != bufb[i])
-      {
-        verbose("\nat address 0x%x expected 0x%02x, read 0x%02x\n",
-            addr + i, bufa[offs + i], bufb[i]);
-        buf_free(bufb);
-        error_exit("verification failed");
-      }
+      loader_write(addr + page * FLASH_PAGE_SIZE, &buf[page * FLASH_PAGE_SIZE],
+          PAGES_IN_ERASE_BLOCK * FLASH_PAGE_SIZE, EEFC_FMR, page_offset + page, erase);
     }
 
-    addr += FLASH_PAGE_SIZE;
-    offs += FLASH_PAGE_SIZE;
-    size -= block_size;
-
     verbose(".");
   }
 
-  buf_free(bufb);
+  loader_finish();
 }
 
 //-----------------------------------------------------------------------------
-static void target_read(void)
+static target_flash_t target_flash =
 {
-  uint32_t addr = FLASH_START + target_options.offset;
-  uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
-
-  while (size)
-  {
-    dap_read_block(addr, &buf[offs], FLASH_PAGE_SIZE);
+  .flash_addr     = FLASH_START,
+  .erase_size     = FLASH_PAGE_SIZE * PAGES_IN_ERASE_BLOCK,
+  .page_size      = FLASH_PAGE_SIZE,
+  .read_size      = FLASH_PAGE_SIZE,
+  .erase          = flash_erase,
+  .write          = flash_write,
+  .wait           = flash_wait,
+  .loader         = program_with_loader,
+};
 
-    addr += FLASH_PAGE_SIZE;
-    offs += FLASH_PAGE_SIZE;
-    size -= FLASH_PAGE_SIZE;
+//-----------------------------------------------------------------------------
+static void target_program(void)
+{
+  target_flash_program(&target_flash, &target_options);
+}
 
-    verbose(".");
-  }
+//-----------------------------------------------------------------------------
+static void target_verify(void)
+{
+  target_flash_verify(&target_flash, &target_options);
+}
 
-  save_file(target_options.name, buf, target_options.size);
+//-----------------------------------------------------------------------------
+static void target_read(void)
+{
+  target_flash_read(&target_flash, &target_options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_fuse(void)
 {
-  bool read_all = (-1 == target_options.fuse_start);
-  uint32_t gpnvm;
-  uint8_t *buf = (uint8_t *)&gpnvm;
-  int size = (target_options.fuse_size < GPNVM_SIZE) ?
-      target_options.fuse_size : GPNVM_SIZE;
+  uint32_t gpnvm, fuses;
 
-  check(0 == target_options.fuse_section, "unsupported fuse section %d",
-      target_options.fuse_section);
+  target_fuse_check(&target_options, 1);
 
-  dap_write_word(EEFC_FCR, CMD_GGPB);
-  while (0 == (dap_read_word(EEFC_FSR) & FSR_FRDY));
+  dap_queue_write_word(EEFC_FCR, CMD_GGPB);
+  eefc_wait_ready();
   gpnvm = dap_read_word(EEFC_FRR);
 
-  if (target_options.fuse_read)
-  {
-    if (target_options.fuse_name)
-    {
-      save_file(target_options.fuse_name, buf, sizeof(gpnvm));
-    }
-    else if (read_all)
-    {
-      message("GPNVM Bits: 0x%02x\n", gpnvm);
-    }
-    else
-    {
-      uint32_t value = extract_value(buf, target_options.fuse_start,
-          target_options.fuse_end);
-
-      message("GPNVM Bits: 0x%02x (%d)\n", value, value);
-    }
-  }
+  target_fuse_read(&target_options, 0, (uint8_t *)&gpnvm, sizeof(gpnvm),
+      "GPNVM Bits", "GPNVM Bits");
 
-  if (target_options.fuse_write)
+  if (target_fuse_apply(&target_options, 0, (uint8_t *)&gpnvm, (uint8_t *)&fuses, sizeof(gpnvm)))
   {
-    if (target_options.fuse_name)
-    {
-      for (int i = 0; i < size; i++)
-        buf[i] = target_options.fuse_data[i];
-    }
-    else
-    {
-      apply_value(buf, target_options.fuse_value, target_options.fuse_start,
-          target_options.fuse_end);
-    }
-
+    // Each bit is a separate flash operation, only the changed ones are written
     for (int i = 0; i < GPNVM_SIZE_BITS; i++)
     {
-      if (gpnvm & (1 << i))
-        dap_write_word(EEFC_FCR, CMD_SGPB | (i << 8));
-      else
-        dap_write_word(EEFC_FCR, CMD_CGPB | (i << 8));
-    }
-  }
+      uint32_t bit = (1 << i);
 
-  if (target_options.fuse_verify)
-  {
-    dap_write_word(EEFC_FCR, CMD_GGPB);
-    while (0 == (dap_read_word(EEFC_FSR) & FSR_FRDY));
-    gpnvm = dap_read_word(EEFC_FRR);
+      if (0 == ((gpnvm ^ fuses) & bit))
+        continue;
 
-    if (target_options.fuse_name)
-    {
-      for (int i = 0; i < size; i++)
-      {
-        if (target_options.fuse_data[i] != buf[i])
-        {
-          message("fuse byte %d expected 0x%02x, got 0x%02x", i,
-              target_options.fuse_data[i], buf[i]);
-          error_exit("fuse verification failed");
-        }
-      }
-    }
-    else
-    {
-      uint32_t value;
-
-      if (read_all)
-      {
-        value = gpnvm;
-      }
-      else
-      {
-        value = extract_value(buf, target_options.fuse_start,
-          target_options.fuse_end);
-      }
-
-      if (target_options.fuse_value != value)
-      {
-        error_exit("fuse verification failed: expected 0x%x (%u), got 0x%x (%u)",
-            target_options.fuse_value, target_options.fuse_value, value, value);
-      }
+      dap_queue_write_word(EEFC_FCR, ((fuses & bit) ? CMD_SGPB : CMD_CGPB) | (i << 8));
+      eefc_wait_ready();
     }
+
+    dap_queue_write_word(EEFC_FCR, CMD_GGPB);
+    eefc_wait_ready();
+    gpnvm = dap_read_word(EEFC_FRR);
   }
+
+  target_fuse_verify(&target_options, 0, (uint8_t *)&gpnvm, sizeof(gpnvm));
 }
 
 //-----------------------------------------------------------------------------
 target_ops_t target_atmel_cm7_ops = 
 {
+  .ids      = target_ids,
   .select   = target_select,
   .deselect = target_deselect,
   .erase    = target_erase,
@@ -35,6 +35,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "manifest.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_ADDR             0
@@ -51,12 +52,19 @@
 #define DSU_CTRL               0x41002100
 #define DSU_STATUSA            0x41002101
 #define DSU_STATUSB            0x41002102
+#define DSU_ADDR               0x41002104
+#define DSU_LENGTH             0x41002108
+#define DSU_DATA               0x4100210c
 
 #define DSU_DID                0x41002118
 #define DSU_BCC0               0x41002120
 #define DSU_BCC1               0x41002124
 
+#define DSU_CTRL_CRC           (1 << 2)
+
+#define DSU_STATUSA_DONE       (1 << 0)
 #define DSU_STATUSA_CRSTEXT    (1 << 1)
+#define DSU_STATUSA_BERR       (1 << 2)
 #define DSU_STATUSA_BREXT      (1 << 5)
 
 #define DSU_STATUSB_BCCD0      (1 << 6)
@@ -82,6 +90,12 @@
 #define DEVICE_REV_SHIFT       8
 #define DEVICE_REV_MASK        0xf
 
+#define NVM_TIMEOUT            1000 // ms
+#define BOOTROM_TIMEOUT        5000 // ms
+#define CRC_TIMEOUT            1000 // ms
+
+#define CRC_BLOCK_SIZE         8192
+
 #define CMD_PREFIX             0x44424700
 #define SIG_PREFIX             0xec000000
 
@@ -134,22 +148,67 @@ static device_t devices[] =
   { 0 },
 };
 
-static device_t target_device;
-static target_options_t target_options;
+static _Thread_local device_t target_device;
+static _Thread_local target_options_t target_options;
+static _Thread_local bool in_park_mode = false;
 
-static uint32_t NVMCTRL_CTRLA;
-static uint32_t NVMCTRL_CTRLB;
-static uint32_t NVMCTRL_CTRLC;
-static uint32_t NVMCTRL_STATUS;
-static uint32_t NVMCTRL_ADDR;
+static _Thread_local uint32_t NVMCTRL_CTRLA;
+static _Thread_local uint32_t NVMCTRL_CTRLB;
+static _Thread_local uint32_t NVMCTRL_CTRLC;
+static _Thread_local uint32_t NVMCTRL_STATUS;
+static _Thread_local uint32_t NVMCTRL_ADDR;
 
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static void nvmctrl_wait_ready(void)
+{
+  check(dap_wait_byte(NVMCTRL_STATUS, NVMCTRL_STATUS_READY, NVMCTRL_STATUS_READY,
+      NVM_TIMEOUT), "timeout while waiting for the NVM controller");
+}
+
+//-----------------------------------------------------------------------------
+static bool dsu_crc32(uint32_t addr, uint32_t size, uint32_t *crc)
+{
+  // BootROM CMD_CRC is only available in the interactive mode, but with DAL 2
+  // the DSU CRC engine is accessible directly from the park mode
+  dap_write_byte(DSU_STATUSA, DSU_STATUSA_DONE | DSU_STATUSA_BERR); // Clear flags
+  dap_queue_write_word(DSU_ADDR, addr);
+  dap_queue_write_word(DSU_LENGTH, size);
+  dap_queue_write_word(DSU_DATA, 0xffffffff);
+  dap_write_byte(DSU_CTRL, DSU_CTRL_CRC);
+
+  if (!dap_wait_byte(DSU_STATUSA, DSU_STATUSA_DONE, DSU_STATUSA_DONE, CRC_TIMEOUT))
+    return false;
+
+  if (dap_read_byte(DSU_STATUSA) & DSU_STATUSA_BERR)
+    return false;
+
+  *crc = dap_read_word(DSU_DATA);
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static bool verify_crc(uint32_t addr, uint8_t *data, uint32_t size)
+{
+  uint32_t crc;
+
+  // The DSU works with whole words, the file buffer is padded with 0xff
+  if (!dsu_crc32(addr, (size + 3) & ~3, &crc))
+    return false;
+
+  return crc == target_crc32(0xffffffff, data, (size + 3) & ~3);
+}
+
 //-----------------------------------------------------------------------------
 static void reset_with_extension(void)
 {
   dap_reset_target_hw(0);
 
+  // The reset takes the BootROM out of the park mode
+  in_park_mode = false;
+
   reconnect_debugger();
 
   dap_write_byte(DSU_STATUSA, DSU_STATUSA_CRSTEXT);
@@ -158,30 +217,26 @@ static void reset_with_extension(void)
 //-----------------------------------------------------------------------------
 static void bootrom_data(uint32_t data)
 {
-  dap_write_word(DSU_BCC0, data);
-  while (dap_read_byte(DSU_STATUSB) & DSU_STATUSB_BCCD0);
+  dap_queue_write_word(DSU_BCC0, data);
+  check(dap_wait_byte(DSU_STATUSB, DSU_STATUSB_BCCD0, 0, BOOTROM_TIMEOUT),
+      "BootROM did not accept the data");
 }
 
 //-----------------------------------------------------------------------------
 static void bootrom_command(int cmd)
 {
-  dap_write_word(DSU_BCC0, CMD_PREFIX | cmd);
-  while (dap_read_byte(DSU_STATUSB) & DSU_STATUSB_BCCD0);
+  dap_queue_write_word(DSU_BCC0, CMD_PREFIX | cmd);
+  check(dap_wait_byte(DSU_STATUSB, DSU_STATUSB_BCCD0, 0, BOOTROM_TIMEOUT),
+      "BootROM did not accept the command");
 }
 
 //-----------------------------------------------------------------------------
 static int bootrom_expect(int status)
 {
   uint32_t v;
-  int i, res;
-
-  for (i = 1000; i > 0; i--)
-  {
-    if (dap_read_byte(DSU_STATUSB) & DSU_STATUSB_BCCD1)
-      break;
-  }
+  int res;
 
-  if (0 == i)
+  if (!dap_wait_byte(DSU_STATUSB, DSU_STATUSB_BCCD1, DSU_STATUSB_BCCD1, BOOTROM_TIMEOUT))
     error_exit("no BootROM response");
 
   v = dap_read_word(DSU_BCC1);
@@ -200,7 +255,6 @@ static int bootrom_expect(int status)
 //-----------------------------------------------------------------------------
 static void bootrom_park(void)
 {
-  static bool in_park_mode = false;
   int response;
 
   if (!in_park_mode)
@@ -220,6 +274,20 @@ static void bootrom_park(void)
   }
 }
 
+//-----------------------------------------------------------------------------
+static int target_ids(target_id_t *ids, int size)
+{
+  int count = 0;
+
+  for (device_t *device = devices; device->dsu_did > 0 && count < size; device++)
+  {
+    ids[count++] = (target_id_t){ .cpu = CPUID_CORTEX_M23, .addr = DSU_DID,
+        .mask = DEVICE_ID_MASK, .value = device->dsu_did };
+  }
+
+  return count;
+}
+
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
@@ -257,9 +325,11 @@ static void target_select(target_options_t *options)
         NVMCTRL_ADDR   = NVMCTRL_NSEC_ADDR;
       }
 
-      target_check_options(&target_options, device->flash_size,
+      target_check_options(&target_options, FLASH_ADDR, NULL, device->flash_size,
           FLASH_ROW_SIZE, FLASH_ROW_SIZE);
 
+      manifest_select(dsu_did, FLASH_ADDR, device->flash_size, FLASH_ROW_SIZE);
+
       return;
     }
   }
@@ -270,6 +340,7 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
+  manifest_close();
   target_free_options(&target_options);
 }
 
@@ -305,6 +376,9 @@ static void target_erase(void)
   }
 
   bootrom_expect(SIG_CMD_SUCCESS);
+
+  target_options.flash_erased = true;
+  manifest_erase();
 }
 
 //-----------------------------------------------------------------------------
@@ -313,216 +387,120 @@ static void target_lock(void)
   bootrom_park();
 
   dap_write_half(NVMCTRL_CTRLA, NVMCTRL_CMD_SDAL0);
-  while (0 == (dap_read_byte(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
+  nvmctrl_wait_ready();
 }
 
 //-----------------------------------------------------------------------------
-static void target_program(void)
+static void flash_erase(uint32_t addr)
+{
+  dap_queue_write_word(NVMCTRL_ADDR, addr);
+  dap_write_half(NVMCTRL_CTRLA, NVMCTRL_CMD_ER);
+  nvmctrl_wait_ready();
+}
+
+//-----------------------------------------------------------------------------
+static void flash_write(uint32_t addr, uint8_t *data, bool erase)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
-  uint32_t offs = 0;
-  uint32_t number_of_rows;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  // Pages are written automatically
+  dap_write_block(addr, data, FLASH_PAGE_SIZE);
+  (void)erase;
+}
 
+//-----------------------------------------------------------------------------
+static target_flash_t target_flash =
+{
+  .flash_addr     = FLASH_ADDR,
+  .erase_size     = FLASH_ROW_SIZE,
+  .page_size      = FLASH_PAGE_SIZE,
+  .read_size      = FLASH_ROW_SIZE,
+  .crc_block_size = CRC_BLOCK_SIZE,
+  .crc            = verify_crc,
+  .erase          = flash_erase,
+  .write          = flash_write,
+};
+
+//-----------------------------------------------------------------------------
+static void target_program(void)
+{
   bootrom_park();
 
   if ((dap_read_byte(DSU_STATUSB) & 0x03) != 0x02)
     error_exit("device is locked (DAL is not 2), perform a chip erase before programming");
 
-  number_of_rows = (size + FLASH_ROW_SIZE - 1) / FLASH_ROW_SIZE;
-
   dap_write_byte(NVMCTRL_CTRLC, 0); // Enable automatic write
 
-  for (uint32_t row = 0; row < number_of_rows; row++)
-  {
-    dap_write_word(NVMCTRL_ADDR, addr);
-
-    dap_write_half(NVMCTRL_CTRLA, NVMCTRL_CMD_ER);
-    while (0 == (dap_read_byte(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
-
-    dap_write_block(addr, &buf[offs], FLASH_ROW_SIZE);
-
-    addr += FLASH_ROW_SIZE;
-    offs += FLASH_ROW_SIZE;
-
-    verbose(".");
-  }
+  target_flash_program(&target_flash, &target_options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
-  uint32_t block_size;
-  uint32_t offs = 0;
-  uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
-
   bootrom_park();
 
   if ((dap_read_byte(DSU_STATUSB) & 0x03) != 0x02)
     error_exit("device is locked (DAL is not 2), unable to verify");
 
-  bufb = buf_alloc(FLASH_ROW_SIZE);
-
-  while (size)
-  {
-    dap_read_block(addr, bufb, FLASH_ROW_SIZE);
-
-    block_size = (size > FLASH_ROW_SIZE) ? FLASH_ROW_SIZE : size;
-
-    for (int i = 0; i < (int)block_size; i++)
-    {
-      if (bufa[offs + i] != bufb[i])
-      {
-        verbose("\nat address 0x%x expected 0x%02x, read 0x%02x\n",
-            addr + i, bufa[offs + i], bufb[i]);
-        buf_free(bufb);
-        error_exit("verification failed");
-      }
-    }
-
-    addr += FLASH_ROW_SIZE;
-    offs += FLASH_ROW_SIZE;
-    size -= block_size;
-
-    verbose(".");
-  }
-
-  buf_free(bufb);
+  target_flash_verify(&target_flash, &target_options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
-  uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
-
   bootrom_park();
 
   if ((dap_read_byte(DSU_STATUSB) & 0x03) != 0x02)
     error_exit("device is locked (DAL is not 2), unable to read");
 
-  while (size)
-  {
-    dap_read_block(addr, &buf[offs], FLASH_ROW_SIZE);
-
-    addr += FLASH_ROW_SIZE;
-    offs += FLASH_ROW_SIZE;
-    size -= FLASH_ROW_SIZE;
-
-    verbose(".");
-  }
-
-  save_file(target_options.name, buf, target_options.size);
+  target_flash_read(&target_flash, &target_options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_fuse(void)
 {
-  uint8_t buf[FLASH_ROW_SIZE];
-  bool read_all = (-1 == target_options.fuse_start);
-  int size = (target_options.fuse_size < FLASH_ROW_SIZE) ?
-      target_options.fuse_size : FLASH_ROW_SIZE;
-  uint32_t addr = 0;
-
-  if (0 == target_options.fuse_section)
-    addr = USER_ROW_ADDR;
-  else if (1 == target_options.fuse_section)
-    addr = BOCOR_ROW_ADDR;
-  else
-    error_exit("unsupported fuse section %d", target_options.fuse_section);
+  static const uint32_t rows[] = { USER_ROW_ADDR, BOCOR_ROW_ADDR };
+  int count = sizeof(rows) / sizeof(uint32_t);
+  uint8_t buf[FLASH_ROW_SIZE], fuses[FLASH_ROW_SIZE];
 
-  bootrom_park();
+  target_fuse_check(&target_options, count);
 
-  dap_read_block(addr, buf, FLASH_ROW_SIZE);
+  bootrom_park();
 
-  if (target_options.fuse_read)
+  for (int section = 0; section < count; section++)
   {
-    if (target_options.fuse_name)
-    {
-      save_file(target_options.fuse_name, buf, FLASH_ROW_SIZE);
-    }
-    else if (read_all)
-    {
-      message("Fuses: ");
+    uint32_t addr = rows[section];
 
-      for (int i = 0; i < FLASH_ROW_SIZE; i++)
-        message("%02x ", buf[i]);
+    if (!target_fuse_section(&target_options, section))
+      continue;
 
-      message("\n");
-    }
-    else
-    {
-      uint32_t value = extract_value(buf, target_options.fuse_start,
-          target_options.fuse_end);
+    dap_read_block(addr, buf, FLASH_ROW_SIZE);
 
-      message("Fuses: 0x%x (%d)\n", value, value);
-    }
-  }
+    target_fuse_read(&target_options, section, buf, FLASH_ROW_SIZE, "Fuses", "Fuses");
 
-  if (target_options.fuse_write)
-  {
-    if (target_options.fuse_name)
-    {
-      for (int i = 0; i < size; i++)
-        buf[i] = target_options.fuse_data[i];
-    }
-    else
+    if (target_fuse_apply(&target_options, section, buf, fuses, FLASH_ROW_SIZE))
     {
-      apply_value(buf, target_options.fuse_value, target_options.fuse_start,
-          target_options.fuse_end);
-    }
-
-    dap_write_byte(NVMCTRL_CTRLC, 0);
-    dap_write_word(NVMCTRL_ADDR, addr);
-    dap_write_half(NVMCTRL_CTRLA, NVMCTRL_CMD_ER);
-    while (0 == (dap_read_byte(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
+      dap_write_byte(NVMCTRL_CTRLC, 0);
+      dap_queue_write_word(NVMCTRL_ADDR, addr);
+      dap_write_half(NVMCTRL_CTRLA, NVMCTRL_CMD_ER);
+      nvmctrl_wait_ready();
 
-    dap_write_block(addr, buf, FLASH_ROW_SIZE);
-  }
-
-  if (target_options.fuse_verify)
-  {
-    dap_read_block(addr, buf, FLASH_ROW_SIZE);
-
-    if (target_options.fuse_name)
-    {
-      for (int i = 0; i < size; i++)
+      // Pages that stay erased are not written
+      for (int offs = 0; offs < FLASH_ROW_SIZE; offs += FLASH_PAGE_SIZE)
       {
-        if (target_options.fuse_data[i] != buf[i])
-        {
-          message("fuse byte %d expected 0x%02x, got 0x%02x", i,
-              target_options.fuse_data[i], buf[i]);
-          error_exit("fuse verification failed");
-        }
+        if (!target_is_blank(&fuses[offs], FLASH_PAGE_SIZE))
+          dap_write_block(addr + offs, &fuses[offs], FLASH_PAGE_SIZE);
       }
-    }
-    else if (read_all)
-    {
-      error_exit("please specify fuse bit range for verification");
-    }
-    else
-    {
-      uint32_t value = extract_value(buf, target_options.fuse_start,
-          target_options.fuse_end);
 
-      if (target_options.fuse_value != value)
-      {
-        error_exit("fuse verification failed: expected 0x%x (%u), got 0x%x (%u)",
-            target_options.fuse_value, target_options.fuse_value, value, value);
-      }
+      dap_read_block(addr, buf, FLASH_ROW_SIZE);
     }
+
+    target_fuse_verify(&target_options, section, buf, FLASH_ROW_SIZE);
   }
 }
 
 //-----------------------------------------------------------------------------
 target_ops_t target_mchp_cm23_ops =
 {
+  .ids      = target_ids,
   .select   = target_select,
   .deselect = target_deselect,
   .erase    = target_erase,
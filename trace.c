@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2013-2015, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "edbg.h"
+#include "trace.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define TRACE_MAGIC            "EDBGTRC\x01"
+#define TRACE_MAGIC_SIZE       8
+#define TRACE_HEADER_SIZE      9
+#define TRACE_MAX_SIZE         1025
+#define TRACE_IN_FLIGHT        16
+#define TRACE_MIN_RUN          2
+
+enum
+{
+  TRACE_REQUEST  = 1,
+  TRACE_RESPONSE = 2,
+};
+
+enum
+{
+  ID_DAP_CONNECT            = 0x02,
+  ID_DAP_TRANSFER           = 0x05,
+  ID_DAP_TRANSFER_BLOCK     = 0x06,
+  ID_DAP_SWJ_PINS           = 0x10,
+  ID_DAP_SWJ_SEQUENCE       = 0x12,
+};
+
+enum
+{
+  DAP_TRANSFER_APnDP        = 1 << 0,
+  DAP_TRANSFER_RnW          = 1 << 1,
+  DAP_TRANSFER_MATCH_VALUE  = 1 << 4,
+  DAP_TRANSFER_MATCH_MASK   = 1 << 5,
+};
+
+#define AP_CSW_SIZE_MASK       (7 << 0)
+#define AP_CSW_SIZE_WORD       (2 << 0)
+#define AP_CSW_ADDRINC_SINGLE  (1 << 4)
+#define AP_CSW_ADDRINC_PACKED  (2 << 4)
+#define AP_CSW_ADDRINC_MASK    (3 << 4)
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  uint8_t   data[TRACE_MAX_SIZE];
+  int       size;
+  uint64_t  time;
+} trace_record_t;
+
+typedef struct
+{
+  uint32_t  commands;
+  uint32_t  transfer_commands;
+  uint32_t  transfer_requests;
+  uint32_t  block_commands;
+  uint32_t  block_words;
+  uint64_t  round_trip;
+  uint32_t  round_trips;
+  uint64_t  first_time;
+  uint64_t  last_time;
+
+  uint32_t  redundant_select;
+  uint32_t  redundant_csw;
+  uint32_t  redundant_tar;
+  uint32_t  read_runs;
+  uint32_t  read_run_words;
+  uint32_t  write_runs;
+  uint32_t  write_run_words;
+
+  // Known state of the DP and the MEM-AP
+  bool      select_known;
+  bool      csw_known;
+  bool      tar_known;
+  uint32_t  select;
+  uint32_t  csw;
+  uint32_t  tar;
+
+  // Current run of single word accesses to sequential addresses
+  bool      run_read;
+  uint32_t  run_addr;
+  uint32_t  run_next;
+  int       run_length;
+} trace_analysis_t;
+
+/*- Variables ---------------------------------------------------------------*/
+static _Thread_local FILE *trace_file = NULL;
+static _Thread_local uint64_t trace_time;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+void trace_open(char *name)
+{
+  trace_file = fopen(name, "wb");
+
+  if (NULL == trace_file)
+    perror_exit("unable to open trace file");
+
+  fwrite(TRACE_MAGIC, TRACE_MAGIC_SIZE, 1, trace_file);
+  trace_time = get_time_us();
+}
+
+//-----------------------------------------------------------------------------
+void trace_close(void)
+{
+  if (trace_file)
+    fclose(trace_file);
+
+  trace_file = NULL;
+}
+
+//-----------------------------------------------------------------------------
+static void trace_record(int type, uint8_t cmd, uint8_t *data, int size)
+{
+  uint8_t header[TRACE_HEADER_SIZE];
+  uint64_t time = get_time_us();
+  uint32_t delta = time - trace_time;
+  int stored = size;
+
+  // Trailing zeros are not stored, HID reports are mostly padding
+  while (stored > 0 && 0 == data[stored - 1])
+    stored--;
+
+  trace_time = time;
+
+  header[0] = type;
+  header[1] = delta & 0xff;
+  header[2] = (delta >> 8) & 0xff;
+  header[3] = (delta >> 16) & 0xff;
+  header[4] = (delta >> 24) & 0xff;
+  header[5] = (size + 1) & 0xff;
+  header[6] = ((size + 1) >> 8) & 0xff;
+  header[7] = (stored + 1) & 0xff;
+  header[8] = ((stored + 1) >> 8) & 0xff;
+
+  fwrite(header, sizeof(header), 1, trace_file);
+  fwrite(&cmd, 1, 1, trace_file);
+  fwrite(data, stored, 1, trace_file);
+}
+
+//-----------------------------------------------------------------------------
+void trace_request(uint8_t *data, int size)
+{
+  if (trace_file && size > 0)
+    trace_record(TRACE_REQUEST, data[0], &data[1], size - 1);
+}
+
+//-----------------------------------------------------------------------------
+void trace_response(uint8_t cmd, uint8_t *data, int size)
+{
+  if (trace_file)
+    trace_record(TRACE_RESPONSE, cmd, data, (size > 0) ? size : 0);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t get_word(uint8_t *buf)
+{
+  return ((uint32_t)buf[3] << 24) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[1] << 8) | buf[0];
+}
+
+//-----------------------------------------------------------------------------
+static bool read_record(FILE *file, trace_record_t *record, int *type, uint64_t *time)
+{
+  uint8_t header[TRACE_HEADER_SIZE];
+  int stored;
+
+  if (1 != fread(header, sizeof(header), 1, file))
+    return false;
+
+  *type = header[0];
+  *time += get_word(&header[1]);
+  record->size = header[5] | (header[6] << 8);
+  record->time = *time;
+  stored = header[7] | (header[8] << 8);
+
+  check((TRACE_REQUEST == *type || TRACE_RESPONSE == *type) && stored <= record->size &&
+      stored > 0 && record->size <= TRACE_MAX_SIZE, "malformed trace record");
+
+  memset(record->data, 0, sizeof(record->data));
+
+  check(1 == fread(record->data, stored, 1, file), "trace file is truncated");
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static void close_run(trace_analysis_t *ta)
+{
+  if (ta->run_length >= TRACE_MIN_RUN)
+  {
+    verbose("             ^ %d single word %s at 0x%08x could be a block\n", ta->run_length,
+        ta->run_read ? "reads" : "writes", ta->run_addr);
+
+    if (ta->run_read)
+    {
+      ta->read_runs++;
+      ta->read_run_words += ta->run_length;
+    }
+    else
+    {
+      ta->write_runs++;
+      ta->write_run_words += ta->run_length;
+    }
+  }
+
+  ta->run_length = 0;
+}
+
+//-----------------------------------------------------------------------------
+static void single_access(trace_analysis_t *ta, bool read, uint32_t addr)
+{
+  if (ta->run_length && ta->run_read == read && ta->run_next == addr)
+  {
+    ta->run_length++;
+  }
+  else
+  {
+    close_run(ta);
+    ta->run_read = read;
+    ta->run_addr = addr;
+    ta->run_length = 1;
+  }
+
+  ta->run_next = addr + 4;
+}
+
+//-----------------------------------------------------------------------------
+static void forget_state(trace_analysis_t *ta)
+{
+  ta->select_known = false;
+  ta->csw_known = false;
+  ta->tar_known = false;
+}
+
+//-----------------------------------------------------------------------------
+static void advance_tar(trace_analysis_t *ta, int count)
+{
+  uint32_t inc = (1 << (ta->csw & AP_CSW_SIZE_MASK)) * count;
+
+  if (!ta->csw_known)
+    ta->tar_known = false;
+
+  if (AP_CSW_ADDRINC_PACKED == (ta->csw & AP_CSW_ADDRINC_MASK))
+    inc = 4 * count;
+  else if (AP_CSW_ADDRINC_SINGLE != (ta->csw & AP_CSW_ADDRINC_MASK))
+    return;
+
+  // Auto-increment is only guaranteed within a 1 KB block
+  if (((ta->tar & 0x3ff) + inc) >= 0x400)
+    ta->tar_known = false;
+
+  ta->tar += inc;
+}
+
+//-----------------------------------------------------------------------------
+static void decode_transfer(trace_analysis_t *ta, uint8_t *req, uint8_t *resp, double ms)
+{
+  int count = req[2];
+  int done = resp ? resp[1] : count;
+  int roffs = 3;
+  int doffs = 3;
+
+  ta->transfer_commands++;
+  ta->transfer_requests += count;
+
+  for (int i = 0; i < count && i < done && roffs < TRACE_MAX_SIZE - 4; i++)
+  {
+    uint8_t r = req[roffs++];
+    bool read = (r & DAP_TRANSFER_RnW) && !(r & DAP_TRANSFER_MATCH_VALUE);
+    uint32_t value = 0;
+    int reg = r & 0x0c;
+    char *note = "";
+
+    if (!read)
+    {
+      value = get_word(&req[roffs]);
+      roffs += 4;
+    }
+    else if (resp && doffs < TRACE_MAX_SIZE - 4)
+    {
+      value = get_word(&resp[doffs]);
+      doffs += 4;
+    }
+
+    if (r & DAP_TRANSFER_MATCH_MASK)
+    {
+      verbose("%10.3f  match mask 0x%08x\n", ms, value);
+      continue;
+    }
+
+    if (0 == (r & DAP_TRANSFER_APnDP))
+    {
+      static const char *dp_read[] = { "IDCODE", "CTRL/STAT", "RESEND", "RDBUFF" };
+      static const char *dp_write[] = { "ABORT", "CTRL/STAT", "SELECT", "RDBUFF" };
+
+      if (!(r & DAP_TRANSFER_RnW) && 0x08 == reg)
+      {
+        if (ta->select_known && ta->select == value)
+        {
+          ta->redundant_select++;
+          note = "  <- redundant";
+        }
+
+        ta->select = value;
+        ta->select_known = true;
+      }
+
+      verbose("%10.3f  %c DP %-10s 0x%08x%s\n", ms, (r & DAP_TRANSFER_RnW) ? 'R' : 'W',
+          (r & DAP_TRANSFER_RnW) ? dp_read[reg / 4] : dp_write[reg / 4], value, note);
+      continue;
+    }
+
+    reg |= ta->select & 0xf0;
+
+    if (0x00 == reg && !(r & DAP_TRANSFER_RnW))
+    {
+      if (ta->csw_known && ta->csw == value)
+      {
+        ta->redundant_csw++;
+        note = "  <- redundant";
+      }
+
+      ta->csw = value;
+      ta->csw_known = true;
+      verbose("%10.3f  W AP CSW        0x%08x%s\n", ms, value, note);
+    }
+    else if (0x04 == reg && !(r & DAP_TRANSFER_RnW))
+    {
+      if (ta->tar_known && ta->tar == value)
+      {
+        ta->redundant_tar++;
+        note = "  <- redundant";
+      }
+
+      ta->tar = value;
+      ta->tar_known = true;
+      verbose("%10.3f  W AP TAR        0x%08x%s\n", ms, value, note);
+    }
+    else if (0x0c == reg)
+    {
+      if (r & DAP_TRANSFER_MATCH_VALUE)
+      {
+        close_run(ta);
+        verbose("%10.3f  R AP DRW        [0x%08x] until 0x%08x\n", ms, ta->tar, value);
+      }
+      else
+      {
+        if (ta->csw_known && ta->tar_known && AP_CSW_SIZE_WORD == (ta->csw & AP_CSW_SIZE_MASK))
+          single_access(ta, read, ta->tar);
+
+        verbose("%10.3f  %c AP DRW        [0x%08x] 0x%08x\n", ms, read ? 'R' : 'W', ta->tar, value);
+        advance_tar(ta, 1);
+      }
+    }
+    else
+    {
+      verbose("%10.3f  %c AP 0x%02x       0x%08x\n", ms, read ? 'R' : 'W', reg, value);
+    }
+  }
+
+  // State is uncertain after a failed or a partially completed transfer
+  if (done < count)
+    forget_state(ta);
+}
+
+//-----------------------------------------------------------------------------
+static void decode_block(trace_analysis_t *ta, uint8_t *req, double ms)
+{
+  int count = req[2] | (req[3] << 8);
+  bool read = req[4] & DAP_TRANSFER_RnW;
+
+  ta->block_commands++;
+  ta->block_words += count;
+
+  close_run(ta);
+
+  verbose("%10.3f  %c AP DRW block  [0x%08x] %d words\n", ms, read ? 'R' : 'W', ta->tar, count);
+
+  advance_tar(ta, count);
+}
+
+//-----------------------------------------------------------------------------
+static void decode_command(trace_analysis_t *ta, trace_record_t *req, trace_record_t *resp)
+{
+  double ms = (req->time - ta->first_time) / 1000.0;
+
+  ta->commands++;
+
+  if (resp)
+  {
+    ta->round_trip += resp->time - req->time;
+    ta->round_trips++;
+  }
+
+  if (ID_DAP_TRANSFER == req->data[0])
+  {
+    decode_transfer(ta, req->data, resp ? resp->data : NULL, ms);
+  }
+  else if (ID_DAP_TRANSFER_BLOCK == req->data[0])
+  {
+    decode_block(ta, req->data, ms);
+  }
+  else
+  {
+    static const char *names[] =
+    {
+      "INFO", "LED", "CONNECT", "DISCONNECT", "TRANSFER_CONFIGURE", "TRANSFER",
+      "TRANSFER_BLOCK", "TRANSFER_ABORT", "WRITE_ABORT", "DELAY", "RESET_TARGET",
+    };
+    static const char *swj_names[] =
+    {
+      "SWJ_PINS", "SWJ_CLOCK", "SWJ_SEQUENCE", "SWD_CONFIGURE",
+    };
+    uint8_t cmd = req->data[0];
+
+    if (cmd < 0x0b)
+      verbose("%10.3f  DAP_%s\n", ms, names[cmd]);
+    else if (cmd >= 0x10 && cmd < 0x14)
+      verbose("%10.3f  DAP_%s\n", ms, swj_names[cmd - 0x10]);
+    else
+      verbose("%10.3f  command 0x%02x\n", ms, cmd);
+
+    if (ID_DAP_CONNECT == req->data[0] || ID_DAP_SWJ_PINS == req->data[0] ||
+        ID_DAP_SWJ_SEQUENCE == req->data[0])
+    {
+      close_run(ta);
+      forget_state(ta);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+void trace_analyze(char *name)
+{
+  static trace_record_t pending[TRACE_IN_FLIGHT];
+  static trace_record_t record;
+  static trace_analysis_t ta;
+  char magic[TRACE_MAGIC_SIZE];
+  int head = 0, count = 0;
+  uint64_t time = 0;
+  int type;
+  FILE *file;
+
+  file = fopen(name, "rb");
+
+  if (NULL == file)
+    perror_exit("unable to open trace file");
+
+  check(1 == fread(magic, sizeof(magic), 1, file) && 0 == memcmp(magic, TRACE_MAGIC, sizeof(magic)),
+      "%s is not a trace file", name);
+
+  memset(&ta, 0, sizeof(ta));
+
+  // Responses arrive in the order the commands were sent
+  while (read_record(file, &record, &type, &time))
+  {
+    if (0 == ta.commands && 0 == count)
+      ta.first_time = record.time;
+
+    ta.last_time = record.time;
+
+    if (TRACE_REQUEST == type)
+    {
+      check(count < TRACE_IN_FLIGHT, "too many commands in flight in the trace");
+      pending[(head + count) % TRACE_IN_FLIGHT] = record;
+      count++;
+    }
+    else
+    {
+      check(count > 0, "response without a request in the trace");
+      decode_command(&ta, &pending[head], &record);
+      head = (head + 1) % TRACE_IN_FLIGHT;
+      count--;
+    }
+  }
+
+  for (; count > 0; count--, head = (head + 1) % TRACE_IN_FLIGHT)
+    decode_command(&ta, &pending[head], NULL);
+
+  close_run(&ta);
+
+  fclose(file);
+
+  message("Trace: %u commands in %.3f ms, average round trip %.0f us\n", ta.commands,
+      (ta.last_time - ta.first_time) / 1000.0,
+      ta.round_trips ? (double)ta.round_trip / ta.round_trips : 0.0);
+  message("  DAP_TRANSFER: %u commands, %u requests\n", ta.transfer_commands, ta.transfer_requests);
+  message("  DAP_TRANSFER_BLOCK: %u commands, %u words\n", ta.block_commands, ta.block_words);
+  message("  other: %u commands\n", ta.commands - ta.transfer_commands - ta.block_commands);
+  message("Possible improvements:\n");
+  message("  redundant SELECT writes: %u\n", ta.redundant_select);
+  message("  redundant CSW writes: %u\n", ta.redundant_csw);
+  message("  redundant TAR writes: %u\n", ta.redundant_tar);
+  message("  single word reads that could be blocks: %u words in %u runs\n",
+      ta.read_run_words, ta.read_runs);
+  message("  single word writes that could be blocks: %u words in %u runs\n",
+      ta.write_run_words, ta.write_runs);
+}